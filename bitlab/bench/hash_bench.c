@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h> // For SHA-256
+
+#include "hash.h"
+
+// Bytes hashed by every timed case, so small and large inputs run for a similar time
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+// Number of 80-byte headers in a full 'headers' message
+#define BENCH_HEADERS 2000
+
+/**
+ * baseline_double_sha256:
+ *   The double-SHA256 as computed by compute_checksum and compute_block_hash before the hash
+ *   module: two one-shot OpenSSL calls.
+ */
+static void baseline_double_sha256(const unsigned char* data, size_t len, unsigned char out[32])
+{
+    unsigned char hash1[SHA256_DIGEST_LENGTH];
+    SHA256(data, len, hash1);
+    SHA256(hash1, SHA256_DIGEST_LENGTH, out);
+}
+
+/**
+ * now_ns:
+ *   Get the monotonic time in nanoseconds.
+ */
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * verify_backend:
+ *   Compare the selected backend with the baseline for every length crossing the padding
+ *   boundaries and for the multi-buffer API. Returns the number of mismatches.
+ */
+static int verify_backend(const unsigned char* data)
+{
+    int mismatches = 0;
+    unsigned char expected[32];
+    unsigned char actual[32];
+
+    for (size_t len = 0; len <= 300; ++len)
+    {
+        baseline_double_sha256(data, len, expected);
+        double_sha256(data, len, actual);
+        mismatches += memcmp(expected, actual, 32) != 0;
+    }
+    baseline_double_sha256(data, 1024 * 1024 + 7, expected);
+    double_sha256(data, 1024 * 1024 + 7, actual);
+    mismatches += memcmp(expected, actual, 32) != 0;
+
+    const size_t item_lens[] = { 32, 55, 64, 80, 119, 200 };
+    unsigned char out[37 * 32];
+    for (size_t i = 0; i < sizeof(item_lens) / sizeof(item_lens[0]); ++i)
+    {
+        for (size_t count = 0; count <= 37; count += 3)
+        {
+            double_sha256_many(data, item_lens[i], count, out);
+            for (size_t j = 0; j < count; ++j)
+            {
+                baseline_double_sha256(data + j * item_lens[i], item_lens[i], expected);
+                mismatches += memcmp(expected, out + j * 32, 32) != 0;
+            }
+        }
+    }
+    return mismatches;
+}
+
+/**
+ * bench_single:
+ *   Time the double-SHA256 of a single message of the given length.
+ */
+static double bench_single(void (*hash)(const unsigned char*, size_t, unsigned char*),
+    const unsigned char* data, size_t len)
+{
+    unsigned char out[32];
+    size_t iterations = BENCH_BYTES / len;
+    double start = now_ns();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        hash(data, len, out);
+        data += out[0] & 1; // keep the calls dependent, so they are not optimized out
+    }
+    return (now_ns() - start) / iterations;
+}
+
+/**
+ * bench_headers:
+ *   Time hashing the headers of a full 'headers' message, with the baseline or the multi-buffer API.
+ */
+static double bench_headers(int baseline, const unsigned char* data, unsigned char* out)
+{
+    size_t iterations = BENCH_BYTES / (BENCH_HEADERS * 80);
+    double start = now_ns();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        if (baseline)
+        {
+            for (size_t j = 0; j < BENCH_HEADERS; ++j)
+                baseline_double_sha256(data + j * 80, 80, out + j * 32);
+        }
+        else
+        {
+            double_sha256_many(data, 80, BENCH_HEADERS, out);
+        }
+    }
+    return (now_ns() - start) / iterations;
+}
+
+int main()
+{
+    size_t data_len = 2 * 1024 * 1024;
+    unsigned char* data = (unsigned char*)malloc(data_len);
+    unsigned char* out = (unsigned char*)malloc(BENCH_HEADERS * 32);
+    if (data == NULL || out == NULL)
+    {
+        fprintf(stderr, "[Error] Failed to allocate benchmark buffers\n");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < data_len; ++i)
+        data[i] = (unsigned char)rand();
+
+    const size_t lengths[] = { 32, 80, 1024, 1024 * 1024 };
+    const size_t length_count = sizeof(lengths) / sizeof(lengths[0]);
+    double baseline_single[sizeof(lengths) / sizeof(lengths[0])];
+    for (size_t i = 0; i < length_count; ++i)
+        baseline_single[i] = bench_single(baseline_double_sha256, data, lengths[i]);
+    double baseline_headers = bench_headers(1, data, out);
+
+    init_hash();
+    printf("Selected backend: %s\n\n", get_hash_backend_name(get_hash_backend()));
+    printf("%-10s %-20s %14s %10s %9s\n", "Backend", "Case", "ns/op", "MB/s", "Speedup");
+    for (size_t i = 0; i < length_count; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "sha256d %zu B", lengths[i]);
+        printf("%-10s %-20s %14.1f %10.1f %8.2fx\n", "baseline", name, baseline_single[i],
+            lengths[i] * 1e3 / baseline_single[i], 1.0);
+    }
+    printf("%-10s %-20s %14.1f %10.1f %8.2fx\n", "baseline", "2000 headers", baseline_headers,
+        BENCH_HEADERS * 80 * 1e3 / baseline_headers, 1.0);
+
+    int failed = 0;
+    for (int backend = 0; backend < HASH_BACKEND_COUNT; ++backend)
+    {
+        const char* backend_name = get_hash_backend_name((hash_backend)backend);
+        if (set_hash_backend((hash_backend)backend) != 0)
+        {
+            printf("%-10s not supported by this processor\n", backend_name);
+            continue;
+        }
+        int mismatches = verify_backend(data);
+        if (mismatches != 0)
+        {
+            printf("%-10s FAILED: %d digests differ from the baseline\n", backend_name, mismatches);
+            failed = 1;
+            continue;
+        }
+
+        for (size_t i = 0; i < length_count; ++i)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "sha256d %zu B", lengths[i]);
+            double ns = bench_single(double_sha256, data, lengths[i]);
+            printf("%-10s %-20s %14.1f %10.1f %8.2fx\n", backend_name, name, ns,
+                lengths[i] * 1e3 / ns, baseline_single[i] / ns);
+        }
+        double ns = bench_headers(0, data, out);
+        printf("%-10s %-20s %14.1f %10.1f %8.2fx\n", backend_name, "2000 headers", ns,
+            BENCH_HEADERS * 80 * 1e3 / ns, baseline_headers / ns);
+    }
+
+    free(data);
+    free(out);
+    return failed;
+}
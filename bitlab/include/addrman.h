@@ -0,0 +1,118 @@
+#ifndef __ADDRMAN_H
+#define __ADDRMAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "peer_queue.h"
+
+// Name of the peers file in the config directory
+#define ADDRMAN_FILE "peers.dat"
+
+// Number of buckets of addresses not connected to yet and their source netgroups
+#define ADDRMAN_NEW_BUCKETS 1024
+
+// Number of buckets of addresses connected to successfully
+#define ADDRMAN_TRIED_BUCKETS 256
+
+// Number of slots in every bucket
+#define ADDRMAN_BUCKET_SIZE 64
+
+// Number of new buckets the addresses of one source netgroup can be spread over
+#define ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP 64
+
+// Number of tried buckets the addresses of one netgroup can be spread over
+#define ADDRMAN_TRIED_BUCKETS_PER_GROUP 8
+
+// Age after which an address not seen again is considered stale, in days
+#define ADDRMAN_HORIZON_DAYS 30
+
+// Number of failed attempts after which an address never connected to is considered stale
+#define ADDRMAN_RETRIES 3
+
+// Number of failed attempts after which an address not connected to for a week is considered stale
+#define ADDRMAN_MAX_FAILURES 10
+
+// Interval at which the address manager is saved to the peers file
+#define ADDRMAN_SAVE_INTERVAL_MS 60000
+
+// Number of addresses moved to the peer queue at startup
+#define ADDRMAN_WARM_START_COUNT 256
+
+/**
+ * Initialize the address manager from the peers file and register the timer saving it. A
+ * missing or corrupted file starts an empty address manager with a new bucket key. Must be
+ * called after the event loop is initialized.
+ *
+ * @param filename The path of the peers file.
+ * @return The number of loaded addresses, or -1 on failure.
+ */
+int init_addrman(const char* filename);
+
+/**
+ * Save the address manager to the peers file and release it.
+ */
+void free_addrman();
+
+/**
+ * Add the address to a new bucket selected by the netgroups of the address and its source, so
+ * a single source cannot fill the table. A known address only has its timestamp and services
+ * refreshed. An occupied slot is taken over only if the address in it is stale.
+ *
+ * @param peer The address with its services and the time it was last seen.
+ * @param source The IPv6 address of the peer which announced the address, NULL if it was
+ *        obtained locally, e.g. from DNS seeds.
+ * @return 1 if the address was added, 0 if it was known or dropped.
+ */
+int addrman_add(const Peer* peer, const unsigned char source[16]);
+
+/**
+ * Record a connection attempt to the address.
+ *
+ * @param addr The IPv6 address of the peer.
+ * @param port The port of the peer.
+ */
+void addrman_attempt(const unsigned char addr[16], uint16_t port);
+
+/**
+ * Record a successful connection to the address and move it to a tried bucket. The address
+ * in the tried slot it lands in is moved back to a new bucket.
+ *
+ * @param addr The IPv6 address of the peer.
+ * @param port The port of the peer.
+ */
+void addrman_good(const unsigned char addr[16], uint16_t port);
+
+/**
+ * Select an address to connect to, randomly from the tried or the new addresses with equal
+ * odds, preferring addresses which were not attempted recently or failed less often.
+ *
+ * @param peer The buffer to store the address.
+ * @return True if an address was selected, false if the address manager is empty.
+ */
+bool addrman_select(Peer* peer);
+
+/**
+ * Copy the addresses worth connecting to, the most recently successful tried addresses first
+ * followed by the most recently seen new ones. Stale addresses are skipped.
+ *
+ * @param peers The buffer to store the addresses.
+ * @param max_count The maximum number of addresses.
+ * @return The number of copied addresses.
+ */
+size_t addrman_get_addresses(Peer* peers, size_t max_count);
+
+/**
+ * Save the address manager to the peers file, replacing it atomically.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int save_addrman();
+
+/**
+ * Print the number of new and tried addresses.
+ */
+void print_addrman_status();
+
+#endif // __ADDRMAN_H
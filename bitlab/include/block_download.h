@@ -0,0 +1,98 @@
+#ifndef __BLOCK_DOWNLOAD_H
+#define __BLOCK_DOWNLOAD_H
+
+#include <stddef.h>
+
+// Interval of the timer scheduling block requests in milliseconds
+#define BLOCK_DOWNLOAD_TICK_MS 100
+
+// Time a peer has to deliver a requested block before it is requested elsewhere in milliseconds
+#define BLOCK_DOWNLOAD_TIMEOUT_MS 10000
+
+// Time the next block to deliver may be in flight while no other block can be requested, before
+// its peer is considered to stall the download, in milliseconds
+#define BLOCK_DOWNLOAD_STALL_MS 2000
+
+// Time a peer stalling the download is not asked for blocks in milliseconds
+#define BLOCK_DOWNLOAD_PENALTY_MS 60000
+
+// Number of blocks past the next block to deliver which may be requested or buffered
+#define BLOCK_DOWNLOAD_WINDOW 512
+
+// Initial number of blocks requested from a peer and not yet received
+#define BLOCK_DOWNLOAD_INITIAL_IN_FLIGHT 4
+
+// Maximum number of blocks requested from a peer and not yet received
+#define BLOCK_DOWNLOAD_MAX_IN_FLIGHT 64
+
+// Interval of the progress reports of a running download in milliseconds
+#define BLOCK_DOWNLOAD_REPORT_MS 10000
+
+/**
+ * Consumer of the downloaded blocks, invoked on the event loop thread in height order.
+ *
+ * @param height The height of the block.
+ * @param block The serialized block, valid only during the call.
+ * @param block_len The length of the block.
+ * @param ctx The context passed on registration.
+ */
+typedef void (*block_consumer)(int height, const unsigned char* block, size_t block_len, void* ctx);
+
+/**
+ * Initialize the block download and register its timer in the event loop. Must be called after
+ * the event loop and the header index are initialized.
+ */
+void init_block_download();
+
+/**
+ * Set the consumer the downloaded blocks are delivered to. Must be called before a download starts.
+ *
+ * @param callback The consumer, NULL to only log the delivered blocks.
+ * @param ctx The context passed to the consumer.
+ */
+void set_block_consumer(block_consumer callback, void* ctx);
+
+/**
+ * Start downloading the blocks of the best chain in the height range from all connected peers.
+ * Every peer has its own window of blocks in flight, grown while it delivers and halved when a
+ * block times out, so faster peers get more requests. A block not received in time is requested
+ * from another peer. Blocks are delivered to the consumer in height order. A running download is
+ * extended to cover the range.
+ *
+ * @param start_height The height of the first block.
+ * @param end_height The height of the last block.
+ * @return 0 if successful, -1 if the range is not in the header index or memory is exhausted.
+ */
+int start_block_download(int start_height, int end_height);
+
+/**
+ * Extend the running download up to the height, e.g. to a block announced by a peer. Only the
+ * heights above the download range are added, and no download is started while none runs.
+ *
+ * @param last_height The height of the last block.
+ * @return 1 if the download was extended, 0 otherwise.
+ */
+int extend_block_download(int last_height);
+
+/**
+ * Stop the block download and drop the blocks not delivered yet.
+ */
+void stop_block_download();
+
+/**
+ * Offer a block received from a peer to the block download, e.g. a block arriving after its
+ * request expired. Called on the event loop thread.
+ *
+ * @param idx The index of the peer in the nodes array.
+ * @param block The serialized block.
+ * @param block_len The length of the block.
+ * @return 1 if the block was requested by the download, 0 otherwise.
+ */
+int receive_block(int idx, const unsigned char* block, size_t block_len);
+
+/**
+ * Print the state of the block download: the delivered height, the rates and the windows of the peers.
+ */
+void print_block_download_status();
+
+#endif // __BLOCK_DOWNLOAD_H
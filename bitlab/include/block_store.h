@@ -0,0 +1,142 @@
+#ifndef __BLOCK_STORE_H
+#define __BLOCK_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+// Directory of the block files and the block index
+#define BLOCK_STORE_DIR "blocks"
+
+// Name of the block index file in the block store directory
+#define BLOCK_INDEX_FILE "index.dat"
+
+// Maximum size of a block file, a block not fitting starts the next file
+#define BLOCK_FILE_SIZE ((uint32_t)128 * 1024 * 1024)
+
+// Initial number of slots of the hash to block table, grown by doubling
+#define BLOCK_TABLE_INITIAL_SIZE 4096
+
+// Interval at which the block files and the block index are synced to disk
+#define BLOCK_STORE_SYNC_INTERVAL_MS 5000
+
+/**
+ * The location of a stored block.
+ *
+ * @param file The number of the block file.
+ * @param offset The offset of the block in the block file.
+ * @param len The length of the block.
+ * @param checksum The first 4 bytes of the double-SHA256 of the block, the checksum of a 'block' message.
+ */
+typedef struct
+{
+    uint32_t file;
+    uint32_t offset;
+    uint32_t len;
+    unsigned char checksum[4];
+} block_location;
+
+/**
+ * Open the block store in the directory and load the block index. Index records pointing past
+ * the end of their block file, e.g. after a crash, are dropped. Registers the sync timer in the
+ * event loop, so it must be called after the event loop is initialized.
+ *
+ * @param dir The directory of the block store, created if missing.
+ * @return The number of stored blocks, or -1 on failure.
+ */
+int init_block_store(const char* dir);
+
+/**
+ * Sync the block store to disk and close it.
+ */
+void free_block_store();
+
+/**
+ * Append the block to the current block file and record it in the block index. The index record
+ * reaches the index file at the next sync, after the block was synced. Blocks already stored are
+ * not written again.
+ *
+ * @param block The serialized block.
+ * @param block_len The length of the block.
+ * @return 1 if the block was stored, 0 if it was already stored, -1 on failure.
+ */
+int store_block(const unsigned char* block, size_t block_len);
+
+/**
+ * Block consumer of the block download storing every delivered block.
+ *
+ * @param height The height of the block.
+ * @param block The serialized block.
+ * @param block_len The length of the block.
+ * @param ctx Unused.
+ */
+void store_downloaded_block(int height, const unsigned char* block, size_t block_len, void* ctx);
+
+/**
+ * Find the location of the stored block.
+ *
+ * @param hash The block hash in internal byte order.
+ * @param location The buffer to store the location, may be NULL.
+ * @return 1 if the block is stored, 0 otherwise.
+ */
+int find_block(const unsigned char hash[HASH_SIZE], block_location* location);
+
+/**
+ * Find the location of the stored block and the path of the block file holding it, e.g. to send
+ * the block with sendfile once the peer is ready for it.
+ *
+ * @param hash The block hash in internal byte order.
+ * @param location The buffer to store the location of the block.
+ * @param path The buffer to store the path of the block file.
+ * @param path_size The size of the path buffer.
+ * @return 1 if the block is stored, 0 otherwise.
+ */
+int find_block_file(const unsigned char hash[HASH_SIZE], block_location* location, char* path,
+    size_t path_size);
+
+/**
+ * Open the block file holding the stored block for reading, e.g. to send the block without
+ * copying it.
+ *
+ * @param hash The block hash in internal byte order.
+ * @param location The buffer to store the location of the block.
+ * @return The file descriptor to be closed by the caller, or -1 if the block is not stored.
+ */
+int open_block(const unsigned char hash[HASH_SIZE], block_location* location);
+
+/**
+ * Read the stored block with pread, without loading anything else.
+ *
+ * @param hash The block hash in internal byte order.
+ * @param block_len The buffer to store the length of the block.
+ * @return The block to be freed by the caller, or NULL if it is not stored.
+ */
+unsigned char* read_block(const unsigned char hash[HASH_SIZE], size_t* block_len);
+
+/**
+ * Get the hashes of the most recently stored blocks in the order they were stored.
+ *
+ * @param hashes The buffer to store the 32-byte hashes.
+ * @param max_count The maximum number of hashes.
+ * @return The number of hashes.
+ */
+size_t get_recent_blocks(unsigned char* hashes, size_t max_count);
+
+/**
+ * Get the number of stored blocks.
+ *
+ * @return The number of blocks.
+ */
+size_t get_block_count();
+
+/**
+ * Sync the blocks stored since the last sync to disk, then append their index records to the
+ * index file and sync it.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int sync_block_store();
+
+#endif // __BLOCK_STORE_H
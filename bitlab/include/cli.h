@@ -143,13 +143,21 @@ int cli_help(char** args);
 int cli_ping(char** args);
 
 /**
- * Connects to the specified IP address.
+ * Connects to the specified IP address or to a number of peers from the peer queue.
  *
- * @param args The IP address.
+ * @param args The IP address, or --from-queue with the number of peers and optional --concurrency and --timeout.
  * @return The exit code.
  */
 int cli_connect(char** args);
 
+/**
+ * Starts, stops or reports accepting inbound connections from peers.
+ *
+ * @param args The port and the maximum number of inbound peers, or the action and no further arguments.
+ * @return The exit code.
+ */
+int cli_listen(char** args);
+
 /**
  * Lists all connected nodes.
  *
@@ -169,8 +177,8 @@ int cli_getaddr(char** args);
 /**
  * @brief Disconnects from the specified node.
  *
- * This function disconnects from the node specified by the given node ID. It closes the socket,
- * terminates the thread, and logs the disconnection.
+ * This function disconnects from the node specified by the given node ID. It removes the socket
+ * from the event loop, closes it, and logs the disconnection.
  *
  * @param args The arguments passed to the function should contain the node ID.
  * @return The exit code.
@@ -217,6 +225,63 @@ int cli_getdata(char** args);
  */
 int cli_tx(char** args);
 
+/**
+ * Prints the counters of messages received from peers.
+ *
+ * @param args The arguments passed to the function should be empty.
+ * @return The exit code.
+ */
+int cli_msgstats(char** args);
+
+/**
+ * Starts, stops or reports the background sync of block headers from connected peers.
+ *
+ * @param args The subject of the sync, its action and no further arguments.
+ * @return The exit code.
+ */
+int cli_sync(char** args);
+
+/**
+ * Starts, stops or reports the crawl of the network for reachable nodes.
+ *
+ * @param args The number of probes in flight and the maximum number of nodes, or the action and no further arguments.
+ * @return The exit code.
+ */
+int cli_crawl(char** args);
+
+/**
+ * Prints or sets the format of the log files.
+ *
+ * @param args The log format, text or binary, or no arguments to print the current one.
+ * @return The exit code.
+ */
+int cli_logformat(char** args);
+
+/**
+ * Prints or sets the global or per-file minimum log levels.
+ *
+ * @param args The log filename prefix and the level, the level alone or no arguments to print the levels.
+ * @return The exit code.
+ */
+int cli_loglevel(char** args);
+
+/**
+ * Prints or sets whether the peer logs are written to one file per peer or to the combined peer log.
+ *
+ * @param args The mode, separate or combined, or no arguments to print the current one.
+ * @return The exit code.
+ */
+int cli_logpeers(char** args);
+
+/**
+ * Prints or sets the default or per-file rotation of the log files.
+ *
+ * @param args The log filename prefix and the rotation options, the options alone, the prefix and
+ * 'default' or no arguments to print the rotations.
+ * @return The exit code.
+ */
+int cli_logrotate(char** args);
+
 
 //// LINE HANDLING FUNCTIONS ////
 
@@ -0,0 +1,115 @@
+#ifndef __COMMAND_H
+#define __COMMAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Length of the command field of the message header
+#define COMMAND_SIZE 12
+
+// Number of slots of the command lookup table, must be a power of two greater than COMMAND_COUNT
+#define COMMAND_TABLE_SIZE 64
+
+/**
+ * The identifiers of the Bitcoin P2P commands known to BitLab. Messages with any other command
+ * are reported as COMMAND_UNKNOWN.
+ */
+typedef enum
+{
+    COMMAND_UNKNOWN,
+    COMMAND_VERSION,
+    COMMAND_VERACK,
+    COMMAND_PING,
+    COMMAND_PONG,
+    COMMAND_ADDR,
+    COMMAND_GETADDR,
+    COMMAND_GETHEADERS,
+    COMMAND_HEADERS,
+    COMMAND_GETBLOCKS,
+    COMMAND_INV,
+    COMMAND_GETDATA,
+    COMMAND_NOTFOUND,
+    COMMAND_BLOCK,
+    COMMAND_TX,
+    COMMAND_SENDHEADERS,
+    COMMAND_SENDCMPCT,
+    COMMAND_FEEFILTER,
+    COMMAND_COUNT
+} command_id;
+
+/**
+ * Callback handling a received message with the command it was registered for.
+ *
+ * @param ctx The context passed to dispatch_command, e.g. the node the message came from.
+ * @param payload The message payload.
+ * @param payload_len The length of the payload.
+ * @param log_filename The name of the log file of the peer.
+ */
+typedef void (*command_handler)(void* ctx, const unsigned char* payload, size_t payload_len,
+    const char* log_filename);
+
+/**
+ * Build the command lookup table. Must be called before any other command function.
+ */
+void init_commands();
+
+/**
+ * Get the identifier of the command from the command field of the message header.
+ *
+ * @param command The 12-byte null-padded command.
+ * @return The command identifier, COMMAND_UNKNOWN if the command is not known.
+ */
+command_id get_command_id(const char command[COMMAND_SIZE]);
+
+/**
+ * Get the name of the command.
+ *
+ * @param id The command identifier.
+ * @return The command name, "unknown" for COMMAND_UNKNOWN.
+ */
+const char* get_command_name(command_id id);
+
+/**
+ * Register the handler of the command. The previous handler of the command is replaced.
+ *
+ * @param id The command identifier.
+ * @param handler The handler, NULL to ignore the command.
+ */
+void register_command_handler(command_id id, command_handler handler);
+
+/**
+ * Handle the message with the handler registered for its command.
+ *
+ * @param id The command identifier.
+ * @param ctx The context passed to the handler.
+ * @param payload The message payload.
+ * @param payload_len The length of the payload.
+ * @param log_filename The name of the log file of the peer.
+ * @return 1 if the message was handled, 0 if no handler is registered for the command.
+ */
+int dispatch_command(command_id id, void* ctx, const unsigned char* payload, size_t payload_len,
+    const char* log_filename);
+
+/**
+ * Update the counters of the command with a received message.
+ *
+ * @param id The command identifier.
+ * @param payload_len The length of the message payload.
+ */
+void count_command(command_id id, size_t payload_len);
+
+/**
+ * Get the counters of the command.
+ *
+ * @param id The command identifier.
+ * @param messages The number of received messages.
+ * @param bytes The total payload size of received messages.
+ */
+void get_command_stats(command_id id, uint64_t* messages, uint64_t* bytes);
+
+/**
+ * Print the counters of every command that was received at least once.
+ */
+void print_command_stats();
+
+#endif // __COMMAND_H
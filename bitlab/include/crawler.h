@@ -0,0 +1,98 @@
+#ifndef __CRAWLER_H
+#define __CRAWLER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Name of the snapshot file of the last crawl in the config directory
+#define CRAWL_SNAPSHOT_FILE "crawl.dat"
+
+// Default number of probes in flight
+#define CRAWL_DEFAULT_CONCURRENCY 256
+
+// Maximum number of probes in flight, every probe holds a socket
+#define CRAWL_MAX_CONCURRENCY 1000
+
+// Default maximum number of probed nodes, the crawl stops once it is reached
+#define CRAWL_DEFAULT_MAX_NODES 100000
+
+// Time given to a probe from the connect to the 'addr' answering 'getaddr'
+#define CRAWL_PROBE_TIMEOUT_MS 10000
+
+// Time given to the peer to answer 'getaddr' once the handshake finished
+#define CRAWL_ADDR_TIMEOUT_MS 5000
+
+// Interval of the timer starting probes and expiring the ones past their deadline
+#define CRAWL_TIMER_INTERVAL_MS 100
+
+// Maximum length of a user agent kept in the snapshot
+#define CRAWL_MAX_USER_AGENT_LEN 255
+
+/**
+ * The result of probing a reachable node.
+ *
+ * @param addr The IPv6 address of the node, IPv4 addresses are IPv6-mapped.
+ * @param port The port of the node.
+ * @param services The services announced in the 'version' of the node.
+ * @param protocol_version The protocol version of the node.
+ * @param start_height The height of the best block of the node.
+ * @param rtt_ms The time from sending 'version' to receiving the 'version' of the node.
+ * @param addr_count The number of addresses the node answered 'getaddr' with.
+ * @param user_agent The user agent of the node.
+ */
+typedef struct
+{
+    unsigned char addr[16];
+    uint16_t port;
+    uint64_t services;
+    int32_t protocol_version;
+    int32_t start_height;
+    uint32_t rtt_ms;
+    uint32_t addr_count;
+    char user_agent[CRAWL_MAX_USER_AGENT_LEN + 1];
+} crawl_node;
+
+/**
+ * Initialize the crawler and register its timer in the event loop. Must be called after the
+ * event loop is initialized.
+ *
+ * @param snapshot_filename The path of the snapshot file written at the end of every crawl.
+ */
+void init_crawler(const char* snapshot_filename);
+
+/**
+ * Stop a running crawl and release the crawler.
+ */
+void free_crawler();
+
+/**
+ * Start a breadth-first crawl of the network from the addresses of the address manager and the
+ * peer queue. Every node gets 'version', 'verack' and 'getaddr' and is disconnected once it
+ * answers with addresses, the addresses not seen yet are probed next. The snapshot of the
+ * reachable nodes is written once no addresses are left or the limit is reached.
+ *
+ * @param concurrency The number of probes in flight.
+ * @param max_nodes The maximum number of probed nodes.
+ * @return 0 if the crawl started, -1 if a crawl is running or there is nothing to probe.
+ */
+int start_crawl(int concurrency, int max_nodes);
+
+/**
+ * Stop the running crawl and write the snapshot of the nodes probed so far.
+ */
+void stop_crawl();
+
+/**
+ * Check if a crawl is running.
+ *
+ * @return True if a crawl is running, false otherwise.
+ */
+bool is_crawl_running();
+
+/**
+ * Print the progress of the running crawl or the summary of the last one.
+ */
+void print_crawl_status();
+
+#endif // __CRAWLER_H
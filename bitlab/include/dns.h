@@ -0,0 +1,65 @@
+#ifndef __DNS_H
+#define __DNS_H
+
+#include <stddef.h>
+
+// Maximum number of addresses kept from the lookup of one domain
+#define DNS_MAX_ADDRESSES 64
+
+// Maximum length of a domain name
+#define DNS_MAX_DOMAIN_LEN 256
+
+// Time given to every DNS seed of a discovery round, the seeds are resolved concurrently
+#define DNS_SEED_TIMEOUT_MS 5000
+
+/**
+ * The status of a domain lookup.
+ */
+typedef enum
+{
+    DNS_LOOKUP_OK,
+    DNS_LOOKUP_FAILED,
+    DNS_LOOKUP_TIMED_OUT
+} dns_lookup_status;
+
+/**
+ * The result of a domain lookup.
+ *
+ * @param domain The looked up domain.
+ * @param status The status of the lookup.
+ * @param error The error message if the lookup failed.
+ * @param count The number of addresses.
+ * @param addresses The IPv4 addresses as IPv6-mapped addresses, like in peer records.
+ */
+typedef struct
+{
+    char domain[DNS_MAX_DOMAIN_LEN];
+    dns_lookup_status status;
+    char error[128];
+    size_t count;
+    unsigned char addresses[DNS_MAX_ADDRESSES][16];
+} dns_lookup_result;
+
+/**
+ * Resolve the IPv4 addresses of the domains concurrently, every domain in its own thread, so the
+ * wait is bounded by the slowest domain or the timeout instead of the sum of all lookups.
+ * Lookups still running at the timeout are reported as timed out and finish in the background.
+ *
+ * @param domains The domains to look up.
+ * @param domain_count The number of domains.
+ * @param timeout_ms The time given to the lookups.
+ * @param results The buffer of domain_count results, in the order of the domains.
+ * @return The number of domains resolved to at least one address.
+ */
+size_t lookup_domains(const char* const* domains, size_t domain_count, int timeout_ms,
+    dns_lookup_result* results);
+
+/**
+ * Get the name of the lookup status.
+ *
+ * @param status The status.
+ * @return The name of the status.
+ */
+const char* get_dns_lookup_status_name(dns_lookup_status status);
+
+#endif // __DNS_H
@@ -0,0 +1,130 @@
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// Maximum number of file descriptors the event loop can watch
+#define EVENT_LOOP_MAX_FDS 65536
+
+// Maximum number of events fetched by a single epoll_wait call
+#define EVENT_LOOP_MAX_EVENTS 256
+
+// Maximum number of periodic timers
+#define EVENT_LOOP_MAX_TIMERS 16
+
+// Maximum number of tasks posted to the event loop thread and not run yet
+#define EVENT_LOOP_MAX_TASKS 256
+
+// Upper bound for a single epoll_wait call, so the exit flag is noticed quickly
+#define EVENT_LOOP_MAX_WAIT_MS 250
+
+/**
+ * Callback invoked by the event loop when a watched file descriptor becomes ready.
+ *
+ * @param fd The file descriptor.
+ * @param events The epoll events that occurred (EPOLLIN, EPOLLOUT, EPOLLERR, ...).
+ * @param ctx The context passed on registration.
+ */
+typedef void (*event_callback)(int fd, uint32_t events, void* ctx);
+
+/**
+ * Callback invoked by the event loop when a periodic timer fires.
+ *
+ * @param ctx The context passed on registration.
+ */
+typedef void (*timer_callback)(void* ctx);
+
+/**
+ * Initialize the event loop. Must be called before any other event loop function.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int init_event_loop();
+
+/**
+ * Event loop handler thread. Waits for events on all registered file descriptors and
+ * dispatches them to their callbacks until the exit flag is set.
+ *
+ * @param arg Not used. Write dummy code for no warning.
+ */
+void* handle_event_loop(void* arg);
+
+/**
+ * Register a file descriptor in the event loop. The descriptor should be non-blocking.
+ *
+ * @param fd The file descriptor.
+ * @param events The epoll events to watch for.
+ * @param callback The callback invoked when the descriptor becomes ready.
+ * @param ctx The context passed to the callback.
+ * @return 0 if successful, otherwise -1.
+ */
+int event_loop_add(int fd, uint32_t events, event_callback callback, void* ctx);
+
+/**
+ * Change the events watched for the registered file descriptor.
+ *
+ * @param fd The file descriptor.
+ * @param events The new set of epoll events.
+ * @return 0 if successful, otherwise -1.
+ */
+int event_loop_modify(int fd, uint32_t events);
+
+/**
+ * Unregister a file descriptor from the event loop. Events already fetched for the descriptor
+ * are discarded, so the callback is never invoked after this function returns on the loop thread.
+ *
+ * @param fd The file descriptor.
+ * @return 0 if successful, otherwise -1.
+ */
+int event_loop_remove(int fd);
+
+/**
+ * Register a periodic timer in the event loop.
+ *
+ * @param callback The callback invoked when the timer fires.
+ * @param ctx The context passed to the callback.
+ * @param interval_ms The interval of the timer in milliseconds.
+ * @return 0 if successful, otherwise -1.
+ */
+int event_loop_add_timer(timer_callback callback, void* ctx, int interval_ms);
+
+/**
+ * Run the callback once on the event loop thread, in the order of posting. Used to act on state
+ * owned by the loop, like peer sockets, from other threads.
+ *
+ * @param callback The callback.
+ * @param ctx The context passed to the callback.
+ * @return 0 if posted, -1 if the event loop is not running or too many tasks are pending.
+ */
+int event_loop_post(timer_callback callback, void* ctx);
+
+/**
+ * Wake the event loop up from epoll_wait, e.g. after changing state it should act upon.
+ */
+void event_loop_wakeup();
+
+/**
+ * Check whether the calling thread is the event loop thread.
+ *
+ * @return 1 if called from the event loop thread, 0 otherwise.
+ */
+int is_event_loop_thread();
+
+/**
+ * Set or clear the O_NONBLOCK flag of the file descriptor.
+ *
+ * @param fd The file descriptor.
+ * @param enabled 1 to make the descriptor non-blocking, 0 to make it blocking.
+ * @return 0 if successful, otherwise -1.
+ */
+int set_nonblocking(int fd, int enabled);
+
+/**
+ * Get the monotonic time in milliseconds.
+ *
+ * @return The monotonic time in milliseconds.
+ */
+uint64_t get_monotonic_ms();
+
+#endif // __EVENT_LOOP_H
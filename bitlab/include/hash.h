@@ -0,0 +1,85 @@
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stddef.h>
+
+// Size of a SHA-256 digest in bytes
+#define HASH_SIZE 32
+
+// Number of messages hashed at once by the AVX2 multi-buffer implementation
+#define HASH_AVX2_LANES 8
+
+/**
+ * The implementations of SHA-256 selectable at runtime.
+ *
+ * @param HASH_BACKEND_OPENSSL One-shot OpenSSL calls, available everywhere.
+ * @param HASH_BACKEND_AVX2 8 messages hashed in parallel with AVX2, single messages use OpenSSL.
+ * @param HASH_BACKEND_SHANI The SHA extensions of x86 processors, batches of messages still use the
+ * AVX2 lanes when the processor has them.
+ */
+typedef enum
+{
+    HASH_BACKEND_OPENSSL,
+    HASH_BACKEND_AVX2,
+    HASH_BACKEND_SHANI,
+    HASH_BACKEND_COUNT
+} hash_backend;
+
+/**
+ * Select the fastest hash backend supported by the processor. Must be called before other
+ * threads start hashing.
+ */
+void init_hash();
+
+/**
+ * Check if the processor supports the hash backend.
+ *
+ * @param backend The hash backend.
+ * @return 1 if the backend can be used, 0 otherwise.
+ */
+int is_hash_backend_supported(hash_backend backend);
+
+/**
+ * Select the hash backend, e.g. to compare the implementations.
+ *
+ * @param backend The hash backend.
+ * @return 0 if successful, -1 if the backend is not supported.
+ */
+int set_hash_backend(hash_backend backend);
+
+/**
+ * Get the selected hash backend.
+ *
+ * @return The hash backend.
+ */
+hash_backend get_hash_backend();
+
+/**
+ * Get the name of the hash backend.
+ *
+ * @param backend The hash backend.
+ * @return The backend name.
+ */
+const char* get_hash_backend_name(hash_backend backend);
+
+/**
+ * Calculate the double-SHA256 of the data, as used for message checksums, block hashes and txids.
+ *
+ * @param data The data.
+ * @param len The length of the data.
+ * @param out The buffer to store the 32-byte digest.
+ */
+void double_sha256(const unsigned char* data, size_t len, unsigned char out[HASH_SIZE]);
+
+/**
+ * Calculate the double-SHA256 of many equally sized items stored one after another, e.g. 80-byte
+ * block headers or 64-byte pairs of merkle tree nodes. Digests are stored in the same order.
+ *
+ * @param data The items.
+ * @param item_len The length of a single item.
+ * @param count The number of items.
+ * @param out The buffer to store count 32-byte digests.
+ */
+void double_sha256_many(const unsigned char* data, size_t item_len, size_t count, unsigned char* out);
+
+#endif // __HASH_H
@@ -0,0 +1,134 @@
+#ifndef __HEADER_INDEX_H
+#define __HEADER_INDEX_H
+
+#include <stddef.h>
+
+#include "hash.h"
+
+// Size of a serialized block header
+#define BLOCK_HEADER_SIZE 80
+
+// Initial number of slots of the hash to height table, grown by doubling
+#define HEADER_TABLE_INITIAL_SIZE 8192
+
+// Address space reserved for the mapping of the headers file, so mapped headers never move (16M headers)
+#define HEADER_MAP_RESERVE ((size_t)16 * 1024 * 1024 * BLOCK_HEADER_SIZE)
+
+// The mapping of the headers file grows in steps of this size, a multiple of the page size
+#define HEADER_MAP_CHUNK ((size_t)16 * 1024 * 1024)
+
+// Number of appended headers after which the headers file is synced to disk
+#define HEADER_SYNC_BATCH 20000
+
+// Suffix of the metadata file recording the tip of the synced headers file
+#define HEADERS_META_SUFFIX ".meta"
+
+// Number of most recent blocks listed one by one in a block locator, before the steps double
+#define LOCATOR_DENSE_COUNT 10
+
+/**
+ * Initialize the header index with the genesis block and map the headers stored in the file.
+ * The file must hold the best chain from genesis on. Headers up to the tip recorded in the
+ * metadata file are trusted, so only the headers appended after the last sync are hashed, though
+ * the difficulty of every header is checked. The file is truncated after the last valid header
+ * extending the chain. Must be called before other
+ * threads start.
+ *
+ * @param filename The file the headers are stored in and appended to.
+ * @return The number of headers loaded from the file, or -1 on failure.
+ */
+int init_header_index(const char* filename);
+
+/**
+ * Sync the headers file and the metadata file to disk, then free the header index.
+ */
+void free_header_index();
+
+/**
+ * Add the headers extending the best chain to the index and append them to the headers file.
+ * Headers already known are skipped. Adding stops at the first header not extending the chain,
+ * whose 'bits' are not the ones required by the difficulty adjustment of mainnet or whose hash
+ * exceeds their target.
+ * The file is synced to disk every HEADER_SYNC_BATCH headers.
+ *
+ * @param headers The consecutive 80-byte headers.
+ * @param count The number of headers.
+ * @return The number of headers added, or -1 on failure.
+ */
+int add_headers(const unsigned char* headers, size_t count);
+
+/**
+ * Get the number of headers in the index, including the genesis block.
+ *
+ * @return The number of headers, the height of the tip plus one.
+ */
+int get_header_count();
+
+/**
+ * Get the height of the block with the given hash.
+ *
+ * @param hash The block hash in internal byte order.
+ * @return The height of the block, or -1 if the block is not known.
+ */
+int get_header_height(const unsigned char hash[HASH_SIZE]);
+
+/**
+ * Get the header and the hash of the block at the given height.
+ *
+ * @param height The height of the block.
+ * @param header The buffer to store the 80-byte header, may be NULL.
+ * @param hash The buffer to store the block hash, may be NULL.
+ * @return 0 if successful, -1 if there is no block at the height.
+ */
+int get_header(int height, unsigned char header[BLOCK_HEADER_SIZE], unsigned char hash[HASH_SIZE]);
+
+/**
+ * Get the header of the block at the given height without copying it. The header is read from
+ * the mapping of the headers file and stays valid until the header index is freed.
+ *
+ * @param height The height of the block.
+ * @return The 80-byte header, or NULL if there is no block at the height.
+ */
+const unsigned char* get_header_data(int height);
+
+/**
+ * Copy the consecutive headers starting at the given height, e.g. to answer 'getheaders'.
+ *
+ * @param start_height The height of the first header.
+ * @param max_count The maximum number of headers.
+ * @param stop_hash The hash of the last header to copy, NULL or zeros to copy max_count headers.
+ * @param headers The buffer to store the 80-byte headers, may be NULL.
+ * @param hashes The buffer to store the block hashes, may be NULL.
+ * @return The number of copied headers.
+ */
+size_t get_headers(int start_height, size_t max_count, const unsigned char* stop_hash,
+    unsigned char* headers, unsigned char* hashes);
+
+/**
+ * Build the block locator of the best chain: the hashes of the 10 most recent blocks, then of
+ * blocks at doubling distances down to the genesis block, which is always included.
+ *
+ * @param locator The buffer to store the 32-byte hashes.
+ * @param max_count The maximum number of hashes, at least 1.
+ * @return The number of hashes in the locator.
+ */
+size_t build_block_locator(unsigned char* locator, size_t max_count);
+
+/**
+ * Find the last block of the best chain known to both sides from the locator of a peer.
+ *
+ * @param locator The 32-byte hashes of the locator, most recent first.
+ * @param count The number of hashes.
+ * @return The height of the first locator hash found in the index, 0 (genesis) if none is known.
+ */
+int find_locator_fork(const unsigned char* locator, size_t count);
+
+/**
+ * Sync the appended headers to disk and record the new tip in the metadata file, if any headers
+ * were appended since the last sync.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int sync_header_index();
+
+#endif // __HEADER_INDEX_H
@@ -0,0 +1,44 @@
+#ifndef __HEADER_SYNC_H
+#define __HEADER_SYNC_H
+
+// Interval of the timer driving the header sync in milliseconds
+#define HEADER_SYNC_TICK_MS 250
+
+// Time a peer has to answer a 'getheaders' before it is considered stalled in milliseconds
+#define HEADER_SYNC_STALL_MS 10000
+
+// Time a stalled or misbehaving peer is not asked for headers in milliseconds
+#define HEADER_SYNC_PENALTY_MS 60000
+
+// Interval of the progress reports of a running header sync in milliseconds
+#define HEADER_SYNC_REPORT_MS 10000
+
+// Weight of the latest batch in the moving average of the header rate of a peer
+#define HEADER_SYNC_RATE_WEIGHT 0.3
+
+/**
+ * Initialize the header sync and register its timer in the event loop. Must be called after the
+ * event loop and the header index are initialized.
+ */
+void init_header_sync();
+
+/**
+ * Start syncing the headers of the best chain from the connected peers in the background.
+ * Batches of headers are requested with the block locator of the header index until a peer
+ * reports no more headers. The fastest responsive peer is asked, a stalled peer is replaced.
+ *
+ * @return 0 if the sync was started, -1 if it is already running.
+ */
+int start_header_sync();
+
+/**
+ * Stop the header sync. Headers received later are ignored.
+ */
+void stop_header_sync();
+
+/**
+ * Print the state of the header sync: the tip height, the sync rate and the rates of the peers.
+ */
+void print_header_sync_status();
+
+#endif // __HEADER_SYNC_H
@@ -4,9 +4,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/types.h>
 
-#define MAX_LOG_FILES 10
 #define MAX_FILENAME_LENGTH 256
 #define BITLAB_LOG "bitlab.log"
 #define LOG_BITLAB_STARTED "BitLab started ----------------------------------------------------------------------------------------"
@@ -15,6 +18,80 @@
 #define LOCKED_FILE_RETRY_TIME 1000 // in microseconds (1 millisecond)
 #define LOCKED_FILE_TIMEOUT 5000000 // in microseconds (5 seconds)
 
+// Maximum length of a formatted log message, longer messages are truncated
+#define LOG_MESSAGE_LENGTH 1024
+
+// Number of records in the ring buffer of every logging thread, a power of two
+#define LOG_RING_CAPACITY 512
+
+// Longest time records wait in the ring buffers before the writer thread writes them
+#define LOG_FLUSH_INTERVAL_MS 100
+
+// Suffix of the binary log files, appended to the name of the text log file
+#define LOG_BINARY_SUFFIX ".bin"
+
+// Magic number of the session records of binary log files, "BLOG" in little-endian
+#define LOG_BINARY_MAGIC 0x474F4C42
+
+// Maximum number of distinct format strings and source files logged in binary format, a power of two
+#define LOG_MAX_STRINGS 4096
+
+// Maximum number of arguments of a format string logged in binary format
+#define LOG_MAX_ARGS 16
+
+// Number of hash buckets of the log sink registry, a power of two
+#define LOG_SINK_BUCKETS 1024
+
+// Maximum number of log files open at once, the least recently used one is closed for a new one
+#define LOG_MAX_OPEN_FILES 64
+
+// Time after which a log file without new records is closed
+#define LOG_SINK_IDLE_MS 60000
+
+// Prefix and suffix of the log files of the peers, combined into LOG_PEERS_FILE when enabled
+#define LOG_PEER_PREFIX "peer_connection_"
+#define LOG_PEER_SUFFIX ".log"
+
+// Log file of all peers tagged with their addresses
+#define LOG_PEERS_FILE "peers.log"
+
+// Maximum length of the peer tag of a combined log record
+#define LOG_MAX_TAG_LENGTH 64
+
+// Name of the log level config file in the config directory
+#define LOG_CONFIG_FILE "log.conf"
+
+// Maximum number of log files with their own minimum level
+#define LOG_MAX_FILE_LEVELS 16
+
+// Maximum number of log files with their own rotation
+#define LOG_MAX_ROTATION_RULES 16
+
+// Default size at which a log file is rotated, 0 disables rotation by size
+#define LOG_ROTATE_DEFAULT_SIZE (16ULL * 1024 * 1024)
+
+// Default age in seconds at which a log file is rotated, 0 disables rotation by age
+#define LOG_ROTATE_DEFAULT_AGE 0
+
+// Default number of rotated segments kept of every log file
+#define LOG_ROTATE_DEFAULT_KEEP 5
+
+// Suffix of the compressed rotated segments
+#define LOG_COMPRESSED_SUFFIX ".gz"
+
+// Nice value of the compression thread, so compression only uses otherwise idle CPU time
+#define LOG_COMPRESS_NICE 19
+
+// Size of the buffer the rotated segments are compressed with
+#define LOG_COMPRESS_BUFFER_SIZE 65536
+
+// Minimum level of the messages written at start, debug builds write everything
+#ifdef DEBUG
+#define LOG_DEFAULT_LEVEL LOG_DEBUG
+#else
+#define LOG_DEFAULT_LEVEL LOG_INFO
+#endif
+
 /**
  * The log level enumeration used to define the level of logging that is being used.
  *
@@ -34,28 +111,230 @@ typedef enum
 } log_level;
 
 /**
- * The logger structure used to store the logger for the logging system.
+ * The log format enumeration used to select how messages are written.
+ *
+ * @param LOG_FORMAT_TEXT Formatted text lines in the log file
+ * @param LOG_FORMAT_BINARY Format string IDs and raw arguments in the binary log file, decoded
+ * offline by bitlab-logdecode
+ */
+typedef enum
+{
+    LOG_FORMAT_TEXT,
+    LOG_FORMAT_BINARY
+} log_format;
+
+/**
+ * The types of the records of binary log files. All integers are in host byte order.
+ *
+ * @param LOG_RECORD_SESSION Starts the records of one run: u32 magic, u64 wall clock time and
+ * u64 monotonic time in nanoseconds. The strings defined before are forgotten.
+ * @param LOG_RECORD_STRING Defines a format string or a source file: u32 ID, u16 length, bytes.
+ * @param LOG_RECORD_MESSAGE A message: u8 level, u32 format ID, u32 source ID, u64 monotonic time
+ * in nanoseconds, u16 length of the arguments and the arguments. Strings are stored as u16 length
+ * and bytes, every other argument as 8 bytes.
+ * @param LOG_RECORD_TEXT A message formatted when logged: u8 level, u64 monotonic time in
+ * nanoseconds, u16 length and bytes of the source file, u16 length and bytes of the message.
+ * @param LOG_RECORD_TAG Tags the following messages with the peer they are from in the combined
+ * peer log: u16 length and bytes of the tag.
+ */
+typedef enum
+{
+    LOG_RECORD_SESSION = 1,
+    LOG_RECORD_STRING = 2,
+    LOG_RECORD_MESSAGE = 3,
+    LOG_RECORD_TEXT = 4,
+    LOG_RECORD_TAG = 5
+} log_record_type;
+
+/**
+ * The argument types of the conversions supported in binary format.
+ */
+typedef enum
+{
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_LONG,
+    LOG_ARG_ULONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_ULLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_UINTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER
+} log_arg_type;
+
+/**
+ * A conversion of a format string.
+ *
+ * @param type The type of the argument.
+ * @param start The offset of the conversion in the format string.
+ * @param length The length of the conversion, from '%' to the conversion character.
+ */
+typedef struct log_format_spec
+{
+    log_arg_type type;
+    size_t start;
+    size_t length;
+} log_format_spec;
+
+/**
+ * The minimum log level of the log files starting with a prefix.
+ *
+ * @param prefix The prefix of the log filenames.
+ * @param level The minimum log level.
+ */
+typedef struct log_file_level
+{
+    char prefix[MAX_FILENAME_LENGTH];
+    log_level level;
+} log_file_level;
+
+/**
+ * The rotation of a log file. Rotated segments are renamed with the time of the rotation appended,
+ * compressed in the background and the oldest ones beyond the kept count are removed.
+ *
+ * @param max_size The size in bytes the log file is rotated at, 0 to disable.
+ * @param max_age The age in seconds of the log file written in this run it is rotated at, 0 to
+ * disable.
+ * @param keep The number of rotated segments kept.
+ * @param compress The flag to indicate rotated segments are compressed with gzip.
+ */
+typedef struct log_rotation
+{
+    uint64_t max_size;
+    uint64_t max_age;
+    int keep;
+    int compress;
+} log_rotation;
+
+/**
+ * The rotation of the log files starting with a prefix.
  *
+ * @param prefix The prefix of the log filenames.
+ * @param rotation The rotation.
+ */
+typedef struct log_rotation_rule
+{
+    char prefix[MAX_FILENAME_LENGTH];
+    log_rotation rotation;
+} log_rotation_rule;
+
+/**
+ * The logger structure used to store a log sink of the logging system. Sinks stay in the
+ * registry for the whole run, their files are opened on demand and closed when idle.
+ *
+ * @param name The name of the sink, the log filename relative to the logs directory.
  * @param filename The filename of the log file.
- * @param file The file pointer for the log file.
+ * @param is_binary The flag to indicate the sink is a binary log file.
+ * @param hash The hash of the name and the format.
+ * @param file The file pointer for the log file, NULL while closed.
+ * @param is_dirty The flag to indicate the file is locked and has records not flushed yet.
+ * @param has_session The flag to indicate the binary log file started the session of this run.
+ * @param last_used_ms The monotonic time of the last record.
+ * @param segment_start The time the log file was first written to in this run, the start of
+ * its age.
+ * @param device The device of the open log file, to detect rotation by another process.
+ * @param inode The inode of the open log file, to detect rotation by another process.
+ * @param end_offset The size of the log file after the last flushed batch, to detect records
+ * appended by another process.
+ * @param defined_strings The bitset of the strings defined in the binary log file in this run,
+ * NULL for text log files.
+ * @param tag The tag of the last record of the binary combined peer log.
+ * @param next The next sink of the hash bucket.
+ * @param lru_prev The more recently used open sink.
+ * @param lru_next The less recently used open sink.
  */
 typedef struct logger
 {
+    char* name;
     char* filename;
+    int is_binary;
+    uint32_t hash;
     FILE* file;
+    int is_dirty;
+    int has_session;
+    uint64_t last_used_ms;
+    time_t segment_start;
+    dev_t device;
+    ino_t inode;
+    off_t end_offset;
+    unsigned char* defined_strings;
+    char tag[LOG_MAX_TAG_LENGTH];
+    struct logger* next;
+    struct logger* lru_prev;
+    struct logger* lru_next;
 } logger;
 
 /**
- * The loggers structure used to store the loggers for the logging system.
+ * The log record passed from the logging thread to the writer thread.
+ *
+ * @param level The log level.
+ * @param is_binary The flag to indicate the record goes to the binary log file.
+ * @param timestamp The time the message was logged at.
+ * @param monotonic_ns The monotonic time the message was logged at, binary records only.
+ * @param source_file The source file that the log message is from, a string literal like __FILE__.
+ * @param format_id The ID of the format string of a binary record, -1 if the message is formatted.
+ * @param source_id The ID of the source file of a binary record.
+ * @param args_len The length of the packed arguments of a binary record.
+ * @param filename The file that the log message is destined for.
+ * @param message The formatted log message or the packed arguments.
+ */
+typedef struct log_record
+{
+    log_level level;
+    int is_binary;
+    time_t timestamp;
+    uint64_t monotonic_ns;
+    const char* source_file;
+    int format_id;
+    int source_id;
+    size_t args_len;
+    char filename[MAX_FILENAME_LENGTH];
+    char message[LOG_MESSAGE_LENGTH];
+} log_record;
+
+/**
+ * The single-producer single-consumer ring buffer of one logging thread. Only the thread moves
+ * the head and only the writer thread moves the tail, so neither side takes a lock.
+ *
+ * @param head The number of records pushed by the thread.
+ * @param tail The number of records written by the writer thread.
+ * @param is_orphaned The flag set when the thread exits, the writer frees the drained ring.
+ * @param next The next ring of the registry.
+ * @param records The records.
+ */
+typedef struct log_ring
+{
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_int is_orphaned;
+    struct log_ring* next;
+    log_record records[LOG_RING_CAPACITY];
+} log_ring;
+
+/**
+ * The loggers structure used to store the registry of log sinks, keyed by the hash of their
+ * names, and the open ones from the most to the least recently used.
  *
  * @param log_mutex The mutex for the loggers.
- * @param array The array of loggers.
+ * @param buckets The hash buckets of the sinks.
+ * @param lru_head The most recently used open sink.
+ * @param lru_tail The least recently used open sink, closed first.
+ * @param count The number of sinks.
+ * @param open_count The number of open log files.
  * @param is_initializing The flag to indicate if the loggers are initializing.
  */
 typedef struct loggers
 {
     pthread_mutex_t log_mutex;
-    logger* array[MAX_LOG_FILES];
+    logger* buckets[LOG_SINK_BUCKETS];
+    logger* lru_head;
+    logger* lru_tail;
+    size_t count;
+    size_t open_count;
     int is_initializing;
 } loggers;
 
@@ -67,14 +346,39 @@ typedef struct loggers
 const char* create_logs_dir();
 
 /**
- * Initialize logging used to initialize the logging system, open and preserve the log file.
+ * Initialize logging used to initialize the logging system, open and preserve the log file and
+ * start the writer thread if it is not running.
  *
  * @param log_file The log file to write to.
  */
 void init_logging(const char* filename);
 
 /**
- * Log a message used to log a message to the console or a file.
+ * The lowest of the global and the per-file minimum levels. Messages below it are skipped by
+ * log_message before their arguments are evaluated.
+ */
+extern atomic_int log_threshold;
+
+/**
+ * Log a message used to log a message to a file. Messages below every minimum level cost one
+ * compare and their arguments are not evaluated, the rest are checked against the minimum level
+ * of their file and passed to log_write.
+ *
+ * @param level The log level.
+ * @param log_file The file that the log message is destined for.
+ * @param source_file The source file that the log message is from.
+ * @param format The format of the log message.
+ * @param ... The arguments for the format.
+ */
+#define log_message(level, log_file, ...) \
+    ((int)(level) >= atomic_load_explicit(&log_threshold, memory_order_relaxed) ? \
+    log_write(level, log_file, __VA_ARGS__) : (void)0)
+
+/**
+ * Write a message to a file if its level reaches the minimum level of the file. The message is
+ * formatted into the ring buffer of the calling thread and written by the writer thread, so the
+ * caller never waits for locks or disk. When the ring buffer is full the message is dropped and
+ * counted. Use log_message, which skips disabled messages without evaluating their arguments.
  *
  * @param level The log level.
  * @param log_file The file that the log message is destined for.
@@ -82,10 +386,202 @@ void init_logging(const char* filename);
  * @param format The format of the log message.
  * @param ... The arguments for the format.
  */
-void log_message(log_level level, const char* filename, const char* source_file, const char* format, ...);
+void log_write(log_level level, const char* filename, const char* source_file, const char* format, ...);
+
+/**
+ * Set the global minimum log level, used by the files without their own minimum level.
+ *
+ * @param level The minimum log level.
+ */
+void set_log_level(log_level level);
+
+/**
+ * Get the global minimum log level.
+ *
+ * @return The minimum log level.
+ */
+log_level get_log_level();
+
+/**
+ * Set the minimum log level of the log files starting with the prefix, like "peer_connection"
+ * for the logs of all peers. The longest matching prefix wins.
+ *
+ * @param prefix The prefix of the log filenames.
+ * @param level The minimum log level.
+ * @return 0 if successful, -1 if LOG_MAX_FILE_LEVELS prefixes are set.
+ */
+int set_file_log_level(const char* prefix, log_level level);
+
+/**
+ * Remove the minimum log level of the prefix, its files use the global minimum level again.
+ *
+ * @param prefix The prefix of the log filenames.
+ */
+void clear_file_log_level(const char* prefix);
+
+/**
+ * Get the per-file minimum log levels.
+ *
+ * @param levels The buffer of the per-file minimum log levels.
+ * @param max_count The size of the buffer.
+ * @return The number of stored levels.
+ */
+int get_file_log_levels(log_file_level* levels, int max_count);
+
+/**
+ * Parse the name of a log level, case-insensitive.
+ *
+ * @param name The name of the log level.
+ * @param level The parsed log level.
+ * @return 0 if successful, -1 if the name is unknown.
+ */
+int parse_log_level(const char* name, log_level* level);
+
+/**
+ * Load the minimum log levels and the rotations from the config file. Every line holds a level,
+ * setting the global minimum level, or a log filename prefix and a level. Lines starting with
+ * "rotate" hold an optional log filename prefix and rotation options, see
+ * parse_log_rotation_option. Empty lines and lines starting with '#' are skipped.
+ *
+ * @param filename The path of the config file.
+ * @return The number of applied lines or -1 if the file cannot be opened.
+ */
+int load_log_config(const char* filename);
+
+/**
+ * Set the rotation of the log files without their own rotation.
+ *
+ * @param rotation The rotation.
+ */
+void set_log_rotation(const log_rotation* rotation);
+
+/**
+ * Get the rotation of the log files without their own rotation.
+ *
+ * @param rotation The rotation.
+ */
+void get_log_rotation(log_rotation* rotation);
+
+/**
+ * Set the rotation of the log files starting with the prefix, like "peer_connection" for the
+ * logs of all peers. The longest matching prefix wins.
+ *
+ * @param prefix The prefix of the log filenames.
+ * @param rotation The rotation.
+ * @return 0 if successful, -1 if LOG_MAX_ROTATION_RULES prefixes are set.
+ */
+int set_file_log_rotation(const char* prefix, const log_rotation* rotation);
+
+/**
+ * Remove the rotation of the prefix, its files use the default rotation again.
+ *
+ * @param prefix The prefix of the log filenames.
+ */
+void clear_file_log_rotation(const char* prefix);
+
+/**
+ * Get the rotation of the log file, the rotation of its longest matching prefix or the default
+ * one.
+ *
+ * @param filename The log filename relative to the logs directory.
+ * @param rotation The rotation.
+ */
+void get_file_log_rotation(const char* filename, log_rotation* rotation);
+
+/**
+ * Get the per-file rotations.
+ *
+ * @param rules The buffer of the per-file rotations.
+ * @param max_count The size of the buffer.
+ * @return The number of stored rotations.
+ */
+int get_file_log_rotations(log_rotation_rule* rules, int max_count);
+
+/**
+ * Parse a rotation option and store it in the rotation: size=<bytes>[K|M|G], age=<seconds>[m|h|d],
+ * keep=<segments> or compress=yes|no.
+ *
+ * @param option The option.
+ * @param rotation The rotation updated with the option.
+ * @return 0 if successful, -1 if the option is invalid.
+ */
+int parse_log_rotation_option(const char* option, log_rotation* rotation);
+
+/**
+ * Get the number of rotated segments waiting for compression.
+ *
+ * @return The number of segments.
+ */
+size_t get_pending_log_compressions();
+
+/**
+ * Set the format of the messages logged from now on. Binary messages go to the log file with
+ * LOG_BINARY_SUFFIX appended, so text and binary records are never mixed in one file.
+ *
+ * @param format The log format.
+ */
+void set_log_format(log_format format);
+
+/**
+ * Get the format of the logged messages.
+ *
+ * @return The log format.
+ */
+log_format get_log_format();
+
+/**
+ * Get the name of the log level as written in text log files.
+ *
+ * @param level The log level.
+ * @return The name of the log level.
+ */
+const char* get_log_level_name(log_level level);
+
+/**
+ * Parse the conversions of a printf format string for binary logging. Flags, field width,
+ * precision and the hh, h, l, ll, z, j and t length modifiers are supported, '*' widths, the L
+ * modifier and %n are not.
+ *
+ * @param format The format string.
+ * @param specs The buffer of the conversions.
+ * @param max_specs The size of the buffer.
+ * @return The number of conversions or -1 if the format string is not supported.
+ */
+int parse_log_format(const char* format, log_format_spec* specs, int max_specs);
+
+/**
+ * Set whether the logs of all peers are combined into LOG_PEERS_FILE, every message tagged with
+ * the address of its peer, instead of a log file per peer.
+ *
+ * @param enabled 1 to combine the peer logs, 0 for a log file per peer.
+ */
+void set_combined_peer_logs(int enabled);
+
+/**
+ * Check if the logs of all peers are combined into LOG_PEERS_FILE.
+ *
+ * @return 1 if the peer logs are combined, 0 otherwise.
+ */
+int get_combined_peer_logs();
+
+/**
+ * Get the number of log sinks and open log files.
+ *
+ * @param sinks The number of log sinks.
+ * @param open_files The number of open log files.
+ */
+void get_log_sink_counts(size_t* sinks, size_t* open_files);
+
+/**
+ * Get the number of log messages dropped because the ring buffer of their thread was full.
+ *
+ * @return The number of dropped messages.
+ */
+uint64_t get_dropped_log_records();
 
 /**
- * Finish logging used to finish logging and close the log file.
+ * Finish logging used to stop the writer thread after it writes the pending messages, close
+ * the log files and wait for the rotated segments to be compressed.
  */
 void finish_logging();
 
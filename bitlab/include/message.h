@@ -0,0 +1,141 @@
+#ifndef __MESSAGE_H
+#define __MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "command.h"
+
+// Bitcoin mainnet magic bytes:
+#define BITCOIN_MAINNET_MAGIC 0xD9B4BEF9
+
+// Maximum accepted payload size of a single message (32 MiB, same as MAX_SIZE of Bitcoin Core)
+#define MAX_MESSAGE_PAYLOAD_SIZE (32 * 1024 * 1024)
+
+// Initial capacity of a message buffer, grown on demand up to the largest pending message
+#define MESSAGE_BUFFER_INITIAL_SIZE 65536
+
+// Minimal free space requested from the buffer before each recv
+#define MESSAGE_BUFFER_MIN_READ 16384
+
+// Structure for Bitcoin P2P message header (24 bytes).
+// For reference: https://en.bitcoin.it/wiki/Protocol_documentation#Message_structure
+#pragma pack(push, 1)
+typedef struct
+{
+    unsigned int magic; // Magic value indicating message origin network
+    char command[12]; // ASCII command (null-padded)
+    unsigned int length; // Payload size (little-endian)
+    unsigned char checksum[4]; // First 4 bytes of double SHA-256 of the payload
+} bitcoin_msg_header;
+#pragma pack(pop)
+
+/**
+ * The reassembly buffer accumulating bytes received from a peer until they form complete messages.
+ * Bytes between start and end are received but not consumed yet.
+ *
+ * @param data The buffer memory.
+ * @param capacity The size of the buffer memory.
+ * @param start The offset of the first unconsumed byte.
+ * @param end The offset one past the last received byte.
+ */
+typedef struct
+{
+    unsigned char* data;
+    size_t capacity;
+    size_t start;
+    size_t end;
+} message_buffer;
+
+/**
+ * The zero-copy view of a complete message inside the message buffer. The view stays valid until
+ * the next message_buffer_recv call on the buffer it was taken from.
+ *
+ * @param header The message header.
+ * @param command The identifier of the message command.
+ * @param payload The message payload.
+ * @param payload_len The length of the payload.
+ */
+typedef struct
+{
+    const bitcoin_msg_header* header;
+    command_id command;
+    const unsigned char* payload;
+    size_t payload_len;
+} message_view;
+
+/**
+ * The result of extracting the next message from the message buffer.
+ *
+ * @param MESSAGE_INCOMPLETE More bytes must be received to complete the next message.
+ * @param MESSAGE_COMPLETE The next message was extracted.
+ * @param MESSAGE_BAD_CHECKSUM The next message was skipped because its checksum did not match.
+ * @param MESSAGE_INVALID The stream is corrupted (wrong magic or oversized payload) and cannot be resynchronized.
+ */
+typedef enum
+{
+    MESSAGE_INCOMPLETE,
+    MESSAGE_COMPLETE,
+    MESSAGE_BAD_CHECKSUM,
+    MESSAGE_INVALID
+} message_status;
+
+/**
+ * Calculate the double-SHA256 of the payload and copy its first 4 bytes as the checksum.
+ *
+ * @param payload The payload.
+ * @param payload_len The length of the payload.
+ * @param out The buffer to store the 4-byte checksum.
+ */
+void compute_checksum(const unsigned char* payload, size_t payload_len, unsigned char out[4]);
+
+/**
+ * Create a Bitcoin P2P message (header + payload) in the buffer. The command is zero-padded to 12 bytes.
+ *
+ * @param buf The buffer to store the message.
+ * @param buf_size The size of the buffer.
+ * @param command The command of the message.
+ * @param payload The payload of the message.
+ * @param payload_len The length of the payload.
+ * @return The size of the message, or 0 if the buffer is too small.
+ */
+size_t build_message(unsigned char* buf, size_t buf_size, const char* command,
+    const unsigned char* payload, size_t payload_len);
+
+/**
+ * Initialize the message buffer.
+ *
+ * @param buffer The message buffer.
+ * @return 0 if successful, otherwise -1.
+ */
+int init_message_buffer(message_buffer* buffer);
+
+/**
+ * Free the message buffer memory.
+ *
+ * @param buffer The message buffer.
+ */
+void free_message_buffer(message_buffer* buffer);
+
+/**
+ * Receive bytes from the socket into the message buffer with a single recv call. The buffer is
+ * compacted or grown first, so a whole pending message (e.g. a multi-megabyte block) fits in it.
+ *
+ * @param buffer The message buffer.
+ * @param fd The socket file descriptor.
+ * @return The result of recv: number of bytes received, 0 on orderly shutdown or -1 on error.
+ */
+ssize_t message_buffer_recv(message_buffer* buffer, int fd);
+
+/**
+ * Extract the next complete message from the message buffer and consume it. The command of the
+ * message is resolved and counted once here.
+ *
+ * @param buffer The message buffer.
+ * @param view The view to store the message in.
+ * @return The status of the extraction.
+ */
+message_status message_buffer_next(message_buffer* buffer, message_view* view);
+
+#endif // __MESSAGE_H
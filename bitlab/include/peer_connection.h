@@ -2,65 +2,164 @@
 #define __PEER_CONNECTION_H
 
 #include <stdint.h>
+#include <time.h>
 #include <pthread.h>
 
+#include "message.h"
+#include "request.h"
+#include "send_queue.h"
+
 // Maximum number of peers to track
 #define MAX_NODES 100
 
-// Bitcoin mainnet magic bytes:
-#define BITCOIN_MAINNET_MAGIC 0xD9B4BEF9
-
 // Default Bitcoin mainnet port:
 #define BITCOIN_MAINNET_PORT 8333
 
-#define htole16(x) ((uint16_t)((((x) & 0xFF) << 8) | (((x) >> 8) & 0xFF)))
-#define htole32(x) ((uint32_t)((((x) & 0xFF) << 24) | (((x) >> 8) & 0xFF00) | (((x) >> 16) & 0xFF) | (((x) >> 24) & 0xFF000000)))
-#define htole64(x) ((uint64_t)((((x) & 0xFF) << 56) | (((x) >> 8) & 0xFF00) | (((x) >> 16) & 0xFF0000) | (((x) >> 24) & 0xFF000000) | (((x) >> 32) & 0xFF00000000) | (((x) >> 40) & 0xFF0000000000) | (((x) >> 48) & 0xFF000000000000) | (((x) >> 56) & 0xFF00000000000000)))
+// Interval between keep-alive pings sent to each peer in seconds
+#define PING_INTERVAL 5
+
+// Interval between checks of pending request deadlines in milliseconds
+#define REQUEST_SWEEP_INTERVAL_MS 100
+
+// Time allowed for a single connect and version handshake in milliseconds
+#define HANDSHAKE_TIMEOUT_MS 5000
+
+// Interval at which the headers appended to the headers file are synced to disk
+#define HEADER_SYNC_INTERVAL_MS 5000
+
+// Default maximum number of inbound peers, the remaining node slots stay free for outbound peers
+#define LISTEN_DEFAULT_MAX_INBOUND 64
+
+// Length of the queue of inbound connections not accepted yet
+#define LISTEN_BACKLOG 128
+
+// Default number of handshakes in flight when connecting to peers from the queue
+#define CONNECT_DEFAULT_CONCURRENCY 32
+
+// Default deadline of connecting to peers from the queue in seconds
+#define CONNECT_DEFAULT_TIMEOUT 30
 
-#define MAX_LOCATOR_COUNT 10
-#define GENESIS_BLOCK_HASH "0000000000000000000000000000000000000000000000000000000000000000"
+// Weight of a new sample in the moving averages of the round-trip time and the throughput
+#define PEER_EWMA_WEIGHT 0.2
+
+// Round-trip time scoring half of the latency points, also assumed for peers not measured yet
+#define PEER_SCORE_RTT_REFERENCE_MS 100.0
+
+// Throughput scoring half of the throughput points, in bytes per second
+#define PEER_SCORE_THROUGHPUT_REFERENCE (100.0 * 1024)
+
+// Interval at which the failures counted against a peer are halved
+#define PEER_FAILURE_DECAY_MS 60000
+
+// Number of best-scoring peers a transaction is broadcast to
+#define TX_BROADCAST_PEERS 8
+
+// Maximum number of hashes in block locators sent by BitLab, enough for chains of 2^22 blocks
+#define MAX_LOCATOR_COUNT 32
+
+// Maximum number of hashes accepted in block locators sent by peers (same as Bitcoin Core)
+#define MAX_LOCATOR_HASHES 101
+
+#define GENESIS_BLOCK_HASH "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f"
 #define HEADERS_FILE "headers.dat"
 #define MAX_HEADERS_COUNT 2000
 
-// Structure for Bitcoin P2P message header (24 bytes).
-// For reference: https://en.bitcoin.it/wiki/Protocol_documentation#Message_structure
-#pragma pack(push, 1)
-typedef struct
-{
-    unsigned int magic; // Magic value indicating message origin network
-    char command[12]; // ASCII command (null-padded)
-    unsigned int length; // Payload size (little-endian)
-    unsigned char checksum[4]; // First 4 bytes of double SHA-256 of the payload
-} bitcoin_msg_header;
-#pragma pack(pop)
+// Maximum number of blocks announced in response to 'getblocks'
+#define MAX_INV_BLOCKS 500
+
+// Maximum number of addresses in an 'addr' message and the size of each of them
+#define MAX_ADDR_COUNT 1000
+#define ADDR_ENTRY_SIZE 30
+
+// Maximum number of inventory vectors in a 'getdata' message
+#define MAX_GETDATA_COUNT 50000
+
+// Inventory type of a block and the flag requesting its witness serialization
+#define INV_TYPE_BLOCK 2
+#define INV_WITNESS_FLAG 0x40000000
 
 /**
  * @brief The structure to store information about a connected peer.
  *
  * @param ip_address The IP address of the peer.
  * @param port The port of the peer.
- * @param socket_fd The socket file descriptor for communication.
- * @param thread The thread assigned to this connection.
+ * @param socket_fd The socket file descriptor for communication, owned by the event loop.
  * @param is_connected The connection status.
- * @param operation_in_progress The operation status.
+ * @param generation The number of connections the slot has held, so stale references are detected.
+ * @param is_inbound Did the peer connect to the listener of BitLab.
+ * @param blocks_served The number of blocks sent to the peer in response to 'getdata'.
  * @param compact_blocks Does peer want to use compact blocks.
  * @param fee_rate Min fee rate in sat/kB of transaction that peer allows.
+ * @param last_ping_time The time the last 'ping' was sent to the peer.
+ * @param ping_nonce The nonce of the 'ping' waiting for its 'pong'.
+ * @param ping_sent_ms The monotonic time the 'ping' waiting for its 'pong' was sent at, 0 if none.
+ * @param rtt_ms The moving average of the round-trip times measured with 'ping'.
+ * @param rtt_min_ms The lowest round-trip time.
+ * @param rtt_max_ms The highest round-trip time.
+ * @param rtt_samples The number of round-trip times measured.
+ * @param bytes_received The number of bytes received from the peer.
+ * @param throughput The moving average of the bytes per second received from the peer.
+ * @param throughput_bytes The number of bytes received at the last throughput sample.
+ * @param throughput_sample_ms The monotonic time of the last throughput sample.
+ * @param failures The number of timed out requests and unanswered pings, halved every PEER_FAILURE_DECAY_MS.
+ * @param failure_decay_ms The monotonic time the failures were last halved at.
+ * @param recv_buffer The bytes received from the peer and not yet handled as complete messages.
+ * @param requests The requests sent to the peer and waiting for responses.
+ * @param send_queue The messages waiting for the socket to become writable.
+ * @param send_mutex The mutex guarding the send queue and the registered events.
+ * @param events The epoll events the socket is registered for in the event loop.
  */
 typedef struct
 {
     char ip_address[64];
     uint16_t port;
     int socket_fd;
-    pthread_t thread;
     int is_connected;
-    int operation_in_progress;
+    uint32_t generation;
+    int is_inbound;
+    uint64_t blocks_served;
     uint64_t compact_blocks;
     uint64_t fee_rate;
+    time_t last_ping_time;
+    uint64_t ping_nonce;
+    uint64_t ping_sent_ms;
+    double rtt_ms;
+    uint32_t rtt_min_ms;
+    uint32_t rtt_max_ms;
+    uint32_t rtt_samples;
+    uint64_t bytes_received;
+    double throughput;
+    uint64_t throughput_bytes;
+    uint64_t throughput_sample_ms;
+    uint32_t failures;
+    uint64_t failure_decay_ms;
+    message_buffer recv_buffer;
+    request_list requests;
+    send_queue send_queue;
+    pthread_mutex_t send_mutex;
+    uint32_t events;
 } Node;
 
 // global array of nodes
 extern Node nodes[MAX_NODES];
 
+/**
+ * @brief Initializes peer connection handling.
+ *
+ * Registers the keep-alive timer pinging connected peers in the event loop. Must be called
+ * after the event loop is initialized.
+ */
+void init_peer_connection();
+
+/**
+ * @brief Builds the payload of the 'version' message sent by BitLab.
+ *
+ * @param buf The buffer to store the payload.
+ * @param buf_size The size of the buffer, at least 86 bytes.
+ * @return The length of the payload, or 0 if the buffer is too small.
+ */
+size_t build_version_payload(unsigned char* buf, size_t buf_size);
+
 /**
  * @brief Lists all connected nodes and their details.
  *
@@ -69,6 +168,26 @@ extern Node nodes[MAX_NODES];
  */
 void list_connected_nodes();
 
+/**
+ * @brief Gets the score of the connected node, combining its round-trip time, its throughput and
+ * the failures counted against it. Latency and throughput add up to 100 points each, halved at
+ * PEER_SCORE_RTT_REFERENCE_MS and PEER_SCORE_THROUGHPUT_REFERENCE, and the sum is divided by one
+ * plus the failures.
+ *
+ * @param idx The index of the node.
+ * @return The score, higher is better, or -1 if the node is not connected.
+ */
+double get_peer_score(int idx);
+
+/**
+ * @brief Gets the connected nodes ordered from the best score to the worst.
+ *
+ * @param indices The buffer to store the indices of the nodes.
+ * @param max_count The maximum number of nodes.
+ * @return The number of stored indices.
+ */
+int get_peers_by_score(int* indices, int max_count);
+
 /**
  * @brief Get the index of the node with the given IP address.
  *
@@ -90,26 +209,64 @@ void send_getaddr_and_wait(int idx);
 /**
  * @brief Connects to a peer using the specified IP address.
  *
- * This function attempts to establish a connection to a peer using the given IP address.
- * It returns a socket file descriptor if the connection is successful, or -1 if it fails.
+ * This function attempts to establish a connection to a peer using the given IP address. The
+ * non-blocking connect and the version handshake are driven by the event loop, the calling
+ * thread waits at most HANDSHAKE_TIMEOUT_MS for the result.
  *
  * @param ip_addr The IP address of the peer to connect to.
+ * @return The index of the connected node, or -1 if the connection failed.
  */
 int connect_to_peer(const char* ip_addr);
 
+/**
+ * @brief Connects to peers taken from the peer queue in parallel.
+ *
+ * This function starts non-blocking connects and version handshakes with up to `count` peers
+ * from the peer queue, keeping at most `concurrency` of them in flight. Every peer is added to
+ * the nodes table as soon as its handshake finishes. Peers still connecting when the deadline
+ * passes are dropped.
+ *
+ * @param count The number of peers to take from the queue.
+ * @param concurrency The maximum number of handshakes in flight.
+ * @param timeout_sec The deadline of the whole operation in seconds.
+ * @return The number of connected peers.
+ */
+int connect_to_peers_from_queue(int count, int concurrency, int timeout_sec);
+
+/**
+ * @brief Starts accepting inbound connections on the given port.
+ *
+ * This function opens a listening socket on all IPv4 interfaces and registers it in the event
+ * loop. Accepted peers go through the version handshake as responders and are added to the nodes
+ * table like outbound peers. Connections over the inbound limit are closed right after accept.
+ *
+ * @param port The port to listen on.
+ * @param max_inbound The maximum number of inbound peers, connected or in the handshake.
+ * @return 0 if successful, -1 if BitLab is already listening or the socket failed.
+ */
+int start_listening(uint16_t port, int max_inbound);
+
+/**
+ * @brief Stops accepting inbound connections. Connected inbound peers are kept.
+ */
+void stop_listening();
+
+/**
+ * @brief Prints the state of the listener: its port, the inbound peers and the blocks served to them.
+ */
+void print_listener_status();
+
 /**
  * @brief Disconnects from the node specified by the node ID.
  *
- * This function disconnects from the node specified by the given node ID. It closes the socket,
- * terminates the thread, and logs the disconnection.
+ * This function disconnects from the node specified by the given node ID. The socket is removed
+ * from the event loop and closed on the event loop thread, which owns the peer sockets, and the
+ * disconnection is logged.
  *
  * @param node_id The ID of the node in the nodes array to disconnect from.
  */
 void disconnect(int node_id);
 
-
-unsigned char* load_blocks_from_file(const char* filename, size_t* payload_len);
-
 /**
  * @brief Sends a 'getheaders' message to the peer and waits for a response.
  *
@@ -120,15 +277,30 @@ unsigned char* load_blocks_from_file(const char* filename, size_t* payload_len);
  */
 void send_getheaders_and_wait(int idx);
 
+/**
+ * @brief Sends a 'getheaders' message to the peer without waiting for the response.
+ *
+ * The message carries the block locator of the best chain in the header index. The callback
+ * is invoked on the event loop thread with the 'headers' response, unless it does not arrive
+ * within the timeout.
+ *
+ * @param idx The index of the peer in the nodes array.
+ * @param timeout_ms The time after which the request expires.
+ * @param callback The callback invoked with the 'headers' payload.
+ * @param ctx The context passed to the callback.
+ * @return 0 if the message was sent, -1 otherwise.
+ */
+int send_getheaders(int idx, int timeout_ms, request_callback callback, void* ctx);
+
 /**
  * @brief Sends a 'headers' message to the peer.
  *
  * This function sends a 'headers' message to the peer identified by the given index.
- * It retrieves the block headers from the local storage starting from the specified
+ * It retrieves the block headers from the header index following the block with the
  * start hash up to the stop hash or the maximum number of headers allowed.
  *
  * @param idx The index of the peer in the nodes array.
- * @param start_hash The hash of the first block header to send.
+ * @param start_hash The hash of the block preceding the first header to send.
  * @param stop_hash The hash of the last block header to send.
  */
 void send_headers(int idx, const unsigned char* start_hash, const unsigned char* stop_hash);
@@ -138,7 +310,7 @@ void send_headers(int idx, const unsigned char* start_hash, const unsigned char*
  *
  * This function sends a 'getblocks' message to the peer identified by the given index
  * and waits for a response. It is used to request a list of blocks from the connected peer.
- * The response is processed and the blocks are saved to a file.
+ * The blocks announced in the response are downloaded into the block store.
  *
  * @param idx The index of the peer in the nodes array.
  */
@@ -158,6 +330,23 @@ void send_getblocks_and_wait(int idx);
  */
 void send_getdata_and_wait(int idx, const unsigned char* hashes, size_t hash_count);
 
+/**
+ * @brief Sends a 'getdata' message for blocks to the peer without waiting for them.
+ *
+ * The callback is invoked on the event loop thread for every 'block' received in response,
+ * until all blocks are received or the timeout expires.
+ *
+ * @param idx The index of the peer in the nodes array.
+ * @param hashes The hashes of the blocks to request.
+ * @param hash_count The number of hashes, at most MAX_INV_BLOCKS.
+ * @param timeout_ms The time after which the request expires.
+ * @param callback The callback invoked with every 'block' payload.
+ * @param ctx The context passed to the callback.
+ * @return 0 if the message was sent, -1 otherwise.
+ */
+int send_getdata_blocks(int idx, const unsigned char* hashes, size_t hash_count, int timeout_ms,
+    request_callback callback, void* ctx);
+
 /**
  * @brief Sends an 'inv' message to the peer and waits for a response.
  *
@@ -1,30 +1,65 @@
 #ifndef __PEER_QUEUE_H
 #define __PEER_QUEUE_H
 
-#define MAX_PEERS 1000
-
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of queued peers, the queue and its dedup set grow by doubling up to it
+#define MAX_PEERS (1024 * 1024)
+
+// Initial number of slots of the peer queue
+#define PEER_QUEUE_INITIAL_SIZE 1024
+
+// Size of the buffer holding the text of a peer IP address, the same as INET6_ADDRSTRLEN
+#define PEER_IP_STRLEN 46
 
 /**
- * The peer structure used to store the peer information obtained by peer discovery process.
+ * The compact record of a peer obtained by peer discovery process, holding the fields of an
+ * 'addr' message entry. IPv4 addresses are stored as IPv4-mapped IPv6 addresses.
  *
- * @param ip The IP address of the peer.
+ * @param addr The IPv6 address in network byte order.
+ * @param services The services advertised for the peer.
+ * @param timestamp The time the peer was last seen in seconds since the epoch.
  * @param port The port of the peer.
  */
 typedef struct
 {
-    char ip[256];
-    int port;
+    unsigned char addr[16];
+    uint64_t services;
+    uint32_t timestamp;
+    uint16_t port;
 } Peer;
 
 /**
- * Add a peer to the queue.
+ * Parse the textual address of a peer into a peer record dated now.
+ *
+ * @param ip The IPv4 or IPv6 address of the peer, followed by ':' and the port if `port` is 0.
+ *        IPv6 addresses followed by the port are enclosed in brackets.
+ * @param port The port of the peer.
+ * @param peer The buffer to store the peer record.
+ * @return True if successful, false if the address or the port is invalid.
+ */
+bool parse_peer(const char* ip, int port, Peer* peer);
+
+/**
+ * Add a peer to the queue unless it is already queued. Duplicates are found in a hash set
+ * in constant time.
  *
- * @param ip The IP address of the peer.
+ * @param ip The IPv4 or IPv6 address of the peer, followed by ':' and the port if `port` is 0.
  * @param port The port of the peer.
+ * @return True if the peer was added, false if it is a duplicate, the address is invalid or the
+ *         queue is full.
+ */
+bool add_peer_to_queue(const char* ip, int port);
+
+/**
+ * Add the peer record to the queue unless a peer with the same address and port is queued.
+ *
+ * @param peer The peer record, e.g. parsed from an 'addr' message.
+ * @return True if the peer was added, false if it is a duplicate or the queue is full.
  */
-void add_peer_to_queue(const char* ip, int port);
+bool add_peer_record(const Peer* peer);
 
 /**
  * Check if the peer queue is empty.
@@ -34,13 +69,12 @@ void add_peer_to_queue(const char* ip, int port);
 bool is_peer_queue_empty();
 
 /**
- * Get a peer from the queue.
+ * Take the oldest peer from the queue.
  *
- * @param buffer The buffer to store the peer.
- * @param buffer_size The size of the buffer.
- * @return True if the peer was successfully retrieved, false otherwise.
+ * @param peer The buffer to store the peer record.
+ * @return True if the peer was successfully retrieved, false if the queue is empty.
  */
-bool get_peer_from_queue(char* buffer, size_t buffer_size);
+bool get_peer_from_queue(Peer* peer);
 
 /**
  * Clear the peer queue.
@@ -53,8 +87,28 @@ void clear_peer_queue();
 void print_peer_queue();
 
 /**
- * Get the peer queue.
+ * Copy the oldest queued peers without taking them from the queue.
+ *
+ * @param peers The buffer to store the peer records.
+ * @param max_count The maximum number of records.
+ * @return The number of copied records.
+ */
+size_t get_peers_from_queue(Peer* peers, size_t max_count);
+
+/**
+ * Get the number of queued peers.
+ *
+ * @return The number of peers.
+ */
+size_t get_peer_queue_count();
+
+/**
+ * Convert the address of the peer to text, dotted for IPv4-mapped addresses.
+ *
+ * @param peer The peer record.
+ * @param buffer The buffer to store the address, at least PEER_IP_STRLEN bytes.
+ * @param buffer_size The size of the buffer.
  */
-Peer* get_peer_queue(int* count);
+void format_peer_ip(const Peer* peer, char* buffer, size_t buffer_size);
 
 #endif // __PEER_QUEUE_H
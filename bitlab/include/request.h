@@ -0,0 +1,171 @@
+#ifndef __REQUEST_H
+#define __REQUEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "command.h"
+#include "message.h"
+
+/**
+ * The state of the request.
+ *
+ * @param REQUEST_PENDING The request waits for its responses.
+ * @param REQUEST_COMPLETED All expected responses were received.
+ * @param REQUEST_TIMED_OUT The request expired before all expected responses were received.
+ * @param REQUEST_FAILED The request could not be sent or the peer disconnected.
+ */
+typedef enum
+{
+    REQUEST_PENDING,
+    REQUEST_COMPLETED,
+    REQUEST_TIMED_OUT,
+    REQUEST_FAILED
+} request_status;
+
+/**
+ * Callback invoked on the event loop thread for every response matching the request.
+ *
+ * @param ctx The context passed on request creation.
+ * @param payload The response payload.
+ * @param payload_len The length of the payload.
+ */
+typedef void (*request_callback)(void* ctx, const unsigned char* payload, size_t payload_len);
+
+/**
+ * The request sent to a peer, waiting for a number of responses with a given command. It is shared
+ * by the pending list of the peer and the creator, and freed when both released it.
+ *
+ * @param command The command of the expected responses.
+ * @param expected The number of responses completing the request.
+ * @param received The number of responses received so far.
+ * @param hashes The hashes of the expected blocks, NULL if any response with the command matches.
+ * @param answered The flags of the expected blocks received so far, NULL without hashes.
+ * @param deadline_ms The monotonic time the request expires at.
+ * @param callback The callback invoked for every response, may be NULL.
+ * @param ctx The context passed to the callback.
+ * @param status The state of the request.
+ * @param refcount The number of references to the request.
+ * @param mutex The mutex guarding the status and the callback invocation.
+ * @param cond The condition signalled when the request is finished.
+ * @param next The next request in the pending list.
+ */
+typedef struct peer_request
+{
+    command_id command;
+    int expected;
+    int received;
+    unsigned char* hashes;
+    unsigned char* answered;
+    uint64_t deadline_ms;
+    request_callback callback;
+    void* ctx;
+    request_status status;
+    atomic_int refcount;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct peer_request* next;
+} peer_request;
+
+/**
+ * The pending requests of a single peer in the order they were sent. Responses are matched to
+ * the oldest pending request expecting their command, as peers answer requests in order. Blocks
+ * are matched to the request expecting their hash, so blocks requested by different requests at
+ * once never end up in the wrong one.
+ *
+ * @param head The oldest pending request.
+ * @param count The number of pending requests.
+ * @param mutex The mutex guarding the list.
+ */
+typedef struct
+{
+    peer_request* head;
+    int count;
+    pthread_mutex_t mutex;
+} request_list;
+
+/**
+ * Initialize the request list.
+ *
+ * @param list The request list.
+ */
+void init_request_list(request_list* list);
+
+/**
+ * Create the request and append it to the pending list. The request must be registered before
+ * the message is sent, so the response cannot arrive before it.
+ *
+ * @param list The pending list of the peer.
+ * @param command The command of the expected responses.
+ * @param expected The number of responses completing the request.
+ * @param hashes The hashes of the `expected` blocks the request waits for, or NULL if any response
+ * with the command matches.
+ * @param timeout_ms The time after which the request expires.
+ * @param callback The callback invoked for every response, may be NULL.
+ * @param ctx The context passed to the callback.
+ * @return The request referenced by the caller, to be released with release_request, or NULL on failure.
+ */
+peer_request* create_request(request_list* list, command_id command, int expected,
+    const unsigned char* hashes, int timeout_ms, request_callback callback, void* ctx);
+
+/**
+ * Pass the received message to the oldest pending request expecting its command, a block to the
+ * request expecting its hash. Called by the reader of the peer for every received message.
+ *
+ * @param list The pending list of the peer.
+ * @param view The received message.
+ * @return 1 if the message was consumed by a request, 0 otherwise.
+ */
+int complete_requests(request_list* list, const message_view* view);
+
+/**
+ * Finish every pending request whose deadline passed as timed out.
+ *
+ * @param list The pending list of the peer.
+ * @param now_ms The current monotonic time in milliseconds.
+ * @return The number of timed out requests.
+ */
+int expire_requests(request_list* list, uint64_t now_ms);
+
+/**
+ * Finish every pending request as failed, e.g. when the peer disconnects.
+ *
+ * @param list The pending list of the peer.
+ */
+void fail_requests(request_list* list);
+
+/**
+ * Remove the request from the pending list and finish it as failed, e.g. when it could not be sent.
+ *
+ * @param list The pending list of the peer.
+ * @param request The request.
+ */
+void cancel_request(request_list* list, peer_request* request);
+
+/**
+ * Wait until the request is finished. Must not be called from the event loop thread.
+ *
+ * @param request The request.
+ * @return The final state of the request.
+ */
+request_status wait_request(peer_request* request);
+
+/**
+ * Release the reference of the caller to the request. The callback is still invoked for responses
+ * received later, so a request can be released right after creation if its result is not awaited.
+ *
+ * @param request The request.
+ */
+void release_request(peer_request* request);
+
+/**
+ * Get the number of pending requests.
+ *
+ * @param list The pending list of the peer.
+ * @return The number of pending requests.
+ */
+int count_requests(request_list* list);
+
+#endif // __REQUEST_H
@@ -0,0 +1,128 @@
+#ifndef __SEND_QUEUE_H
+#define __SEND_QUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Queued bytes above which the queue stops accepting messages and reading from the peer pauses
+#define SEND_QUEUE_HIGH_WATER (4 * 1024 * 1024)
+
+// Queued bytes below which a queue over the high-water mark accepts messages again
+#define SEND_QUEUE_LOW_WATER (1024 * 1024)
+
+// Maximum number of queued messages written with a single system call
+#define SEND_QUEUE_MAX_BATCH 64
+
+// Queued file bytes above which the queue stops accepting file messages, they take no memory
+// but each one is read from disk while the peer drains it
+#define SEND_QUEUE_FILE_HIGH_WATER (64 * 1024 * 1024)
+
+/**
+ * The message waiting in the send queue, either held in memory or a range of a file sent with
+ * sendfile without copying it through userspace.
+ *
+ * @param next The next message in the queue.
+ * @param len The length of the message.
+ * @param offset The number of bytes of the message already written.
+ * @param is_file Is the message a range of a file.
+ * @param file_fd The file descriptor of the file, -1 until the file is opened when the message is written.
+ * @param file_offset The offset of the range in the file.
+ * @param data The message bytes, or the NUL-terminated path of the file.
+ */
+typedef struct send_frame
+{
+    struct send_frame* next;
+    size_t len;
+    size_t offset;
+    int is_file;
+    int file_fd;
+    off_t file_offset;
+    unsigned char data[];
+} send_frame;
+
+/**
+ * The outbound queue of a peer socket. Messages are written whole and in order, the bytes the
+ * socket does not accept at once stay queued until it becomes writable again. The queue is not
+ * synchronized, the owner guards it.
+ *
+ * @param head The oldest queued message, partially written if its offset is not 0.
+ * @param tail The newest queued message.
+ * @param size The number of queued bytes held in memory not written yet.
+ * @param file_size The number of queued file bytes not written yet.
+ * @param over_high_water Is the queue over the high-water mark and not yet drained below the low-water mark.
+ */
+typedef struct
+{
+    send_frame* head;
+    send_frame* tail;
+    size_t size;
+    size_t file_size;
+    int over_high_water;
+} send_queue;
+
+/**
+ * Initialize the send queue.
+ *
+ * @param queue The send queue.
+ */
+void init_send_queue(send_queue* queue);
+
+/**
+ * Drop every queued message and close the files opened for them.
+ *
+ * @param queue The send queue.
+ */
+void free_send_queue(send_queue* queue);
+
+/**
+ * Send the message to the socket after the messages queued before it. The message is written at
+ * once if nothing is queued, the part the socket does not accept is copied to the queue.
+ *
+ * @param queue The send queue.
+ * @param fd The non-blocking socket file descriptor.
+ * @param msg The message.
+ * @param msg_len The length of the message.
+ * @return 0 if the message was written or queued, -1 with errno set if the queue is over the
+ *         high-water mark (ENOBUFS), out of memory or the socket failed.
+ */
+int send_queue_push(send_queue* queue, int fd, const unsigned char* msg, size_t msg_len);
+
+/**
+ * Send the message made of the header and a range of a file to the socket after the messages
+ * queued before it. The header is copied to the queue and the file range is written with sendfile
+ * straight from the page cache. The file is opened only when its turn comes, so queued file
+ * messages hold no file descriptors.
+ *
+ * @param queue The send queue.
+ * @param fd The non-blocking socket file descriptor.
+ * @param header The bytes sent before the file range, e.g. the message header.
+ * @param header_len The length of the header.
+ * @param path The path of the file.
+ * @param file_offset The offset of the range in the file.
+ * @param len The length of the range.
+ * @return 0 if the message was written or queued, -1 with errno set if the queue is over one of
+ *         its high-water marks (ENOBUFS), out of memory or the socket failed.
+ */
+int send_queue_push_file(send_queue* queue, int fd, const unsigned char* header, size_t header_len,
+    const char* path, off_t file_offset, size_t len);
+
+/**
+ * Write as many queued messages as the socket accepts, batching several messages held in memory
+ * per system call and sending file ranges with sendfile.
+ *
+ * @param queue The send queue.
+ * @param fd The non-blocking socket file descriptor.
+ * @return 0 if the socket accepted everything it could, -1 with errno set if the socket or a
+ *         queued file failed, which leaves the stream to the peer broken.
+ */
+int send_queue_flush(send_queue* queue, int fd);
+
+/**
+ * Check if messages are waiting in the queue, e.g. to wait for the socket to become writable.
+ *
+ * @param queue The send queue.
+ * @return 1 if the queue is not empty, 0 otherwise.
+ */
+int send_queue_pending(const send_queue* queue);
+
+#endif // __SEND_QUEUE_H
@@ -90,6 +90,17 @@ uint64_t ntohll(uint64_t value);
  */
 size_t read_var_int(const unsigned char* data, uint64_t* value);
 
+/**
+ * Read the var_int at the offset of the data without reading past its end.
+ *
+ * @param data The data.
+ * @param data_len The length of the data.
+ * @param offset The offset of the var_int, advanced past it.
+ * @param value The buffer to store the value.
+ * @return 1 if successful, 0 if the data is truncated.
+ */
+int read_compact_size(const unsigned char* data, size_t data_len, size_t* offset, uint64_t* value);
+
 /**
  * Check if the IP address is valid.
  *
@@ -0,0 +1,870 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "addrman.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "event_loop.h"
+#include "hash.h"
+#include "log.h"
+#include "utils.h"
+
+// Magic number and version of the peers file
+#define ADDRMAN_FILE_MAGIC 0x4d414c42
+#define ADDRMAN_FILE_VERSION 1
+
+// Number of slots of the new and tried tables, every address takes exactly one of them
+#define ADDRMAN_NEW_SLOTS (ADDRMAN_NEW_BUCKETS * ADDRMAN_BUCKET_SIZE)
+#define ADDRMAN_TRIED_SLOTS (ADDRMAN_TRIED_BUCKETS * ADDRMAN_BUCKET_SIZE)
+#define ADDRMAN_MAX_ENTRIES (ADDRMAN_NEW_SLOTS + ADDRMAN_TRIED_SLOTS)
+
+// Number of slots of the address to entry index, a power of two over twice the entries
+#define ADDRMAN_INDEX_SIZE (256 * 1024)
+
+/**
+ * The address known to the address manager.
+ *
+ * @param peer The address, its services and the time it was last seen.
+ * @param source The IPv6 address of the peer which announced the address.
+ * @param last_try The time of the last connection attempt.
+ * @param last_success The time of the last successful connection.
+ * @param attempts The number of attempts since the last successful connection.
+ * @param slot The slot of the address in the new or tried table.
+ * @param list_pos The position of the address in the list of new or tried addresses.
+ * @param in_tried Is the address in the tried table.
+ */
+typedef struct
+{
+    Peer peer;
+    unsigned char source[16];
+    uint32_t last_try;
+    uint32_t last_success;
+    uint32_t attempts;
+    int32_t slot;
+    int32_t list_pos;
+    bool in_tried;
+} addr_info;
+
+/**
+ * The record of an address in the peers file, in host byte order.
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+    unsigned char addr[16];
+    uint16_t port;
+    uint64_t services;
+    uint32_t timestamp;
+    unsigned char source[16];
+    uint32_t last_try;
+    uint32_t last_success;
+    uint32_t attempts;
+    uint8_t in_tried;
+} addr_record;
+
+/**
+ * The header of the peers file, followed by the records and the first 4 bytes of the
+ * double-SHA256 of everything before them.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    unsigned char key[32];
+    uint32_t count;
+} addr_file_header;
+#pragma pack(pop)
+
+// State of the address manager, guarded by the addrman mutex
+static pthread_mutex_t addrman_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char* addrman_filename = NULL;
+static unsigned char bucket_key[32];
+static uint64_t rng_state = 0;
+static addr_info* entries = NULL;
+static int32_t* free_ids = NULL;
+static int32_t free_count = 0;
+static int32_t* index_table = NULL;
+static int32_t* new_table = NULL;
+static int32_t* tried_table = NULL;
+static int32_t* new_ids = NULL;
+static int32_t* tried_ids = NULL;
+static int32_t new_count = 0;
+static int32_t tried_count = 0;
+static bool dirty = false;
+
+/**
+ * random_u64:
+ *   Next number of the xorshift64* generator. Must be called with the addrman mutex held.
+ */
+static uint64_t random_u64()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/**
+ * fill_random:
+ *   Fill the buffer with bytes from /dev/urandom, or from the clock if it cannot be read.
+ */
+static void fill_random(unsigned char* buffer, size_t len)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    ssize_t bytes_read = fd >= 0 ? read(fd, buffer, len) : -1;
+    if (fd >= 0)
+        close(fd);
+    if (bytes_read == (ssize_t)len)
+        return;
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    for (size_t i = 0; i < len; ++i)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (unsigned char)(seed >> 56);
+    }
+}
+
+/**
+ * keyed_hash:
+ *   Hash of the data prefixed with the secret bucket key, so peers cannot predict the buckets
+ *   their addresses land in.
+ */
+static uint64_t keyed_hash(const unsigned char* data, size_t len)
+{
+    unsigned char buffer[96];
+    unsigned char digest[HASH_SIZE];
+    memcpy(buffer, bucket_key, sizeof(bucket_key));
+    memcpy(buffer + sizeof(bucket_key), data, len);
+    double_sha256(buffer, sizeof(bucket_key) + len, digest);
+    uint64_t hash = 0;
+    for (int i = 7; i >= 0; --i)
+        hash = hash << 8 | digest[i];
+    return hash;
+}
+
+/**
+ * get_netgroup:
+ *   Store the netgroup of the address in the 5-byte buffer: the /16 of IPv4 addresses and the
+ *   /32 of IPv6 addresses, tagged with the address family.
+ */
+static void get_netgroup(const unsigned char addr[16], unsigned char group[5])
+{
+    static const unsigned char v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+    memset(group, 0, 5);
+    if (memcmp(addr, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0)
+    {
+        group[0] = 4;
+        memcpy(group + 1, addr + 12, 2);
+    }
+    else
+    {
+        group[0] = 6;
+        memcpy(group + 1, addr, 4);
+    }
+}
+
+/**
+ * get_new_bucket:
+ *   Select the new bucket of the address announced by the source. The addresses of one source
+ *   netgroup land in at most ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP buckets.
+ */
+static uint32_t get_new_bucket(const addr_info* info)
+{
+    unsigned char data[18];
+    get_netgroup(info->peer.addr, data);
+    get_netgroup(info->source, data + 5);
+    uint64_t hash1 = keyed_hash(data, 10) % ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP;
+    memcpy(data + 10, &hash1, sizeof(hash1));
+    return (uint32_t)(keyed_hash(data + 5, 13) % ADDRMAN_NEW_BUCKETS);
+}
+
+/**
+ * get_tried_bucket:
+ *   Select the tried bucket of the address. The addresses of one netgroup land in at most
+ *   ADDRMAN_TRIED_BUCKETS_PER_GROUP buckets.
+ */
+static uint32_t get_tried_bucket(const addr_info* info)
+{
+    unsigned char data[18];
+    memcpy(data, info->peer.addr, 16);
+    memcpy(data + 16, &info->peer.port, 2);
+    uint64_t hash1 = keyed_hash(data, 18) % ADDRMAN_TRIED_BUCKETS_PER_GROUP;
+    get_netgroup(info->peer.addr, data);
+    memcpy(data + 5, &hash1, sizeof(hash1));
+    return (uint32_t)(keyed_hash(data, 13) % ADDRMAN_TRIED_BUCKETS);
+}
+
+/**
+ * get_slot:
+ *   Select the slot of the address within the bucket of the new or tried table.
+ */
+static int32_t get_slot(const addr_info* info, uint32_t bucket, bool tried)
+{
+    unsigned char data[23];
+    data[0] = tried ? 'K' : 'N';
+    memcpy(data + 1, &bucket, 4);
+    memcpy(data + 5, info->peer.addr, 16);
+    memcpy(data + 21, &info->peer.port, 2);
+    return (int32_t)(bucket * ADDRMAN_BUCKET_SIZE + keyed_hash(data, sizeof(data)) % ADDRMAN_BUCKET_SIZE);
+}
+
+/**
+ * hash_address:
+ *   FNV-1a hash of the address and port for the entry index.
+ */
+static size_t hash_address(const unsigned char addr[16], uint16_t port)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < 16; ++i)
+        hash = (hash ^ addr[i]) * 1099511628211ULL;
+    hash = (hash ^ (port & 0xFF)) * 1099511628211ULL;
+    hash = (hash ^ (port >> 8)) * 1099511628211ULL;
+    return (size_t)hash;
+}
+
+/**
+ * find_index_slot:
+ *   Find the index slot holding the entry of the address, or the free slot ending its probe
+ *   sequence. Must be called with the addrman mutex held.
+ */
+static size_t find_index_slot(const unsigned char addr[16], uint16_t port)
+{
+    size_t mask = ADDRMAN_INDEX_SIZE - 1;
+    size_t i = hash_address(addr, port) & mask;
+    while (index_table[i] >= 0)
+    {
+        const Peer* peer = &entries[index_table[i]].peer;
+        if (peer->port == port && memcmp(peer->addr, addr, 16) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * find_entry:
+ *   Get the entry of the address or -1 if it is not known. Must be called with the addrman
+ *   mutex held.
+ */
+static int32_t find_entry(const unsigned char addr[16], uint16_t port)
+{
+    return index_table[find_index_slot(addr, port)];
+}
+
+/**
+ * remove_from_index:
+ *   Remove the entry from the index, shifting back the entries probed past it. Must be called
+ *   with the addrman mutex held.
+ */
+static void remove_from_index(int32_t id)
+{
+    size_t mask = ADDRMAN_INDEX_SIZE - 1;
+    size_t i = find_index_slot(entries[id].peer.addr, entries[id].peer.port);
+    size_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (index_table[j] < 0)
+            break;
+        const Peer* peer = &entries[index_table[j]].peer;
+        size_t home = hash_address(peer->addr, peer->port) & mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+            index_table[i] = index_table[j];
+            i = j;
+        }
+    }
+    index_table[i] = -1;
+}
+
+/**
+ * add_to_list:
+ *   Append the entry to the list of new or tried addresses, used to select them at random.
+ */
+static void add_to_list(int32_t id)
+{
+    if (entries[id].in_tried)
+    {
+        entries[id].list_pos = tried_count;
+        tried_ids[tried_count++] = id;
+    }
+    else
+    {
+        entries[id].list_pos = new_count;
+        new_ids[new_count++] = id;
+    }
+}
+
+/**
+ * remove_from_list:
+ *   Remove the entry from its list, moving the last entry of the list into its place.
+ */
+static void remove_from_list(int32_t id)
+{
+    int32_t* ids = entries[id].in_tried ? tried_ids : new_ids;
+    int32_t* count = entries[id].in_tried ? &tried_count : &new_count;
+    int32_t last = ids[--(*count)];
+    ids[entries[id].list_pos] = last;
+    entries[last].list_pos = entries[id].list_pos;
+}
+
+/**
+ * delete_entry:
+ *   Forget the address, freeing its table slot. Must be called with the addrman mutex held.
+ */
+static void delete_entry(int32_t id)
+{
+    addr_info* info = &entries[id];
+    if (info->slot >= 0)
+    {
+        if (info->in_tried)
+            tried_table[info->slot] = -1;
+        else
+            new_table[info->slot] = -1;
+        remove_from_list(id);
+    }
+    remove_from_index(id);
+    free_ids[free_count++] = id;
+}
+
+/**
+ * is_terrible:
+ *   Check if the address is not worth keeping: seen too long ago, from the future, or failing
+ *   too often.
+ */
+static bool is_terrible(const addr_info* info, uint32_t now)
+{
+    if (info->last_try != 0 && now - info->last_try < 60)
+        return false;
+    if (info->peer.timestamp > now + 10 * 60)
+        return true;
+    if (info->peer.timestamp == 0 || now - info->peer.timestamp > ADDRMAN_HORIZON_DAYS * 24 * 3600)
+        return true;
+    if (info->last_success == 0 && info->attempts >= ADDRMAN_RETRIES)
+        return true;
+    if (now - info->last_success > 7 * 24 * 3600 && info->attempts >= ADDRMAN_MAX_FAILURES)
+        return true;
+    return false;
+}
+
+/**
+ * get_chance:
+ *   Relative odds of selecting the address, lowered after a recent attempt and after every
+ *   failed attempt.
+ */
+static double get_chance(const addr_info* info, uint32_t now)
+{
+    double chance = 1.0;
+    if (now - info->last_try < 10 * 60)
+        chance *= 0.01;
+    for (uint32_t i = 0; i < info->attempts && i < 8; ++i)
+        chance *= 0.66;
+    return chance;
+}
+
+/**
+ * place_in_new:
+ *   Put the entry in its slot of the new table, taking the slot over from a stale address.
+ *   Returns true if the entry was placed, false if the slot is held by a good address. Must be
+ *   called with the addrman mutex held.
+ */
+static bool place_in_new(int32_t id, uint32_t now)
+{
+    addr_info* info = &entries[id];
+    int32_t slot = get_slot(info, get_new_bucket(info), false);
+    int32_t other = new_table[slot];
+    if (other >= 0 && other != id)
+    {
+        if (!is_terrible(&entries[other], now))
+            return false;
+        delete_entry(other);
+    }
+    info->in_tried = false;
+    info->slot = slot;
+    new_table[slot] = id;
+    add_to_list(id);
+    return true;
+}
+
+/**
+ * create_entry:
+ *   Allocate the entry of a new address and add it to the index, not yet to a table.
+ *   Returns the entry or -1 if all entries are taken. Must be called with the addrman mutex held.
+ */
+static int32_t create_entry(const Peer* peer, const unsigned char source[16])
+{
+    if (free_count == 0)
+        return -1;
+    int32_t id = free_ids[--free_count];
+    addr_info* info = &entries[id];
+    memset(info, 0, sizeof(*info));
+    info->peer = *peer;
+    if (source != NULL)
+        memcpy(info->source, source, 16);
+    else
+        memcpy(info->source, peer->addr, 16);
+    info->slot = -1;
+    info->list_pos = -1;
+    index_table[find_index_slot(peer->addr, peer->port)] = id;
+    return id;
+}
+
+/**
+ * place_in_tried:
+ *   Move the entry to its slot of the tried table. The address holding the slot is moved back
+ *   to the new table, or forgotten if its new slot is held by a good address. Must be called
+ *   with the addrman mutex held.
+ */
+static void place_in_tried(int32_t id, uint32_t now)
+{
+    addr_info* info = &entries[id];
+    if (info->slot >= 0 && !info->in_tried)
+    {
+        new_table[info->slot] = -1;
+        remove_from_list(id);
+    }
+    int32_t slot = get_slot(info, get_tried_bucket(info), true);
+    int32_t evicted = tried_table[slot];
+    if (evicted >= 0)
+    {
+        remove_from_list(evicted);
+        entries[evicted].slot = -1;
+        tried_table[slot] = -1;
+        if (!place_in_new(evicted, now))
+            delete_entry(evicted);
+    }
+    info->in_tried = true;
+    info->slot = slot;
+    tried_table[slot] = id;
+    add_to_list(id);
+}
+
+/**
+ * load_addrman:
+ *   Load the addresses of the peers file, tried addresses first so they keep their slots.
+ *   Returns the number of loaded addresses, or -1 if the file is missing or corrupted.
+ *   Must be called with the addrman mutex held.
+ */
+static int load_addrman()
+{
+    FILE* file = fopen(addrman_filename, "rb");
+    if (file == NULL)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < (long)(sizeof(addr_file_header) + 4))
+    {
+        fclose(file);
+        return -1;
+    }
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (data == NULL || fread(data, 1, size, file) != (size_t)size)
+    {
+        free(data);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    addr_file_header header;
+    memcpy(&header, data, sizeof(header));
+    unsigned char checksum[HASH_SIZE];
+    double_sha256(data, size - 4, checksum);
+    if (header.magic != ADDRMAN_FILE_MAGIC || header.version != ADDRMAN_FILE_VERSION ||
+        header.count > ADDRMAN_MAX_ENTRIES ||
+        (size_t)size != sizeof(header) + header.count * sizeof(addr_record) + 4 ||
+        memcmp(checksum, data + size - 4, 4) != 0)
+    {
+        free(data);
+        return -1;
+    }
+
+    memcpy(bucket_key, header.key, sizeof(bucket_key));
+    uint32_t now = (uint32_t)time(NULL);
+    int loaded = 0;
+    for (int pass = 1; pass >= 0; --pass)
+    {
+        for (uint32_t i = 0; i < header.count; ++i)
+        {
+            addr_record record;
+            memcpy(&record, data + sizeof(header) + i * sizeof(addr_record), sizeof(record));
+            if (record.in_tried != pass)
+                continue;
+
+            Peer peer;
+            memset(&peer, 0, sizeof(peer));
+            memcpy(peer.addr, record.addr, 16);
+            peer.port = record.port;
+            peer.services = record.services;
+            peer.timestamp = record.timestamp;
+            if (find_entry(peer.addr, peer.port) >= 0)
+                continue;
+            int32_t id = create_entry(&peer, record.source);
+            if (id < 0)
+                break;
+            entries[id].last_try = record.last_try;
+            entries[id].last_success = record.last_success;
+            entries[id].attempts = record.attempts;
+
+            // A tried address whose slot is taken falls back to the new table
+            if (record.in_tried && tried_table[get_slot(&entries[id], get_tried_bucket(&entries[id]), true)] < 0)
+                place_in_tried(id, now);
+            else if (!place_in_new(id, now))
+            {
+                delete_entry(id);
+                continue;
+            }
+            loaded++;
+        }
+    }
+    free(data);
+    return loaded;
+}
+
+/**
+ * save_timer:
+ *   Event loop timer saving the address manager if it changed.
+ */
+static void save_timer(void* ctx)
+{
+    (void)ctx;
+    pthread_mutex_lock(&addrman_mutex);
+    bool changed = dirty;
+    pthread_mutex_unlock(&addrman_mutex);
+    if (changed)
+        save_addrman();
+}
+
+int init_addrman(const char* filename)
+{
+    pthread_mutex_lock(&addrman_mutex);
+    addrman_filename = strdup(filename);
+    entries = (addr_info*)malloc(ADDRMAN_MAX_ENTRIES * sizeof(addr_info));
+    free_ids = (int32_t*)malloc(ADDRMAN_MAX_ENTRIES * sizeof(int32_t));
+    index_table = (int32_t*)malloc(ADDRMAN_INDEX_SIZE * sizeof(int32_t));
+    new_table = (int32_t*)malloc(ADDRMAN_NEW_SLOTS * sizeof(int32_t));
+    tried_table = (int32_t*)malloc(ADDRMAN_TRIED_SLOTS * sizeof(int32_t));
+    new_ids = (int32_t*)malloc(ADDRMAN_NEW_SLOTS * sizeof(int32_t));
+    tried_ids = (int32_t*)malloc(ADDRMAN_TRIED_SLOTS * sizeof(int32_t));
+    if (addrman_filename == NULL || entries == NULL || free_ids == NULL || index_table == NULL ||
+        new_table == NULL || tried_table == NULL || new_ids == NULL || tried_ids == NULL)
+    {
+        pthread_mutex_unlock(&addrman_mutex);
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to allocate the address manager");
+        free_addrman();
+        return -1;
+    }
+
+    // Entries are taken from the end of the free list, lowest first
+    free_count = 0;
+    for (int32_t i = ADDRMAN_MAX_ENTRIES - 1; i >= 0; --i)
+        free_ids[free_count++] = i;
+    memset(index_table, 0xFF, ADDRMAN_INDEX_SIZE * sizeof(int32_t));
+    memset(new_table, 0xFF, ADDRMAN_NEW_SLOTS * sizeof(int32_t));
+    memset(tried_table, 0xFF, ADDRMAN_TRIED_SLOTS * sizeof(int32_t));
+    new_count = 0;
+    tried_count = 0;
+    fill_random((unsigned char*)&rng_state, sizeof(rng_state));
+    rng_state |= 1;
+    fill_random(bucket_key, sizeof(bucket_key));
+
+    int loaded = load_addrman();
+    if (loaded < 0)
+    {
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "No valid peers file %s, starting empty",
+            addrman_filename);
+        loaded = 0;
+    }
+    else
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Loaded %d addresses (%d tried) from %s",
+            loaded, tried_count, addrman_filename);
+    dirty = false;
+    pthread_mutex_unlock(&addrman_mutex);
+
+    if (event_loop_add_timer(save_timer, NULL, ADDRMAN_SAVE_INTERVAL_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register address manager save timer");
+    return loaded;
+}
+
+void free_addrman()
+{
+    if (entries != NULL && addrman_filename != NULL)
+        save_addrman();
+    pthread_mutex_lock(&addrman_mutex);
+    free(addrman_filename);
+    free(entries);
+    free(free_ids);
+    free(index_table);
+    free(new_table);
+    free(tried_table);
+    free(new_ids);
+    free(tried_ids);
+    addrman_filename = NULL;
+    entries = NULL;
+    free_ids = NULL;
+    index_table = NULL;
+    new_table = NULL;
+    tried_table = NULL;
+    new_ids = NULL;
+    tried_ids = NULL;
+    new_count = 0;
+    tried_count = 0;
+    pthread_mutex_unlock(&addrman_mutex);
+}
+
+int addrman_add(const Peer* peer, const unsigned char source[16])
+{
+    pthread_mutex_lock(&addrman_mutex);
+    if (entries == NULL)
+    {
+        pthread_mutex_unlock(&addrman_mutex);
+        return 0;
+    }
+
+    // Addresses claiming to be seen in the future are dated now
+    uint32_t now = (uint32_t)time(NULL);
+    Peer added = *peer;
+    if (added.timestamp == 0 || added.timestamp > now + 10 * 60)
+        added.timestamp = now;
+
+    int result = 0;
+    int32_t id = find_entry(added.addr, added.port);
+    if (id >= 0)
+    {
+        addr_info* info = &entries[id];
+        if (added.timestamp > info->peer.timestamp)
+            info->peer.timestamp = added.timestamp;
+        info->peer.services |= added.services;
+        dirty = true;
+    }
+    else
+    {
+        id = create_entry(&added, source);
+        if (id >= 0 && place_in_new(id, now))
+        {
+            result = 1;
+            dirty = true;
+        }
+        else if (id >= 0)
+            delete_entry(id);
+    }
+    pthread_mutex_unlock(&addrman_mutex);
+    return result;
+}
+
+void addrman_attempt(const unsigned char addr[16], uint16_t port)
+{
+    pthread_mutex_lock(&addrman_mutex);
+    int32_t id = entries != NULL ? find_entry(addr, port) : -1;
+    if (id >= 0)
+    {
+        entries[id].last_try = (uint32_t)time(NULL);
+        entries[id].attempts++;
+        dirty = true;
+    }
+    pthread_mutex_unlock(&addrman_mutex);
+}
+
+void addrman_good(const unsigned char addr[16], uint16_t port)
+{
+    pthread_mutex_lock(&addrman_mutex);
+    if (entries == NULL)
+    {
+        pthread_mutex_unlock(&addrman_mutex);
+        return;
+    }
+
+    // Peers connected to without being announced, e.g. given on the command line, are known from now on
+    uint32_t now = (uint32_t)time(NULL);
+    int32_t id = find_entry(addr, port);
+    if (id < 0)
+    {
+        Peer peer;
+        memset(&peer, 0, sizeof(peer));
+        memcpy(peer.addr, addr, 16);
+        peer.port = port;
+        peer.timestamp = now;
+        id = create_entry(&peer, NULL);
+    }
+    if (id >= 0)
+    {
+        addr_info* info = &entries[id];
+        info->last_success = now;
+        info->last_try = now;
+        info->peer.timestamp = now;
+        info->attempts = 0;
+        if (!info->in_tried || info->slot < 0)
+            place_in_tried(id, now);
+        dirty = true;
+    }
+    pthread_mutex_unlock(&addrman_mutex);
+}
+
+bool addrman_select(Peer* peer)
+{
+    pthread_mutex_lock(&addrman_mutex);
+    if (entries == NULL || new_count + tried_count == 0)
+    {
+        pthread_mutex_unlock(&addrman_mutex);
+        return false;
+    }
+
+    // Retried picks get ever more likely to be accepted, so the loop ends quickly
+    uint32_t now = (uint32_t)time(NULL);
+    bool use_tried = tried_count > 0 && (new_count == 0 || (random_u64() & 1));
+    const int32_t* ids = use_tried ? tried_ids : new_ids;
+    int32_t count = use_tried ? tried_count : new_count;
+    double factor = 1.0;
+    for (;;)
+    {
+        const addr_info* info = &entries[ids[random_u64() % count]];
+        double roll = (random_u64() >> 11) * (1.0 / 9007199254740992.0);
+        if (roll < factor * get_chance(info, now))
+        {
+            *peer = info->peer;
+            break;
+        }
+        factor *= 1.2;
+    }
+    pthread_mutex_unlock(&addrman_mutex);
+    return true;
+}
+
+/**
+ * compare_by_recency:
+ *   Order entries by the last successful connection, then by the time they were last seen,
+ *   most recent first.
+ */
+static int compare_by_recency(const void* a, const void* b)
+{
+    const addr_info* x = &entries[*(const int32_t*)a];
+    const addr_info* y = &entries[*(const int32_t*)b];
+    if (x->last_success != y->last_success)
+        return x->last_success > y->last_success ? -1 : 1;
+    if (x->peer.timestamp != y->peer.timestamp)
+        return x->peer.timestamp > y->peer.timestamp ? -1 : 1;
+    return 0;
+}
+
+size_t addrman_get_addresses(Peer* peers, size_t max_count)
+{
+    pthread_mutex_lock(&addrman_mutex);
+    if (entries == NULL)
+    {
+        pthread_mutex_unlock(&addrman_mutex);
+        return 0;
+    }
+    uint32_t now = (uint32_t)time(NULL);
+    size_t count = 0;
+    int32_t* ids = (int32_t*)malloc((size_t)(tried_count > new_count ? tried_count : new_count) *
+        sizeof(int32_t) + 1);
+    for (int pass = 0; ids != NULL && pass < 2 && count < max_count; ++pass)
+    {
+        const int32_t* list = pass == 0 ? tried_ids : new_ids;
+        int32_t list_count = pass == 0 ? tried_count : new_count;
+        size_t candidates = 0;
+        for (int32_t i = 0; i < list_count; ++i)
+        {
+            if (!is_terrible(&entries[list[i]], now))
+                ids[candidates++] = list[i];
+        }
+        qsort(ids, candidates, sizeof(int32_t), compare_by_recency);
+        for (size_t i = 0; i < candidates && count < max_count; ++i)
+            peers[count++] = entries[ids[i]].peer;
+    }
+    free(ids);
+    pthread_mutex_unlock(&addrman_mutex);
+    return count;
+}
+
+int save_addrman()
+{
+    pthread_mutex_lock(&addrman_mutex);
+    if (entries == NULL)
+    {
+        pthread_mutex_unlock(&addrman_mutex);
+        return -1;
+    }
+    uint32_t count = (uint32_t)(new_count + tried_count);
+    size_t size = sizeof(addr_file_header) + count * sizeof(addr_record) + 4;
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (data == NULL)
+    {
+        pthread_mutex_unlock(&addrman_mutex);
+        return -1;
+    }
+    addr_file_header header;
+    header.magic = ADDRMAN_FILE_MAGIC;
+    header.version = ADDRMAN_FILE_VERSION;
+    memcpy(header.key, bucket_key, sizeof(header.key));
+    header.count = count;
+    memcpy(data, &header, sizeof(header));
+    size_t offset = sizeof(header);
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        const int32_t* list = pass == 0 ? tried_ids : new_ids;
+        int32_t list_count = pass == 0 ? tried_count : new_count;
+        for (int32_t i = 0; i < list_count; ++i)
+        {
+            const addr_info* info = &entries[list[i]];
+            addr_record record;
+            memcpy(record.addr, info->peer.addr, 16);
+            record.port = info->peer.port;
+            record.services = info->peer.services;
+            record.timestamp = info->peer.timestamp;
+            memcpy(record.source, info->source, 16);
+            record.last_try = info->last_try;
+            record.last_success = info->last_success;
+            record.attempts = info->attempts;
+            record.in_tried = info->in_tried;
+            memcpy(data + offset, &record, sizeof(record));
+            offset += sizeof(record);
+        }
+    }
+    unsigned char checksum[HASH_SIZE];
+    double_sha256(data, offset, checksum);
+    memcpy(data + offset, checksum, 4);
+    dirty = false;
+    char tmp_filename[512];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", addrman_filename);
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s", addrman_filename);
+    pthread_mutex_unlock(&addrman_mutex);
+
+    // The file is replaced only once the new one is complete on disk
+    int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int result = fd >= 0 && write(fd, data, size) == (ssize_t)size && fsync(fd) == 0 ? 0 : -1;
+    if (fd >= 0)
+        close(fd);
+    if (result == 0 && rename(tmp_filename, filename) != 0)
+        result = -1;
+    if (result != 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to save peers file %s: %s", filename,
+            strerror(errno));
+        unlink(tmp_filename);
+        pthread_mutex_lock(&addrman_mutex);
+        dirty = true;
+        pthread_mutex_unlock(&addrman_mutex);
+    }
+    free(data);
+    return result;
+}
+
+void print_addrman_status()
+{
+    pthread_mutex_lock(&addrman_mutex);
+    if (entries == NULL)
+        guarded_print_line("Address manager: not initialized");
+    else
+        guarded_print_line("Address manager: %d new, %d tried addresses", new_count, tried_count);
+    pthread_mutex_unlock(&addrman_mutex);
+}
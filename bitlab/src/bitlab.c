@@ -1,6 +1,7 @@
 #include "bitlab.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 
@@ -9,6 +10,17 @@
 #include "utils.h"
 #include "thread.h"
 #include "peer_discovery.h"
+#include "peer_connection.h"
+#include "event_loop.h"
+#include "command.h"
+#include "hash.h"
+#include "header_index.h"
+#include "header_sync.h"
+#include "block_download.h"
+#include "block_store.h"
+#include "addrman.h"
+#include "crawler.h"
+#include "peer_queue.h"
 
 bitlab_result run_bitlab(int argc, char* argv[])
 {
@@ -16,8 +28,57 @@ bitlab_result run_bitlab(int argc, char* argv[])
     init_config_dir();
     init_logging(BITLAB_LOG);
     log_message(LOG_INFO, BITLAB_LOG, __FILE__, LOG_BITLAB_STARTED);
+    const char* home = getenv("HOME");
+    char log_config_filename[512];
+    if (home != NULL)
+        snprintf(log_config_filename, sizeof(log_config_filename), "%s/.bitlab/%s", home, LOG_CONFIG_FILE);
+    else
+        snprintf(log_config_filename, sizeof(log_config_filename), "%s", LOG_CONFIG_FILE);
+    int log_levels = load_log_config(log_config_filename);
+    if (log_levels > 0)
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Loaded %d log levels from %s", log_levels,
+            log_config_filename);
     init_program_state(&state);
     init_program_operation(&operation);
+    if (init_event_loop() != 0)
+    {
+        finish_logging();
+        return BITLAB_RESULT_FAILURE;
+    }
+    init_hash();
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Hash backend: %s",
+        get_hash_backend_name(get_hash_backend()));
+    init_commands();
+    if (init_header_index(HEADERS_FILE) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to initialize the header index");
+    if (init_block_store(BLOCK_STORE_DIR) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to initialize the block store");
+    init_peer_connection();
+
+    // the address manager lives in the config directory, its best addresses warm the peer queue
+    char peers_filename[512];
+    if (home != NULL)
+        snprintf(peers_filename, sizeof(peers_filename), "%s/.bitlab/%s", home, ADDRMAN_FILE);
+    else
+        snprintf(peers_filename, sizeof(peers_filename), "%s", ADDRMAN_FILE);
+    if (init_addrman(peers_filename) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to initialize the address manager");
+    Peer warm_peers[ADDRMAN_WARM_START_COUNT];
+    size_t warm_count = addrman_get_addresses(warm_peers, ADDRMAN_WARM_START_COUNT);
+    for (size_t i = 0; i < warm_count; ++i)
+        add_peer_record(&warm_peers[i]);
+    if (warm_count > 0)
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Queued %zu known peers", warm_count);
+    char crawl_filename[512];
+    if (home != NULL)
+        snprintf(crawl_filename, sizeof(crawl_filename), "%s/.bitlab/%s", home, CRAWL_SNAPSHOT_FILE);
+    else
+        snprintf(crawl_filename, sizeof(crawl_filename), "%s", CRAWL_SNAPSHOT_FILE);
+    init_crawler(crawl_filename);
+    init_header_sync();
+    init_block_download();
+    set_block_consumer(store_downloaded_block, NULL);
+    pthread_t event_loop_thread = thread_runner(handle_event_loop, "Event loop", NULL);
     pthread_t cli_thread = thread_runner(handle_cli, "CLI", NULL);
     pthread_t peer_discovery_thread = thread_runner(handle_peer_discovery, "Peer discovery", NULL);
 
@@ -58,8 +119,14 @@ bitlab_result run_bitlab(int argc, char* argv[])
     // cleanup
     pthread_join(cli_thread, NULL);
     pthread_join(peer_discovery_thread, NULL);
+    pthread_join(event_loop_thread, NULL);
     destroy_program_state(&state);
     destroy_program_operation(&operation);
+    stop_listening();
+    free_crawler();
+    free_addrman();
+    free_block_store();
+    free_header_index();
     log_message(LOG_INFO, BITLAB_LOG, __FILE__, LOG_BITLAB_FINISHED);
     finish_logging();
     return BITLAB_RESULT_SUCCESS;
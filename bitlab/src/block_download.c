@@ -0,0 +1,712 @@
+#include "block_download.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "event_loop.h"
+#include "hash.h"
+#include "header_index.h"
+#include "log.h"
+#include "peer_connection.h"
+#include "utils.h"
+
+// Size of the smallest transaction: version, no inputs, no outputs and lock time
+#define MIN_TRANSACTION_SIZE 10
+
+/**
+ * The state of a block of the download range.
+ *
+ * @param BLOCK_QUEUED The block waits to be requested.
+ * @param BLOCK_IN_FLIGHT The block was requested from a peer.
+ * @param BLOCK_RECEIVED The block was received and waits for the blocks below it.
+ * @param BLOCK_DELIVERED The block was passed to the consumer.
+ */
+typedef enum
+{
+    BLOCK_QUEUED,
+    BLOCK_IN_FLIGHT,
+    BLOCK_RECEIVED,
+    BLOCK_DELIVERED
+} block_state;
+
+/**
+ * A block of the download range.
+ *
+ * @param data The received block, NULL until it is received.
+ * @param len The length of the received block.
+ * @param requested_ms The monotonic time the block was last requested at.
+ * @param state The state of the block.
+ * @param peer The peer the block was last requested from.
+ * @param excluded_peer The peer the block timed out at, not asked for it again if possible.
+ */
+typedef struct
+{
+    unsigned char* data;
+    size_t len;
+    uint64_t requested_ms;
+    block_state state;
+    int peer;
+    int excluded_peer;
+} block_entry;
+
+/**
+ * The block download statistics of a peer.
+ *
+ * @param in_flight The number of blocks requested from the peer and not yet received.
+ * @param window The number of blocks the peer may have in flight.
+ * @param received The number of blocks received from the peer.
+ * @param bytes The number of block bytes received from the peer.
+ * @param penalized_until_ms The monotonic time until which the peer is not asked for blocks.
+ */
+typedef struct
+{
+    int in_flight;
+    int window;
+    int received;
+    uint64_t bytes;
+    uint64_t penalized_until_ms;
+} peer_download_stats;
+
+// State of the block download, guarded by the download mutex
+static pthread_mutex_t download_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int download_active = 0;
+static block_entry* entries = NULL;
+static int start_height = 0;
+static int end_height = -1;
+static int next_height = 0;
+static uint64_t download_start_ms = 0;
+static uint64_t last_report_ms = 0;
+static uint64_t delivered_bytes = 0;
+static peer_download_stats peer_stats[MAX_NODES];
+static block_consumer consumer = NULL;
+static void* consumer_ctx = NULL;
+
+/**
+ * get_entry:
+ *   Get the entry of the block at the given height. Must be called with the download mutex held.
+ */
+static block_entry* get_entry(int height)
+{
+    return &entries[height - start_height];
+}
+
+/**
+ * free_entries:
+ *   Drop the download range and the buffered blocks. Must be called with the download mutex held.
+ */
+static void free_entries()
+{
+    if (entries != NULL)
+    {
+        for (int height = start_height; height <= end_height; ++height)
+            free(get_entry(height)->data);
+    }
+    free(entries);
+    entries = NULL;
+    download_active = 0;
+    end_height = start_height - 1;
+}
+
+/**
+ * get_window_end:
+ *   Get the height of the last block which may be requested, so at most BLOCK_DOWNLOAD_WINDOW
+ *   blocks wait for the delivery of the blocks below them. Must be called with the download
+ *   mutex held.
+ */
+static int get_window_end()
+{
+    int window_end = next_height + BLOCK_DOWNLOAD_WINDOW - 1;
+    return window_end < end_height ? window_end : end_height;
+}
+
+/**
+ * count_connected_peers:
+ *   Get the number of connected peers.
+ */
+static int count_connected_peers()
+{
+    int count = 0;
+    for (int i = 0; i < MAX_NODES; ++i)
+        count += nodes[i].is_connected != 0;
+    return count;
+}
+
+static void handle_download_block(void* ctx, const unsigned char* payload, size_t payload_len);
+static void penalize_peer(int idx, uint64_t now_ms);
+
+/**
+ * request_blocks:
+ *   Fill the free part of the window of the peer with the lowest queued blocks in a single
+ *   'getdata'. A block timed out at the peer is left for the other peers. Must be called with
+ *   the download mutex held.
+ */
+static void request_blocks(int idx, uint64_t now_ms, int other_peers)
+{
+    peer_download_stats* stats = &peer_stats[idx];
+    int free_slots = stats->window - stats->in_flight;
+    if (free_slots <= 0 || stats->penalized_until_ms > now_ms)
+        return;
+
+    unsigned char hashes[BLOCK_DOWNLOAD_MAX_IN_FLIGHT * HASH_SIZE];
+    int heights[BLOCK_DOWNLOAD_MAX_IN_FLIGHT];
+    int count = 0;
+    int window_end = get_window_end();
+    for (int height = next_height; height <= window_end && count < free_slots; ++height)
+    {
+        block_entry* entry = get_entry(height);
+        if (entry->state != BLOCK_QUEUED || (entry->excluded_peer == idx && other_peers))
+            continue;
+        if (get_header(height, NULL, hashes + count * HASH_SIZE) != 0)
+            break;
+        heights[count++] = height;
+    }
+    if (count == 0)
+        return;
+
+    if (send_getdata_blocks(idx, hashes, count, BLOCK_DOWNLOAD_TIMEOUT_MS, handle_download_block,
+        (void*)(uintptr_t)idx) != 0)
+        return;
+    for (int i = 0; i < count; ++i)
+    {
+        block_entry* entry = get_entry(heights[i]);
+        entry->state = BLOCK_IN_FLIGHT;
+        entry->peer = idx;
+        entry->requested_ms = now_ms;
+    }
+    stats->in_flight += count;
+}
+
+/**
+ * schedule_requests:
+ *   Request queued blocks from every connected peer with free slots in its window, starting
+ *   with the best-scoring peers so the next blocks go to the fastest ones.
+ *   Must be called with the download mutex held.
+ */
+static void schedule_requests(uint64_t now_ms)
+{
+    int peers[MAX_NODES];
+    int peer_count = get_peers_by_score(peers, MAX_NODES);
+    int other_peers = peer_count > 1;
+    for (int i = 0; i < peer_count; ++i)
+        request_blocks(peers[i], now_ms, other_peers);
+}
+
+/**
+ * deliver_blocks:
+ *   Pass the received blocks following the delivered ones to the consumer in height order and
+ *   finish the download after the last one. Must be called with the download mutex held.
+ */
+static void deliver_blocks()
+{
+    while (download_active && next_height <= end_height)
+    {
+        block_entry* entry = get_entry(next_height);
+        if (entry->state != BLOCK_RECEIVED)
+            return;
+        if (consumer != NULL)
+            consumer(next_height, entry->data, entry->len, consumer_ctx);
+        else
+            log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Downloaded block %d (%zu bytes)",
+                next_height, entry->len);
+        delivered_bytes += entry->len;
+        free(entry->data);
+        entry->data = NULL;
+        entry->state = BLOCK_DELIVERED;
+        next_height++;
+    }
+
+    if (download_active && next_height > end_height)
+    {
+        uint64_t elapsed_ms = get_monotonic_ms() - download_start_ms;
+        int count = end_height - start_height + 1;
+        guarded_print_line("Block download finished: %d blocks (%.1f MB) in %.1f s (%.0f blocks/s)",
+            count, delivered_bytes / 1e6, elapsed_ms / 1000.0,
+            elapsed_ms > 0 ? count * 1000.0 / elapsed_ms : 0);
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Block download finished at height %d", end_height);
+        free_entries();
+    }
+}
+
+/**
+ * skip_bytes:
+ *   Advance the offset past `count` bytes of the data. Returns 1 if successful, 0 if the data
+ *   is truncated.
+ */
+static int skip_bytes(size_t data_len, size_t* offset, uint64_t count)
+{
+    if (count > data_len - *offset)
+        return 0;
+    *offset += (size_t)count;
+    return 1;
+}
+
+/**
+ * hash_transaction:
+ *   Compute the txid of the transaction at the offset of the block and advance the offset past
+ *   it. The witness of a segwit transaction is not part of its txid.
+ *   Returns 1 if successful, 0 if the transaction is truncated or memory is exhausted.
+ */
+static int hash_transaction(const unsigned char* block, size_t block_len, size_t* offset,
+    unsigned char txid[HASH_SIZE])
+{
+    size_t start = *offset;
+    if (!skip_bytes(block_len, offset, 4))
+        return 0;
+
+    // A zero input count followed by a non-zero flag marks the segwit serialization
+    int witness = block_len - *offset >= 2 && block[*offset] == 0 && block[*offset + 1] != 0;
+    if (witness)
+        *offset += 2;
+    size_t body_start = *offset;
+
+    uint64_t input_count;
+    if (!read_compact_size(block, block_len, offset, &input_count))
+        return 0;
+    for (uint64_t i = 0; i < input_count; ++i)
+    {
+        // Previous output, script and sequence
+        uint64_t script_len;
+        if (!skip_bytes(block_len, offset, 36) ||
+            !read_compact_size(block, block_len, offset, &script_len) ||
+            !skip_bytes(block_len, offset, script_len) || !skip_bytes(block_len, offset, 4))
+            return 0;
+    }
+    uint64_t output_count;
+    if (!read_compact_size(block, block_len, offset, &output_count))
+        return 0;
+    for (uint64_t i = 0; i < output_count; ++i)
+    {
+        // Value and script
+        uint64_t script_len;
+        if (!skip_bytes(block_len, offset, 8) ||
+            !read_compact_size(block, block_len, offset, &script_len) ||
+            !skip_bytes(block_len, offset, script_len))
+            return 0;
+    }
+    size_t body_end = *offset;
+
+    // The witness holds a stack of items for every input
+    for (uint64_t i = 0; witness && i < input_count; ++i)
+    {
+        uint64_t item_count;
+        if (!read_compact_size(block, block_len, offset, &item_count))
+            return 0;
+        for (uint64_t j = 0; j < item_count; ++j)
+        {
+            uint64_t item_len;
+            if (!read_compact_size(block, block_len, offset, &item_len) ||
+                !skip_bytes(block_len, offset, item_len))
+                return 0;
+        }
+    }
+    size_t lock_time = *offset;
+    if (!skip_bytes(block_len, offset, 4))
+        return 0;
+    if (!witness)
+    {
+        double_sha256(block + start, *offset - start, txid);
+        return 1;
+    }
+
+    // Version, inputs, outputs and lock time without the marker, flag and witness
+    size_t body_len = body_end - body_start;
+    unsigned char* stripped = (unsigned char*)malloc(body_len + 8);
+    if (stripped == NULL)
+        return 0;
+    memcpy(stripped, block + start, 4);
+    memcpy(stripped + 4, block + body_start, body_len);
+    memcpy(stripped + 4 + body_len, block + lock_time, 4);
+    double_sha256(stripped, body_len + 8, txid);
+    free(stripped);
+    return 1;
+}
+
+/**
+ * check_merkle_root:
+ *   Check that the transactions of the block hash to the merkle root of its header, so a peer
+ *   cannot attach another body to a valid header. A level of the tree with two equal neighbours
+ *   is rejected, as repeating the last transactions of a block keeps its root.
+ *   Returns 1 if the block matches its header, 0 otherwise.
+ */
+static int check_merkle_root(const unsigned char* block, size_t block_len)
+{
+    size_t offset = BLOCK_HEADER_SIZE;
+    uint64_t tx_count;
+    if (!read_compact_size(block, block_len, &offset, &tx_count) || tx_count == 0 ||
+        tx_count > (block_len - offset) / MIN_TRANSACTION_SIZE)
+        return 0;
+
+    // Two levels of the tree, with room for the copy of the last node of an odd level
+    size_t count = (size_t)tx_count;
+    unsigned char* level = (unsigned char*)malloc((count + 1) * HASH_SIZE);
+    unsigned char* parents = (unsigned char*)malloc((count + 1) * HASH_SIZE);
+    int valid = level != NULL && parents != NULL;
+    for (size_t i = 0; valid && i < count; ++i)
+        valid = hash_transaction(block, block_len, &offset, level + i * HASH_SIZE);
+    valid = valid && offset == block_len;
+
+    while (valid && count > 1)
+    {
+        for (size_t i = 0; valid && i + 1 < count; i += 2)
+            valid = memcmp(level + i * HASH_SIZE, level + (i + 1) * HASH_SIZE, HASH_SIZE) != 0;
+        if (count % 2 != 0)
+            memcpy(level + count * HASH_SIZE, level + (count - 1) * HASH_SIZE, HASH_SIZE);
+        count = (count + 1) / 2;
+        double_sha256_many(level, 2 * HASH_SIZE, count, parents);
+        unsigned char* hashed = level;
+        level = parents;
+        parents = hashed;
+    }
+
+    // The merkle root follows the version and the previous block hash
+    valid = valid && memcmp(level, block + 36, HASH_SIZE) == 0;
+    free(level);
+    free(parents);
+    return valid;
+}
+
+int receive_block(int idx, const unsigned char* block, size_t block_len)
+{
+    if (block_len < BLOCK_HEADER_SIZE || idx < 0 || idx >= MAX_NODES)
+        return 0;
+
+    unsigned char hash[HASH_SIZE];
+    double_sha256(block, BLOCK_HEADER_SIZE, hash);
+    int height = get_header_height(hash);
+
+    // Hashed outside of the lock, only blocks of the header index can be downloaded
+    int valid = height >= 0 && check_merkle_root(block, block_len);
+
+    pthread_mutex_lock(&download_mutex);
+    if (!download_active || height < start_height || height > end_height)
+    {
+        pthread_mutex_unlock(&download_mutex);
+        return 0;
+    }
+    block_entry* entry = get_entry(height);
+    if (entry->state == BLOCK_RECEIVED || entry->state == BLOCK_DELIVERED)
+    {
+        pthread_mutex_unlock(&download_mutex);
+        return 1; // duplicate of a block requested twice
+    }
+    if (!valid)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Peer %d (%s) sent block %d with transactions not matching its header, requesting it elsewhere",
+            idx, nodes[idx].ip_address, height);
+        nodes[idx].failures++;
+        penalize_peer(idx, get_monotonic_ms());
+        pthread_mutex_unlock(&download_mutex);
+        return 1;
+    }
+
+    unsigned char* data = (unsigned char*)malloc(block_len);
+    if (data == NULL)
+    {
+        pthread_mutex_unlock(&download_mutex);
+        return 1; // requested again after the timeout
+    }
+    memcpy(data, block, block_len);
+
+    // A block delivered late by a peer it timed out at still counts for the peer asked last
+    if (entry->state == BLOCK_IN_FLIGHT)
+    {
+        peer_download_stats* owner = &peer_stats[entry->peer];
+        owner->in_flight--;
+        if (entry->peer == idx && owner->window < BLOCK_DOWNLOAD_MAX_IN_FLIGHT)
+            owner->window++;
+    }
+    entry->data = data;
+    entry->len = block_len;
+    entry->state = BLOCK_RECEIVED;
+    peer_stats[idx].received++;
+    peer_stats[idx].bytes += block_len;
+    deliver_blocks();
+
+    // Refill the window once half of it was received, so 'getdata' messages carry several blocks
+    if (download_active && peer_stats[idx].in_flight <= peer_stats[idx].window / 2)
+        request_blocks(idx, get_monotonic_ms(), count_connected_peers() > 1);
+    pthread_mutex_unlock(&download_mutex);
+    return 1;
+}
+
+/**
+ * handle_download_block:
+ *   Pass the block received in response to a 'getdata' of the download on.
+ */
+static void handle_download_block(void* ctx, const unsigned char* payload, size_t payload_len)
+{
+    int idx = (int)(uintptr_t)ctx;
+    if (!receive_block(idx, payload, payload_len))
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Peer %d sent a block not requested by the download", idx);
+}
+
+/**
+ * requeue_peer_blocks:
+ *   Requeue every block in flight at the peer, to be requested from the other peers.
+ *   Must be called with the download mutex held.
+ */
+static void requeue_peer_blocks(int idx)
+{
+    int window_end = get_window_end();
+    for (int height = next_height; height <= window_end; ++height)
+    {
+        block_entry* entry = get_entry(height);
+        if (entry->state == BLOCK_IN_FLIGHT && entry->peer == idx)
+        {
+            entry->state = BLOCK_QUEUED;
+            entry->excluded_peer = idx;
+        }
+    }
+    peer_stats[idx].in_flight = 0;
+}
+
+/**
+ * penalize_peer:
+ *   Requeue the blocks in flight at the peer and stop asking it for blocks for a while, then
+ *   start it over with a single block in flight. Must be called with the download mutex held.
+ */
+static void penalize_peer(int idx, uint64_t now_ms)
+{
+    requeue_peer_blocks(idx);
+    peer_stats[idx].window = 1;
+    peer_stats[idx].penalized_until_ms = now_ms + BLOCK_DOWNLOAD_PENALTY_MS;
+}
+
+/**
+ * check_stalling_peer:
+ *   Penalize the peer holding back the next block to deliver while every other block of the
+ *   window is already requested or received, so the faster peers idle. Must be called with the
+ *   download mutex held.
+ */
+static void check_stalling_peer(uint64_t now_ms)
+{
+    block_entry* next = get_entry(next_height);
+    if (next->state != BLOCK_IN_FLIGHT || now_ms - next->requested_ms < BLOCK_DOWNLOAD_STALL_MS ||
+        count_connected_peers() < 2)
+        return;
+    int window_end = get_window_end();
+    for (int height = next_height; height <= window_end; ++height)
+    {
+        if (get_entry(height)->state == BLOCK_QUEUED)
+            return;
+    }
+
+    int peer = next->peer;
+    log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+        "Peer %d (%s) stalls the download at height %d, requesting its blocks elsewhere", peer,
+        nodes[peer].ip_address, next_height);
+    penalize_peer(peer, now_ms);
+}
+
+/**
+ * expire_blocks:
+ *   Requeue the blocks of disconnected peers and the blocks not received in time, halving the
+ *   window of the peers they timed out at. Must be called with the download mutex held.
+ */
+static void expire_blocks(uint64_t now_ms)
+{
+    int timed_out[MAX_NODES] = { 0 };
+    int window_end = get_window_end();
+    for (int height = next_height; height <= window_end; ++height)
+    {
+        block_entry* entry = get_entry(height);
+        if (entry->state != BLOCK_IN_FLIGHT)
+            continue;
+        int peer = entry->peer;
+        if (nodes[peer].is_connected && now_ms - entry->requested_ms < BLOCK_DOWNLOAD_TIMEOUT_MS)
+            continue;
+
+        if (nodes[peer].is_connected)
+        {
+            entry->excluded_peer = peer;
+            timed_out[peer]++;
+        }
+        entry->state = BLOCK_QUEUED;
+        peer_stats[peer].in_flight--;
+    }
+
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        if (!nodes[i].is_connected && peer_stats[i].in_flight == 0)
+        {
+            peer_stats[i].window = BLOCK_DOWNLOAD_INITIAL_IN_FLIGHT;
+        }
+        else if (timed_out[i] > 0)
+        {
+            log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+                "%d blocks timed out at peer %d (%s), requesting them elsewhere", timed_out[i], i,
+                nodes[i].ip_address);
+            peer_stats[i].window = peer_stats[i].window > 1 ? peer_stats[i].window / 2 : 1;
+        }
+    }
+}
+
+/**
+ * drive_block_download:
+ *   Event loop timer expiring stalled requests, requesting queued blocks and reporting the
+ *   progress of the download.
+ */
+static void drive_block_download(void* ctx)
+{
+    (void)ctx;
+    pthread_mutex_lock(&download_mutex);
+    if (!download_active)
+    {
+        pthread_mutex_unlock(&download_mutex);
+        return;
+    }
+
+    uint64_t now_ms = get_monotonic_ms();
+    expire_blocks(now_ms);
+    check_stalling_peer(now_ms);
+    schedule_requests(now_ms);
+
+    if (now_ms - last_report_ms >= BLOCK_DOWNLOAD_REPORT_MS)
+    {
+        last_report_ms = now_ms;
+        uint64_t elapsed_ms = now_ms - download_start_ms;
+        guarded_print_line("Block download: height %d of %d, %.0f blocks/s from %d peers",
+            next_height - 1, end_height, (next_height - start_height) * 1000.0 / elapsed_ms,
+            count_connected_peers());
+    }
+    pthread_mutex_unlock(&download_mutex);
+}
+
+/**
+ * grow_entries:
+ *   Extend the download range up to the height with queued blocks. Heights already in the range
+ *   are left alone. Must be called with the download mutex held while a download is running.
+ *   Returns 0 if successful, -1 if memory is exhausted.
+ */
+static int grow_entries(int last_height)
+{
+    if (last_height <= end_height)
+        return 0;
+    block_entry* grown = (block_entry*)realloc(entries,
+        (size_t)(last_height - start_height + 1) * sizeof(block_entry));
+    if (grown == NULL)
+        return -1;
+    entries = grown;
+    memset(entries + (end_height - start_height + 1), 0,
+        (size_t)(last_height - end_height) * sizeof(block_entry));
+    for (int height = end_height + 1; height <= last_height; ++height)
+        get_entry(height)->excluded_peer = -1;
+    end_height = last_height;
+    return 0;
+}
+
+void init_block_download()
+{
+    for (int i = 0; i < MAX_NODES; ++i)
+        peer_stats[i].window = BLOCK_DOWNLOAD_INITIAL_IN_FLIGHT;
+    if (event_loop_add_timer(drive_block_download, NULL, BLOCK_DOWNLOAD_TICK_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register block download timer");
+}
+
+void set_block_consumer(block_consumer callback, void* ctx)
+{
+    pthread_mutex_lock(&download_mutex);
+    consumer = callback;
+    consumer_ctx = ctx;
+    pthread_mutex_unlock(&download_mutex);
+}
+
+int start_block_download(int first_height, int last_height)
+{
+    if (first_height < 0 || first_height > last_height || last_height >= get_header_count())
+        return -1;
+
+    pthread_mutex_lock(&download_mutex);
+    if (download_active)
+    {
+        // Extend the running download, the blocks below it were already requested
+        int result = grow_entries(last_height);
+        pthread_mutex_unlock(&download_mutex);
+        return result;
+    }
+
+    entries = (block_entry*)calloc((size_t)(last_height - first_height + 1), sizeof(block_entry));
+    if (entries == NULL)
+    {
+        pthread_mutex_unlock(&download_mutex);
+        return -1;
+    }
+    start_height = first_height;
+    end_height = last_height;
+    next_height = first_height;
+    for (int height = start_height; height <= end_height; ++height)
+        get_entry(height)->excluded_peer = -1;
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        peer_stats[i].in_flight = 0;
+        peer_stats[i].received = 0;
+        peer_stats[i].bytes = 0;
+        peer_stats[i].window = BLOCK_DOWNLOAD_INITIAL_IN_FLIGHT;
+        peer_stats[i].penalized_until_ms = 0;
+    }
+    download_active = 1;
+    download_start_ms = get_monotonic_ms();
+    last_report_ms = download_start_ms;
+    delivered_bytes = 0;
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Block download started for heights %d to %d",
+        start_height, end_height);
+    schedule_requests(download_start_ms);
+    pthread_mutex_unlock(&download_mutex);
+    return 0;
+}
+
+int extend_block_download(int last_height)
+{
+    if (last_height >= get_header_count())
+        return 0;
+
+    pthread_mutex_lock(&download_mutex);
+    int extended = download_active && last_height > end_height && grow_entries(last_height) == 0;
+    if (extended)
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Block download extended to height %d", end_height);
+    pthread_mutex_unlock(&download_mutex);
+    return extended;
+}
+
+void stop_block_download()
+{
+    pthread_mutex_lock(&download_mutex);
+    if (download_active)
+    {
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Block download stopped at height %d",
+            next_height - 1);
+        free_entries();
+    }
+    pthread_mutex_unlock(&download_mutex);
+}
+
+void print_block_download_status()
+{
+    pthread_mutex_lock(&download_mutex);
+    uint64_t now_ms = get_monotonic_ms();
+    if (download_active)
+    {
+        uint64_t elapsed_ms = now_ms - download_start_ms;
+        guarded_print_line("Block download running: height %d of %d, %.0f blocks/s, %.2f MB/s over %.1f s",
+            next_height - 1, end_height,
+            elapsed_ms > 0 ? (next_height - start_height) * 1000.0 / elapsed_ms : 0,
+            elapsed_ms > 0 ? delivered_bytes / 1e3 / elapsed_ms : 0, elapsed_ms / 1000.0);
+    }
+    else
+        guarded_print_line("Block download not running");
+
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        if (!nodes[i].is_connected)
+            continue;
+        const peer_download_stats* stats = &peer_stats[i];
+        guarded_print_line("  Peer %d (%s): %d blocks (%.1f MB) received, %d of %d in flight%s", i,
+            nodes[i].ip_address, stats->received, stats->bytes / 1e6, stats->in_flight, stats->window,
+            stats->penalized_until_ms > now_ms ? ", penalized" : "");
+    }
+    pthread_mutex_unlock(&download_mutex);
+}
@@ -0,0 +1,441 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "block_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "event_loop.h"
+#include "log.h"
+
+/**
+ * The record of a stored block in the block index file.
+ *
+ * @param hash The block hash.
+ * @param location The location of the block.
+ */
+typedef struct
+{
+    unsigned char hash[HASH_SIZE];
+    block_location location;
+} block_record;
+
+// Records of the stored blocks in the order they were stored, guarded by the index lock
+static block_record* records = NULL;
+static size_t record_count = 0;
+static size_t record_capacity = 0;
+
+// Open addressing table from block hash to record index + 1, 0 marks an empty slot
+static size_t* block_table = NULL;
+static size_t block_table_size = 0;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// The single writer appending to the current block file and the index file
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char* store_dir = NULL;
+static int index_fd = -1;
+static int block_fd = -1;
+static uint32_t current_file = 0;
+static uint32_t current_size = 0;
+static int unsynced = 0;
+
+// Number of records in the index file, the rest wait for their blocks to be synced
+static size_t indexed_count = 0;
+
+/**
+ * hash_slot:
+ *   Map the block hash to its first slot in the block table. The low bytes of block hashes are
+ *   uniformly distributed, so 8 of them are enough.
+ */
+static size_t hash_slot(const unsigned char hash[HASH_SIZE])
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (block_table_size - 1);
+}
+
+/**
+ * find_record:
+ *   Look the block hash up in the block table. Must be called with the index lock held.
+ *   Returns the record of the block or NULL if it is not stored.
+ */
+static const block_record* find_record(const unsigned char hash[HASH_SIZE])
+{
+    if (block_table_size == 0)
+        return NULL;
+    size_t slot = hash_slot(hash);
+    while (block_table[slot] != 0)
+    {
+        const block_record* record = &records[block_table[slot] - 1];
+        if (memcmp(record->hash, hash, HASH_SIZE) == 0)
+            return record;
+        slot = (slot + 1) & (block_table_size - 1);
+    }
+    return NULL;
+}
+
+/**
+ * insert_record:
+ *   Insert the record into the block table. Must be called with the index write lock held and
+ *   free slots available.
+ */
+static void insert_record(size_t index)
+{
+    size_t slot = hash_slot(records[index].hash);
+    while (block_table[slot] != 0)
+        slot = (slot + 1) & (block_table_size - 1);
+    block_table[slot] = index + 1;
+}
+
+/**
+ * add_record:
+ *   Append the record and index it, growing the records and keeping the block table at most
+ *   half full. Must be called with the index write lock held. Returns 0 if successful, -1 otherwise.
+ */
+static int add_record(const block_record* record)
+{
+    if (record_count == record_capacity)
+    {
+        size_t capacity = record_capacity > 0 ? record_capacity * 2 : BLOCK_TABLE_INITIAL_SIZE;
+        block_record* grown = (block_record*)realloc(records, capacity * sizeof(block_record));
+        if (grown == NULL)
+            return -1;
+        records = grown;
+        record_capacity = capacity;
+    }
+    if ((record_count + 1) * 2 > block_table_size)
+    {
+        size_t size = block_table_size > 0 ? block_table_size * 2 : BLOCK_TABLE_INITIAL_SIZE;
+        size_t* table = (size_t*)calloc(size, sizeof(size_t));
+        if (table == NULL)
+            return -1;
+        free(block_table);
+        block_table = table;
+        block_table_size = size;
+        for (size_t i = 0; i < record_count; ++i)
+            insert_record(i);
+    }
+    records[record_count] = *record;
+    insert_record(record_count);
+    record_count++;
+    return 0;
+}
+
+/**
+ * block_filename:
+ *   Build the name of the block file with the given number.
+ */
+static void block_filename(char* buffer, size_t size, uint32_t file)
+{
+    snprintf(buffer, size, "%s/blk%05u.dat", store_dir, file);
+}
+
+/**
+ * open_block_file:
+ *   Open the block file with the given number for appending, emptied if `truncate` is set.
+ *   Returns the file descriptor or -1 on failure.
+ */
+static int open_block_file(uint32_t file, int truncate)
+{
+    char filename[512];
+    block_filename(filename, sizeof(filename), file);
+    return open(filename, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+}
+
+/**
+ * get_file_size:
+ *   Get the size of the block file with the given number, 0 if it does not exist.
+ */
+static off_t get_file_size(uint32_t file)
+{
+    char filename[512];
+    block_filename(filename, sizeof(filename), file);
+    struct stat st;
+    return stat(filename, &st) == 0 ? st.st_size : 0;
+}
+
+/**
+ * load_index:
+ *   Load the records of the index file up to the first one pointing past the end of its block
+ *   file and truncate the index file after it. Returns the number of loaded records.
+ */
+static size_t load_index()
+{
+    block_record record;
+    off_t file_size = -1;
+    uint32_t sized_file = 0;
+    while (read(index_fd, &record, sizeof(record)) == (ssize_t)sizeof(record))
+    {
+        if (file_size < 0 || record.location.file != sized_file)
+        {
+            sized_file = record.location.file;
+            file_size = get_file_size(sized_file);
+        }
+        if ((off_t)record.location.offset + record.location.len > file_size || add_record(&record) != 0)
+            break;
+    }
+
+    // Drop a torn or dangling tail, so appended records follow the valid ones
+    if (ftruncate(index_fd, (off_t)(record_count * sizeof(block_record))) != 0 ||
+        lseek(index_fd, 0, SEEK_END) < 0)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Failed to truncate block index: %s", strerror(errno));
+    }
+    return record_count;
+}
+
+/**
+ * sync_store:
+ *   Event loop timer syncing the blocks stored since the last sync to disk.
+ */
+static void sync_store(void* ctx)
+{
+    (void)ctx;
+    sync_block_store();
+}
+
+int init_block_store(const char* dir)
+{
+    free_block_store();
+
+    pthread_mutex_lock(&store_mutex);
+    pthread_rwlock_wrlock(&index_lock);
+    store_dir = strdup(dir);
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s/%s", dir, BLOCK_INDEX_FILE);
+    if (store_dir == NULL || (mkdir(dir, 0755) != 0 && errno != EEXIST) ||
+        (index_fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to open block store %s: %s", dir,
+            strerror(errno));
+        pthread_rwlock_unlock(&index_lock);
+        pthread_mutex_unlock(&store_mutex);
+        free_block_store();
+        return -1;
+    }
+    size_t loaded = load_index();
+    indexed_count = loaded;
+
+    // Continue after the last indexed block, blocks written but not indexed are overwritten
+    if (loaded > 0)
+    {
+        const block_location* last = &records[loaded - 1].location;
+        current_file = last->file;
+        current_size = last->offset + last->len;
+    }
+    block_fd = open_block_file(current_file, 0);
+    if (block_fd < 0 || ftruncate(block_fd, current_size) != 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to open block file %u: %s",
+            current_file, strerror(errno));
+        pthread_rwlock_unlock(&index_lock);
+        pthread_mutex_unlock(&store_mutex);
+        free_block_store();
+        return -1;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&store_mutex);
+
+    if (event_loop_add_timer(sync_store, NULL, BLOCK_STORE_SYNC_INTERVAL_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register block store sync timer");
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Block store loaded %zu blocks from %s, block file %u",
+        loaded, dir, current_file);
+    return (int)loaded;
+}
+
+void free_block_store()
+{
+    sync_block_store();
+
+    pthread_mutex_lock(&store_mutex);
+    pthread_rwlock_wrlock(&index_lock);
+    if (index_fd >= 0)
+        close(index_fd);
+    if (block_fd >= 0)
+        close(block_fd);
+    free(records);
+    free(block_table);
+    free(store_dir);
+    index_fd = -1;
+    block_fd = -1;
+    records = NULL;
+    record_count = 0;
+    record_capacity = 0;
+    block_table = NULL;
+    block_table_size = 0;
+    store_dir = NULL;
+    current_file = 0;
+    current_size = 0;
+    indexed_count = 0;
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&store_mutex);
+}
+
+int store_block(const unsigned char* block, size_t block_len)
+{
+    if (block_len < 80 || block_len > BLOCK_FILE_SIZE)
+        return -1;
+
+    block_record record;
+    double_sha256(block, 80, record.hash);
+    if (find_block(record.hash, NULL))
+        return 0;
+    unsigned char digest[HASH_SIZE];
+    double_sha256(block, block_len, digest);
+    memcpy(record.location.checksum, digest, 4);
+    record.location.len = (uint32_t)block_len;
+
+    pthread_mutex_lock(&store_mutex);
+    if (block_fd < 0 || find_block(record.hash, NULL))
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return block_fd < 0 ? -1 : 0;
+    }
+
+    // Start the next block file when the block does not fit, the full file is synced first
+    if (current_size > 0 && current_size + block_len > BLOCK_FILE_SIZE)
+    {
+        int next_fd = open_block_file(current_file + 1, 1);
+        if (next_fd < 0)
+        {
+            log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to open block file %u: %s",
+                current_file + 1, strerror(errno));
+            pthread_mutex_unlock(&store_mutex);
+            return -1;
+        }
+        fdatasync(block_fd);
+        close(block_fd);
+        block_fd = next_fd;
+        current_file++;
+        current_size = 0;
+    }
+    record.location.file = current_file;
+    record.location.offset = current_size;
+
+    // The index record is appended by the next sync, once the block is on the disk
+    int result = -1;
+    if (pwrite(block_fd, block, block_len, current_size) == (ssize_t)block_len)
+    {
+        current_size += (uint32_t)block_len;
+        pthread_rwlock_wrlock(&index_lock);
+        result = add_record(&record) == 0 ? 1 : -1;
+        pthread_rwlock_unlock(&index_lock);
+        unsynced = 1;
+    }
+    else
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to store block in file %u: %s",
+            current_file, strerror(errno));
+    }
+    pthread_mutex_unlock(&store_mutex);
+    return result;
+}
+
+void store_downloaded_block(int height, const unsigned char* block, size_t block_len, void* ctx)
+{
+    (void)ctx;
+    if (store_block(block, block_len) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to store downloaded block %d", height);
+}
+
+int find_block(const unsigned char hash[HASH_SIZE], block_location* location)
+{
+    pthread_rwlock_rdlock(&index_lock);
+    const block_record* record = find_record(hash);
+    if (record != NULL && location != NULL)
+        *location = record->location;
+    pthread_rwlock_unlock(&index_lock);
+    return record != NULL;
+}
+
+int find_block_file(const unsigned char hash[HASH_SIZE], block_location* location, char* path,
+    size_t path_size)
+{
+    if (!find_block(hash, location))
+        return 0;
+
+    pthread_mutex_lock(&store_mutex);
+    int found = store_dir != NULL;
+    if (found)
+        block_filename(path, path_size, location->file);
+    pthread_mutex_unlock(&store_mutex);
+    return found;
+}
+
+int open_block(const unsigned char hash[HASH_SIZE], block_location* location)
+{
+    char filename[512];
+    if (!find_block_file(hash, location, filename, sizeof(filename)))
+        return -1;
+    return open(filename, O_RDONLY);
+}
+
+unsigned char* read_block(const unsigned char hash[HASH_SIZE], size_t* block_len)
+{
+    block_location location;
+    int fd = open_block(hash, &location);
+    if (fd < 0)
+        return NULL;
+
+    unsigned char* block = (unsigned char*)malloc(location.len);
+    if (block == NULL || pread(fd, block, location.len, location.offset) != (ssize_t)location.len)
+    {
+        free(block);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    *block_len = location.len;
+    return block;
+}
+
+size_t get_recent_blocks(unsigned char* hashes, size_t max_count)
+{
+    pthread_rwlock_rdlock(&index_lock);
+    size_t count = record_count < max_count ? record_count : max_count;
+    for (size_t i = 0; i < count; ++i)
+        memcpy(hashes + i * HASH_SIZE, records[record_count - count + i].hash, HASH_SIZE);
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+}
+
+size_t get_block_count()
+{
+    pthread_rwlock_rdlock(&index_lock);
+    size_t count = record_count;
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+}
+
+int sync_block_store()
+{
+    pthread_mutex_lock(&store_mutex);
+    int result = 0;
+    if (unsynced && block_fd >= 0 && index_fd >= 0)
+    {
+        // The index records are written only after the blocks they point at reached the disk,
+        // so a crash never leaves records pointing at unwritten data. Blocks of a full block
+        // file were synced when the next file was started.
+        size_t pending = record_count - indexed_count;
+        size_t pending_len = pending * sizeof(block_record);
+        result = fdatasync(block_fd) == 0 &&
+            pwrite(index_fd, records + indexed_count, pending_len,
+                (off_t)(indexed_count * sizeof(block_record))) == (ssize_t)pending_len &&
+            fdatasync(index_fd) == 0 ? 0 : -1;
+        if (result == 0)
+        {
+            indexed_count = record_count;
+            unsynced = 0;
+        }
+        else
+            log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to sync block store: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&store_mutex);
+    return result;
+}
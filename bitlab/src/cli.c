@@ -7,7 +7,14 @@
 #include <sys/stat.h>
 
 #include "peer_queue.h"
+#include "addrman.h"
+#include "crawler.h"
 #include "peer_connection.h"
+#include "header_index.h"
+#include "header_sync.h"
+#include "block_download.h"
+#include "block_store.h"
+#include "command.h"
 #include "state.h"
 #include "utils.h"
 #include "ip.h"
@@ -91,8 +98,16 @@ static cli_command cli_commands[] =
         .cli_command_name = "connect",
         .cli_command_brief_desc = "Connects to the specified IP address.",
         .cli_command_detailed_desc =
-        " * connect - Connects to the specified IP address to establish a peer-to-peer connection.",
-        .cli_command_usage = "connect [IP address]"
+        " * connect - Connects to the specified IP address to establish a peer-to-peer connection. With --from-queue connects to N peers from the peer queue in parallel, with at most C handshakes in flight (default 32) and a deadline of S seconds (default 30).",
+        .cli_command_usage = "connect [IP address | --from-queue N [--concurrency C] [--timeout S]]"
+    },
+    {
+        .cli_command = &cli_listen,
+        .cli_command_name = "listen",
+        .cli_command_brief_desc = "Accepts inbound connections from peers.",
+        .cli_command_detailed_desc =
+        " * listen - Listens on the given port (default 8333) for inbound peers, which are answered in the version handshake and served headers and blocks like outbound peers. At most the given number of inbound peers (default 64) are connected at once, further connections are closed right after accept. Add 'stop' to stop listening while keeping the connected peers or 'status' to print the inbound peers and the blocks served to them.",
+        .cli_command_usage = "listen [port [max inbound] | stop | status]"
     },
     {
         .cli_command = &cli_ping,
@@ -114,7 +129,7 @@ static cli_command cli_commands[] =
         .cli_command = &cli_list,
         .cli_command_name = "list",
         .cli_command_brief_desc = "Lists connected nodes.",
-        .cli_command_detailed_desc = " * list - Lists nodes connected with 'connect' command. Shows IP address, port, socket FD, thread ID, connection status, operation status, compact blocks, and fee rate.",
+        .cli_command_detailed_desc = " * list - Lists nodes connected with 'connect' command. Shows IP address, port, socket FD, connection status, pending requests, compact blocks, and fee rate.",
         .cli_command_usage = "list"
     },
     {
@@ -128,7 +143,7 @@ static cli_command cli_commands[] =
         .cli_command = &cli_disconnect,
         .cli_command_name = "disconnect",
         .cli_command_brief_desc = "Disconnect from specified node.",
-        .cli_command_detailed_desc = " * disconnect - Disconnects from node specified by the given node ID. Closes the socket, terminates the thread, and logs the disconnection.",
+        .cli_command_detailed_desc = " * disconnect - Disconnects from node specified by the given node ID. Removes the socket from the event loop, closes it, and logs the disconnection.",
         .cli_command_usage = "disconnect [idx of node]"
     },
     {
@@ -149,7 +164,7 @@ static cli_command cli_commands[] =
         .cli_command = &cli_inv,
         .cli_command_name = "inv",
         .cli_command_brief_desc = "Let's answer 'getblocks' manually or verbosely send advertisement about known blocks.",
-        .cli_command_detailed_desc = " * inv - Sends an 'inv' message to the specified peer using the existing blocks.dat file to advertise known blocks.",
+        .cli_command_detailed_desc = " * inv - Sends an 'inv' message to the specified peer advertising the blocks most recently stored in the block store.",
         .cli_command_usage = "inv [idx of node]"
     },
     {
@@ -163,8 +178,57 @@ static cli_command cli_commands[] =
         .cli_command = &cli_tx,
         .cli_command_name = "tx",
         .cli_command_brief_desc = "Sends a transaction to a specified node.",
-        .cli_command_detailed_desc = " * tx - Sends a 'tx' message to the specified node with the provided transaction data.",
-        .cli_command_usage = "tx [idx of node] [transaction data in hex]"
+        .cli_command_detailed_desc = " * tx - Sends a 'tx' message to the specified node with the provided transaction data. 'best' instead of the index broadcasts it to the best-scoring connected nodes, ranked by round-trip time, throughput and failures as shown by 'list'.",
+        .cli_command_usage = "tx [idx of node | best] [transaction data in hex]"
+    },
+    {
+        .cli_command = &cli_msgstats,
+        .cli_command_name = "msgstats",
+        .cli_command_brief_desc = "Prints received message counters.",
+        .cli_command_detailed_desc = " * msgstats - Prints the number of messages and payload bytes received from all peers for every command.",
+        .cli_command_usage = "msgstats"
+    },
+    {
+        .cli_command = &cli_sync,
+        .cli_command_name = "sync",
+        .cli_command_brief_desc = "Syncs block headers or blocks from connected peers.",
+        .cli_command_detailed_desc = " * sync headers - Starts requesting batches of headers in the background from the fastest connected peer until the tip is reached. Validates linkage and proof of work, replaces stalled peers and reports headers per second. 'sync blocks' downloads the blocks of the given height range of the header index, the whole chain by default, from all connected peers in parallel and delivers them in height order. Stalled blocks are requested from other peers. Add 'stop' to stop the sync or 'status' to print its progress.",
+        .cli_command_usage = "sync [headers [start | stop | status] | blocks [start height end height | stop | status]]"
+    },
+    {
+        .cli_command = &cli_crawl,
+        .cli_command_name = "crawl",
+        .cli_command_brief_desc = "Crawls the network for reachable nodes.",
+        .cli_command_detailed_desc = " * crawl - Starts a breadth-first walk of the network in the background from the known addresses. Every node is sent 'version' and 'getaddr' and disconnected once it answers, the new addresses it returns are probed next. At most the given number of probes (default 256) are in flight and at most the given number of nodes (default 100000) are probed. The user agent, services, start height and round-trip time of every reachable node are saved to ~/.bitlab/crawl.dat when the crawl ends. Add 'stop' to end the crawl early or 'status' to print its progress.",
+        .cli_command_usage = "crawl [concurrency [max nodes] | stop | status]"
+    },
+    {
+        .cli_command = &cli_logformat,
+        .cli_command_name = "logformat",
+        .cli_command_brief_desc = "Prints or sets the format of the log files.",
+        .cli_command_detailed_desc = " * logformat - Prints the current log format or switches it. 'binary' stores format string IDs and raw arguments instead of formatted lines, which is much cheaper on busy peers, in the log files with the .bin suffix next to the text ones. Decode them with 'bitlab-logdecode ~/.bitlab/logs/bitlab.log.bin'. 'text' switches back to formatted lines.",
+        .cli_command_usage = "logformat [text | binary]"
+    },
+    {
+        .cli_command = &cli_loglevel,
+        .cli_command_name = "loglevel",
+        .cli_command_brief_desc = "Prints or sets the minimum log levels.",
+        .cli_command_detailed_desc = " * loglevel - Prints the minimum log levels or sets the global one (debug, info, warn, error or fatal). With a log filename prefix first, like 'peer_connection' for the logs of all peers, sets the level of the matching files only, 'default' removes it. Messages below the level are skipped before they are formatted. Levels are also loaded at start from ~/.bitlab/log.conf, one level or prefix and level per line.",
+        .cli_command_usage = "loglevel [[file prefix] debug | info | warn | error | fatal | default]"
+    },
+    {
+        .cli_command = &cli_logpeers,
+        .cli_command_name = "logpeers",
+        .cli_command_brief_desc = "Prints or sets where the peer logs are written.",
+        .cli_command_detailed_desc = " * logpeers - Prints whether every peer has its own log file or switches it. 'combined' writes the logs of all peers to ~/.bitlab/logs/peers.log, every line tagged with the address of the peer, which keeps the number of files low on nodes with thousands of peers. 'separate' switches back to one peer_connection_<address>.log per peer. At most 64 log files are kept open, the least recently used ones are closed and reopened when logged to again.",
+        .cli_command_usage = "logpeers [separate | combined]"
+    },
+    {
+        .cli_command = &cli_logrotate,
+        .cli_command_name = "logrotate",
+        .cli_command_brief_desc = "Prints or sets the rotation of the log files.",
+        .cli_command_detailed_desc = " * logrotate - Prints the rotation of the log files or changes the default one with options: size=<bytes>[K|M|G] and age=<seconds>[m|h|d] rotate the file once it reaches the size or the age (0 disables), keep=<count> sets the number of rotated segments kept and compress=yes|no gzips them. With a log filename prefix first, like 'peer_connection' for the logs of all peers, changes the rotation of the matching files only, 'default' removes it. Rotated files get the time of the rotation appended and are compressed by a low priority background thread. Rotations are also loaded at start from ~/.bitlab/log.conf, from lines starting with 'rotate' followed by the same arguments.",
+        .cli_command_usage = "logrotate [[file prefix] size=<bytes> age=<seconds> keep=<count> compress=yes|no | [file prefix] default]"
     },
 }; // do not add NULLs at the end
 
@@ -520,6 +584,14 @@ int cli_info(char** args)
     }
     else
         guarded_print_line("Peer discovery: inactive");
+    print_addrman_status();
+    guarded_print_line("Dropped log messages: %llu",
+        (unsigned long long)get_dropped_log_records());
+    size_t sinks;
+    size_t open_files;
+    get_log_sink_counts(&sinks, &open_files);
+    guarded_print_line("Log sinks: %zu (%zu open files)", sinks, open_files);
+    guarded_print_line("Rotated logs waiting for compression: %zu", get_pending_log_compressions());
 
     pthread_mutex_unlock(&cli_mutex);
     return 0;
@@ -776,6 +848,38 @@ int cli_connect(char** args)
         pthread_mutex_unlock(&cli_mutex);
         return 1;
     }
+    if (strcmp(args[0], "--from-queue") == 0)
+    {
+        int count = 0;
+        int concurrency = CONNECT_DEFAULT_CONCURRENCY;
+        int timeout = CONNECT_DEFAULT_TIMEOUT;
+        int i = 0;
+        while (args[i] != NULL)
+        {
+            int* value = NULL;
+            if (strcmp(args[i], "--from-queue") == 0)
+                value = &count;
+            else if (strcmp(args[i], "--concurrency") == 0)
+                value = &concurrency;
+            else if (strcmp(args[i], "--timeout") == 0)
+                value = &timeout;
+
+            if (value == NULL || args[i + 1] == NULL || (*value = strtol(args[i + 1], NULL, 10)) <= 0)
+            {
+                log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+                    "Invalid argument for connect command: %s", args[i]);
+                print_usage("connect");
+                pthread_mutex_unlock(&cli_mutex);
+                return 1;
+            }
+            i += 2;
+        }
+        guarded_print_line("Connecting to %d peers from the queue (concurrency %d, timeout %ds)",
+            count, concurrency, timeout);
+        connect_to_peers_from_queue(count, concurrency, timeout);
+        pthread_mutex_unlock(&cli_mutex);
+        return 0;
+    }
     if (args[1] != NULL)
     {
         log_message(LOG_WARN, BITLAB_LOG, __FILE__,
@@ -1011,19 +1115,30 @@ int cli_inv(char** args)
 
     int idx = atoi(args[0]);
 
-    // Load inventory data from blocks.dat
-    size_t inv_len;
-    unsigned char* inv_data = load_blocks_from_file("blocks.dat", &inv_len);
+    // Advertise the most recently stored blocks
+    unsigned char hashes[MAX_INV_BLOCKS * 32];
+    size_t inv_count = get_recent_blocks(hashes, MAX_INV_BLOCKS);
+    if (inv_count == 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__,
+            "No blocks in the block store to advertise");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+    unsigned char* inv_data = (unsigned char*)malloc(inv_count * 36);
     if (!inv_data)
     {
         log_message(LOG_ERROR, BITLAB_LOG, __FILE__,
-            "Failed to load inventory data from blocks.dat");
+            "Failed to allocate inventory data");
         pthread_mutex_unlock(&cli_mutex);
         return 1;
     }
-
-    size_t inv_count = inv_len / 36;
-    printf("inv_len: %zu, inv_count: %zu\n", inv_len, inv_count);
+    for (size_t i = 0; i < inv_count; ++i)
+    {
+        const unsigned char type[4] = { INV_TYPE_BLOCK, 0, 0, 0 };
+        memcpy(inv_data + i * 36, type, 4);
+        memcpy(inv_data + i * 36 + 4, hashes + i * 32, 32);
+    }
 
     // Send the 'inv' message
     send_inv_and_wait(idx, inv_data, inv_count);
@@ -1045,8 +1160,24 @@ int cli_tx(char** args)
         return 1;
     }
 
-    int idx = atoi(args[0]);
-    if (idx < 0 || idx >= MAX_NODES)
+    int peers[TX_BROADCAST_PEERS];
+    int peer_count = 0;
+    if (strcmp(args[0], "best") == 0)
+    {
+        peer_count = get_peers_by_score(peers, TX_BROADCAST_PEERS);
+        if (peer_count == 0)
+        {
+            guarded_print_line("No connected peers");
+            pthread_mutex_unlock(&cli_mutex);
+            return 0;
+        }
+    }
+    else
+    {
+        peers[0] = atoi(args[0]);
+        peer_count = peers[0] >= 0 && peers[0] < MAX_NODES;
+    }
+    if (peer_count == 0)
     {
         log_message(LOG_WARN, BITLAB_LOG, __FILE__,
             "Invalid node index for tx command");
@@ -1071,8 +1202,11 @@ int cli_tx(char** args)
         sscanf(&args[1][i * 2], "%2hhx", &tx_data[i]);
     }
 
-    guarded_print_line("Sending transaction to %d with size %zu", idx, tx_size);
-    send_tx(idx, tx_data, tx_size);
+    for (int i = 0; i < peer_count; ++i)
+    {
+        guarded_print_line("Sending transaction to %d with size %zu", peers[i], tx_size);
+        send_tx(peers[i], tx_data, tx_size);
+    }
 
     free(tx_data);
     pthread_mutex_unlock(&cli_mutex);
@@ -1095,6 +1229,347 @@ int cli_list(char** args)
     return 0;
 }
 
+int cli_msgstats(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    if (args[0] != NULL)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Too many arguments for msgstats command");
+        print_usage("msgstats");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+    print_command_stats();
+    pthread_mutex_unlock(&cli_mutex);
+    return 0;
+}
+
+int cli_logformat(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    if (args[0] != NULL && args[1] != NULL)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Too many arguments for logformat command");
+        print_usage("logformat");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+    if (args[0] == NULL)
+        guarded_print_line("Log format: %s", get_log_format() == LOG_FORMAT_BINARY ? "binary" : "text");
+    else if (strcmp(args[0], "text") == 0)
+        set_log_format(LOG_FORMAT_TEXT);
+    else if (strcmp(args[0], "binary") == 0)
+        set_log_format(LOG_FORMAT_BINARY);
+    else
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Unknown log format: %s", args[0]);
+        print_usage("logformat");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+    pthread_mutex_unlock(&cli_mutex);
+    return 0;
+}
+
+int cli_loglevel(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    if (args[0] != NULL && args[1] != NULL && args[2] != NULL)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Too many arguments for loglevel command");
+        print_usage("loglevel");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+    if (args[0] == NULL)
+    {
+        guarded_print_line("Log level: %s", get_log_level_name(get_log_level()));
+        log_file_level levels[LOG_MAX_FILE_LEVELS];
+        int count = get_file_log_levels(levels, LOG_MAX_FILE_LEVELS);
+        for (int i = 0; i < count; ++i)
+            guarded_print_line(" %s*: %s", levels[i].prefix, get_log_level_name(levels[i].level));
+        pthread_mutex_unlock(&cli_mutex);
+        return 0;
+    }
+
+    const char* prefix = args[1] != NULL ? args[0] : NULL;
+    const char* name = args[1] != NULL ? args[1] : args[0];
+    log_level level;
+    int result = 0;
+    if (prefix != NULL && strcmp(name, "default") == 0)
+        clear_file_log_level(prefix);
+    else if (parse_log_level(name, &level) < 0)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Unknown log level: %s", name);
+        print_usage("loglevel");
+        result = 1;
+    }
+    else if (prefix == NULL)
+        set_log_level(level);
+    else if (set_file_log_level(prefix, level) < 0)
+    {
+        guarded_print_line("At most %d log file prefixes can have their own level", LOG_MAX_FILE_LEVELS);
+        result = 1;
+    }
+    pthread_mutex_unlock(&cli_mutex);
+    return result;
+}
+
+int cli_logpeers(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    if (args[0] != NULL && args[1] != NULL)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Too many arguments for logpeers command");
+        print_usage("logpeers");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+    if (args[0] == NULL)
+        guarded_print_line("Peer logs: %s", get_combined_peer_logs() ? "combined" : "separate");
+    else if (strcmp(args[0], "separate") == 0)
+        set_combined_peer_logs(0);
+    else if (strcmp(args[0], "combined") == 0)
+        set_combined_peer_logs(1);
+    else
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Unknown peer log mode: %s", args[0]);
+        print_usage("logpeers");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+    pthread_mutex_unlock(&cli_mutex);
+    return 0;
+}
+
+/**
+ * print_log_rotation:
+ *   Print the rotation of the log files with the given prefix, NULL for the default one.
+ */
+static void print_log_rotation(const char* prefix, const log_rotation* rotation)
+{
+    guarded_print_line("%s%s: size=%llu age=%llu keep=%d compress=%s",
+        prefix != NULL ? prefix : "Log rotation", prefix != NULL ? "*" : "",
+        (unsigned long long)rotation->max_size, (unsigned long long)rotation->max_age,
+        rotation->keep, rotation->compress ? "yes" : "no");
+}
+
+int cli_logrotate(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    log_rotation rotation;
+    if (args[0] == NULL)
+    {
+        get_log_rotation(&rotation);
+        print_log_rotation(NULL, &rotation);
+        log_rotation_rule rules[LOG_MAX_ROTATION_RULES];
+        int count = get_file_log_rotations(rules, LOG_MAX_ROTATION_RULES);
+        for (int i = 0; i < count; ++i)
+            print_log_rotation(rules[i].prefix, &rules[i].rotation);
+        pthread_mutex_unlock(&cli_mutex);
+        return 0;
+    }
+
+    const char* prefix = strchr(args[0], '=') == NULL ? args[0] : NULL;
+    char** options = prefix != NULL ? args + 1 : args;
+    if (prefix != NULL && options[0] != NULL && strcmp(options[0], "default") == 0 && options[1] == NULL)
+    {
+        clear_file_log_rotation(prefix);
+        pthread_mutex_unlock(&cli_mutex);
+        return 0;
+    }
+    if (options[0] == NULL)
+    {
+        print_usage("logrotate");
+        pthread_mutex_unlock(&cli_mutex);
+        return 1;
+    }
+
+    if (prefix != NULL)
+        get_file_log_rotation(prefix, &rotation);
+    else
+        get_log_rotation(&rotation);
+    for (int i = 0; options[i] != NULL; ++i)
+    {
+        if (parse_log_rotation_option(options[i], &rotation) < 0)
+        {
+            log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+                "Invalid log rotation option: %s", options[i]);
+            print_usage("logrotate");
+            pthread_mutex_unlock(&cli_mutex);
+            return 1;
+        }
+    }
+    int result = 0;
+    if (prefix == NULL)
+        set_log_rotation(&rotation);
+    else if (set_file_log_rotation(prefix, &rotation) < 0)
+    {
+        guarded_print_line("At most %d log file prefixes can have their own rotation", LOG_MAX_ROTATION_RULES);
+        result = 1;
+    }
+    pthread_mutex_unlock(&cli_mutex);
+    return result;
+}
+
+/**
+ * sync_headers_action:
+ *   Run the action of the 'sync headers' command. Returns 0 if successful, 1 otherwise.
+ */
+static int sync_headers_action(char** args)
+{
+    const char* action = args[0] != NULL ? args[0] : "start";
+    if (args[0] != NULL && args[1] != NULL)
+        return 1;
+    if (strcmp(action, "start") == 0)
+    {
+        if (start_header_sync() == 0)
+            guarded_print_line("Header sync started at height %d", get_header_count() - 1);
+        else
+            guarded_print_line("Header sync is already running");
+    }
+    else if (strcmp(action, "stop") == 0)
+    {
+        stop_header_sync();
+        guarded_print_line("Header sync stopped at height %d", get_header_count() - 1);
+    }
+    else if (strcmp(action, "status") == 0)
+        print_header_sync_status();
+    else
+        return 1;
+    return 0;
+}
+
+/**
+ * sync_blocks_action:
+ *   Run the action of the 'sync blocks' command. Returns 0 if successful, 1 otherwise.
+ */
+static int sync_blocks_action(char** args)
+{
+    if (args[0] != NULL && strcmp(args[0], "stop") == 0 && args[1] == NULL)
+    {
+        stop_block_download();
+        guarded_print_line("Block download stopped");
+        return 0;
+    }
+    if (args[0] != NULL && strcmp(args[0], "status") == 0 && args[1] == NULL)
+    {
+        print_block_download_status();
+        return 0;
+    }
+
+    // The whole best chain of the header index by default
+    int start_height = 0;
+    int end_height = get_header_count() - 1;
+    if (args[0] != NULL)
+    {
+        if (args[1] == NULL || args[2] != NULL)
+            return 1;
+        start_height = atoi(args[0]);
+        end_height = atoi(args[1]);
+    }
+    if (start_block_download(start_height, end_height) != 0)
+    {
+        guarded_print_line("Invalid block range %d to %d, the header index ends at height %d",
+            start_height, end_height, get_header_count() - 1);
+        return 0;
+    }
+    guarded_print_line("Downloading blocks %d to %d", start_height, end_height);
+    return 0;
+}
+
+int cli_sync(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    int result = 1;
+    if (args[0] != NULL && strcmp(args[0], "headers") == 0)
+        result = sync_headers_action(args + 1);
+    else if (args[0] != NULL && strcmp(args[0], "blocks") == 0)
+        result = sync_blocks_action(args + 1);
+    if (result != 0)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Invalid arguments for sync command");
+        print_usage("sync");
+    }
+    pthread_mutex_unlock(&cli_mutex);
+    return result;
+}
+
+int cli_listen(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    int result = 0;
+    if (args[0] != NULL && strcmp(args[0], "stop") == 0 && args[1] == NULL)
+    {
+        stop_listening();
+        guarded_print_line("Stopped listening");
+    }
+    else if (args[0] != NULL && strcmp(args[0], "status") == 0 && args[1] == NULL)
+        print_listener_status();
+    else
+    {
+        int port = args[0] != NULL ? atoi(args[0]) : BITCOIN_MAINNET_PORT;
+        int max_inbound = args[0] != NULL && args[1] != NULL ? atoi(args[1]) : LISTEN_DEFAULT_MAX_INBOUND;
+        if (port <= 0 || port > 65535 || max_inbound <= 0 || max_inbound > MAX_NODES ||
+            (args[0] != NULL && args[1] != NULL && args[2] != NULL))
+            result = 1;
+        else if (start_listening((uint16_t)port, max_inbound) == 0)
+            guarded_print_line("Listening on port %d, at most %d inbound peers", port, max_inbound);
+    }
+    if (result != 0)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Invalid arguments for listen command");
+        print_usage("listen");
+    }
+    pthread_mutex_unlock(&cli_mutex);
+    return result;
+}
+
+int cli_crawl(char** args)
+{
+    pthread_mutex_lock(&cli_mutex);
+    int result = 0;
+    if (args[0] != NULL && strcmp(args[0], "stop") == 0 && args[1] == NULL)
+    {
+        if (is_crawl_running())
+        {
+            stop_crawl();
+            guarded_print_line("Stopping the crawl");
+        }
+        else
+            guarded_print_line("No crawl is running");
+    }
+    else if (args[0] != NULL && strcmp(args[0], "status") == 0 && args[1] == NULL)
+        print_crawl_status();
+    else
+    {
+        int concurrency = args[0] != NULL ? atoi(args[0]) : CRAWL_DEFAULT_CONCURRENCY;
+        int max_nodes = args[0] != NULL && args[1] != NULL ? atoi(args[1]) : CRAWL_DEFAULT_MAX_NODES;
+        if (concurrency <= 0 || concurrency > CRAWL_MAX_CONCURRENCY || max_nodes <= 0 ||
+            (args[0] != NULL && args[1] != NULL && args[2] != NULL))
+            result = 1;
+        else if (start_crawl(concurrency, max_nodes) == 0)
+            guarded_print_line("Crawl started, %d probes in flight, at most %d nodes", concurrency, max_nodes);
+    }
+    if (result != 0)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Invalid arguments for crawl command");
+        print_usage("crawl");
+    }
+    pthread_mutex_unlock(&cli_mutex);
+    return result;
+}
+
 int cli_clear(char** args)
 {
     pthread_mutex_lock(&cli_mutex);
@@ -0,0 +1,170 @@
+#include "command.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "utils.h"
+
+/**
+ * The 12-byte command field split into two words, so it is compared with two integer comparisons.
+ *
+ * @param low The first 8 bytes of the command.
+ * @param high The last 4 bytes of the command.
+ */
+typedef struct
+{
+    uint64_t low;
+    uint32_t high;
+} command_key;
+
+/**
+ * The registered command.
+ *
+ * @param name The command name.
+ * @param key The command name null-padded to the size of the command field.
+ * @param handler The handler of the command.
+ * @param messages The number of received messages.
+ * @param bytes The total payload size of received messages.
+ */
+typedef struct
+{
+    const char* name;
+    command_key key;
+    command_handler handler;
+    atomic_uint_least64_t messages;
+    atomic_uint_least64_t bytes;
+} command_entry;
+
+// Indexed by command_id
+static command_entry commands[COMMAND_COUNT] =
+{
+    [COMMAND_UNKNOWN] = {.name = "unknown"},
+    [COMMAND_VERSION] = {.name = "version"},
+    [COMMAND_VERACK] = {.name = "verack"},
+    [COMMAND_PING] = {.name = "ping"},
+    [COMMAND_PONG] = {.name = "pong"},
+    [COMMAND_ADDR] = {.name = "addr"},
+    [COMMAND_GETADDR] = {.name = "getaddr"},
+    [COMMAND_GETHEADERS] = {.name = "getheaders"},
+    [COMMAND_HEADERS] = {.name = "headers"},
+    [COMMAND_GETBLOCKS] = {.name = "getblocks"},
+    [COMMAND_INV] = {.name = "inv"},
+    [COMMAND_GETDATA] = {.name = "getdata"},
+    [COMMAND_NOTFOUND] = {.name = "notfound"},
+    [COMMAND_BLOCK] = {.name = "block"},
+    [COMMAND_TX] = {.name = "tx"},
+    [COMMAND_SENDHEADERS] = {.name = "sendheaders"},
+    [COMMAND_SENDCMPCT] = {.name = "sendcmpct"},
+    [COMMAND_FEEFILTER] = {.name = "feefilter"},
+};
+
+// Open addressing table of command identifiers, COMMAND_UNKNOWN marks an empty slot
+static command_id command_table[COMMAND_TABLE_SIZE];
+
+/**
+ * load_key:
+ *   Load the command field into a command key.
+ */
+static command_key load_key(const char command[COMMAND_SIZE])
+{
+    command_key key;
+    memcpy(&key.low, command, sizeof(key.low));
+    memcpy(&key.high, command + sizeof(key.low), sizeof(key.high));
+    return key;
+}
+
+/**
+ * hash_key:
+ *   Map the command key to its first slot in the command table.
+ */
+static unsigned int hash_key(command_key key)
+{
+    uint64_t hash = (key.low ^ ((uint64_t)key.high << 17)) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(hash >> 32) & (COMMAND_TABLE_SIZE - 1);
+}
+
+void init_commands()
+{
+    memset(command_table, 0, sizeof(command_table));
+    for (int id = COMMAND_UNKNOWN + 1; id < COMMAND_COUNT; ++id)
+    {
+        char command[COMMAND_SIZE];
+        memset(command, 0, sizeof(command));
+        memcpy(command, commands[id].name, strlen(commands[id].name));
+        commands[id].key = load_key(command);
+
+        unsigned int slot = hash_key(commands[id].key);
+        while (command_table[slot] != COMMAND_UNKNOWN)
+            slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+        command_table[slot] = (command_id)id;
+    }
+}
+
+command_id get_command_id(const char command[COMMAND_SIZE])
+{
+    command_key key = load_key(command);
+    unsigned int slot = hash_key(key);
+    while (command_table[slot] != COMMAND_UNKNOWN)
+    {
+        const command_entry* entry = &commands[command_table[slot]];
+        if (entry->key.low == key.low && entry->key.high == key.high)
+            return command_table[slot];
+        slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+    }
+    return COMMAND_UNKNOWN;
+}
+
+const char* get_command_name(command_id id)
+{
+    if (id < 0 || id >= COMMAND_COUNT)
+        id = COMMAND_UNKNOWN;
+    return commands[id].name;
+}
+
+void register_command_handler(command_id id, command_handler handler)
+{
+    if (id <= COMMAND_UNKNOWN || id >= COMMAND_COUNT)
+        return;
+    commands[id].handler = handler;
+}
+
+int dispatch_command(command_id id, void* ctx, const unsigned char* payload, size_t payload_len,
+    const char* log_filename)
+{
+    if (id <= COMMAND_UNKNOWN || id >= COMMAND_COUNT || commands[id].handler == NULL)
+        return 0;
+    commands[id].handler(ctx, payload, payload_len, log_filename);
+    return 1;
+}
+
+void count_command(command_id id, size_t payload_len)
+{
+    if (id < 0 || id >= COMMAND_COUNT)
+        id = COMMAND_UNKNOWN;
+    atomic_fetch_add_explicit(&commands[id].messages, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&commands[id].bytes, payload_len, memory_order_relaxed);
+}
+
+void get_command_stats(command_id id, uint64_t* messages, uint64_t* bytes)
+{
+    if (id < 0 || id >= COMMAND_COUNT)
+        id = COMMAND_UNKNOWN;
+    *messages = atomic_load_explicit(&commands[id].messages, memory_order_relaxed);
+    *bytes = atomic_load_explicit(&commands[id].bytes, memory_order_relaxed);
+}
+
+void print_command_stats()
+{
+    guarded_print_line("%-12s %12s %16s", "Command", "Messages", "Bytes");
+    for (int id = 0; id < COMMAND_COUNT; ++id)
+    {
+        uint64_t messages;
+        uint64_t bytes;
+        get_command_stats((command_id)id, &messages, &bytes);
+        if (messages == 0)
+            continue;
+        guarded_print_line("%-12s %12llu %16llu", commands[id].name,
+            (unsigned long long)messages, (unsigned long long)bytes);
+    }
+}
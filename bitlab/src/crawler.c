@@ -0,0 +1,747 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "crawler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "addrman.h"
+#include "event_loop.h"
+#include "message.h"
+#include "peer_connection.h"
+#include "peer_queue.h"
+#include "utils.h"
+
+// Magic number and version of the snapshot file
+#define CRAWL_SNAPSHOT_MAGIC 0x52434c42
+#define CRAWL_SNAPSHOT_VERSION 1
+
+// Initial number of slots of the set of seen addresses, grown by doubling
+#define CRAWL_SEEN_INITIAL_SIZE 4096
+
+/**
+ * The state of a probe.
+ *
+ * @param PROBE_CONNECTING The non-blocking connect is in progress.
+ * @param PROBE_HANDSHAKE 'version' was sent, waiting for the 'version' of the node.
+ * @param PROBE_GETADDR 'verack' and 'getaddr' were sent, waiting for 'addr'.
+ */
+typedef enum
+{
+    PROBE_CONNECTING,
+    PROBE_HANDSHAKE,
+    PROBE_GETADDR
+} probe_state;
+
+/**
+ * The probe of one node, driven by the event loop until the node answers 'getaddr'.
+ *
+ * @param node The result of the probe, kept if the node sent its 'version'.
+ * @param ip_address The IPv4 address of the node.
+ * @param socket_fd The non-blocking socket.
+ * @param state The state of the probe.
+ * @param recv_buffer The bytes received from the node.
+ * @param version_sent_ms The monotonic time 'version' was sent at.
+ * @param deadline_ms The monotonic time the probe ends at.
+ * @param next The next probe in flight.
+ */
+typedef struct crawl_probe
+{
+    crawl_node node;
+    char ip_address[PEER_IP_STRLEN];
+    int socket_fd;
+    probe_state state;
+    message_buffer recv_buffer;
+    uint64_t version_sent_ms;
+    uint64_t deadline_ms;
+    struct crawl_probe* next;
+} crawl_probe;
+
+/**
+ * The slot of the set of addresses seen during the crawl.
+ *
+ * @param addr The IPv6 address.
+ * @param port The port.
+ * @param used Is the slot taken.
+ */
+typedef struct
+{
+    unsigned char addr[16];
+    uint16_t port;
+    bool used;
+} seen_slot;
+
+/**
+ * The header of the snapshot file, followed by the records of the reachable nodes.
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_time;
+    uint32_t duration_ms;
+    uint32_t probed;
+    uint32_t count;
+} crawl_snapshot_header;
+
+/**
+ * The record of a reachable node in the snapshot file, followed by its user agent.
+ */
+typedef struct
+{
+    unsigned char addr[16];
+    uint16_t port;
+    uint64_t services;
+    int32_t protocol_version;
+    int32_t start_height;
+    uint32_t rtt_ms;
+    uint32_t addr_count;
+    uint8_t user_agent_len;
+} crawl_snapshot_record;
+#pragma pack(pop)
+
+// State of the crawler, guarded by the crawl mutex
+static pthread_mutex_t crawl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char* snapshot_filename = NULL;
+static bool crawl_running = false;
+static bool crawl_stop_requested = false;
+static int crawl_concurrency = 0;
+static size_t crawl_max_nodes = 0;
+static uint64_t crawl_start_ms = 0;
+static uint64_t crawl_end_ms = 0;
+static time_t crawl_start_time = 0;
+
+// Addresses waiting to be probed, a queue growing by doubling
+static Peer* frontier = NULL;
+static size_t frontier_head = 0;
+static size_t frontier_count = 0;
+static size_t frontier_capacity = 0;
+
+// Open-addressing set of the addresses queued or probed, kept under half full
+static seen_slot* seen_set = NULL;
+static size_t seen_set_size = 0;
+static size_t seen_count = 0;
+
+// Probes in flight and the results of the finished ones
+static crawl_probe* probes = NULL;
+static int probes_in_flight = 0;
+static size_t probed_count = 0;
+static crawl_node* results = NULL;
+static size_t result_count = 0;
+static size_t result_capacity = 0;
+static uint64_t addresses_received = 0;
+
+static void fill_probes();
+
+/**
+ * hash_seen_key:
+ *   FNV-1a hash of the address and port.
+ */
+static size_t hash_seen_key(const unsigned char addr[16], uint16_t port)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < 16; ++i)
+        hash = (hash ^ addr[i]) * 1099511628211ULL;
+    hash = (hash ^ (port & 0xFF)) * 1099511628211ULL;
+    hash = (hash ^ (port >> 8)) * 1099511628211ULL;
+    return (size_t)hash;
+}
+
+/**
+ * find_seen_slot:
+ *   Find the slot holding the address, or the free slot ending its probe sequence.
+ */
+static size_t find_seen_slot(const unsigned char addr[16], uint16_t port)
+{
+    size_t mask = seen_set_size - 1;
+    size_t i = hash_seen_key(addr, port) & mask;
+    while (seen_set[i].used && (seen_set[i].port != port || memcmp(seen_set[i].addr, addr, 16) != 0))
+        i = (i + 1) & mask;
+    return i;
+}
+
+/**
+ * mark_seen:
+ *   Add the address to the set of seen addresses, growing it when half full.
+ *   Returns true if the address was not seen before, false if it was or memory is exhausted.
+ */
+static bool mark_seen(const Peer* peer)
+{
+    if ((seen_count + 1) * 2 > seen_set_size)
+    {
+        size_t new_size = seen_set_size == 0 ? CRAWL_SEEN_INITIAL_SIZE : seen_set_size * 2;
+        seen_slot* new_set = (seen_slot*)calloc(new_size, sizeof(seen_slot));
+        if (new_set == NULL)
+            return false;
+        seen_slot* old_set = seen_set;
+        size_t old_size = seen_set_size;
+        seen_set = new_set;
+        seen_set_size = new_size;
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            if (old_set[i].used)
+                seen_set[find_seen_slot(old_set[i].addr, old_set[i].port)] = old_set[i];
+        }
+        free(old_set);
+    }
+    size_t slot = find_seen_slot(peer->addr, peer->port);
+    if (seen_set[slot].used)
+        return false;
+    memcpy(seen_set[slot].addr, peer->addr, 16);
+    seen_set[slot].port = peer->port;
+    seen_set[slot].used = true;
+    seen_count++;
+    return true;
+}
+
+/**
+ * push_frontier:
+ *   Queue the address for probing unless it was seen or the crawl has enough addresses to reach
+ *   its limit. Must be called with the crawl mutex held.
+ */
+static void push_frontier(const Peer* peer)
+{
+    if (probed_count + frontier_count >= crawl_max_nodes || !mark_seen(peer))
+        return;
+    if (frontier_head + frontier_count == frontier_capacity)
+    {
+        // Reuse the space of the probed addresses before growing
+        if (frontier_head > 0)
+        {
+            memmove(frontier, frontier + frontier_head, frontier_count * sizeof(Peer));
+            frontier_head = 0;
+        }
+        if (frontier_count == frontier_capacity)
+        {
+            size_t new_capacity = frontier_capacity == 0 ? 1024 : frontier_capacity * 2;
+            Peer* new_frontier = (Peer*)realloc(frontier, new_capacity * sizeof(Peer));
+            if (new_frontier == NULL)
+                return;
+            frontier = new_frontier;
+            frontier_capacity = new_capacity;
+        }
+    }
+    frontier[frontier_head + frontier_count++] = *peer;
+}
+
+/**
+ * parse_version:
+ *   Store the services, protocol version, user agent and start height of the 'version' payload
+ *   in the node. Returns true if successful, false if the payload is truncated.
+ */
+static bool parse_version(const unsigned char* payload, size_t payload_len, crawl_node* node)
+{
+    // version, services, timestamp, addr_recv, addr_from and nonce
+    if (payload_len < 80)
+        return false;
+    memcpy(&node->protocol_version, payload, 4);
+    memcpy(&node->services, payload + 4, 8);
+    size_t offset = 80;
+    uint64_t user_agent_len = 0;
+    if (!read_compact_size(payload, payload_len, &offset, &user_agent_len) ||
+        user_agent_len > payload_len - offset)
+        return false;
+    size_t kept_len = user_agent_len < CRAWL_MAX_USER_AGENT_LEN ? (size_t)user_agent_len : CRAWL_MAX_USER_AGENT_LEN;
+    memcpy(node->user_agent, payload + offset, kept_len);
+    node->user_agent[kept_len] = '\0';
+    offset += user_agent_len;
+    if (payload_len - offset >= 4)
+        memcpy(&node->start_height, payload + offset, 4);
+    return true;
+}
+
+/**
+ * is_crawlable:
+ *   Check if the address is a publicly routable IPv4 address, outside the unspecified, private,
+ *   loopback, link-local, carrier-grade NAT and multicast or reserved prefixes.
+ */
+static bool is_crawlable(const unsigned char addr[16])
+{
+    if (!IN6_IS_ADDR_V4MAPPED((const struct in6_addr*)addr))
+        return false;
+    const unsigned char* ipv4 = addr + 12;
+    return ipv4[0] != 0 && ipv4[0] != 10 && ipv4[0] != 127 && ipv4[0] < 224 &&
+        !(ipv4[0] == 100 && ipv4[1] >= 64 && ipv4[1] <= 127) &&
+        !(ipv4[0] == 169 && ipv4[1] == 254) &&
+        !(ipv4[0] == 172 && ipv4[1] >= 16 && ipv4[1] <= 31) &&
+        !(ipv4[0] == 192 && ipv4[1] == 168);
+}
+
+/**
+ * parse_addr:
+ *   Queue the public IPv4 addresses of the 'addr' payload not seen yet and record them in the
+ *   address manager with the probed node as their source.
+ *   Returns the number of addresses in the payload.
+ */
+static size_t parse_addr(crawl_probe* probe, const unsigned char* payload, size_t payload_len)
+{
+    size_t offset = 0;
+    uint64_t count = 0;
+    if (!read_compact_size(payload, payload_len, &offset, &count) || count > MAX_ADDR_COUNT)
+        return 0;
+    size_t parsed = 0;
+    for (; parsed < count && payload_len - offset >= ADDR_ENTRY_SIZE; ++parsed)
+    {
+        // Timestamp and services are little-endian, the port is big-endian
+        const unsigned char* entry = payload + offset;
+        offset += ADDR_ENTRY_SIZE;
+        Peer peer;
+        memset(&peer, 0, sizeof(peer));
+        peer.timestamp = (uint32_t)entry[0] | (uint32_t)entry[1] << 8 | (uint32_t)entry[2] << 16 |
+            (uint32_t)entry[3] << 24;
+        for (int j = 7; j >= 0; --j)
+            peer.services = peer.services << 8 | entry[4 + j];
+        memcpy(peer.addr, entry + 12, 16);
+        peer.port = (uint16_t)(entry[28] << 8 | entry[29]);
+
+        if (peer.port == 0 || !is_crawlable(peer.addr))
+            continue;
+        addrman_add(&peer, probe->node.addr);
+        push_frontier(&peer);
+    }
+    addresses_received += parsed;
+    return parsed;
+}
+
+/**
+ * add_result:
+ *   Append the node to the results, growing them by doubling. Must be called with the crawl
+ *   mutex held.
+ */
+static void add_result(const crawl_node* node)
+{
+    if (result_count == result_capacity)
+    {
+        size_t new_capacity = result_capacity == 0 ? 1024 : result_capacity * 2;
+        crawl_node* new_results = (crawl_node*)realloc(results, new_capacity * sizeof(crawl_node));
+        if (new_results == NULL)
+            return;
+        results = new_results;
+        result_capacity = new_capacity;
+    }
+    results[result_count++] = *node;
+}
+
+/**
+ * finish_probe:
+ *   Close the probe and keep its result if the node sent its 'version'. Must be called with the
+ *   crawl mutex held on the event loop thread.
+ */
+static void finish_probe(crawl_probe* probe, const char* reason)
+{
+    for (crawl_probe** it = &probes; *it != NULL; it = &(*it)->next)
+    {
+        if (*it == probe)
+        {
+            *it = probe->next;
+            break;
+        }
+    }
+    probes_in_flight--;
+    if (probe->socket_fd >= 0)
+    {
+        event_loop_remove(probe->socket_fd);
+        close(probe->socket_fd);
+    }
+    free_message_buffer(&probe->recv_buffer);
+
+    if (probe->state == PROBE_GETADDR)
+        add_result(&probe->node);
+    else
+        log_message(LOG_DEBUG, BITLAB_LOG, __FILE__, "Crawl probe of %s:%u failed: %s",
+            probe->ip_address, probe->node.port, reason);
+    free(probe);
+}
+
+/**
+ * send_probe_message:
+ *   Build the message and send it on the socket of the probe, the small messages of a probe fit
+ *   in the send buffer. Returns 0 if successful, -1 otherwise.
+ */
+static int send_probe_message(crawl_probe* probe, const char* command, const unsigned char* payload,
+    size_t payload_len)
+{
+    unsigned char msg[256];
+    size_t msg_len = build_message(msg, sizeof(msg), command, payload, payload_len);
+    if (msg_len == 0 || send(probe->socket_fd, msg, msg_len, MSG_NOSIGNAL) != (ssize_t)msg_len)
+        return -1;
+    return 0;
+}
+
+/**
+ * handle_probe_message:
+ *   Advance the probe with the message of the node. Returns true if the probe is done.
+ */
+static bool handle_probe_message(crawl_probe* probe, const message_view* view)
+{
+    if (view->command == COMMAND_VERSION && probe->state == PROBE_HANDSHAKE)
+    {
+        probe->node.rtt_ms = (uint32_t)(get_monotonic_ms() - probe->version_sent_ms);
+        if (!parse_version(view->payload, view->payload_len, &probe->node))
+            return true;
+        probe->state = PROBE_GETADDR;
+        if (send_probe_message(probe, "verack", NULL, 0) < 0 ||
+            send_probe_message(probe, "getaddr", NULL, 0) < 0)
+            return true;
+        uint64_t addr_deadline_ms = get_monotonic_ms() + CRAWL_ADDR_TIMEOUT_MS;
+        if (addr_deadline_ms < probe->deadline_ms)
+            probe->deadline_ms = addr_deadline_ms;
+    }
+    else if (view->command == COMMAND_ADDR && probe->state == PROBE_GETADDR)
+    {
+        // A single address is the node announcing itself, the answer to 'getaddr' is longer
+        size_t count = parse_addr(probe, view->payload, view->payload_len);
+        probe->node.addr_count += (uint32_t)count;
+        return count > 1;
+    }
+    return false;
+}
+
+/**
+ * handle_probe_event:
+ *   Event loop callback advancing the probe: finishing the connect, sending 'version' and
+ *   handling the messages of the node.
+ */
+static void handle_probe_event(int fd, uint32_t events, void* ctx)
+{
+    crawl_probe* probe = (crawl_probe*)ctx;
+    pthread_mutex_lock(&crawl_mutex);
+    if (probe->state == PROBE_CONNECTING)
+    {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+            error = errno;
+        if (error != 0 || !(events & EPOLLOUT))
+        {
+            if (error != 0)
+                finish_probe(probe, strerror(error));
+            pthread_mutex_unlock(&crawl_mutex);
+            fill_probes();
+            return;
+        }
+
+        unsigned char version_payload[200];
+        size_t version_payload_len = build_version_payload(version_payload, sizeof(version_payload));
+        probe->version_sent_ms = get_monotonic_ms();
+        if (send_probe_message(probe, "version", version_payload, version_payload_len) < 0)
+            finish_probe(probe, "sending 'version' failed");
+        else
+        {
+            probe->state = PROBE_HANDSHAKE;
+            event_loop_modify(fd, EPOLLIN);
+        }
+        pthread_mutex_unlock(&crawl_mutex);
+        fill_probes();
+        return;
+    }
+
+    bool done = false;
+    const char* reason = "connection closed by node";
+    ssize_t bytes_received = message_buffer_recv(&probe->recv_buffer, fd);
+    if (bytes_received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        done = true;
+        reason = strerror(errno);
+    }
+    else if (bytes_received == 0)
+        done = true;
+
+    // Messages received before the connection was closed are still handled
+    message_view view;
+    message_status status;
+    while (!done && (status = message_buffer_next(&probe->recv_buffer, &view)) != MESSAGE_INCOMPLETE)
+    {
+        if (status == MESSAGE_INVALID)
+        {
+            done = true;
+            reason = "invalid message stream";
+        }
+        else if (status == MESSAGE_COMPLETE && handle_probe_message(probe, &view))
+        {
+            done = true;
+            reason = "done";
+        }
+    }
+    if (done)
+        finish_probe(probe, reason);
+    pthread_mutex_unlock(&crawl_mutex);
+    if (done)
+        fill_probes();
+}
+
+/**
+ * start_probe:
+ *   Start the non-blocking connect to the node and hand the probe over to the event loop.
+ *   Returns false if no socket is available, the address then goes back to the frontier.
+ *   Must be called with the crawl mutex held on the event loop thread.
+ */
+static bool start_probe(const Peer* peer)
+{
+    crawl_probe* probe = (crawl_probe*)calloc(1, sizeof(crawl_probe));
+    if (probe == NULL)
+        return false;
+    memcpy(probe->node.addr, peer->addr, 16);
+    probe->node.port = peer->port;
+    format_peer_ip(peer, probe->ip_address, sizeof(probe->ip_address));
+    probe->state = PROBE_CONNECTING;
+    probe->deadline_ms = get_monotonic_ms() + CRAWL_PROBE_TIMEOUT_MS;
+    probe->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (probe->socket_fd < 0 || init_message_buffer(&probe->recv_buffer) != 0)
+    {
+        if (probe->socket_fd >= 0)
+            close(probe->socket_fd);
+        free(probe);
+        return false;
+    }
+    probe->next = probes;
+    probes = probe;
+    probes_in_flight++;
+    probed_count++;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(peer->port);
+    memcpy(&addr.sin_addr, peer->addr + 12, 4);
+    if (set_nonblocking(probe->socket_fd, 1) < 0 ||
+        (connect(probe->socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS))
+        finish_probe(probe, strerror(errno));
+    else if (event_loop_add(probe->socket_fd, EPOLLOUT, handle_probe_event, probe) < 0)
+        finish_probe(probe, "event loop registration failed");
+    return true;
+}
+
+/**
+ * write_snapshot:
+ *   Write the reachable nodes to the snapshot file, replacing it atomically.
+ *   Returns 0 if successful, -1 otherwise. Must be called with the crawl mutex held.
+ */
+static int write_snapshot()
+{
+    char tmp_filename[512];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", snapshot_filename);
+    FILE* file = fopen(tmp_filename, "wb");
+    if (file == NULL)
+        return -1;
+    crawl_snapshot_header header;
+    header.magic = CRAWL_SNAPSHOT_MAGIC;
+    header.version = CRAWL_SNAPSHOT_VERSION;
+    header.start_time = (uint64_t)crawl_start_time;
+    header.duration_ms = (uint32_t)(crawl_end_ms - crawl_start_ms);
+    header.probed = (uint32_t)probed_count;
+    header.count = (uint32_t)result_count;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; ok && i < result_count; ++i)
+    {
+        const crawl_node* node = &results[i];
+        crawl_snapshot_record record;
+        memcpy(record.addr, node->addr, 16);
+        record.port = node->port;
+        record.services = node->services;
+        record.protocol_version = node->protocol_version;
+        record.start_height = node->start_height;
+        record.rtt_ms = node->rtt_ms;
+        record.addr_count = node->addr_count;
+        record.user_agent_len = (uint8_t)strlen(node->user_agent);
+        ok = fwrite(&record, sizeof(record), 1, file) == 1 &&
+            fwrite(node->user_agent, 1, record.user_agent_len, file) == record.user_agent_len;
+    }
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    if (fclose(file) != 0 || !ok || rename(tmp_filename, snapshot_filename) != 0)
+    {
+        unlink(tmp_filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * finish_crawl:
+ *   End the crawl once no probe is in flight and write the snapshot. Must be called with the
+ *   crawl mutex held.
+ */
+static void finish_crawl()
+{
+    crawl_running = false;
+    crawl_end_ms = get_monotonic_ms();
+    frontier_head = 0;
+    frontier_count = 0;
+    uint64_t duration_ms = crawl_end_ms - crawl_start_ms;
+    if (write_snapshot() < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to write crawl snapshot %s: %s",
+            snapshot_filename, strerror(errno));
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__,
+        "Crawl finished in %llu ms: %zu reachable of %zu probed, %llu addresses received",
+        (unsigned long long)duration_ms, result_count, probed_count, (unsigned long long)addresses_received);
+    guarded_print_line("Crawl finished in %llu s: %zu reachable of %zu probed nodes, snapshot saved to %s",
+        (unsigned long long)(duration_ms / 1000), result_count, probed_count, snapshot_filename);
+}
+
+/**
+ * fill_probes:
+ *   Start probes from the frontier up to the concurrency and end the crawl once nothing is left.
+ *   Must be called on the event loop thread.
+ */
+static void fill_probes()
+{
+    pthread_mutex_lock(&crawl_mutex);
+    while (crawl_running && !crawl_stop_requested && probes_in_flight < crawl_concurrency &&
+        frontier_count > 0 && probed_count < crawl_max_nodes)
+    {
+        Peer peer = frontier[frontier_head];
+        if (!start_probe(&peer))
+            break;
+        frontier_head++;
+        frontier_count--;
+    }
+    if (crawl_running && probes_in_flight == 0 &&
+        (crawl_stop_requested || frontier_count == 0 || probed_count >= crawl_max_nodes))
+        finish_crawl();
+    pthread_mutex_unlock(&crawl_mutex);
+}
+
+/**
+ * crawl_timer:
+ *   Event loop timer ending the probes past their deadline, or all of them once the crawl is
+ *   stopped, and starting new ones.
+ */
+static void crawl_timer(void* ctx)
+{
+    (void)ctx;
+    pthread_mutex_lock(&crawl_mutex);
+    uint64_t now_ms = get_monotonic_ms();
+    crawl_probe* probe = probes;
+    while (probe != NULL)
+    {
+        crawl_probe* next = probe->next;
+        if (crawl_stop_requested || probe->deadline_ms <= now_ms)
+            finish_probe(probe, crawl_stop_requested ? "crawl stopped" : "timed out");
+        probe = next;
+    }
+    pthread_mutex_unlock(&crawl_mutex);
+    fill_probes();
+}
+
+void init_crawler(const char* filename)
+{
+    pthread_mutex_lock(&crawl_mutex);
+    snapshot_filename = strdup(filename);
+    pthread_mutex_unlock(&crawl_mutex);
+    if (event_loop_add_timer(crawl_timer, NULL, CRAWL_TIMER_INTERVAL_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register crawl timer");
+}
+
+void free_crawler()
+{
+    // The event loop is stopped, the probes left are closed here
+    pthread_mutex_lock(&crawl_mutex);
+    while (probes != NULL)
+        finish_probe(probes, "exiting");
+    crawl_running = false;
+    free(frontier);
+    free(seen_set);
+    free(results);
+    free(snapshot_filename);
+    frontier = NULL;
+    seen_set = NULL;
+    results = NULL;
+    snapshot_filename = NULL;
+    frontier_count = frontier_capacity = frontier_head = 0;
+    seen_count = seen_set_size = 0;
+    result_count = result_capacity = 0;
+    pthread_mutex_unlock(&crawl_mutex);
+}
+
+int start_crawl(int concurrency, int max_nodes)
+{
+    pthread_mutex_lock(&crawl_mutex);
+    if (crawl_running || snapshot_filename == NULL)
+    {
+        pthread_mutex_unlock(&crawl_mutex);
+        guarded_print_line("[Error] A crawl is already running");
+        return -1;
+    }
+    crawl_concurrency = concurrency;
+    crawl_max_nodes = (size_t)max_nodes;
+    crawl_stop_requested = false;
+    frontier_head = 0;
+    frontier_count = 0;
+    seen_count = 0;
+    if (seen_set != NULL)
+        memset(seen_set, 0, seen_set_size * sizeof(seen_slot));
+    result_count = 0;
+    probed_count = 0;
+    addresses_received = 0;
+
+    // The known addresses seed the walk, the best of the address manager first
+    size_t seed_max = (size_t)max_nodes < MAX_PEERS ? (size_t)max_nodes : MAX_PEERS;
+    Peer* seeds = (Peer*)malloc(seed_max * sizeof(Peer));
+    size_t seed_count = 0;
+    if (seeds != NULL)
+    {
+        seed_count = addrman_get_addresses(seeds, seed_max);
+        seed_count += get_peers_from_queue(seeds + seed_count, seed_max - seed_count);
+    }
+    for (size_t i = 0; i < seed_count; ++i)
+    {
+        if (is_crawlable(seeds[i].addr))
+            push_frontier(&seeds[i]);
+    }
+    free(seeds);
+    if (frontier_count == 0)
+    {
+        pthread_mutex_unlock(&crawl_mutex);
+        guarded_print_line("[Error] No IPv4 addresses to start the crawl from, run peerdiscovery first");
+        return -1;
+    }
+
+    crawl_running = true;
+    crawl_start_ms = get_monotonic_ms();
+    crawl_start_time = time(NULL);
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Crawl started from %zu addresses, %d probes in flight",
+        frontier_count, concurrency);
+    pthread_mutex_unlock(&crawl_mutex);
+    event_loop_wakeup();
+    return 0;
+}
+
+void stop_crawl()
+{
+    pthread_mutex_lock(&crawl_mutex);
+    if (crawl_running)
+        crawl_stop_requested = true;
+    pthread_mutex_unlock(&crawl_mutex);
+}
+
+bool is_crawl_running()
+{
+    pthread_mutex_lock(&crawl_mutex);
+    bool running = crawl_running;
+    pthread_mutex_unlock(&crawl_mutex);
+    return running;
+}
+
+void print_crawl_status()
+{
+    pthread_mutex_lock(&crawl_mutex);
+    if (crawl_running)
+        guarded_print_line("Crawl running for %llu s: %zu probed, %zu reachable, %d in flight, %zu queued, %llu addresses received",
+            (unsigned long long)((get_monotonic_ms() - crawl_start_ms) / 1000), probed_count, result_count,
+            probes_in_flight, frontier_count, (unsigned long long)addresses_received);
+    else if (crawl_start_ms != 0)
+        guarded_print_line("Last crawl: %zu reachable of %zu probed nodes in %llu s, snapshot %s", result_count,
+            probed_count, (unsigned long long)((crawl_end_ms - crawl_start_ms) / 1000), snapshot_filename);
+    else
+        guarded_print_line("No crawl was run");
+    pthread_mutex_unlock(&crawl_mutex);
+}
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "dns.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "utils.h"
+
+/**
+ * The lookups of one call, shared with the lookup threads which may outlive the call.
+ *
+ * @param mutex The mutex guarding the batch.
+ * @param cond The condition signaled when a lookup finishes, using the monotonic clock.
+ * @param pending The number of lookups still running.
+ * @param refs The number of owners: the caller and every running lookup thread.
+ * @param results The results of the lookups.
+ */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t pending;
+    size_t refs;
+    dns_lookup_result* results;
+} dns_batch;
+
+/**
+ * The lookup of one domain of the batch.
+ *
+ * @param batch The batch of the lookup.
+ * @param index The index of the domain in the batch.
+ */
+typedef struct
+{
+    dns_batch* batch;
+    size_t index;
+} dns_job;
+
+/**
+ * release_batch:
+ *   Drop one reference to the batch, freeing it with the last one.
+ */
+static void release_batch(dns_batch* batch)
+{
+    pthread_mutex_lock(&batch->mutex);
+    bool last = --batch->refs == 0;
+    pthread_mutex_unlock(&batch->mutex);
+    if (!last)
+        return;
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->mutex);
+    free(batch->results);
+    free(batch);
+}
+
+/**
+ * resolve_domain:
+ *   Resolve the IPv4 addresses of the domain with the blocking getaddrinfo. Unspecified
+ *   addresses and duplicates are skipped.
+ */
+static void resolve_domain(dns_lookup_result* result)
+{
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int status = getaddrinfo(result->domain, NULL, &hints, &res);
+    if (status != 0)
+    {
+        result->status = DNS_LOOKUP_FAILED;
+        snprintf(result->error, sizeof(result->error), "%s", gai_strerror(status));
+        return;
+    }
+
+    result->count = 0;
+    for (struct addrinfo* p = res; p != NULL && result->count < DNS_MAX_ADDRESSES; p = p->ai_next)
+    {
+        if (p->ai_family != AF_INET)
+            continue;
+        const struct sockaddr_in* ipv4 = (const struct sockaddr_in*)p->ai_addr;
+        if (ipv4->sin_addr.s_addr == INADDR_ANY)
+            continue;
+        unsigned char addr[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+        memcpy(addr + 12, &ipv4->sin_addr, 4);
+        bool known = false;
+        for (size_t i = 0; i < result->count && !known; ++i)
+            known = memcmp(result->addresses[i], addr, 16) == 0;
+        if (!known)
+            memcpy(result->addresses[result->count++], addr, 16);
+    }
+    freeaddrinfo(res);
+    result->status = DNS_LOOKUP_OK;
+}
+
+/**
+ * handle_dns_lookup:
+ *   Lookup thread resolving one domain and storing the result in the batch.
+ */
+static void* handle_dns_lookup(void* arg)
+{
+    dns_job* job = (dns_job*)arg;
+    dns_batch* batch = job->batch;
+    size_t index = job->index;
+    free(job);
+
+    // The domain is written before the thread starts and never changed
+    dns_lookup_result* result = (dns_lookup_result*)calloc(1, sizeof(dns_lookup_result));
+    if (result != NULL)
+    {
+        memcpy(result->domain, batch->results[index].domain, sizeof(result->domain));
+        resolve_domain(result);
+    }
+
+    pthread_mutex_lock(&batch->mutex);
+    if (result != NULL)
+        batch->results[index] = *result;
+    else
+    {
+        batch->results[index].status = DNS_LOOKUP_FAILED;
+        snprintf(batch->results[index].error, sizeof(batch->results[index].error), "out of memory");
+    }
+    batch->pending--;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+    free(result);
+    release_batch(batch);
+    return NULL;
+}
+
+/**
+ * start_lookup:
+ *   Start the detached lookup thread of the domain of the batch.
+ *   Returns 0 if successful, the error number otherwise.
+ */
+static int start_lookup(dns_batch* batch, size_t index)
+{
+    dns_job* job = (dns_job*)malloc(sizeof(dns_job));
+    if (job == NULL)
+        return ENOMEM;
+    job->batch = batch;
+    job->index = index;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int result = pthread_create(&thread, &attr, handle_dns_lookup, job);
+    pthread_attr_destroy(&attr);
+    if (result != 0)
+        free(job);
+    return result;
+}
+
+size_t lookup_domains(const char* const* domains, size_t domain_count, int timeout_ms,
+    dns_lookup_result* results)
+{
+    if (domain_count == 0)
+        return 0;
+    dns_batch* batch = (dns_batch*)calloc(1, sizeof(dns_batch));
+    dns_lookup_result* batch_results = (dns_lookup_result*)calloc(domain_count, sizeof(dns_lookup_result));
+    if (batch == NULL || batch_results == NULL)
+    {
+        free(batch);
+        free(batch_results);
+        for (size_t i = 0; i < domain_count; ++i)
+        {
+            memset(&results[i], 0, sizeof(results[i]));
+            snprintf(results[i].domain, sizeof(results[i].domain), "%s", domains[i]);
+            results[i].status = DNS_LOOKUP_FAILED;
+            snprintf(results[i].error, sizeof(results[i].error), "out of memory");
+        }
+        return 0;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&batch->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&batch->mutex, NULL);
+    batch->results = batch_results;
+    batch->refs = 1;
+
+    // Lookups not finished by the deadline keep the timed out status
+    pthread_mutex_lock(&batch->mutex);
+    for (size_t i = 0; i < domain_count; ++i)
+    {
+        snprintf(batch_results[i].domain, sizeof(batch_results[i].domain), "%s", domains[i]);
+        batch_results[i].status = DNS_LOOKUP_TIMED_OUT;
+        snprintf(batch_results[i].error, sizeof(batch_results[i].error), "no answer within %d ms", timeout_ms);
+        int error = start_lookup(batch, i);
+        if (error == 0)
+        {
+            batch->pending++;
+            batch->refs++;
+        }
+        else
+        {
+            batch_results[i].status = DNS_LOOKUP_FAILED;
+            snprintf(batch_results[i].error, sizeof(batch_results[i].error), "%s", strerror(error));
+        }
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (batch->pending > 0)
+    {
+        if (pthread_cond_timedwait(&batch->cond, &batch->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    size_t resolved = 0;
+    for (size_t i = 0; i < domain_count; ++i)
+    {
+        results[i] = batch_results[i];
+        if (results[i].status == DNS_LOOKUP_OK && results[i].count > 0)
+            resolved++;
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    release_batch(batch);
+    return resolved;
+}
+
+const char* get_dns_lookup_status_name(dns_lookup_status status)
+{
+    switch (status)
+    {
+    case DNS_LOOKUP_OK:
+        return "ok";
+    case DNS_LOOKUP_FAILED:
+        return "failed";
+    case DNS_LOOKUP_TIMED_OUT:
+        return "timed out";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "event_loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "state.h"
+#include "utils.h"
+
+/**
+ * The registered file descriptor handler. The generation is bumped on every registration, so
+ * events fetched for a descriptor that was closed and reused in the meantime are discarded.
+ *
+ * @param callback The callback invoked when the descriptor becomes ready.
+ * @param ctx The context passed to the callback.
+ * @param generation The registration generation of the descriptor.
+ */
+typedef struct
+{
+    event_callback callback;
+    void* ctx;
+    uint32_t generation;
+} event_handler;
+
+/**
+ * The periodic timer.
+ *
+ * @param callback The callback invoked when the timer fires.
+ * @param ctx The context passed to the callback.
+ * @param interval_ms The interval of the timer in milliseconds.
+ * @param next_fire_ms The monotonic time of the next firing.
+ */
+typedef struct
+{
+    timer_callback callback;
+    void* ctx;
+    int interval_ms;
+    uint64_t next_fire_ms;
+} event_timer;
+
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
+static pthread_t loop_thread;
+static volatile int loop_running = 0;
+
+static event_handler handlers[EVENT_LOOP_MAX_FDS];
+static pthread_mutex_t handlers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The task posted to the event loop thread.
+ *
+ * @param callback The callback run on the event loop thread.
+ * @param ctx The context passed to the callback.
+ */
+typedef struct
+{
+    timer_callback callback;
+    void* ctx;
+} event_task;
+
+static event_task tasks[EVENT_LOOP_MAX_TASKS];
+static size_t task_head = 0;
+static size_t task_count = 0;
+static pthread_mutex_t tasks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static event_timer timers[EVENT_LOOP_MAX_TIMERS];
+static int timer_count = 0;
+static pthread_mutex_t timers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t get_monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int set_nonblocking(int fd, int enabled)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+int init_event_loop()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        log_message(LOG_FATAL, BITLAB_LOG, __FILE__, "epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+    {
+        log_message(LOG_FATAL, BITLAB_LOG, __FILE__, "eventfd failed: %s", strerror(errno));
+        close(epoll_fd);
+        epoll_fd = -1;
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)wakeup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) < 0)
+    {
+        log_message(LOG_FATAL, BITLAB_LOG, __FILE__, "epoll_ctl on wakeup fd failed: %s", strerror(errno));
+        close(wakeup_fd);
+        close(epoll_fd);
+        wakeup_fd = -1;
+        epoll_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_add(int fd, uint32_t events, event_callback callback, void* ctx)
+{
+    if (epoll_fd < 0 || fd < 0 || fd >= EVENT_LOOP_MAX_FDS || callback == NULL)
+        return -1;
+
+    pthread_mutex_lock(&handlers_mutex);
+    handlers[fd].callback = callback;
+    handlers[fd].ctx = ctx;
+    handlers[fd].generation++;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = ((uint64_t)handlers[fd].generation << 32) | (uint32_t)fd;
+    int result = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (result < 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "epoll_ctl add of fd %d failed: %s", fd, strerror(errno));
+        handlers[fd].callback = NULL;
+        handlers[fd].ctx = NULL;
+    }
+    pthread_mutex_unlock(&handlers_mutex);
+    return result;
+}
+
+int event_loop_modify(int fd, uint32_t events)
+{
+    if (epoll_fd < 0 || fd < 0 || fd >= EVENT_LOOP_MAX_FDS)
+        return -1;
+
+    pthread_mutex_lock(&handlers_mutex);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = ((uint64_t)handlers[fd].generation << 32) | (uint32_t)fd;
+    int result = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    pthread_mutex_unlock(&handlers_mutex);
+    return result;
+}
+
+int event_loop_remove(int fd)
+{
+    if (epoll_fd < 0 || fd < 0 || fd >= EVENT_LOOP_MAX_FDS)
+        return -1;
+
+    pthread_mutex_lock(&handlers_mutex);
+    int result = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    handlers[fd].callback = NULL;
+    handlers[fd].ctx = NULL;
+    handlers[fd].generation++;
+    pthread_mutex_unlock(&handlers_mutex);
+    return result;
+}
+
+int event_loop_add_timer(timer_callback callback, void* ctx, int interval_ms)
+{
+    if (callback == NULL || interval_ms <= 0)
+        return -1;
+
+    pthread_mutex_lock(&timers_mutex);
+    if (timer_count >= EVENT_LOOP_MAX_TIMERS)
+    {
+        pthread_mutex_unlock(&timers_mutex);
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Too many event loop timers");
+        return -1;
+    }
+    timers[timer_count].callback = callback;
+    timers[timer_count].ctx = ctx;
+    timers[timer_count].interval_ms = interval_ms;
+    timers[timer_count].next_fire_ms = get_monotonic_ms() + interval_ms;
+    timer_count++;
+    pthread_mutex_unlock(&timers_mutex);
+    event_loop_wakeup();
+    return 0;
+}
+
+int event_loop_post(timer_callback callback, void* ctx)
+{
+    if (callback == NULL || !loop_running)
+        return -1;
+
+    pthread_mutex_lock(&tasks_mutex);
+    if (task_count >= EVENT_LOOP_MAX_TASKS)
+    {
+        pthread_mutex_unlock(&tasks_mutex);
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Too many event loop tasks");
+        return -1;
+    }
+    event_task* task = &tasks[(task_head + task_count) % EVENT_LOOP_MAX_TASKS];
+    task->callback = callback;
+    task->ctx = ctx;
+    task_count++;
+    pthread_mutex_unlock(&tasks_mutex);
+    event_loop_wakeup();
+    return 0;
+}
+
+void event_loop_wakeup()
+{
+    if (wakeup_fd < 0)
+        return;
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Event loop wakeup failed: %s", strerror(errno));
+}
+
+int is_event_loop_thread()
+{
+    return loop_running && pthread_equal(pthread_self(), loop_thread);
+}
+
+/**
+ * run_tasks:
+ *   Run the tasks posted so far, tasks posted by them run in the next iteration.
+ */
+static void run_tasks()
+{
+    pthread_mutex_lock(&tasks_mutex);
+    size_t count = task_count;
+    pthread_mutex_unlock(&tasks_mutex);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        pthread_mutex_lock(&tasks_mutex);
+        event_task task = tasks[task_head];
+        task_head = (task_head + 1) % EVENT_LOOP_MAX_TASKS;
+        task_count--;
+        pthread_mutex_unlock(&tasks_mutex);
+        task.callback(task.ctx);
+    }
+}
+
+/**
+ * run_timers:
+ *   Fire all due timers and return the number of milliseconds until the next one.
+ */
+static int run_timers()
+{
+    uint64_t now = get_monotonic_ms();
+    int wait_ms = EVENT_LOOP_MAX_WAIT_MS;
+
+    pthread_mutex_lock(&timers_mutex);
+    int count = timer_count;
+    pthread_mutex_unlock(&timers_mutex);
+
+    for (int i = 0; i < count; ++i)
+    {
+        event_timer* timer = &timers[i];
+        if (timer->next_fire_ms <= now)
+        {
+            timer->callback(timer->ctx);
+            now = get_monotonic_ms();
+            timer->next_fire_ms = now + timer->interval_ms;
+        }
+        uint64_t remaining = timer->next_fire_ms - now;
+        if (remaining < (uint64_t)wait_ms)
+            wait_ms = (int)remaining;
+    }
+    return wait_ms;
+}
+
+void* handle_event_loop(void* arg)
+{
+    loop_thread = pthread_self();
+    loop_running = 1;
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    while (!get_exit_flag())
+    {
+        run_tasks();
+        int wait_ms = run_timers();
+        int n = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, wait_ms);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = (int)(events[i].data.u64 & 0xFFFFFFFF);
+            uint32_t generation = (uint32_t)(events[i].data.u64 >> 32);
+
+            if (fd == wakeup_fd)
+            {
+                uint64_t value;
+                while (read(wakeup_fd, &value, sizeof(value)) > 0)
+                    ;
+                continue;
+            }
+
+            // Copy the handler out, so it may unregister itself from the callback
+            pthread_mutex_lock(&handlers_mutex);
+            event_callback callback = handlers[fd].callback;
+            void* ctx = handlers[fd].ctx;
+            int current = handlers[fd].generation == generation;
+            pthread_mutex_unlock(&handlers_mutex);
+
+            if (callback != NULL && current)
+                callback(fd, events[i].events, ctx);
+        }
+    }
+
+    loop_running = 0;
+    close(wakeup_fd);
+    close(epoll_fd);
+    wakeup_fd = -1;
+    epoll_fd = -1;
+    if (arg) {} // dummy code to avoid unused parameter warning
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Exiting event loop thread");
+    pthread_exit(NULL);
+}
@@ -0,0 +1,381 @@
+#include "hash.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <openssl/sha.h> // For SHA-256
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HASH_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// SHA-256 initial hash values
+static const uint32_t sha256_iv[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// SHA-256 round constants
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const char* backend_names[HASH_BACKEND_COUNT] =
+{
+    [HASH_BACKEND_OPENSSL] = "openssl",
+    [HASH_BACKEND_AVX2] = "avx2",
+    [HASH_BACKEND_SHANI] = "sha-ni",
+};
+
+static hash_backend selected_backend = HASH_BACKEND_OPENSSL;
+
+// Batches go through the AVX2 lanes, which beat one SHA-NI message at a time
+static int batch_avx2 = 0;
+
+/**
+ * load_be32:
+ *   Read the big-endian 32-bit word.
+ */
+static uint32_t load_be32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * store_be32:
+ *   Write the 32-bit word in big-endian order.
+ */
+static void store_be32(unsigned char* p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+/**
+ * pad_tail:
+ *   Copy the bytes after the last full block of the message to the buffer and append the SHA-256
+ *   padding. Returns the number of padded blocks, 1 or 2.
+ */
+static size_t pad_tail(unsigned char tail[128], const unsigned char* data, size_t len)
+{
+    size_t rest = len % 64;
+    size_t blocks = rest + 9 <= 64 ? 1 : 2;
+    memset(tail, 0, blocks * 64);
+    if (rest > 0)
+        memcpy(tail, data + len - rest, rest);
+    tail[rest] = 0x80;
+    uint64_t bits = (uint64_t)len * 8;
+    store_be32(tail + blocks * 64 - 8, (uint32_t)(bits >> 32));
+    store_be32(tail + blocks * 64 - 4, (uint32_t)bits);
+    return blocks;
+}
+
+/**
+ * double_sha256_openssl:
+ *   Two one-shot OpenSSL SHA-256 calls.
+ */
+static void double_sha256_openssl(const unsigned char* data, size_t len, unsigned char out[HASH_SIZE])
+{
+    unsigned char hash1[SHA256_DIGEST_LENGTH];
+    SHA256(data, len, hash1);
+    SHA256(hash1, SHA256_DIGEST_LENGTH, out);
+}
+
+#ifdef HASH_X86
+
+/**
+ * sha256_transform_shani:
+ *   Compress the 64-byte blocks into the state with the SHA extensions. The state is kept in the
+ *   ABEF/CDGH register layout expected by the sha256rnds2 instruction during the whole loop.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(uint32_t state[8], const unsigned char* blocks, size_t count)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+    while (count-- > 0)
+    {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msg[4];
+
+#pragma GCC unroll 16
+        for (int group = 0; group < 16; ++group)
+        {
+            __m128i w;
+            if (group < 4)
+            {
+                w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + group * 16)), byte_swap);
+            }
+            else
+            {
+                // W[t] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16] for 4 words at once
+                w = _mm_sha256msg1_epu32(msg[group & 3], msg[(group + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(group + 3) & 3], msg[(group + 2) & 3], 4));
+                w = _mm_sha256msg2_epu32(w, msg[(group + 3) & 3]);
+            }
+            msg[group & 3] = w;
+
+            __m128i wk = _mm_add_epi32(w, _mm_loadu_si128((const __m128i*)&sha256_k[group * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        blocks += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8); // EFGH
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+/**
+ * sha256_shani:
+ *   Calculate the SHA-256 of the message with the SHA extensions.
+ */
+static void sha256_shani(const unsigned char* data, size_t len, unsigned char out[HASH_SIZE])
+{
+    uint32_t state[8];
+    memcpy(state, sha256_iv, sizeof(state));
+
+    size_t full_blocks = len / 64;
+    if (full_blocks > 0)
+        sha256_transform_shani(state, data, full_blocks);
+
+    unsigned char tail[128];
+    size_t tail_blocks = pad_tail(tail, data, len);
+    sha256_transform_shani(state, tail, tail_blocks);
+
+    for (int i = 0; i < 8; ++i)
+        store_be32(out + i * 4, state[i]);
+}
+
+/**
+ * double_sha256_shani:
+ *   Calculate the double-SHA256 of the message with the SHA extensions.
+ */
+static void double_sha256_shani(const unsigned char* data, size_t len, unsigned char out[HASH_SIZE])
+{
+    unsigned char hash1[HASH_SIZE];
+    sha256_shani(data, len, hash1);
+    sha256_shani(hash1, HASH_SIZE, out);
+}
+
+#define ROTR_AVX2(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/**
+ * sha256_transform_avx2:
+ *   Compress one 64-byte block of 8 independent messages into their states. Every 32-bit lane of
+ *   the vectors belongs to a different message, the block words are already in host order.
+ */
+__attribute__((target("avx2")))
+static void sha256_transform_avx2(__m256i state[8], const __m256i block[16])
+{
+    __m256i w[64];
+    for (int t = 0; t < 16; ++t)
+        w[t] = block[t];
+    for (int t = 16; t < 64; ++t)
+    {
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR_AVX2(w[t - 15], 7),
+            ROTR_AVX2(w[t - 15], 18)), _mm256_srli_epi32(w[t - 15], 3));
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR_AVX2(w[t - 2], 17),
+            ROTR_AVX2(w[t - 2], 19)), _mm256_srli_epi32(w[t - 2], 10));
+        w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0), _mm256_add_epi32(w[t - 7], s1));
+    }
+
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+#pragma GCC unroll 8
+    for (int t = 0; t < 64; ++t)
+    {
+        __m256i big_s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR_AVX2(e, 6), ROTR_AVX2(e, 11)),
+            ROTR_AVX2(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, big_s1), _mm256_add_epi32(ch,
+            _mm256_add_epi32(w[t], _mm256_set1_epi32((int)sha256_k[t]))));
+        __m256i big_s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR_AVX2(a, 2), ROTR_AVX2(a, 13)),
+            ROTR_AVX2(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = _mm256_add_epi32(big_s0, maj);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(t1, t2);
+    }
+
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+    state[5] = _mm256_add_epi32(state[5], f);
+    state[6] = _mm256_add_epi32(state[6], g);
+    state[7] = _mm256_add_epi32(state[7], h);
+}
+
+/**
+ * double_sha256_8_avx2:
+ *   Calculate the double-SHA256 of 8 consecutive items of the same length in parallel. The second
+ *   hash takes the state words of the first one directly, as its single block is the digest.
+ */
+__attribute__((target("avx2")))
+static void double_sha256_8_avx2(const unsigned char* data, size_t item_len, unsigned char* out)
+{
+    unsigned char tails[HASH_AVX2_LANES][128];
+    size_t full_blocks = item_len / 64;
+    size_t tail_blocks = 0;
+    for (int lane = 0; lane < HASH_AVX2_LANES; ++lane)
+        tail_blocks = pad_tail(tails[lane], data + lane * item_len, item_len);
+
+    __m256i state[8];
+    __m256i block[16];
+    for (int i = 0; i < 8; ++i)
+        state[i] = _mm256_set1_epi32((int)sha256_iv[i]);
+
+    for (size_t b = 0; b < full_blocks + tail_blocks; ++b)
+    {
+        const unsigned char* p[HASH_AVX2_LANES];
+        for (int lane = 0; lane < HASH_AVX2_LANES; ++lane)
+        {
+            p[lane] = b < full_blocks ? data + lane * item_len + b * 64
+                : tails[lane] + (b - full_blocks) * 64;
+        }
+        for (int j = 0; j < 16; ++j)
+        {
+            block[j] = _mm256_setr_epi32((int)load_be32(p[0] + j * 4), (int)load_be32(p[1] + j * 4),
+                (int)load_be32(p[2] + j * 4), (int)load_be32(p[3] + j * 4),
+                (int)load_be32(p[4] + j * 4), (int)load_be32(p[5] + j * 4),
+                (int)load_be32(p[6] + j * 4), (int)load_be32(p[7] + j * 4));
+        }
+        sha256_transform_avx2(state, block);
+    }
+
+    for (int j = 0; j < 8; ++j)
+        block[j] = state[j];
+    block[8] = _mm256_set1_epi32((int)0x80000000U);
+    for (int j = 9; j < 15; ++j)
+        block[j] = _mm256_setzero_si256();
+    block[15] = _mm256_set1_epi32(HASH_SIZE * 8);
+    for (int i = 0; i < 8; ++i)
+        state[i] = _mm256_set1_epi32((int)sha256_iv[i]);
+    sha256_transform_avx2(state, block);
+
+    uint32_t words[8][HASH_AVX2_LANES];
+    for (int j = 0; j < 8; ++j)
+        _mm256_storeu_si256((__m256i*)words[j], state[j]);
+    for (int lane = 0; lane < HASH_AVX2_LANES; ++lane)
+    {
+        for (int j = 0; j < 8; ++j)
+            store_be32(out + lane * HASH_SIZE + j * 4, words[j][lane]);
+    }
+}
+
+#endif // HASH_X86
+
+int is_hash_backend_supported(hash_backend backend)
+{
+    switch (backend)
+    {
+    case HASH_BACKEND_OPENSSL:
+        return 1;
+#ifdef HASH_X86
+    case HASH_BACKEND_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    case HASH_BACKEND_SHANI:
+    {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+            return 0;
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+            return 0;
+        return (ebx & (1U << 29)) != 0; // SHA extensions
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+void init_hash()
+{
+    if (is_hash_backend_supported(HASH_BACKEND_SHANI))
+        selected_backend = HASH_BACKEND_SHANI;
+    else if (is_hash_backend_supported(HASH_BACKEND_AVX2))
+        selected_backend = HASH_BACKEND_AVX2;
+    else
+        selected_backend = HASH_BACKEND_OPENSSL;
+    batch_avx2 = selected_backend != HASH_BACKEND_OPENSSL && is_hash_backend_supported(HASH_BACKEND_AVX2);
+}
+
+int set_hash_backend(hash_backend backend)
+{
+    if (backend < 0 || backend >= HASH_BACKEND_COUNT || !is_hash_backend_supported(backend))
+        return -1;
+    selected_backend = backend;
+    batch_avx2 = backend != HASH_BACKEND_OPENSSL && is_hash_backend_supported(HASH_BACKEND_AVX2);
+    return 0;
+}
+
+hash_backend get_hash_backend()
+{
+    return selected_backend;
+}
+
+const char* get_hash_backend_name(hash_backend backend)
+{
+    if (backend < 0 || backend >= HASH_BACKEND_COUNT)
+        return "unknown";
+    return backend_names[backend];
+}
+
+void double_sha256(const unsigned char* data, size_t len, unsigned char out[HASH_SIZE])
+{
+#ifdef HASH_X86
+    if (selected_backend == HASH_BACKEND_SHANI)
+    {
+        double_sha256_shani(data, len, out);
+        return;
+    }
+#endif
+    double_sha256_openssl(data, len, out);
+}
+
+void double_sha256_many(const unsigned char* data, size_t item_len, size_t count, unsigned char* out)
+{
+    size_t i = 0;
+#ifdef HASH_X86
+    if (batch_avx2)
+    {
+        for (; i + HASH_AVX2_LANES <= count; i += HASH_AVX2_LANES)
+            double_sha256_8_avx2(data + i * item_len, item_len, out + i * HASH_SIZE);
+    }
+#endif
+    for (; i < count; ++i)
+        double_sha256(data + i * item_len, item_len, out + i * HASH_SIZE);
+}
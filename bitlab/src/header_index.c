@@ -0,0 +1,777 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and MAP_NORESERVE
+
+#include "header_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+
+// Number of headers hashed at once when verifying the headers file
+#define HEADER_LOAD_BATCH 2000
+
+// Magic number of the metadata file ("BLHI")
+#define HEADERS_META_MAGIC 0x49484c42
+
+// Compact form of the highest target allowed on mainnet
+#define POW_LIMIT_BITS 0x1d00ffff
+
+// Number of blocks between difficulty adjustments and the time they are expected to take
+#define RETARGET_INTERVAL 2016
+#define RETARGET_TIMESPAN (14 * 24 * 60 * 60)
+
+/**
+ * The metadata file written after every sync of the headers file.
+ *
+ * @param magic The magic number of the file.
+ * @param height The height of the tip synced to disk, the number of headers in the file.
+ * @param tip_hash The hash of the tip synced to disk.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t height;
+    unsigned char tip_hash[HASH_SIZE];
+} headers_meta;
+
+// Header of the Bitcoin mainnet genesis block
+static const unsigned char genesis_header[BLOCK_HEADER_SIZE] =
+{
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x3b, 0xa3, 0xed, 0xfd, 0x7a, 0x7b, 0x12, 0xb2, 0x7a, 0xc7, 0x2c, 0x3e,
+    0x67, 0x76, 0x8f, 0x61, 0x7f, 0xc8, 0x1b, 0xc3, 0x88, 0x8a, 0x51, 0x32, 0x3a, 0x9f, 0xb8, 0xaa,
+    0x4b, 0x1e, 0x5e, 0x4a, 0x29, 0xab, 0x5f, 0x49, 0xff, 0xff, 0x00, 0x1d, 0x1d, 0xac, 0x2b, 0x7c,
+};
+
+// Headers file holding the headers from height 1 on, mapped read-only into a reserved range
+static int headers_fd = -1;
+static unsigned char* map_base = NULL;
+static size_t map_len = 0;
+
+// Number of headers of the best chain including genesis and the hash of its tip. The hash of
+// every other block is the previous block hash of its successor, so it is not stored.
+static int header_count = 0;
+static unsigned char tip_hash[HASH_SIZE];
+
+// Open addressing table from block hash to height + 1, 0 marks an empty slot
+static int* height_table = NULL;
+static size_t height_table_size = 0;
+
+static char* headers_filename = NULL;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Number of headers synced to disk, guarded by the sync mutex
+static int synced_count = 0;
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * header_at:
+ *   Get the header at the given height. Must be called with the index lock held.
+ */
+static const unsigned char* header_at(int height)
+{
+    if (height == 0)
+        return genesis_header;
+    return map_base + (size_t)(height - 1) * BLOCK_HEADER_SIZE;
+}
+
+/**
+ * hash_at:
+ *   Get the hash of the block at the given height, the previous block hash of its successor.
+ *   Must be called with the index lock held.
+ */
+static const unsigned char* hash_at(int height)
+{
+    if (height == header_count - 1)
+        return tip_hash;
+    // The previous block hash follows the 4-byte version
+    return header_at(height + 1) + 4;
+}
+
+/**
+ * hash_slot:
+ *   Map the block hash to its first slot in the height table. The low bytes of block hashes are
+ *   uniformly distributed, so 8 of them are enough.
+ */
+static size_t hash_slot(const unsigned char hash[HASH_SIZE])
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (height_table_size - 1);
+}
+
+/**
+ * find_height:
+ *   Look the block hash up in the height table. Must be called with the index lock held.
+ *   Returns the height of the block or -1 if it is not known.
+ */
+static int find_height(const unsigned char hash[HASH_SIZE])
+{
+    if (height_table_size == 0)
+        return -1;
+    size_t slot = hash_slot(hash);
+    while (height_table[slot] != 0)
+    {
+        int height = height_table[slot] - 1;
+        if (memcmp(hash_at(height), hash, HASH_SIZE) == 0)
+            return height;
+        slot = (slot + 1) & (height_table_size - 1);
+    }
+    return -1;
+}
+
+/**
+ * insert_height:
+ *   Insert the block at the given height into the height table. Must be called with the index
+ *   lock held and free slots available.
+ */
+static void insert_height(int height)
+{
+    size_t slot = hash_slot(hash_at(height));
+    while (height_table[slot] != 0)
+        slot = (slot + 1) & (height_table_size - 1);
+    height_table[slot] = height + 1;
+}
+
+/**
+ * reserve_table:
+ *   Keep the height table at most half full with `count` blocks, rehashing the known blocks when
+ *   it grows. Must be called with the index write lock held. Returns 0 if successful, -1 otherwise.
+ */
+static int reserve_table(int count)
+{
+    if ((size_t)count * 2 <= height_table_size)
+        return 0;
+
+    size_t size = height_table_size > 0 ? height_table_size : HEADER_TABLE_INITIAL_SIZE;
+    while ((size_t)count * 2 > size)
+        size *= 2;
+    int* table = (int*)calloc(size, sizeof(int));
+    if (table == NULL)
+        return -1;
+    free(height_table);
+    height_table = table;
+    height_table_size = size;
+    for (int height = 0; height < header_count; ++height)
+        insert_height(height);
+    return 0;
+}
+
+/**
+ * map_headers:
+ *   Extend the mapping of the headers file to cover `len` bytes. Only the new chunks are mapped,
+ *   into the reserved range right after the existing ones, so mapped headers never move.
+ *   Returns 0 if successful, -1 otherwise.
+ */
+static int map_headers(size_t len)
+{
+    if (len <= map_len)
+        return 0;
+
+    size_t new_len = (len + HEADER_MAP_CHUNK - 1) / HEADER_MAP_CHUNK * HEADER_MAP_CHUNK;
+    if (new_len > HEADER_MAP_RESERVE)
+        return -1;
+    void* chunk = mmap(map_base + map_len, new_len - map_len, PROT_READ, MAP_SHARED | MAP_FIXED,
+        headers_fd, (off_t)map_len);
+    if (chunk == MAP_FAILED)
+        return -1;
+    map_len = new_len;
+    return 0;
+}
+
+/**
+ * extend_tip:
+ *   Make the header stored in the headers file at the next height the new tip.
+ *   Must be called with the index write lock held. Returns 0 if successful, -1 otherwise.
+ */
+static int extend_tip(const unsigned char hash[HASH_SIZE])
+{
+    if (reserve_table(header_count + 1) != 0)
+        return -1;
+    memcpy(tip_hash, hash, HASH_SIZE);
+    header_count++;
+    insert_height(header_count - 1);
+    return 0;
+}
+
+/**
+ * read_le32:
+ *   Read the little-endian 32-bit field of the header.
+ */
+static uint32_t read_le32(const unsigned char* p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * expand_target:
+ *   Decode the compact 'bits' into the little-endian target, the byte order of block hashes.
+ *   Returns 1 if the target is valid, 0 if it is negative, zero or overflowing.
+ */
+static int expand_target(uint32_t bits, unsigned char target[HASH_SIZE])
+{
+    int exponent = (int)(bits >> 24);
+    uint32_t mantissa = bits & 0x007fffff;
+    if ((bits & 0x00800000) != 0 || mantissa == 0)
+        return 0; // negative or zero target
+
+    // The mantissa fills the bytes below the exponent
+    memset(target, 0, HASH_SIZE);
+    for (int i = 0; i < 3; ++i)
+    {
+        int position = exponent - 3 + i;
+        unsigned char byte = (unsigned char)(mantissa >> (8 * i));
+        if (position >= HASH_SIZE && byte != 0)
+            return 0; // overflowing target
+        if (position >= 0 && position < HASH_SIZE)
+            target[position] = byte;
+    }
+    return 1;
+}
+
+/**
+ * compare_target:
+ *   Compare the little-endian 256-bit numbers. Returns a negative, zero or positive value as
+ *   memcmp does.
+ */
+static int compare_target(const unsigned char* a, const unsigned char* b)
+{
+    for (int i = HASH_SIZE - 1; i >= 0; --i)
+    {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * compact_target:
+ *   Encode the little-endian target into the compact 'bits', rounding it down to 3 bytes.
+ */
+static uint32_t compact_target(const unsigned char target[HASH_SIZE])
+{
+    int size = HASH_SIZE;
+    while (size > 0 && target[size - 1] == 0)
+        size--;
+    uint32_t mantissa = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        int position = size - 3 + i;
+        if (position >= 0)
+            mantissa |= (uint32_t)target[position] << (8 * i);
+    }
+
+    // The sign bit of the mantissa must stay clear
+    if (mantissa & 0x00800000)
+    {
+        mantissa >>= 8;
+        size++;
+    }
+    return mantissa | (uint32_t)size << 24;
+}
+
+/**
+ * retarget:
+ *   Compute the 'bits' of the first block of a difficulty period from the 'bits' of the last
+ *   block of the previous one and the time the previous period took, limited to a quarter and 4
+ *   times the expected time. The target never exceeds the proof of work limit.
+ */
+static uint32_t retarget(uint32_t bits, int64_t timespan)
+{
+    if (timespan < RETARGET_TIMESPAN / 4)
+        timespan = RETARGET_TIMESPAN / 4;
+    if (timespan > RETARGET_TIMESPAN * 4)
+        timespan = RETARGET_TIMESPAN * 4;
+
+    unsigned char limit[HASH_SIZE];
+    unsigned char target[HASH_SIZE];
+    expand_target(POW_LIMIT_BITS, limit);
+    if (!expand_target(bits, target))
+        return POW_LIMIT_BITS;
+
+    // Multiply by the timespan with 4 bytes of headroom, then divide from the top byte down
+    unsigned char product[HASH_SIZE + 4];
+    uint64_t carry = 0;
+    for (int i = 0; i < HASH_SIZE + 4; ++i)
+    {
+        carry += (i < HASH_SIZE ? target[i] : 0) * (uint64_t)timespan;
+        product[i] = (unsigned char)carry;
+        carry >>= 8;
+    }
+    uint64_t remainder = 0;
+    for (int i = HASH_SIZE + 3; i >= 0; --i)
+    {
+        remainder = remainder << 8 | product[i];
+        product[i] = (unsigned char)(remainder / RETARGET_TIMESPAN);
+        remainder %= RETARGET_TIMESPAN;
+    }
+
+    for (int i = HASH_SIZE; i < HASH_SIZE + 4; ++i)
+    {
+        if (product[i] != 0)
+            return POW_LIMIT_BITS;
+    }
+    if (compare_target(product, limit) > 0)
+        return POW_LIMIT_BITS;
+    return compact_target(product);
+}
+
+/**
+ * check_proof_of_work:
+ *   Check that the target encoded in the compact 'bits' of the header is within the proof of
+ *   work limit and that the block hash does not exceed it. Returns 1 if the proof of work is
+ *   valid, 0 otherwise.
+ */
+static int check_proof_of_work(const unsigned char* header, const unsigned char hash[HASH_SIZE])
+{
+    unsigned char limit[HASH_SIZE];
+    unsigned char target[HASH_SIZE];
+    expand_target(POW_LIMIT_BITS, limit);
+    if (!expand_target(read_le32(header + 72), target) || compare_target(target, limit) > 0)
+        return 0;
+    return compare_target(hash, target) <= 0;
+}
+
+/**
+ * chain_header_at:
+ *   Get the header at the given height, from the run of new headers starting at `run_height`
+ *   if it is not below it, from the headers file otherwise. A NULL run reads every header from
+ *   the file. Must be called with the index lock held.
+ */
+static const unsigned char* chain_header_at(int height, const unsigned char* run, int run_height)
+{
+    if (run == NULL || height < run_height)
+        return header_at(height);
+    return run + (size_t)(height - run_height) * BLOCK_HEADER_SIZE;
+}
+
+/**
+ * check_header:
+ *   Check that the 'bits' of the header at the given height are the ones required by the
+ *   difficulty adjustment of mainnet, so a chain cannot lower its difficulty, and that its hash
+ *   meets them. The headers below are read as chain_header_at does.
+ *   Returns 1 if the header is valid, 0 otherwise.
+ */
+static int check_header(int height, const unsigned char* run, int run_height,
+    const unsigned char hash[HASH_SIZE])
+{
+    const unsigned char* header = chain_header_at(height, run, run_height);
+    const unsigned char* prev = chain_header_at(height - 1, run, run_height);
+    uint32_t expected = read_le32(prev + 72);
+    if (height % RETARGET_INTERVAL == 0)
+    {
+        // The time from the first to the last block of the period, as mainnet has measured it
+        const unsigned char* first = chain_header_at(height - RETARGET_INTERVAL, run, run_height);
+        expected = retarget(expected, (int64_t)read_le32(prev + 68) - (int64_t)read_le32(first + 68));
+    }
+    return read_le32(header + 72) == expected && check_proof_of_work(header, hash);
+}
+
+/**
+ * meta_filename:
+ *   Build the name of the metadata file of the headers file.
+ */
+static void meta_filename(char* buffer, size_t size)
+{
+    snprintf(buffer, size, "%s%s", headers_filename, HEADERS_META_SUFFIX);
+}
+
+/**
+ * load_meta:
+ *   Read the tip recorded by the last sync. Returns the synced height, 0 if the metadata file is
+ *   missing or does not match the headers file.
+ */
+static int load_meta(int file_count, unsigned char hash[HASH_SIZE])
+{
+    char filename[512];
+    meta_filename(filename, sizeof(filename));
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        return 0;
+
+    headers_meta meta;
+    size_t read_count = fread(&meta, sizeof(meta), 1, file);
+    fclose(file);
+    if (read_count != 1 || meta.magic != HEADERS_META_MAGIC || meta.height == 0 ||
+        meta.height > (uint32_t)file_count)
+        return 0;
+
+    // A single hash proves the synced part of the file is the chain the tip was recorded for
+    unsigned char actual[HASH_SIZE];
+    double_sha256(map_base + (size_t)(meta.height - 1) * BLOCK_HEADER_SIZE, BLOCK_HEADER_SIZE, actual);
+    if (memcmp(actual, meta.tip_hash, HASH_SIZE) != 0)
+        return 0;
+    memcpy(hash, meta.tip_hash, HASH_SIZE);
+    return (int)meta.height;
+}
+
+/**
+ * load_headers_file:
+ *   Index the headers stored in the mapped headers file. The headers synced before are indexed
+ *   from their links alone, the rest is hashed and checked to extend the chain.
+ *   Returns the number of loaded headers.
+ */
+static int load_headers_file(int file_count)
+{
+    unsigned char synced_tip[HASH_SIZE];
+    int synced_height = load_meta(file_count, synced_tip);
+    if (synced_height > 0 && memcmp(header_at(1) + 4, tip_hash, HASH_SIZE) == 0)
+    {
+        if (reserve_table(synced_height + 1) != 0)
+            return 0;
+        header_count = synced_height + 1;
+        memcpy(tip_hash, synced_tip, HASH_SIZE);
+        for (int height = 1; height < header_count; ++height)
+        {
+            // Hashes are the links of the successors, only the difficulty is checked
+            if (!check_header(height, NULL, 0, hash_at(height)))
+            {
+                header_count = height;
+                memcpy(tip_hash, header_at(height) + 4, HASH_SIZE);
+                break;
+            }
+            insert_height(height);
+        }
+    }
+    synced_count = header_count - 1;
+
+    unsigned char hashes[HEADER_LOAD_BATCH * HASH_SIZE];
+    while (header_count - 1 < file_count)
+    {
+        int batch = file_count - (header_count - 1);
+        if (batch > HEADER_LOAD_BATCH)
+            batch = HEADER_LOAD_BATCH;
+        const unsigned char* headers = header_at(header_count);
+        double_sha256_many(headers, BLOCK_HEADER_SIZE, batch, hashes);
+        for (int i = 0; i < batch; ++i)
+        {
+            if (memcmp(headers + i * BLOCK_HEADER_SIZE + 4, tip_hash, HASH_SIZE) != 0 ||
+                !check_header(header_count, NULL, 0, hashes + i * HASH_SIZE) ||
+                extend_tip(hashes + i * HASH_SIZE) != 0)
+            {
+                log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+                    "Headers file %s does not extend the chain after height %d, ignoring the rest",
+                    headers_filename, header_count - 1);
+                return header_count - 1;
+            }
+        }
+    }
+    return header_count - 1;
+}
+
+int init_header_index(const char* filename)
+{
+    free_header_index();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_rwlock_wrlock(&index_lock);
+    headers_filename = strdup(filename);
+    headers_fd = open(filename, O_RDWR | O_CREAT, 0644);
+    map_base = (unsigned char*)mmap(NULL, HEADER_MAP_RESERVE, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    struct stat st;
+    if (headers_filename == NULL || headers_fd < 0 || map_base == MAP_FAILED ||
+        fstat(headers_fd, &st) != 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to open headers file %s: %s",
+            filename, strerror(errno));
+        if (map_base == MAP_FAILED)
+            map_base = NULL;
+        pthread_rwlock_unlock(&index_lock);
+        free_header_index();
+        return -1;
+    }
+
+    int file_count = (int)(st.st_size / BLOCK_HEADER_SIZE);
+    if (map_headers((size_t)file_count * BLOCK_HEADER_SIZE) != 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to map headers file %s: %s",
+            filename, strerror(errno));
+        pthread_rwlock_unlock(&index_lock);
+        free_header_index();
+        return -1;
+    }
+
+    header_count = 1;
+    double_sha256(genesis_header, BLOCK_HEADER_SIZE, tip_hash);
+    reserve_table(1);
+    insert_height(0);
+    int loaded = load_headers_file(file_count);
+
+    // Drop a torn last record and headers not extending the chain, so appends extend the chain
+    if (st.st_size != (off_t)loaded * BLOCK_HEADER_SIZE &&
+        ftruncate(headers_fd, (off_t)loaded * BLOCK_HEADER_SIZE) != 0)
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Failed to truncate headers file %s: %s",
+            filename, strerror(errno));
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__,
+        "Header index loaded %d headers from %s in %ld ms, tip height %d", loaded, filename,
+        (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000), loaded);
+    return loaded;
+}
+
+void free_header_index()
+{
+    if (headers_fd >= 0)
+        sync_header_index();
+
+    pthread_rwlock_wrlock(&index_lock);
+    if (map_base != NULL)
+        munmap(map_base, HEADER_MAP_RESERVE);
+    if (headers_fd >= 0)
+        close(headers_fd);
+    free(height_table);
+    free(headers_filename);
+    map_base = NULL;
+    map_len = 0;
+    headers_fd = -1;
+    header_count = 0;
+    height_table = NULL;
+    height_table_size = 0;
+    headers_filename = NULL;
+    synced_count = 0;
+    pthread_rwlock_unlock(&index_lock);
+}
+
+int add_headers(const unsigned char* headers, size_t count)
+{
+    if (count == 0)
+        return 0;
+
+    // Hash outside of the lock, readers are not blocked meanwhile
+    unsigned char* hashes = (unsigned char*)malloc(count * HASH_SIZE);
+    if (hashes == NULL)
+        return -1;
+    double_sha256_many(headers, BLOCK_HEADER_SIZE, count, hashes);
+
+    // The index lock makes the caller the single writer of the headers file
+    pthread_rwlock_wrlock(&index_lock);
+    if (header_count == 0)
+    {
+        pthread_rwlock_unlock(&index_lock);
+        free(hashes);
+        return -1;
+    }
+
+    // Skip the known headers and take the run extending the tip
+    size_t first = 0;
+    while (first < count && find_height(hashes + first * HASH_SIZE) >= 0)
+        first++;
+    size_t added = 0;
+    const unsigned char* prev_hash = tip_hash;
+    while (first + added < count &&
+        memcmp(headers + (first + added) * BLOCK_HEADER_SIZE + 4, prev_hash, HASH_SIZE) == 0 &&
+        check_header(header_count + (int)added, headers + first * BLOCK_HEADER_SIZE, header_count,
+            hashes + (first + added) * HASH_SIZE))
+    {
+        prev_hash = hashes + (first + added) * HASH_SIZE;
+        added++;
+    }
+
+    // Written before the tip moves, so the mapping holds every indexed header
+    int result = 0;
+    if (added > 0)
+    {
+        size_t len = added * BLOCK_HEADER_SIZE;
+        off_t offset = (off_t)(header_count - 1) * BLOCK_HEADER_SIZE;
+        ssize_t written = pwrite(headers_fd, headers + first * BLOCK_HEADER_SIZE, len, offset);
+        if (written != (ssize_t)len || map_headers((size_t)offset + len) != 0)
+        {
+            log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to append %zu headers to %s: %s",
+                added, headers_filename, strerror(errno));
+            result = -1;
+        }
+        for (size_t i = 0; result == 0 && i < added; ++i)
+        {
+            if (extend_tip(hashes + (first + i) * HASH_SIZE) != 0)
+                result = -1;
+        }
+    }
+    int unsynced = header_count - 1 - synced_count;
+    pthread_rwlock_unlock(&index_lock);
+    free(hashes);
+
+    if (unsynced >= HEADER_SYNC_BATCH)
+        sync_header_index();
+    return result < 0 ? -1 : (int)added;
+}
+
+int sync_header_index()
+{
+    pthread_mutex_lock(&sync_mutex);
+    pthread_rwlock_rdlock(&index_lock);
+    headers_meta meta;
+    meta.magic = HEADERS_META_MAGIC;
+    meta.height = header_count > 0 ? (uint32_t)(header_count - 1) : 0;
+    memcpy(meta.tip_hash, tip_hash, HASH_SIZE);
+    int fd = headers_fd;
+    char filename[512];
+    if (headers_filename != NULL)
+        meta_filename(filename, sizeof(filename));
+    pthread_rwlock_unlock(&index_lock);
+
+    if (fd < 0 || (int)meta.height == synced_count)
+    {
+        pthread_mutex_unlock(&sync_mutex);
+        return 0;
+    }
+
+    // The headers reach the disk before the metadata pointing at them
+    int result = fdatasync(fd);
+    if (result == 0)
+    {
+        char tmp_filename[520];
+        snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+        FILE* file = fopen(tmp_filename, "wb");
+        result = -1;
+        if (file != NULL)
+        {
+            if (fwrite(&meta, sizeof(meta), 1, file) == 1 && fflush(file) == 0 && fsync(fileno(file)) == 0)
+                result = 0;
+            fclose(file);
+        }
+        if (result == 0)
+            result = rename(tmp_filename, filename);
+    }
+    if (result == 0)
+        synced_count = (int)meta.height;
+    else
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to sync headers file: %s", strerror(errno));
+    pthread_mutex_unlock(&sync_mutex);
+    return result;
+}
+
+int get_header_count()
+{
+    pthread_rwlock_rdlock(&index_lock);
+    int count = header_count;
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+}
+
+int get_header_height(const unsigned char hash[HASH_SIZE])
+{
+    pthread_rwlock_rdlock(&index_lock);
+    int height = find_height(hash);
+    pthread_rwlock_unlock(&index_lock);
+    return height;
+}
+
+int get_header(int height, unsigned char header[BLOCK_HEADER_SIZE], unsigned char hash[HASH_SIZE])
+{
+    pthread_rwlock_rdlock(&index_lock);
+    if (height < 0 || height >= header_count)
+    {
+        pthread_rwlock_unlock(&index_lock);
+        return -1;
+    }
+    if (header != NULL)
+        memcpy(header, header_at(height), BLOCK_HEADER_SIZE);
+    if (hash != NULL)
+        memcpy(hash, hash_at(height), HASH_SIZE);
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+}
+
+const unsigned char* get_header_data(int height)
+{
+    pthread_rwlock_rdlock(&index_lock);
+    const unsigned char* header = height >= 0 && height < header_count ? header_at(height) : NULL;
+    pthread_rwlock_unlock(&index_lock);
+    return header;
+}
+
+/**
+ * is_zero_hash:
+ *   Check if the hash is all zeros, e.g. a stop hash requesting as many headers as possible.
+ */
+static int is_zero_hash(const unsigned char* hash)
+{
+    for (int i = 0; i < HASH_SIZE; ++i)
+    {
+        if (hash[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+size_t get_headers(int start_height, size_t max_count, const unsigned char* stop_hash,
+    unsigned char* headers, unsigned char* hashes)
+{
+    if (stop_hash != NULL && is_zero_hash(stop_hash))
+        stop_hash = NULL;
+
+    size_t count = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    for (int height = start_height < 0 ? 0 : start_height; height < header_count && count < max_count;
+        ++height)
+    {
+        if (headers != NULL)
+            memcpy(headers + count * BLOCK_HEADER_SIZE, header_at(height), BLOCK_HEADER_SIZE);
+        if (hashes != NULL)
+            memcpy(hashes + count * HASH_SIZE, hash_at(height), HASH_SIZE);
+        count++;
+        if (stop_hash != NULL && memcmp(hash_at(height), stop_hash, HASH_SIZE) == 0)
+            break;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+}
+
+size_t build_block_locator(unsigned char* locator, size_t max_count)
+{
+    if (max_count == 0)
+        return 0;
+
+    size_t count = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    int step = 1;
+    for (int height = header_count - 1; height > 0 && count + 1 < max_count; height -= step)
+    {
+        memcpy(locator + count * HASH_SIZE, hash_at(height), HASH_SIZE);
+        count++;
+        if (count >= LOCATOR_DENSE_COUNT)
+            step *= 2;
+    }
+    if (header_count > 0)
+    {
+        memcpy(locator + count * HASH_SIZE, hash_at(0), HASH_SIZE);
+        count++;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+}
+
+int find_locator_fork(const unsigned char* locator, size_t count)
+{
+    int fork = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int height = find_height(locator + i * HASH_SIZE);
+        if (height >= 0)
+        {
+            fork = height;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return fork;
+}
@@ -0,0 +1,318 @@
+#include "header_sync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "event_loop.h"
+#include "header_index.h"
+#include "log.h"
+#include "message.h"
+#include "peer_connection.h"
+#include "utils.h"
+
+/**
+ * The header sync statistics of a peer.
+ *
+ * @param rate The moving average of the headers per second received from the peer.
+ * @param batches The number of batches received from the peer.
+ * @param penalized_until_ms The monotonic time until which the peer is not asked for headers.
+ */
+typedef struct
+{
+    double rate;
+    int batches;
+    uint64_t penalized_until_ms;
+} peer_sync_stats;
+
+// State of the header sync, guarded by the sync mutex
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int sync_active = 0;
+static int sync_peer = -1;
+static int request_in_flight = 0;
+static uint64_t request_sent_ms = 0;
+static uintptr_t sync_generation = 0;
+static uint64_t sync_start_ms = 0;
+static uint64_t last_report_ms = 0;
+static int sync_start_height = 0;
+static peer_sync_stats peer_stats[MAX_NODES];
+
+/**
+ * get_sync_rate:
+ *   Get the number of headers per second added since the sync started. Must be called with the
+ *   sync mutex held.
+ */
+static double get_sync_rate(uint64_t now_ms)
+{
+    uint64_t elapsed_ms = now_ms - sync_start_ms;
+    if (elapsed_ms == 0)
+        return 0;
+    return (get_header_count() - 1 - sync_start_height) * 1000.0 / elapsed_ms;
+}
+
+/**
+ * penalize_peer:
+ *   Stop asking the current sync peer for headers for a while. Must be called with the sync
+ *   mutex held.
+ */
+static void penalize_peer(uint64_t now_ms, const char* reason)
+{
+    if (sync_peer < 0)
+        return;
+    log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Header sync peer %d (%s) %s, switching peers",
+        sync_peer, nodes[sync_peer].ip_address, reason);
+    peer_stats[sync_peer].penalized_until_ms = now_ms + HEADER_SYNC_PENALTY_MS;
+    sync_peer = -1;
+    request_in_flight = 0;
+    sync_generation++; // late responses of the peer are ignored
+}
+
+/**
+ * select_peer:
+ *   Select the connected peer with the highest header rate which is not penalized. Peers not
+ *   measured yet are preferred, so every peer gets a chance to be measured. Peers are visited
+ *   from the best peer score, which breaks the ties.
+ *   Returns the index of the peer or -1 if there is none.
+ */
+static int select_peer(uint64_t now_ms)
+{
+    int best = -1;
+    int peers[MAX_NODES];
+    int peer_count = get_peers_by_score(peers, MAX_NODES);
+    for (int k = 0; k < peer_count; ++k)
+    {
+        int i = peers[k];
+        if (peer_stats[i].penalized_until_ms > now_ms)
+            continue;
+        if (best < 0 || peer_stats[i].batches == 0 ||
+            (peer_stats[best].batches > 0 && peer_stats[i].rate > peer_stats[best].rate))
+        {
+            best = i;
+            if (peer_stats[i].batches == 0)
+                break;
+        }
+    }
+    return best;
+}
+
+static void handle_sync_headers(void* ctx, const unsigned char* payload, size_t payload_len);
+
+/**
+ * request_next_batch:
+ *   Ask the sync peer for the headers following the tip of the header index, selecting a new
+ *   peer if needed. Must be called with the sync mutex held.
+ */
+static void request_next_batch(uint64_t now_ms)
+{
+    if (sync_peer < 0 || !nodes[sync_peer].is_connected)
+    {
+        sync_peer = select_peer(now_ms);
+        if (sync_peer < 0)
+            return;
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Header sync peer: %d (%s)", sync_peer,
+            nodes[sync_peer].ip_address);
+    }
+
+    sync_generation++;
+    if (send_getheaders(sync_peer, HEADER_SYNC_STALL_MS, handle_sync_headers,
+        (void*)sync_generation) != 0)
+    {
+        penalize_peer(now_ms, "could not be sent 'getheaders'");
+        return;
+    }
+    request_in_flight = 1;
+    request_sent_ms = now_ms;
+}
+
+/**
+ * finish_sync:
+ *   Stop the sync after the peer reported no more headers. Must be called with the sync mutex held.
+ */
+static void finish_sync(uint64_t now_ms)
+{
+    int tip_height = get_header_count() - 1;
+    guarded_print_line("Header sync finished: tip height %d, %d headers in %.1f s (%.0f headers/s)",
+        tip_height, tip_height - sync_start_height, (now_ms - sync_start_ms) / 1000.0,
+        get_sync_rate(now_ms));
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Header sync finished at height %d", tip_height);
+    sync_active = 0;
+    request_in_flight = 0;
+    sync_generation++;
+    sync_header_index();
+}
+
+/**
+ * handle_sync_headers:
+ *   Add the headers received from the sync peer and request the next batch right away.
+ *   The linkage and proof of work are validated by the header index, a batch not extending the
+ *   chain marks the peer as misbehaving. A batch shorter than the maximum ends the sync.
+ */
+static void handle_sync_headers(void* ctx, const unsigned char* payload, size_t payload_len)
+{
+    pthread_mutex_lock(&sync_mutex);
+    if (!sync_active || (uintptr_t)ctx != sync_generation)
+    {
+        pthread_mutex_unlock(&sync_mutex);
+        return;
+    }
+    request_in_flight = 0;
+    uint64_t now_ms = get_monotonic_ms();
+
+    // Each header is followed by a transaction count, which is always 0 in 'headers' messages
+    size_t offset = 0;
+    uint64_t count = payload_len > 0 ? read_var_int(payload, &offset) : 0;
+    if (count > MAX_HEADERS_COUNT)
+        count = MAX_HEADERS_COUNT;
+    unsigned char* headers = (unsigned char*)malloc(count * BLOCK_HEADER_SIZE + 1);
+    if (headers == NULL)
+    {
+        pthread_mutex_unlock(&sync_mutex);
+        return;
+    }
+    size_t parsed = 0;
+    for (uint64_t i = 0; i < count && offset + BLOCK_HEADER_SIZE + 1 <= payload_len; i++)
+    {
+        memcpy(headers + parsed * BLOCK_HEADER_SIZE, payload + offset, BLOCK_HEADER_SIZE);
+        parsed++;
+        offset += BLOCK_HEADER_SIZE;
+        read_var_int(payload, &offset);
+    }
+
+    int before = get_header_count();
+    int added = add_headers(headers, parsed);
+    int connected = 1;
+    if (parsed > 0)
+    {
+        unsigned char last_hash[HASH_SIZE];
+        double_sha256(headers + (parsed - 1) * BLOCK_HEADER_SIZE, BLOCK_HEADER_SIZE, last_hash);
+        connected = get_header_height(last_hash) >= 0;
+    }
+    free(headers);
+
+    peer_sync_stats* stats = &peer_stats[sync_peer];
+    if (parsed > 0)
+    {
+        uint64_t elapsed_ms = now_ms > request_sent_ms ? now_ms - request_sent_ms : 1;
+        double rate = parsed * 1000.0 / elapsed_ms;
+        stats->rate = stats->batches == 0 ? rate :
+            HEADER_SYNC_RATE_WEIGHT * rate + (1 - HEADER_SYNC_RATE_WEIGHT) * stats->rate;
+        stats->batches++;
+    }
+
+    if (added < 0)
+    {
+        guarded_print_line("[Error] Header sync failed to store headers, stopping.");
+        sync_active = 0;
+    }
+    else if (!connected)
+        penalize_peer(now_ms, "sent headers not extending the chain or with invalid proof of work");
+    else if (parsed < MAX_HEADERS_COUNT)
+        finish_sync(now_ms);
+    else if (get_header_count() == before)
+        penalize_peer(now_ms, "sent only known headers");
+    else
+        request_next_batch(now_ms);
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+/**
+ * drive_header_sync:
+ *   Event loop timer replacing a stalled or disconnected sync peer, requesting headers when no
+ *   request is in flight and reporting the progress of the sync.
+ */
+static void drive_header_sync(void* ctx)
+{
+    (void)ctx;
+    pthread_mutex_lock(&sync_mutex);
+    if (!sync_active)
+    {
+        pthread_mutex_unlock(&sync_mutex);
+        return;
+    }
+
+    uint64_t now_ms = get_monotonic_ms();
+    if (request_in_flight && !nodes[sync_peer].is_connected)
+        penalize_peer(now_ms, "disconnected");
+    else if (request_in_flight && now_ms - request_sent_ms >= HEADER_SYNC_STALL_MS)
+        penalize_peer(now_ms, "stalled");
+    if (!request_in_flight)
+        request_next_batch(now_ms);
+
+    if (now_ms - last_report_ms >= HEADER_SYNC_REPORT_MS)
+    {
+        last_report_ms = now_ms;
+        if (sync_peer < 0)
+            guarded_print_line("Header sync: height %d, waiting for a connected peer",
+                get_header_count() - 1);
+        else
+            guarded_print_line("Header sync: height %d, %.0f headers/s from peer %d (%s)",
+                get_header_count() - 1, get_sync_rate(now_ms), sync_peer, nodes[sync_peer].ip_address);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+void init_header_sync()
+{
+    if (event_loop_add_timer(drive_header_sync, NULL, HEADER_SYNC_TICK_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register header sync timer");
+}
+
+int start_header_sync()
+{
+    pthread_mutex_lock(&sync_mutex);
+    if (sync_active)
+    {
+        pthread_mutex_unlock(&sync_mutex);
+        return -1;
+    }
+    uint64_t now_ms = get_monotonic_ms();
+    sync_active = 1;
+    sync_peer = -1;
+    request_in_flight = 0;
+    sync_start_ms = now_ms;
+    last_report_ms = now_ms;
+    sync_start_height = get_header_count() - 1;
+    memset(peer_stats, 0, sizeof(peer_stats));
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Header sync started at height %d", sync_start_height);
+    request_next_batch(now_ms);
+    pthread_mutex_unlock(&sync_mutex);
+    return 0;
+}
+
+void stop_header_sync()
+{
+    pthread_mutex_lock(&sync_mutex);
+    if (sync_active)
+    {
+        sync_active = 0;
+        request_in_flight = 0;
+        sync_generation++;
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Header sync stopped at height %d",
+            get_header_count() - 1);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+void print_header_sync_status()
+{
+    pthread_mutex_lock(&sync_mutex);
+    uint64_t now_ms = get_monotonic_ms();
+    if (sync_active)
+        guarded_print_line("Header sync running: height %d, %.0f headers/s over %.1f s",
+            get_header_count() - 1, get_sync_rate(now_ms), (now_ms - sync_start_ms) / 1000.0);
+    else
+        guarded_print_line("Header sync not running: height %d", get_header_count() - 1);
+
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        if (!nodes[i].is_connected)
+            continue;
+        const peer_sync_stats* stats = &peer_stats[i];
+        guarded_print_line("  Peer %d (%s): %.0f headers/s over %d batches%s%s", i, nodes[i].ip_address,
+            stats->rate, stats->batches, i == sync_peer && sync_active ? ", syncing" : "",
+            stats->penalized_until_ms > now_ms ? ", penalized" : "");
+    }
+    pthread_mutex_unlock(&sync_mutex);
+}
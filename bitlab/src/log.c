@@ -1,22 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
+#include <dirent.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <zlib.h>
 
 #include "utils.h"
 
-static struct loggers logs = { PTHREAD_MUTEX_INITIALIZER, {NULL}, 0 };
+static struct loggers logs = { PTHREAD_MUTEX_INITIALIZER, {NULL}, NULL, NULL, 0, 0, 0 };
 
 static const char* logs_dir = NULL;
 
+// Registry of the ring buffers, new rings are pushed at the head and only the writer unlinks
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_ring* rings = NULL;
+static _Thread_local log_ring* thread_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+// Writer thread, woken by the timeout or by a ring getting half full
+static pthread_t writer_thread;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond;
+static int writer_running = 0;
+static atomic_int writer_stop;
+static atomic_uint_least64_t dropped_records;
+static uint64_t reported_drops = 0;
+
+// Format of the messages logged from now on
+static atomic_int current_format = LOG_FORMAT_TEXT;
+
+// Flag routing the peer logs to the combined peer log
+static atomic_int combined_peer_logs;
+
+// Rotations, changes are serialized by the mutex which the writer thread takes once per batch
+static pthread_mutex_t rotation_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_rotation default_rotation = { LOG_ROTATE_DEFAULT_SIZE, LOG_ROTATE_DEFAULT_AGE,
+    LOG_ROTATE_DEFAULT_KEEP, 1 };
+static log_rotation_rule rotation_rules[LOG_MAX_ROTATION_RULES];
+static int rotation_rule_count = 0;
+
+/**
+ * A rotated segment waiting for compression and the removal of the oldest segments.
+ *
+ * @param path The path of the rotated segment.
+ * @param filename The path of the log file the segment was rotated from.
+ * @param keep The number of rotated segments kept.
+ * @param compress The flag to indicate the segment is compressed.
+ * @param next The next job of the queue.
+ */
+typedef struct compress_job
+{
+    char* path;
+    char* filename;
+    int keep;
+    int compress;
+    struct compress_job* next;
+} compress_job;
+
+// Compression thread, started by the first rotation and running at LOG_COMPRESS_NICE
+static pthread_t compress_thread;
+static pthread_mutex_t compress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static compress_job* compress_head = NULL;
+static compress_job* compress_tail = NULL;
+static size_t compress_pending = 0;
+static int compress_running = 0;
+static int compress_stop = 0;
+
+/**
+ * The minimum level of the log files starting with the prefix. Entries are only appended and
+ * their prefixes never change once published, so logging threads read them without a lock.
+ *
+ * @param prefix The prefix of the log filenames.
+ * @param prefix_len The length of the prefix.
+ * @param level The minimum log level, -1 if cleared.
+ */
+typedef struct
+{
+    char prefix[MAX_FILENAME_LENGTH];
+    size_t prefix_len;
+    atomic_int level;
+} file_level_entry;
+
+// Minimum levels, changes are serialized by the mutex and recompute the threshold
+atomic_int log_threshold = LOG_DEFAULT_LEVEL;
+static atomic_int global_level = LOG_DEFAULT_LEVEL;
+static pthread_mutex_t levels_mutex = PTHREAD_MUTEX_INITIALIZER;
+static file_level_entry file_levels[LOG_MAX_FILE_LEVELS];
+static atomic_int file_level_count;
+
+// Interned format strings and source files of binary records, the slot is the ID
+static _Atomic(const char*) strings[LOG_MAX_STRINGS];
+static atomic_int string_ready[LOG_MAX_STRINGS];
+static unsigned char string_types[LOG_MAX_STRINGS][LOG_MAX_ARGS];
+static int string_arg_counts[LOG_MAX_STRINGS];
+
 const char* create_logs_dir()
 {
     const char* home = getenv("HOME");
@@ -31,6 +125,875 @@ const char* create_logs_dir()
     return logs_dir;
 }
 
+/**
+ * get_monotonic_ns:
+ *   Get the monotonic time in nanoseconds.
+ */
+static uint64_t get_monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * orphan_ring:
+ *   Thread exit destructor handing the ring of the thread over to the writer to free.
+ */
+static void orphan_ring(void* arg)
+{
+    log_ring* ring = (log_ring*)arg;
+    atomic_store_explicit(&ring->is_orphaned, 1, memory_order_release);
+}
+
+/**
+ * init_rings:
+ *   Create the thread exit key of the rings and the writer condition on the monotonic clock.
+ */
+static void init_rings()
+{
+    pthread_key_create(&ring_key, orphan_ring);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/**
+ * register_ring:
+ *   Allocate the ring of the calling thread and add it to the registry.
+ *   Returns the ring or NULL if out of memory.
+ */
+static log_ring* register_ring()
+{
+    pthread_once(&ring_once, init_rings);
+    log_ring* ring = (log_ring*)malloc(sizeof(log_ring));
+    if (ring == NULL)
+        return NULL;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->is_orphaned, 0);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * lock_log_file:
+ *   Take the exclusive lock of the log file shared with other BitLab processes, retrying until
+ *   LOCKED_FILE_TIMEOUT. Returns 0 if locked, -1 if timed out.
+ */
+static int lock_log_file(FILE* log, const char* full_path)
+{
+    int timeout = 0;
+    int error = flock(fileno(log), LOCK_EX | LOCK_NB);
+    while (error == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+    {
+        usleep(LOCKED_FILE_RETRY_TIME);
+        timeout += LOCKED_FILE_RETRY_TIME;
+
+        if (timeout > LOCKED_FILE_TIMEOUT)
+        {
+            fprintf(stderr, "Log file locking timed out: %s\n", full_path);
+            return -1;
+        }
+        error = flock(fileno(log), LOCK_EX | LOCK_NB);
+    }
+    return 0;
+}
+
+/**
+ * write_session:
+ *   Start the records of this run in the binary log file, with the clocks the monotonic times of
+ *   the messages are converted with.
+ */
+static void write_session(FILE* file)
+{
+    unsigned char buffer[21];
+    uint32_t magic = LOG_BINARY_MAGIC;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    uint64_t monotonic_ns = get_monotonic_ns();
+    buffer[0] = LOG_RECORD_SESSION;
+    memcpy(buffer + 1, &magic, 4);
+    memcpy(buffer + 5, &realtime_ns, 8);
+    memcpy(buffer + 13, &monotonic_ns, 8);
+    fwrite(buffer, 1, sizeof(buffer), file);
+}
+
+/**
+ * format_timestamp:
+ *   Format the time of the record, reusing the last result within the same second.
+ */
+static const char* format_timestamp(time_t timestamp)
+{
+    static char formatted[TIMESTAMP_LENGTH];
+    static time_t formatted_time = (time_t)-1;
+    if (timestamp != formatted_time)
+    {
+        struct tm tm_time;
+        localtime_r(&timestamp, &tm_time);
+        strftime(formatted, sizeof(formatted), "%Y-%m-%d %H:%M:%S", &tm_time);
+        formatted_time = timestamp;
+    }
+    return formatted;
+}
+
+/**
+ * define_string:
+ *   Write the interned string to the binary log file unless it was written in this run.
+ */
+static void define_string(logger* log, int id)
+{
+    if (log->defined_strings[id / 8] & (1 << (id % 8)))
+        return;
+    const char* string = atomic_load_explicit(&strings[id], memory_order_acquire);
+    size_t len = strlen(string);
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+    unsigned char buffer[7];
+    uint32_t id32 = (uint32_t)id;
+    uint16_t len16 = (uint16_t)len;
+    buffer[0] = LOG_RECORD_STRING;
+    memcpy(buffer + 1, &id32, 4);
+    memcpy(buffer + 5, &len16, 2);
+    fwrite(buffer, 1, sizeof(buffer), log->file);
+    fwrite(string, 1, len, log->file);
+    log->defined_strings[id / 8] |= (unsigned char)(1 << (id % 8));
+}
+
+/**
+ * write_binary_record:
+ *   Append the record to the binary log file, defining its strings and its tag first.
+ */
+static void write_binary_record(logger* log, const log_record* record, const char* tag)
+{
+    unsigned char buffer[20];
+    if (strcmp(log->tag, tag) != 0)
+    {
+        uint16_t tag_len = (uint16_t)strlen(tag);
+        buffer[0] = LOG_RECORD_TAG;
+        memcpy(buffer + 1, &tag_len, 2);
+        fwrite(buffer, 1, 3, log->file);
+        fwrite(tag, 1, tag_len, log->file);
+        snprintf(log->tag, sizeof(log->tag), "%s", tag);
+    }
+
+    uint8_t level = (uint8_t)record->level;
+    if (record->format_id >= 0)
+    {
+        define_string(log, record->format_id);
+        define_string(log, record->source_id);
+        uint32_t format_id = (uint32_t)record->format_id;
+        uint32_t source_id = (uint32_t)record->source_id;
+        uint16_t args_len = (uint16_t)record->args_len;
+        buffer[0] = LOG_RECORD_MESSAGE;
+        buffer[1] = level;
+        memcpy(buffer + 2, &format_id, 4);
+        memcpy(buffer + 6, &source_id, 4);
+        memcpy(buffer + 10, &record->monotonic_ns, 8);
+        memcpy(buffer + 18, &args_len, 2);
+        fwrite(buffer, 1, 20, log->file);
+        fwrite(record->message, 1, record->args_len, log->file);
+        return;
+    }
+
+    size_t source_len = strlen(record->source_file);
+    if (source_len > UINT16_MAX)
+        source_len = UINT16_MAX;
+    uint16_t source_len16 = (uint16_t)source_len;
+    uint16_t message_len16 = (uint16_t)strlen(record->message);
+    buffer[0] = LOG_RECORD_TEXT;
+    buffer[1] = level;
+    memcpy(buffer + 2, &record->monotonic_ns, 8);
+    memcpy(buffer + 10, &source_len16, 2);
+    fwrite(buffer, 1, 12, log->file);
+    fwrite(record->source_file, 1, source_len, log->file);
+    fwrite(&message_len16, 1, 2, log->file);
+    fwrite(record->message, 1, message_len16, log->file);
+}
+
+/**
+ * hash_sink_name:
+ *   FNV-1a hash of the sink name, mixed with the format.
+ */
+static uint32_t hash_sink_name(const char* name, int is_binary)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p != '\0'; ++p)
+    {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return is_binary ? hash ^ 0x9E3779B9u : hash;
+}
+
+/**
+ * unlink_lru:
+ *   Remove the open sink from the LRU list.
+ */
+static void unlink_lru(logger* log)
+{
+    if (log->lru_prev != NULL)
+        log->lru_prev->lru_next = log->lru_next;
+    else
+        logs.lru_head = log->lru_next;
+    if (log->lru_next != NULL)
+        log->lru_next->lru_prev = log->lru_prev;
+    else
+        logs.lru_tail = log->lru_prev;
+    log->lru_prev = NULL;
+    log->lru_next = NULL;
+}
+
+/**
+ * push_lru:
+ *   Put the open sink at the head of the LRU list as the most recently used one.
+ */
+static void push_lru(logger* log)
+{
+    log->lru_prev = NULL;
+    log->lru_next = logs.lru_head;
+    if (logs.lru_head != NULL)
+        logs.lru_head->lru_prev = log;
+    else
+        logs.lru_tail = log;
+    logs.lru_head = log;
+}
+
+/**
+ * close_sink:
+ *   Flush, unlock and close the log file of the sink, which stays registered and is reopened by
+ *   its next record. Must be called with the log mutex held.
+ */
+static void close_sink(logger* log)
+{
+    if (log->is_dirty)
+    {
+        fflush(log->file);
+        log->end_offset = (off_t)ftell(log->file);
+        flock(fileno(log->file), LOCK_UN);
+        log->is_dirty = 0;
+    }
+    fclose(log->file);
+    log->file = NULL;
+    unlink_lru(log);
+    logs.open_count--;
+}
+
+/**
+ * find_sink:
+ *   Find the sink of the log file in the registry or register it.
+ *   Must be called with the log mutex held. Returns the sink or NULL if out of memory.
+ */
+static logger* find_sink(const char* name, int is_binary)
+{
+    uint32_t hash = hash_sink_name(name, is_binary);
+    logger** bucket = &logs.buckets[hash & (LOG_SINK_BUCKETS - 1)];
+    for (logger* log = *bucket; log != NULL; log = log->next)
+    {
+        if (log->hash == hash && log->is_binary == is_binary && strcmp(log->name, name) == 0)
+            return log;
+    }
+
+    logger* log = (logger*)calloc(1, sizeof(logger));
+    if (log == NULL)
+        return NULL;
+    size_t filename_len = strlen(logs_dir) + strlen(name) + strlen(LOG_BINARY_SUFFIX) + 2;
+    log->name = strdup(name);
+    log->filename = (char*)malloc(filename_len);
+    if (is_binary)
+        log->defined_strings = (unsigned char*)calloc(LOG_MAX_STRINGS / 8, 1);
+    if (log->name == NULL || log->filename == NULL || (is_binary && log->defined_strings == NULL))
+    {
+        perror("Failed to allocate memory for log sink");
+        free(log->name);
+        free(log->filename);
+        free(log->defined_strings);
+        free(log);
+        return NULL;
+    }
+    snprintf(log->filename, filename_len, "%s/%s%s", logs_dir, name,
+        is_binary ? LOG_BINARY_SUFFIX : "");
+    log->is_binary = is_binary;
+    log->hash = hash;
+    log->next = *bucket;
+    *bucket = log;
+    logs.count++;
+    return log;
+}
+
+/**
+ * reset_session:
+ *   Make the binary log file start a new session with the next record, defining its strings and
+ *   its tag again.
+ */
+static void reset_session(logger* log)
+{
+    log->has_session = 0;
+    log->tag[0] = '\0';
+    if (log->defined_strings != NULL)
+        memset(log->defined_strings, 0, LOG_MAX_STRINGS / 8);
+}
+
+/**
+ * start_segment:
+ *   Remember the identity of the newly opened log file and start its age. A binary log file
+ *   starts a new session, the strings and the tag of the previous file are not in it.
+ */
+static void start_segment(logger* log, const struct stat* st)
+{
+    log->device = st->st_dev;
+    log->inode = st->st_ino;
+    log->segment_start = time(NULL);
+    reset_session(log);
+}
+
+/**
+ * open_sink:
+ *   Make sure the log file of the sink is open and locked for the batch, closing the least
+ *   recently used file at LOG_MAX_OPEN_FILES. A file rotated by another BitLab process is
+ *   reopened. A binary log file starts the session of this run.
+ *   Must be called with the log mutex held. Returns 0 if successful, -1 otherwise.
+ */
+static int open_sink(logger* log, uint64_t now_ms)
+{
+    for (int attempt = 0;; ++attempt)
+    {
+        if (log->file == NULL)
+        {
+            if (logs.open_count >= LOG_MAX_OPEN_FILES && logs.lru_tail != NULL)
+                close_sink(logs.lru_tail);
+            log->file = fopen(log->filename, "a");
+            if (log->file == NULL)
+            {
+                fprintf(stderr, "Failed to create or open log file: %s\n", log->filename);
+                return -1;
+            }
+            logs.open_count++;
+        }
+        else
+            unlink_lru(log);
+        push_lru(log);
+        if (log->is_dirty)
+            break;
+
+        // The lock is held until the batch is flushed, a timed out lock still gets the records
+        lock_log_file(log->file, log->filename);
+        log->is_dirty = 1;
+        struct stat file_st;
+        struct stat path_st;
+        if (fstat(fileno(log->file), &file_st) != 0)
+            break;
+        if (file_st.st_dev != log->device || file_st.st_ino != log->inode)
+            start_segment(log, &file_st);
+        else if (log->is_binary && file_st.st_size != log->end_offset)
+        {
+            // Another process appended its session since our last batch, which the decoder
+            // takes as the end of our strings and tag
+            reset_session(log);
+        }
+
+        // Another process rotates the file while holding its lock, so the name is checked after locking
+        if (attempt > 0 || (stat(log->filename, &path_st) == 0 &&
+            path_st.st_dev == file_st.st_dev && path_st.st_ino == file_st.st_ino))
+            break;
+        close_sink(log);
+    }
+    log->last_used_ms = now_ms;
+
+    if (log->is_binary && !log->has_session)
+    {
+        write_session(log->file);
+        log->has_session = 1;
+        log->tag[0] = '\0';
+    }
+    return 0;
+}
+
+/**
+ * get_peer_tag:
+ *   Get the address of the peer from the name of its log file.
+ *   Returns 1 if the name is a peer log file, 0 otherwise.
+ */
+static int get_peer_tag(const char* name, char* tag, size_t tag_size)
+{
+    size_t prefix_len = strlen(LOG_PEER_PREFIX);
+    size_t suffix_len = strlen(LOG_PEER_SUFFIX);
+    size_t name_len = strlen(name);
+    if (name_len <= prefix_len + suffix_len || strncmp(name, LOG_PEER_PREFIX, prefix_len) != 0 ||
+        strcmp(name + name_len - suffix_len, LOG_PEER_SUFFIX) != 0)
+        return 0;
+    size_t tag_len = name_len - prefix_len - suffix_len;
+    if (tag_len >= tag_size)
+        tag_len = tag_size - 1;
+    memcpy(tag, name + prefix_len, tag_len);
+    tag[tag_len] = '\0';
+    return 1;
+}
+
+/**
+ * write_record:
+ *   Append the record to the log file of its sink, peer records to the combined peer log when
+ *   enabled. Must be called with the log mutex held.
+ */
+static void write_record(const log_record* record, uint64_t now_ms)
+{
+    if (logs_dir == NULL)
+    {
+        logs_dir = create_logs_dir();
+        if (logs_dir == NULL)
+        {
+            fprintf(stderr, "Failed to create logs directory\n");
+            return;
+        }
+    }
+
+    const char* name = record->filename;
+    char tag[LOG_MAX_TAG_LENGTH] = "";
+    if (atomic_load_explicit(&combined_peer_logs, memory_order_relaxed) &&
+        get_peer_tag(name, tag, sizeof(tag)))
+        name = LOG_PEERS_FILE;
+
+    logger* log = find_sink(name, record->is_binary);
+    if (log == NULL || open_sink(log, now_ms) < 0)
+    {
+        atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+        return;
+    }
+    if (record->is_binary)
+    {
+        write_binary_record(log, record, tag);
+        return;
+    }
+
+    const char* level_str = get_log_level_name(record->level);
+    const char* timestamp = format_timestamp(record->timestamp);
+    if (tag[0] != '\0')
+        fprintf(log->file, "%s - %s - %s - [%s] %s\n", timestamp, level_str, record->source_file,
+            tag, record->message);
+    else
+        fprintf(log->file, "%s - %s - %s - %s\n", timestamp, level_str, record->source_file,
+            record->message);
+}
+
+/**
+ * find_rotation:
+ *   Get the rotation of the longest prefix matching the log file or the default one.
+ *   Must be called with the rotation mutex held.
+ */
+static void find_rotation(const char* filename, log_rotation* rotation)
+{
+    *rotation = default_rotation;
+    size_t best_len = 0;
+    for (int i = 0; i < rotation_rule_count; ++i)
+    {
+        size_t prefix_len = strlen(rotation_rules[i].prefix);
+        if (prefix_len > best_len && strncmp(filename, rotation_rules[i].prefix, prefix_len) == 0)
+        {
+            *rotation = rotation_rules[i].rotation;
+            best_len = prefix_len;
+        }
+    }
+}
+
+/**
+ * A rotated segment found in the logs directory.
+ *
+ * @param name The filename of the segment.
+ * @param key The time of the rotation and the zero-padded counter of the rotations within that
+ * second, ordering the segments from the oldest.
+ */
+typedef struct
+{
+    char* name;
+    char key[32];
+} log_segment;
+
+/**
+ * compare_segments:
+ *   Order rotated segments from the oldest.
+ */
+static int compare_segments(const void* a, const void* b)
+{
+    return strcmp(((const log_segment*)a)->key, ((const log_segment*)b)->key);
+}
+
+/**
+ * remove_old_segments:
+ *   Remove the oldest rotated segments of the log file, compressed or not, beyond the kept count.
+ */
+static void remove_old_segments(const char* filename, int keep)
+{
+    const char* slash = strrchr(filename, '/');
+    if (slash == NULL)
+        return;
+    size_t dir_len = (size_t)(slash - filename);
+    char dir[MAX_FILENAME_LENGTH * 2];
+    if (dir_len >= sizeof(dir))
+        return;
+    memcpy(dir, filename, dir_len);
+    dir[dir_len] = '\0';
+    const char* name = slash + 1;
+    size_t name_len = strlen(name);
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return;
+    log_segment* segments = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        // Segments are named "<log file>.<YYYYmmdd-HHMMSS>[-<n>]", segments being compressed end with ".tmp"
+        const char* entry_name = entry->d_name;
+        size_t entry_len = strlen(entry_name);
+        if (strncmp(entry_name, name, name_len) != 0 || entry_name[name_len] != '.' ||
+            !isdigit((unsigned char)entry_name[name_len + 1]) ||
+            (entry_len > 4 && strcmp(entry_name + entry_len - 4, ".tmp") == 0))
+            continue;
+        if (count == capacity)
+        {
+            size_t new_capacity = capacity == 0 ? 16 : capacity * 2;
+            log_segment* new_segments = (log_segment*)realloc(segments, new_capacity * sizeof(log_segment));
+            if (new_segments == NULL)
+                break;
+            segments = new_segments;
+            capacity = new_capacity;
+        }
+        char stamp[16] = "";
+        unsigned long counter = 0;
+        sscanf(entry_name + name_len + 1, "%15[0-9-]-%lu", stamp, &counter);
+        segments[count].name = strdup(entry_name);
+        snprintf(segments[count].key, sizeof(segments[count].key), "%s.%010lu", stamp, counter);
+        if (segments[count].name != NULL)
+            count++;
+    }
+    closedir(d);
+
+    qsort(segments, count, sizeof(log_segment), compare_segments);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (keep >= 0 && count - i > (size_t)keep)
+        {
+            char path[MAX_FILENAME_LENGTH * 3];
+            snprintf(path, sizeof(path), "%s/%s", dir, segments[i].name);
+            unlink(path);
+        }
+        free(segments[i].name);
+    }
+    free(segments);
+}
+
+/**
+ * compress_segment:
+ *   Compress the rotated segment to a gzip file next to it and remove the segment. A process
+ *   still writing its last batch to the segment holds its lock, so the lock is taken first.
+ *   Returns 0 if successful, -1 otherwise.
+ */
+static int compress_segment(const char* path)
+{
+    char compressed_path[MAX_FILENAME_LENGTH * 3];
+    char tmp_path[sizeof(compressed_path) + sizeof(".tmp")];
+    snprintf(compressed_path, sizeof(compressed_path), "%s%s", path, LOG_COMPRESSED_SUFFIX);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", compressed_path);
+
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+        return -1;
+    flock(fileno(in), LOCK_EX);
+    gzFile out = gzopen(tmp_path, "wb6");
+    if (out == NULL)
+    {
+        fclose(in);
+        return -1;
+    }
+
+    char* buffer = (char*)malloc(LOG_COMPRESS_BUFFER_SIZE);
+    int result = buffer != NULL ? 0 : -1;
+    size_t len;
+    while (result == 0 && (len = fread(buffer, 1, LOG_COMPRESS_BUFFER_SIZE, in)) > 0)
+    {
+        if (gzwrite(out, buffer, (unsigned int)len) != (int)len)
+            result = -1;
+    }
+    if (ferror(in))
+        result = -1;
+    if (gzclose(out) != Z_OK)
+        result = -1;
+    fclose(in);
+    free(buffer);
+
+    if (result == 0 && rename(tmp_path, compressed_path) == 0)
+        unlink(path);
+    else
+    {
+        unlink(tmp_path);
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * handle_log_compressor:
+ *   Compression thread compressing the rotated segments and removing the oldest ones, at the
+ *   lowest priority so it never competes with the node. Exits once logging finishes and the
+ *   queue is empty.
+ */
+static void* handle_log_compressor(void* arg)
+{
+    (void)arg;
+    // Linux keeps the nice value per thread, so only this thread is lowered
+    setpriority(PRIO_PROCESS, 0, LOG_COMPRESS_NICE);
+    pthread_mutex_lock(&compress_mutex);
+    for (;;)
+    {
+        while (compress_head == NULL && !compress_stop)
+            pthread_cond_wait(&compress_cond, &compress_mutex);
+        compress_job* job = compress_head;
+        if (job == NULL)
+            break;
+        compress_head = job->next;
+        if (compress_head == NULL)
+            compress_tail = NULL;
+        pthread_mutex_unlock(&compress_mutex);
+
+        if (job->compress && compress_segment(job->path) < 0)
+            fprintf(stderr, "Failed to compress rotated log file: %s\n", job->path);
+        remove_old_segments(job->filename, job->keep);
+        free(job->path);
+        free(job->filename);
+        free(job);
+
+        pthread_mutex_lock(&compress_mutex);
+        compress_pending--;
+    }
+    pthread_mutex_unlock(&compress_mutex);
+    return NULL;
+}
+
+/**
+ * queue_compression:
+ *   Queue the rotated segment for the compression thread, starting it on first use.
+ */
+static void queue_compression(const char* path, const char* filename, const log_rotation* rotation)
+{
+    compress_job* job = (compress_job*)malloc(sizeof(compress_job));
+    if (job == NULL)
+        return;
+    job->path = strdup(path);
+    job->filename = strdup(filename);
+    job->keep = rotation->keep;
+    job->compress = rotation->compress;
+    job->next = NULL;
+    if (job->path == NULL || job->filename == NULL)
+    {
+        free(job->path);
+        free(job->filename);
+        free(job);
+        return;
+    }
+
+    pthread_mutex_lock(&compress_mutex);
+    if (!compress_running)
+    {
+        compress_stop = 0;
+        if (pthread_create(&compress_thread, NULL, handle_log_compressor, NULL) == 0)
+            compress_running = 1;
+        else
+        {
+            perror("Failed to start the log compression thread");
+            pthread_mutex_unlock(&compress_mutex);
+            free(job->path);
+            free(job->filename);
+            free(job);
+            return;
+        }
+    }
+    if (compress_tail != NULL)
+        compress_tail->next = job;
+    else
+        compress_head = job;
+    compress_tail = job;
+    compress_pending++;
+    pthread_cond_signal(&compress_cond);
+    pthread_mutex_unlock(&compress_mutex);
+}
+
+/**
+ * rotate_sink:
+ *   Rename the flushed and locked log file to a segment named with the time of the rotation and
+ *   close it, the next record opens a new file. Must be called with the log mutex held.
+ */
+static void rotate_sink(logger* log, const log_rotation* rotation, time_t now)
+{
+    struct tm tm_time;
+    char stamp[32];
+    localtime_r(&now, &tm_time);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm_time);
+
+    // A second rotation within the same second gets a counter appended
+    char path[MAX_FILENAME_LENGTH * 3];
+    char compressed_path[sizeof(path) + sizeof(LOG_COMPRESSED_SUFFIX)];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s.%s", log->filename, stamp);
+    for (int i = 1;; ++i)
+    {
+        snprintf(compressed_path, sizeof(compressed_path), "%s%s", path, LOG_COMPRESSED_SUFFIX);
+        if (stat(path, &st) != 0 && stat(compressed_path, &st) != 0)
+            break;
+        snprintf(path, sizeof(path), "%s.%s-%d", log->filename, stamp, i);
+    }
+
+    if (rename(log->filename, path) != 0)
+    {
+        fprintf(stderr, "Failed to rotate log file: %s\n", log->filename);
+        log->segment_start = now;
+        flock(fileno(log->file), LOCK_UN);
+        log->is_dirty = 0;
+        return;
+    }
+    // The inode of the segment may be reused by the new file once the segment is compressed
+    close_sink(log);
+    log->device = 0;
+    log->inode = 0;
+    queue_compression(path, log->filename, rotation);
+}
+
+/**
+ * flush_loggers:
+ *   Flush the log files written in the batch and release their locks, rotating the files past
+ *   the size or the age of their rotation, and close the files idle for LOG_SINK_IDLE_MS.
+ *   Must be called with the log mutex held.
+ */
+static void flush_loggers(uint64_t now_ms)
+{
+    time_t now = time(NULL);
+    pthread_mutex_lock(&rotation_mutex);
+    logger* log = logs.lru_head;
+    while (log != NULL)
+    {
+        logger* next = log->lru_next;
+        if (log->is_dirty)
+        {
+            fflush(log->file);
+            log_rotation rotation;
+            find_rotation(log->name, &rotation);
+            long size = ftell(log->file);
+            log->end_offset = (off_t)size;
+            if ((rotation.max_size > 0 && size >= 0 && (uint64_t)size >= rotation.max_size) ||
+                (rotation.max_age > 0 && now - log->segment_start >= (time_t)rotation.max_age))
+                rotate_sink(log, &rotation, now);
+            else
+            {
+                flock(fileno(log->file), LOCK_UN);
+                log->is_dirty = 0;
+            }
+        }
+        log = next;
+    }
+    pthread_mutex_unlock(&rotation_mutex);
+    while (logs.lru_tail != NULL && now_ms - logs.lru_tail->last_used_ms >= LOG_SINK_IDLE_MS)
+        close_sink(logs.lru_tail);
+}
+
+/**
+ * drain_rings:
+ *   Write the records of every ring in one batch, report newly dropped records and free the
+ *   drained rings of exited threads. Runs on the writer thread only.
+ *   Returns the number of written records.
+ */
+static size_t drain_rings()
+{
+    size_t count = 0;
+    pthread_mutex_lock(&rings_mutex);
+    log_ring* ring = rings;
+    pthread_mutex_unlock(&rings_mutex);
+
+    // Rings pushed meanwhile are ahead of the snapshot and wait for the next batch
+    uint64_t now_ms = get_monotonic_ns() / 1000000;
+    pthread_mutex_lock(&logs.log_mutex);
+    while (ring != NULL)
+    {
+        log_ring* next = ring->next;
+        int is_orphaned = atomic_load_explicit(&ring->is_orphaned, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; ++tail, ++count)
+            write_record(&ring->records[tail % LOG_RING_CAPACITY], now_ms);
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if (is_orphaned)
+        {
+            pthread_mutex_lock(&rings_mutex);
+            log_ring** link = &rings;
+            while (*link != ring)
+                link = &(*link)->next;
+            *link = ring->next;
+            pthread_mutex_unlock(&rings_mutex);
+            free(ring);
+        }
+        ring = next;
+    }
+
+    uint64_t dropped = atomic_load_explicit(&dropped_records, memory_order_relaxed);
+    if (dropped > reported_drops)
+    {
+        log_record record;
+        record.level = LOG_WARN;
+        record.is_binary = 0;
+        record.timestamp = time(NULL);
+        record.source_file = __FILE__;
+        snprintf(record.filename, sizeof(record.filename), "%s", BITLAB_LOG);
+        snprintf(record.message, sizeof(record.message),
+            "Dropped %llu log messages, the log buffer was full",
+            (unsigned long long)(dropped - reported_drops));
+        write_record(&record, now_ms);
+        reported_drops = dropped;
+    }
+    flush_loggers(now_ms);
+    pthread_mutex_unlock(&logs.log_mutex);
+    return count;
+}
+
+/**
+ * handle_log_writer:
+ *   Writer thread draining the rings until logging finishes, sleeping up to
+ *   LOG_FLUSH_INTERVAL_MS when they are empty.
+ */
+static void* handle_log_writer(void* arg)
+{
+    (void)arg;
+    while (!atomic_load(&writer_stop))
+    {
+        if (drain_rings() > 0)
+            continue;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += (long)LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&writer_mutex);
+        if (!atomic_load(&writer_stop))
+            pthread_cond_timedwait(&writer_cond, &writer_mutex, &deadline);
+        pthread_mutex_unlock(&writer_mutex);
+    }
+    drain_rings();
+    return NULL;
+}
+
 void init_logging(const char* filename)
 {
     logs.is_initializing = 1;
@@ -53,168 +1016,726 @@ void init_logging(const char* filename)
         }
     }
 
-    char full_path[BUFFER_SIZE];
-    snprintf(full_path, sizeof(full_path), "%s/%s", logs_dir, filename);
-
     pthread_mutex_lock(&logs.log_mutex);
-    for (int i = 0; i < MAX_LOG_FILES; ++i)
+    logger* log = find_sink(filename, 0);
+    if (log == NULL || open_sink(log, get_monotonic_ns() / 1000000) < 0)
+        perror("Failed to open log file");
+    else
+    {
+        fflush(log->file);
+        flock(fileno(log->file), LOCK_UN);
+        log->is_dirty = 0;
+    }
+    pthread_mutex_unlock(&logs.log_mutex);
+
+    pthread_once(&ring_once, init_rings);
+    pthread_mutex_lock(&writer_mutex);
+    if (!writer_running)
     {
-        if (logs.array[i] == NULL)
+        atomic_store(&writer_stop, 0);
+        if (pthread_create(&writer_thread, NULL, handle_log_writer, NULL) == 0)
+            writer_running = 1;
+        else
+            perror("Failed to start the log writer thread");
+    }
+    pthread_mutex_unlock(&writer_mutex);
+    logs.is_initializing = 0;
+}
+
+/**
+ * intern_string:
+ *   Find the ID of the format string or source file by its address, interning it on first use
+ *   with the argument types of its conversions. The table is lock-free: a slot is claimed by
+ *   compare-and-swap and readers wait for nothing, a string being interned by another thread is
+ *   reported as not interned.
+ *   Returns the ID or -1 if the string is not interned.
+ */
+static int intern_string(const char* string)
+{
+    size_t mask = LOG_MAX_STRINGS - 1;
+    size_t slot = (size_t)(((uint64_t)(uintptr_t)string * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    for (size_t probe = 0; probe < LOG_MAX_STRINGS; ++probe, slot = (slot + 1) & mask)
+    {
+        const char* key = atomic_load_explicit(&strings[slot], memory_order_acquire);
+        if (key == NULL)
         {
-            logs.array[i] = (struct logger*)malloc(sizeof(logger));
-            logs.array[i]->filename = (char*)malloc(strlen(full_path) + 1);
-            if (logs.array[i]->filename == NULL)
+            if (atomic_compare_exchange_strong(&strings[slot], &key, string))
             {
-                perror("Failed to allocate memory for filename");
-                free(logs.array[i]);
-                logs.array[i] = NULL;
-                break;
-            }
-            snprintf(logs.array[i]->filename, strlen(full_path) + 1, "%s", full_path);
-            logs.array[i]->file = fopen(full_path, "a");
-            if (logs.array[i]->file == NULL)
-            {
-                perror("Failed to open log file");
-                free(logs.array[i]->filename);
-                free(logs.array[i]);
-                logs.array[i] = NULL;
+                log_format_spec specs[LOG_MAX_ARGS];
+                int count = parse_log_format(string, specs, LOG_MAX_ARGS);
+                for (int i = 0; i < count; ++i)
+                    string_types[slot][i] = (unsigned char)specs[i].type;
+                string_arg_counts[slot] = count;
+                atomic_store_explicit(&string_ready[slot], 1, memory_order_release);
+                return (int)slot;
             }
+        }
+        if (key == string)
+            return atomic_load_explicit(&string_ready[slot], memory_order_acquire) ? (int)slot : -1;
+    }
+    return -1;
+}
+
+/**
+ * pack_arguments:
+ *   Copy the raw arguments of the conversions into the buffer of a binary record, truncating
+ *   strings to the space left. Returns the length of the packed arguments.
+ */
+static size_t pack_arguments(const unsigned char* types, int count, va_list args, char* buffer,
+    size_t size)
+{
+    size_t offset = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        uint64_t value = 0;
+        switch ((log_arg_type)types[i])
+        {
+        case LOG_ARG_INT: value = (uint64_t)(int64_t)va_arg(args, int); break;
+        case LOG_ARG_UINT: value = va_arg(args, unsigned int); break;
+        case LOG_ARG_LONG: value = (uint64_t)(int64_t)va_arg(args, long); break;
+        case LOG_ARG_ULONG: value = va_arg(args, unsigned long); break;
+        case LOG_ARG_LLONG: value = (uint64_t)va_arg(args, long long); break;
+        case LOG_ARG_ULLONG: value = va_arg(args, unsigned long long); break;
+        case LOG_ARG_SIZE: value = va_arg(args, size_t); break;
+        case LOG_ARG_INTMAX: value = (uint64_t)va_arg(args, intmax_t); break;
+        case LOG_ARG_UINTMAX: value = va_arg(args, uintmax_t); break;
+        case LOG_ARG_PTRDIFF: value = (uint64_t)(int64_t)va_arg(args, ptrdiff_t); break;
+        case LOG_ARG_POINTER: value = (uint64_t)(uintptr_t)va_arg(args, void*); break;
+        case LOG_ARG_DOUBLE:
+        {
+            double number = va_arg(args, double);
+            memcpy(&value, &number, sizeof(value));
             break;
         }
+        case LOG_ARG_STRING:
+        {
+            const char* string = va_arg(args, const char*);
+            if (string == NULL)
+                string = "(null)";
+
+            // Every following argument takes at most 8 bytes
+            size_t available = size - offset - 2 - 8 * (size_t)(count - i - 1);
+            uint16_t len = (uint16_t)strnlen(string, available);
+            memcpy(buffer + offset, &len, 2);
+            memcpy(buffer + offset + 2, string, len);
+            offset += 2 + (size_t)len;
+            continue;
+        }
+        }
+        memcpy(buffer + offset, &value, 8);
+        offset += 8;
     }
-    logs.is_initializing = 0;
-    pthread_mutex_unlock(&logs.log_mutex);
+    return offset;
 }
 
-void log_message(log_level level, const char* filename, const char* source_file, const char* format, ...)
+/**
+ * get_minimum_level:
+ *   Get the minimum level of the log file, the level of its longest matching prefix or the
+ *   global one.
+ */
+static int get_minimum_level(const char* filename)
 {
-    if (logs_dir == NULL)
+    int level = atomic_load_explicit(&global_level, memory_order_relaxed);
+    int count = atomic_load_explicit(&file_level_count, memory_order_acquire);
+    size_t best_len = 0;
+    for (int i = 0; i < count; ++i)
     {
-        logs_dir = create_logs_dir();
-        if (logs_dir == NULL)
+        const file_level_entry* entry = &file_levels[i];
+        int entry_level = atomic_load_explicit(&entry->level, memory_order_relaxed);
+        if (entry_level >= 0 && entry->prefix_len > best_len &&
+            strncmp(filename, entry->prefix, entry->prefix_len) == 0)
         {
-            fprintf(stderr, "Failed to create logs directory\n");
-            return;
+            level = entry_level;
+            best_len = entry->prefix_len;
         }
     }
+    return level;
+}
 
-    char full_path[BUFFER_SIZE];
-    snprintf(full_path, sizeof(full_path), "%s/%s", logs_dir, filename);
+/**
+ * update_threshold:
+ *   Set the threshold of log_message to the lowest minimum level. Must be called with the levels
+ *   mutex held.
+ */
+static void update_threshold()
+{
+    int threshold = atomic_load_explicit(&global_level, memory_order_relaxed);
+    int count = atomic_load_explicit(&file_level_count, memory_order_relaxed);
+    for (int i = 0; i < count; ++i)
+    {
+        int level = atomic_load_explicit(&file_levels[i].level, memory_order_relaxed);
+        if (level >= 0 && level < threshold)
+            threshold = level;
+    }
+    atomic_store_explicit(&log_threshold, threshold, memory_order_relaxed);
+}
 
-    pthread_mutex_lock(&logs.log_mutex);
+void log_write(log_level level, const char* filename, const char* source_file, const char* format, ...)
+{
+    if ((int)level < get_minimum_level(filename))
+        return;
+
+    log_ring* ring = thread_ring != NULL ? thread_ring : register_ring();
+    if (ring == NULL)
+    {
+        atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+        return;
+    }
 
-    FILE* log = NULL;
-    for (int i = 0; i < MAX_LOG_FILES; ++i)
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_CAPACITY)
     {
-        if (logs.array[i] != NULL && !strcmp(logs.array[i]->filename, full_path))
+        atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_record* record = &ring->records[head % LOG_RING_CAPACITY];
+    record->level = level;
+    record->is_binary = atomic_load_explicit(&current_format, memory_order_relaxed) == LOG_FORMAT_BINARY;
+    record->source_file = source_file;
+    record->format_id = -1;
+    size_t filename_len = strnlen(filename, sizeof(record->filename) - 1);
+    memcpy(record->filename, filename, filename_len);
+    record->filename[filename_len] = '\0';
+    va_list args;
+    if (record->is_binary)
+    {
+        // Formats not supported by the packer are formatted and stored as text records
+        record->monotonic_ns = get_monotonic_ns();
+        int format_id = intern_string(format);
+        int source_id = intern_string(source_file);
+        if (format_id >= 0 && source_id >= 0 && string_arg_counts[format_id] >= 0)
         {
-            log = logs.array[i]->file;
-            break;
+            va_start(args, format);
+            record->args_len = pack_arguments(string_types[format_id],
+                string_arg_counts[format_id], args, record->message, sizeof(record->message));
+            va_end(args);
+            record->format_id = format_id;
+            record->source_id = source_id;
         }
     }
+    else
+        record->timestamp = time(NULL);
+    if (record->format_id < 0)
+    {
+        va_start(args, format);
+        vsnprintf(record->message, sizeof(record->message), format, args);
+        va_end(args);
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 
-    if (log == NULL)
+    // Waking the writer early keeps bursts from filling the ring, a missed wakeup only delays it
+    if (head + 1 - tail == LOG_RING_CAPACITY / 2)
+        pthread_cond_signal(&writer_cond);
+}
+
+void set_log_level(log_level level)
+{
+    pthread_mutex_lock(&levels_mutex);
+    atomic_store_explicit(&global_level, level, memory_order_relaxed);
+    update_threshold();
+    pthread_mutex_unlock(&levels_mutex);
+}
+
+log_level get_log_level()
+{
+    return (log_level)atomic_load_explicit(&global_level, memory_order_relaxed);
+}
+
+int set_file_log_level(const char* prefix, log_level level)
+{
+    size_t prefix_len = strnlen(prefix, MAX_FILENAME_LENGTH - 1);
+    if (prefix_len == 0)
+        return -1;
+
+    pthread_mutex_lock(&levels_mutex);
+    int count = atomic_load_explicit(&file_level_count, memory_order_relaxed);
+    file_level_entry* entry = NULL;
+    for (int i = 0; i < count && entry == NULL; ++i)
+    {
+        if (file_levels[i].prefix_len == prefix_len &&
+            strncmp(file_levels[i].prefix, prefix, prefix_len) == 0)
+            entry = &file_levels[i];
+    }
+    if (entry == NULL)
     {
-        // Try to create and open the log file if it doesn't exist
-        log = fopen(full_path, "a");
-        if (log == NULL)
+        // A cleared entry keeps its prefix for the readers, so new prefixes are appended
+        if (count >= LOG_MAX_FILE_LEVELS)
         {
-            pthread_mutex_unlock(&logs.log_mutex);
-            fprintf(stderr, "Failed to create or open log file: %s\n", full_path);
-            return;
+            pthread_mutex_unlock(&levels_mutex);
+            return -1;
         }
+        entry = &file_levels[count];
+        memcpy(entry->prefix, prefix, prefix_len);
+        entry->prefix[prefix_len] = '\0';
+        entry->prefix_len = prefix_len;
+        atomic_store_explicit(&entry->level, level, memory_order_relaxed);
+        atomic_store_explicit(&file_level_count, count + 1, memory_order_release);
+    }
+    else
+        atomic_store_explicit(&entry->level, level, memory_order_relaxed);
+    update_threshold();
+    pthread_mutex_unlock(&levels_mutex);
+    return 0;
+}
+
+void clear_file_log_level(const char* prefix)
+{
+    pthread_mutex_lock(&levels_mutex);
+    int count = atomic_load_explicit(&file_level_count, memory_order_relaxed);
+    for (int i = 0; i < count; ++i)
+    {
+        if (strncmp(file_levels[i].prefix, prefix, MAX_FILENAME_LENGTH) == 0)
+            atomic_store_explicit(&file_levels[i].level, -1, memory_order_relaxed);
+    }
+    update_threshold();
+    pthread_mutex_unlock(&levels_mutex);
+}
+
+int get_file_log_levels(log_file_level* levels, int max_count)
+{
+    int stored = 0;
+    pthread_mutex_lock(&levels_mutex);
+    int count = atomic_load_explicit(&file_level_count, memory_order_relaxed);
+    for (int i = 0; i < count && stored < max_count; ++i)
+    {
+        int level = atomic_load_explicit(&file_levels[i].level, memory_order_relaxed);
+        if (level < 0)
+            continue;
+        memcpy(levels[stored].prefix, file_levels[i].prefix, sizeof(levels[stored].prefix));
+        levels[stored].level = (log_level)level;
+        stored++;
+    }
+    pthread_mutex_unlock(&levels_mutex);
+    return stored;
+}
 
-        // Add the new log file to the logs array
-        for (int i = 0; i < MAX_LOG_FILES; ++i)
+int parse_log_level(const char* name, log_level* level)
+{
+    static const log_level levels[] = { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i)
+    {
+        if (strcasecmp(name, get_log_level_name(levels[i])) == 0)
         {
-            if (logs.array[i] == NULL)
-            {
-                logs.array[i] = (struct logger*)malloc(sizeof(logger));
-                logs.array[i]->filename = (char*)malloc(strlen(full_path) + 1);
-                if (logs.array[i]->filename == NULL)
-                {
-                    perror("Failed to allocate memory for filename");
-                    free(logs.array[i]);
-                    logs.array[i] = NULL;
-                    fclose(log);
-                    pthread_mutex_unlock(&logs.log_mutex);
-                    return;
-                }
-                snprintf(logs.array[i]->filename, strlen(full_path) + 1, "%s", full_path);
-                logs.array[i]->file = log;
-                break;
-            }
+            *level = levels[i];
+            return 0;
         }
     }
+    return -1;
+}
 
-    int timeout = 0;
-    int error = 0;
+/**
+ * apply_rotation_config:
+ *   Apply a "rotate [prefix] option..." line of the config file, the options not given keep the
+ *   current rotation of the prefix. Returns 0 if successful, -1 if the line is invalid.
+ */
+static int apply_rotation_config(char* line)
+{
+    char* save = NULL;
+    strtok_r(line, " \t\r\n", &save);
+    char* token = strtok_r(NULL, " \t\r\n", &save);
+    const char* prefix = NULL;
+    if (token != NULL && strchr(token, '=') == NULL)
+    {
+        prefix = token;
+        token = strtok_r(NULL, " \t\r\n", &save);
+    }
+    if (token == NULL)
+        return -1;
 
-    error = flock(fileno(log), LOCK_EX | LOCK_NB);
-    while (error == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+    log_rotation rotation;
+    if (prefix != NULL)
+        get_file_log_rotation(prefix, &rotation);
+    else
+        get_log_rotation(&rotation);
+    for (; token != NULL; token = strtok_r(NULL, " \t\r\n", &save))
     {
-        usleep(LOCKED_FILE_RETRY_TIME);
-        timeout += LOCKED_FILE_RETRY_TIME;
+        if (parse_log_rotation_option(token, &rotation) < 0)
+            return -1;
+    }
+    if (prefix == NULL)
+    {
+        set_log_rotation(&rotation);
+        return 0;
+    }
+    return set_file_log_rotation(prefix, &rotation);
+}
 
-        if (timeout > LOCKED_FILE_TIMEOUT)
+int load_log_config(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+        return -1;
+
+    int applied = 0;
+    int line_number = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        char first[MAX_FILENAME_LENGTH];
+        char second[32];
+        char extra[2];
+        int fields = sscanf(line, "%255s %31s %1s", first, second, extra);
+        if (fields <= 0)
+            continue;
+        log_level level;
+        int is_valid = 0;
+        if (strcmp(first, "rotate") == 0)
+            is_valid = apply_rotation_config(line) == 0;
+        else if (fields == 1 && parse_log_level(first, &level) == 0)
         {
-            fprintf(stderr, "Log file locking timed out: %s\n", full_path);
-            pthread_mutex_unlock(&logs.log_mutex);
-            return;
+            set_log_level(level);
+            is_valid = 1;
         }
-        error = flock(fileno(log), LOCK_EX | LOCK_NB);
+        else if (fields == 2 && parse_log_level(second, &level) == 0)
+            is_valid = set_file_log_level(first, level) == 0;
+
+        if (is_valid)
+            applied++;
+        else
+            log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Invalid line %d in %s", line_number,
+                filename);
+    }
+    fclose(file);
+    return applied;
+}
+
+void set_log_rotation(const log_rotation* rotation)
+{
+    pthread_mutex_lock(&rotation_mutex);
+    default_rotation = *rotation;
+    pthread_mutex_unlock(&rotation_mutex);
+}
+
+void get_log_rotation(log_rotation* rotation)
+{
+    pthread_mutex_lock(&rotation_mutex);
+    *rotation = default_rotation;
+    pthread_mutex_unlock(&rotation_mutex);
+}
+
+int set_file_log_rotation(const char* prefix, const log_rotation* rotation)
+{
+    size_t prefix_len = strnlen(prefix, MAX_FILENAME_LENGTH - 1);
+    if (prefix_len == 0)
+        return -1;
+
+    pthread_mutex_lock(&rotation_mutex);
+    log_rotation_rule* rule = NULL;
+    for (int i = 0; i < rotation_rule_count && rule == NULL; ++i)
+    {
+        if (strlen(rotation_rules[i].prefix) == prefix_len &&
+            strncmp(rotation_rules[i].prefix, prefix, prefix_len) == 0)
+            rule = &rotation_rules[i];
+    }
+    if (rule == NULL)
+    {
+        if (rotation_rule_count >= LOG_MAX_ROTATION_RULES)
+        {
+            pthread_mutex_unlock(&rotation_mutex);
+            return -1;
+        }
+        rule = &rotation_rules[rotation_rule_count++];
+        memcpy(rule->prefix, prefix, prefix_len);
+        rule->prefix[prefix_len] = '\0';
+    }
+    rule->rotation = *rotation;
+    pthread_mutex_unlock(&rotation_mutex);
+    return 0;
+}
+
+void clear_file_log_rotation(const char* prefix)
+{
+    pthread_mutex_lock(&rotation_mutex);
+    for (int i = 0; i < rotation_rule_count; ++i)
+    {
+        if (strncmp(rotation_rules[i].prefix, prefix, MAX_FILENAME_LENGTH) == 0)
+        {
+            rotation_rules[i] = rotation_rules[--rotation_rule_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rotation_mutex);
+}
+
+void get_file_log_rotation(const char* filename, log_rotation* rotation)
+{
+    pthread_mutex_lock(&rotation_mutex);
+    find_rotation(filename, rotation);
+    pthread_mutex_unlock(&rotation_mutex);
+}
+
+int get_file_log_rotations(log_rotation_rule* rules, int max_count)
+{
+    pthread_mutex_lock(&rotation_mutex);
+    int count = rotation_rule_count < max_count ? rotation_rule_count : max_count;
+    memcpy(rules, rotation_rules, (size_t)count * sizeof(log_rotation_rule));
+    pthread_mutex_unlock(&rotation_mutex);
+    return count;
+}
+
+int parse_log_rotation_option(const char* option, log_rotation* rotation)
+{
+    const char* value = strchr(option, '=');
+    if (value == NULL)
+        return -1;
+    size_t key_len = (size_t)(value - option);
+    value++;
+
+    if (key_len == 8 && strncmp(option, "compress", key_len) == 0)
+    {
+        if (strcasecmp(value, "yes") == 0)
+            rotation->compress = 1;
+        else if (strcasecmp(value, "no") == 0)
+            rotation->compress = 0;
+        else
+            return -1;
+        return 0;
     }
 
-    fseek(log, 0, SEEK_END);
+    if (!isdigit((unsigned char)value[0]))
+        return -1;
+    char* end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (errno != 0)
+        return -1;
+    unsigned long long multiplier = 1;
+    if (key_len == 4 && strncmp(option, "size", key_len) == 0)
+    {
+        switch (toupper((unsigned char)*end))
+        {
+        case 'K': multiplier = 1024ULL; break;
+        case 'M': multiplier = 1024ULL * 1024; break;
+        case 'G': multiplier = 1024ULL * 1024 * 1024; break;
+        }
+        if (multiplier > 1)
+            end++;
+        if (*end != '\0')
+            return -1;
+        rotation->max_size = number * multiplier;
+    }
+    else if (key_len == 3 && strncmp(option, "age", key_len) == 0)
+    {
+        switch (*end)
+        {
+        case 's': end++; break;
+        case 'm': multiplier = 60; end++; break;
+        case 'h': multiplier = 3600; end++; break;
+        case 'd': multiplier = 86400; end++; break;
+        }
+        if (*end != '\0')
+            return -1;
+        rotation->max_age = number * multiplier;
+    }
+    else if (key_len == 4 && strncmp(option, "keep", key_len) == 0)
+    {
+        if (*end != '\0' || number > INT32_MAX)
+            return -1;
+        rotation->keep = (int)number;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+size_t get_pending_log_compressions()
+{
+    pthread_mutex_lock(&compress_mutex);
+    size_t pending = compress_pending;
+    pthread_mutex_unlock(&compress_mutex);
+    return pending;
+}
 
-    const char* level_str;
+void set_log_format(log_format format)
+{
+    atomic_store_explicit(&current_format, format, memory_order_relaxed);
+}
+
+log_format get_log_format()
+{
+    return (log_format)atomic_load_explicit(&current_format, memory_order_relaxed);
+}
+
+const char* get_log_level_name(log_level level)
+{
     switch (level)
     {
-    case LOG_DEBUG: level_str = "DEBUG"; break;
-    case LOG_INFO: level_str = "INFO"; break;
-    case LOG_WARN: level_str = "WARN"; break;
-    case LOG_ERROR: level_str = "ERROR"; break;
-    case LOG_FATAL: level_str = "FATAL"; break;
-    default: level_str = "UNKNOWN"; break;
+    case LOG_DEBUG: return "DEBUG";
+    case LOG_INFO: return "INFO";
+    case LOG_WARN: return "WARN";
+    case LOG_ERROR: return "ERROR";
+    case LOG_FATAL: return "FATAL";
+    default: return "UNKNOWN";
     }
+}
 
-    char timestamp[TIMESTAMP_LENGTH];
-    get_formatted_timestamp(timestamp, TIMESTAMP_LENGTH);
+int parse_log_format(const char* format, log_format_spec* specs, int max_specs)
+{
+    int count = 0;
+    for (size_t i = 0; format[i] != '\0'; ++i)
+    {
+        if (format[i] != '%')
+            continue;
+        size_t start = i++;
+        if (format[i] == '%')
+            continue;
 
-    char message[1024];
-    va_list args;
-    va_start(args, format);
-    vsnprintf(message, sizeof(message), format, args);
-    va_end(args);
+        while (format[i] != '\0' && strchr("-+ #0", format[i]) != NULL)
+            i++;
+        while (isdigit((unsigned char)format[i]))
+            i++;
+        if (format[i] == '.')
+        {
+            i++;
+            while (isdigit((unsigned char)format[i]))
+                i++;
+        }
+        if (format[i] == '*')
+            return -1;
 
-    fprintf(log, "%s - %s - %s - %s\n", timestamp, level_str, source_file, message);
+        // 'H' stands for hh and 'q' for ll
+        char modifier = '\0';
+        if (format[i] == 'h' || format[i] == 'l')
+        {
+            modifier = format[i++];
+            if (format[i] == modifier)
+            {
+                modifier = modifier == 'h' ? 'H' : 'q';
+                i++;
+            }
+        }
+        else if (format[i] == 'z' || format[i] == 'j' || format[i] == 't')
+            modifier = format[i++];
+
+        log_arg_type type;
+        switch (format[i])
+        {
+        case 'd':
+        case 'i':
+            type = modifier == 'l' ? LOG_ARG_LONG : modifier == 'q' ? LOG_ARG_LLONG :
+                modifier == 'z' ? LOG_ARG_SIZE : modifier == 'j' ? LOG_ARG_INTMAX :
+                modifier == 't' ? LOG_ARG_PTRDIFF : LOG_ARG_INT;
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            type = modifier == 'l' ? LOG_ARG_ULONG : modifier == 'q' ? LOG_ARG_ULLONG :
+                modifier == 'z' ? LOG_ARG_SIZE : modifier == 'j' ? LOG_ARG_UINTMAX :
+                modifier == 't' ? LOG_ARG_PTRDIFF : LOG_ARG_UINT;
+            break;
+        case 'c':
+            if (modifier != '\0')
+                return -1;
+            type = LOG_ARG_INT;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (modifier != '\0' && modifier != 'l')
+                return -1;
+            type = LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            if (modifier != '\0')
+                return -1;
+            type = LOG_ARG_STRING;
+            break;
+        case 'p':
+            if (modifier != '\0')
+                return -1;
+            type = LOG_ARG_POINTER;
+            break;
+        default:
+            return -1;
+        }
+        if (count >= max_specs)
+            return -1;
+        specs[count].type = type;
+        specs[count].start = start;
+        specs[count].length = i - start + 1;
+        count++;
+    }
+    return count;
+}
 
-    fflush(log);
+void set_combined_peer_logs(int enabled)
+{
+    atomic_store_explicit(&combined_peer_logs, enabled != 0, memory_order_relaxed);
+}
 
-    flock(fileno(log), LOCK_UN);
+int get_combined_peer_logs()
+{
+    return atomic_load_explicit(&combined_peer_logs, memory_order_relaxed);
+}
 
+void get_log_sink_counts(size_t* sinks, size_t* open_files)
+{
+    pthread_mutex_lock(&logs.log_mutex);
+    *sinks = logs.count;
+    *open_files = logs.open_count;
     pthread_mutex_unlock(&logs.log_mutex);
 }
 
+uint64_t get_dropped_log_records()
+{
+    return atomic_load_explicit(&dropped_records, memory_order_relaxed);
+}
+
 void finish_logging()
 {
     while (logs.is_initializing)
     {
         usleep(10000); // 10 ms
     }
+    pthread_once(&ring_once, init_rings);
+    pthread_mutex_lock(&writer_mutex);
+    int was_running = writer_running;
+    atomic_store(&writer_stop, 1);
+    pthread_cond_signal(&writer_cond);
+    writer_running = 0;
+    pthread_mutex_unlock(&writer_mutex);
+    if (was_running)
+        pthread_join(writer_thread, NULL);
+
     pthread_mutex_lock(&logs.log_mutex);
-    for (int i = 0; i < MAX_LOG_FILES; ++i)
+    for (int i = 0; i < LOG_SINK_BUCKETS; ++i)
     {
-        if (logs.array[i] != NULL)
+        while (logs.buckets[i] != NULL)
         {
-            fclose(logs.array[i]->file);
-            if (logs.array[i]->filename != NULL)
-                free(logs.array[i]->filename);
-            free(logs.array[i]);
-            logs.array[i] = NULL;
+            logger* log = logs.buckets[i];
+            logs.buckets[i] = log->next;
+            if (log->file != NULL)
+                close_sink(log);
+            free(log->name);
+            free(log->filename);
+            free(log->defined_strings);
+            free(log);
         }
     }
+    logs.count = 0;
     pthread_mutex_unlock(&logs.log_mutex);
+
+    pthread_mutex_lock(&compress_mutex);
+    int was_compressing = compress_running;
+    compress_stop = 1;
+    pthread_cond_signal(&compress_cond);
+    compress_running = 0;
+    pthread_mutex_unlock(&compress_mutex);
+    if (was_compressing)
+        pthread_join(compress_thread, NULL);
     if (logs_dir != NULL)
     {
         free((void*)logs_dir);
@@ -0,0 +1,193 @@
+#include "message.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "hash.h"
+
+// Checksum of the empty payload of e.g. 'verack' and 'getaddr': first 4 bytes of double-SHA256("")
+static const unsigned char empty_checksum[4] = { 0x5d, 0xf6, 0xe0, 0xe2 };
+
+void compute_checksum(const unsigned char* payload, size_t payload_len, unsigned char out[4])
+{
+    if (payload_len == 0)
+    {
+        memcpy(out, empty_checksum, 4);
+        return;
+    }
+
+    unsigned char hash[HASH_SIZE];
+    double_sha256(payload, payload_len, hash);
+
+    // Copy first 4 bytes to out
+    memcpy(out, hash, 4);
+}
+
+size_t build_message(
+    unsigned char* buf,
+    size_t buf_size,
+    const char* command,
+    const unsigned char* payload,
+    size_t payload_len)
+{
+    if (buf_size < (sizeof(bitcoin_msg_header) + payload_len))
+    {
+        return 0;
+    }
+
+    // Prepare the header
+    bitcoin_msg_header header;
+    memset(&header, 0, sizeof(header));
+
+    header.magic = BITCOIN_MAINNET_MAGIC;
+
+    // Zero out the command field, then copy up to 12 bytes
+    memset(header.command, 0, sizeof(header.command));
+    {
+        size_t cmd_len = strlen(command);
+        if (cmd_len > sizeof(header.command))
+        {
+            cmd_len = sizeof(header.command);
+        }
+        memcpy(header.command, command, cmd_len);
+    }
+
+    header.length = payload_len;
+
+    // Compute the checksum of the payload
+    unsigned char csum[4];
+    compute_checksum(payload, payload_len, csum);
+    memcpy(&header.checksum, csum, 4);
+
+    // Copy header into buf, then the payload
+    memcpy(buf, &header, sizeof(header));
+    if (payload_len > 0)
+        memcpy(buf + sizeof(header), payload, payload_len);
+
+    return sizeof(header) + payload_len;
+}
+
+int init_message_buffer(message_buffer* buffer)
+{
+    buffer->data = (unsigned char*)malloc(MESSAGE_BUFFER_INITIAL_SIZE);
+    if (buffer->data == NULL)
+    {
+        buffer->capacity = 0;
+        buffer->start = 0;
+        buffer->end = 0;
+        return -1;
+    }
+    buffer->capacity = MESSAGE_BUFFER_INITIAL_SIZE;
+    buffer->start = 0;
+    buffer->end = 0;
+    return 0;
+}
+
+void free_message_buffer(message_buffer* buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->start = 0;
+    buffer->end = 0;
+}
+
+/**
+ * reserve_space:
+ *   Make sure at least `needed` bytes are free after the end of the received data, compacting the
+ *   unconsumed bytes to the front first and growing the buffer only if that is not enough.
+ */
+static int reserve_space(message_buffer* buffer, size_t needed)
+{
+    size_t pending = buffer->end - buffer->start;
+
+    // Drop memory kept after an unusually large message once it has been consumed
+    if (pending == 0 && buffer->capacity > MESSAGE_BUFFER_INITIAL_SIZE * 16)
+    {
+        unsigned char* data = (unsigned char*)realloc(buffer->data, MESSAGE_BUFFER_INITIAL_SIZE);
+        if (data != NULL)
+        {
+            buffer->data = data;
+            buffer->capacity = MESSAGE_BUFFER_INITIAL_SIZE;
+        }
+    }
+
+    if (buffer->capacity - buffer->end >= needed)
+        return 0;
+
+    if (buffer->start > 0)
+    {
+        memmove(buffer->data, buffer->data + buffer->start, pending);
+        buffer->start = 0;
+        buffer->end = pending;
+        if (buffer->capacity - buffer->end >= needed)
+            return 0;
+    }
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : MESSAGE_BUFFER_INITIAL_SIZE;
+    if (capacity < pending + needed)
+        capacity = pending + needed;
+    unsigned char* data = (unsigned char*)realloc(buffer->data, capacity);
+    if (data == NULL)
+        return -1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+ssize_t message_buffer_recv(message_buffer* buffer, int fd)
+{
+    size_t pending = buffer->end - buffer->start;
+    size_t needed = MESSAGE_BUFFER_MIN_READ;
+
+    // Make room for the rest of a partially received message at once
+    if (pending >= sizeof(bitcoin_msg_header))
+    {
+        const bitcoin_msg_header* hdr = (const bitcoin_msg_header*)(buffer->data + buffer->start);
+        if (hdr->magic == BITCOIN_MAINNET_MAGIC && hdr->length <= MAX_MESSAGE_PAYLOAD_SIZE)
+        {
+            size_t message_size = sizeof(bitcoin_msg_header) + hdr->length;
+            if (message_size > pending && message_size - pending > needed)
+                needed = message_size - pending;
+        }
+    }
+
+    if (reserve_space(buffer, needed) != 0)
+        return -1;
+
+    ssize_t bytes_received = recv(fd, buffer->data + buffer->end, buffer->capacity - buffer->end, 0);
+    if (bytes_received > 0)
+        buffer->end += bytes_received;
+    return bytes_received;
+}
+
+message_status message_buffer_next(message_buffer* buffer, message_view* view)
+{
+    size_t pending = buffer->end - buffer->start;
+    if (pending < sizeof(bitcoin_msg_header))
+        return MESSAGE_INCOMPLETE;
+
+    const bitcoin_msg_header* hdr = (const bitcoin_msg_header*)(buffer->data + buffer->start);
+    if (hdr->magic != BITCOIN_MAINNET_MAGIC || hdr->length > MAX_MESSAGE_PAYLOAD_SIZE)
+        return MESSAGE_INVALID;
+
+    size_t message_size = sizeof(bitcoin_msg_header) + hdr->length;
+    if (pending < message_size)
+        return MESSAGE_INCOMPLETE;
+
+    view->header = hdr;
+    view->command = get_command_id(hdr->command);
+    view->payload = buffer->data + buffer->start + sizeof(bitcoin_msg_header);
+    view->payload_len = hdr->length;
+    buffer->start += message_size;
+
+    unsigned char csum[4];
+    compute_checksum(view->payload, view->payload_len, csum);
+    if (memcmp(csum, hdr->checksum, 4) != 0)
+        return MESSAGE_BAD_CHECKSUM;
+    count_command(view->command, view->payload_len);
+    return MESSAGE_COMPLETE;
+}
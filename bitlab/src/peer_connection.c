@@ -11,16 +11,22 @@
 #include <time.h>
 #include <errno.h>
 #include <stdint.h> // for uint64_t, etc.
-#include <openssl/sha.h> // For SHA-256
 #include <pthread.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <stdbool.h>
 #include <bits/pthreadtypes.h>
 
 #include "peer_queue.h"
+#include "addrman.h"
 #include "utils.h"
 #include "log.h"
 #include "ip.h"
+#include "event_loop.h"
+#include "hash.h"
+#include "header_index.h"
+#include "block_download.h"
+#include "block_store.h"
 
 // Global array to hold connected nodes
 Node nodes[MAX_NODES];
@@ -30,26 +36,18 @@ void handle_inv_message(int idx, const unsigned char* payload, size_t payload_le
 size_t build_getblocks_message(unsigned char* buffer, size_t buffer_size, const unsigned char* block_locator, size_t locator_count);
 size_t write_var_int(unsigned char* buf, uint64_t value);
 void decode_transactions(const unsigned char* block_data, size_t block_len);
-
-/**
- * compute_checksum:
- *   Calculate the double-SHA256 of the payload, then copy the first 4 bytes
- *   into `out[4]` as the checksum.
- */
-static void compute_checksum(const unsigned char* payload, size_t payload_len,
-    unsigned char out[4])
-{
-    unsigned char hash1[SHA256_DIGEST_LENGTH];
-    unsigned char hash2[SHA256_DIGEST_LENGTH];
-
-    // First SHA-256
-    SHA256(payload, payload_len, hash1);
-    // Second SHA-256
-    SHA256(hash1, SHA256_DIGEST_LENGTH, hash2);
-
-    // Copy first 4 bytes to out
-    memcpy(out, hash2, 4);
-}
+static void handle_peer_message(Node* node, const message_view* view, const char* log_filename);
+static int queue_message(Node* node, const unsigned char* msg, size_t msg_len);
+static int queue_file_message(Node* node, const unsigned char* header, size_t header_len,
+    const char* path, off_t file_offset, size_t len);
+static void send_headers_from(Node* node, int start_height, const unsigned char* stop_hash);
+static peer_request* send_request(Node* node, const unsigned char* msg, size_t msg_len,
+    command_id command, int expected, int timeout_ms, request_callback callback, void* ctx);
+static int finish_waiting(Node* node, peer_request* request);
+static peer_request* send_getdata(Node* node, const unsigned char* hashes, size_t hash_count);
+static void expire_connections(void* ctx);
+static int send_request_and_wait(Node* node, const unsigned char* msg, size_t msg_len,
+    command_id command, int expected, int timeout_ms, request_callback callback, void* ctx);
 
 /**
  * build_version_payload:
@@ -57,7 +55,7 @@ static void compute_checksum(const unsigned char* payload, size_t payload_len,
  *     protocol version, services, timestamp, addr_recv, addr_from, nonce,
  *     user agent, start_height, and relay.
  */
-static size_t build_version_payload(unsigned char* buf, size_t buf_size)
+size_t build_version_payload(unsigned char* buf, size_t buf_size)
 {
     // We need at least 86 bytes for a minimal version message
     if (buf_size < 86)
@@ -126,55 +124,6 @@ static size_t build_version_payload(unsigned char* buf, size_t buf_size)
     return offset; // total payload size
 }
 
-/**
- * build_message:
- *   Creates a Bitcoin P2P message (header + payload) in `buf`.
- *   The 'command' is zero-padded to 12 bytes. The payload is appended.
- *   We compute the 4-byte double-SHA256 checksum.
- */
-static size_t build_message(
-    unsigned char* buf,
-    size_t buf_size,
-    const char* command,
-    const unsigned char* payload,
-    size_t payload_len)
-{
-    if (buf_size < (sizeof(bitcoin_msg_header) + payload_len))
-    {
-        return 0;
-    }
-
-    // Prepare the header
-    bitcoin_msg_header header;
-    memset(&header, 0, sizeof(header));
-
-    header.magic = BITCOIN_MAINNET_MAGIC;
-
-    // Zero out the command field, then copy up to 12 bytes
-    memset(header.command, 0, sizeof(header.command));
-    {
-        size_t cmd_len = strlen(command);
-        if (cmd_len > sizeof(header.command))
-        {
-            cmd_len = sizeof(header.command);
-        }
-        memcpy(header.command, command, cmd_len);
-    }
-
-    header.length = payload_len;
-
-    // Compute the checksum of the payload
-    unsigned char csum[4];
-    compute_checksum(payload, payload_len, csum);
-    memcpy(&header.checksum, csum, 4);
-
-    // Copy header into buf, then the payload
-    memcpy(buf, &header, sizeof(header));
-    memcpy(buf + sizeof(header), payload, payload_len);
-
-    return sizeof(header) + payload_len;
-}
-
 size_t build_getheaders_message(unsigned char* buffer, size_t buffer_size, const unsigned char* block_locator, size_t locator_count)
 {
     if (buffer_size < sizeof(bitcoin_msg_header) + 37)
@@ -208,9 +157,7 @@ size_t build_getheaders_message(unsigned char* buffer, size_t buffer_size, const
 
 void compute_block_hash(const unsigned char* block_header, unsigned char* output_hash)
 {
-    unsigned char hash1[32];
-    SHA256(block_header, 80, hash1); // First SHA-256
-    SHA256(hash1, 32, output_hash);  // Second SHA-256
+    double_sha256(block_header, 80, output_hash);
 }
 
 size_t write_var_int(unsigned char* buffer, uint64_t value)
@@ -276,16 +223,72 @@ void list_connected_nodes()
             guarded_print_line(" IP Address: %s", nodes[i].ip_address);
             guarded_print_line(" Port: %u", nodes[i].port);
             guarded_print_line(" Socket FD: %d", nodes[i].socket_fd);
-            guarded_print_line(" Thread ID: %lu", nodes[i].thread);
             guarded_print_line(" Is Connected: %d", nodes[i].is_connected);
-            guarded_print_line(" Is operation in progress: %d",
-                nodes[i].operation_in_progress);
+            guarded_print_line(" Inbound: %d", nodes[i].is_inbound);
+            guarded_print_line(" Blocks served: %llu",
+                (unsigned long long)nodes[i].blocks_served);
+            guarded_print_line(" Pending requests: %d",
+                count_requests(&nodes[i].requests));
             guarded_print_line(" Compact blocks: %lu",
                 nodes[i].compact_blocks);
             guarded_print_line(" Fee_rate: %lu",
                 nodes[i].fee_rate);
+            if (nodes[i].rtt_samples > 0)
+                guarded_print_line(" RTT: %.1f ms (min %u ms, max %u ms, %u samples)",
+                    nodes[i].rtt_ms, nodes[i].rtt_min_ms, nodes[i].rtt_max_ms,
+                    nodes[i].rtt_samples);
+            else
+                guarded_print_line(" RTT: not measured");
+            guarded_print_line(" Throughput: %.1f KiB/s",
+                nodes[i].throughput / 1024);
+            guarded_print_line(" Failures: %u", nodes[i].failures);
+            guarded_print_line(" Score: %.1f", get_peer_score(i));
+        }
+    }
+}
+
+double get_peer_score(int idx)
+{
+    if (idx < 0 || idx >= MAX_NODES || nodes[idx].is_connected != 1)
+        return -1;
+    const Node* node = &nodes[idx];
+
+    // Peers without a measured round-trip time are neither preferred nor avoided
+    double rtt_ms = node->rtt_samples > 0 ? node->rtt_ms : PEER_SCORE_RTT_REFERENCE_MS;
+    double latency_score = 100 * PEER_SCORE_RTT_REFERENCE_MS / (PEER_SCORE_RTT_REFERENCE_MS + rtt_ms);
+    double throughput_score = 100 * node->throughput /
+        (node->throughput + PEER_SCORE_THROUGHPUT_REFERENCE);
+    return (latency_score + throughput_score) / (1 + node->failures);
+}
+
+int get_peers_by_score(int* indices, int max_count)
+{
+    int count = 0;
+    double scores[MAX_NODES];
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        double score = get_peer_score(i);
+        if (score < 0)
+            continue;
+
+        // Insertion into the list sorted from the best score, the worst falls off when full
+        int pos = count;
+        while (pos > 0 && scores[pos - 1] < score)
+            pos--;
+        if (pos >= max_count)
+            continue;
+        int last = count < max_count ? count : max_count - 1;
+        for (int j = last; j > pos; --j)
+        {
+            indices[j] = indices[j - 1];
+            scores[j] = scores[j - 1];
         }
+        indices[pos] = i;
+        scores[pos] = score;
+        if (count < max_count)
+            count++;
     }
+    return count;
 }
 
 int get_idx(const char* ip_address)
@@ -300,308 +303,195 @@ int get_idx(const char* ip_address)
     return -1;
 }
 
-void send_getaddr_and_wait(int idx)
+/**
+ * handle_addr_response:
+ *   Print the addresses received in response to 'getaddr', record them in the address manager
+ *   with the node as their source and add them to the peer queue.
+ */
+static void handle_addr_response(void* ctx, const unsigned char* payload_data, size_t payload_len)
 {
-    if (idx < 0 || idx >= MAX_NODES || !nodes[idx].is_connected)
-    {
-        fprintf(stderr, "[Error] Invalid node index or node not connected.\n");
-        return;
-    }
-
-    Node* node = &nodes[idx];
+    Node* node = (Node*)ctx;
     char log_filename[256];
     snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
         node->ip_address);
 
-    // Build the 'getaddr' message
-    unsigned char getaddr_msg[sizeof(bitcoin_msg_header)];
-    size_t msg_len = build_message(getaddr_msg, sizeof(getaddr_msg), "getaddr", NULL,
-        0);
-    if (msg_len == 0)
-    {
-        fprintf(stderr, "[Error] Failed to build 'getaddr' message.\n");
-        return;
-    }
+    log_message(LOG_INFO, log_filename, __FILE__, "[!] Received addr command ");
+
+    size_t offset = 0;
 
-    // Send the 'getaddr' message
-    ssize_t bytes_sent = send(node->socket_fd, getaddr_msg, msg_len, 0);
-    if (bytes_sent < 0)
+    // Check if the payload length is sufficient to read the count of address entries
+    if (payload_len < 1)
     {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to send 'getaddr' message: %s", strerror(errno));
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Insufficient payload length to read address count");
         return;
     }
 
-    log_message(LOG_INFO, log_filename, __FILE__, "Sent 'getaddr' message.");
-    node->operation_in_progress = 1;
+    // Read the count of address entries (var_int)
+    uint64_t count = read_var_int(payload_data + offset, &offset);
 
-    // Wait for 10 seconds for a response
-    struct timeval tv;
-    tv.tv_sec = 3;
-    tv.tv_usec = 0;
-    setsockopt(node->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-    char buffer[32768];
-    size_t total_bytes_received = 0;
-    ssize_t bytes_received;
-
-    // Receive the message in parts
-    while (total_bytes_received < sizeof(bitcoin_msg_header))
-    {
-        log_message(LOG_INFO, log_filename, __FILE__, "first while receiving");
-        bytes_received = recv(node->socket_fd, buffer + total_bytes_received,
-            sizeof(buffer) - total_bytes_received - 1, 0);
-        if (bytes_received <= 0)
-        {
-            log_message(LOG_INFO, log_filename, __FILE__, "Recv 1 failed: %s",
-                strerror(errno));
-            node->is_connected = 0;
-            node->operation_in_progress = 0;
-            return;
-        }
-        total_bytes_received += bytes_received;
-    }
+    // The netgroup of the announcing node selects the new buckets of the addresses
+    Peer source;
+    if (!parse_peer(node->ip_address, node->port, &source))
+        memset(&source, 0, sizeof(source));
 
-    bitcoin_msg_header* hdr = (bitcoin_msg_header*)buffer;
-    size_t payload_len = hdr->length;
-    size_t message_size = sizeof(bitcoin_msg_header) + payload_len;
-    int retry_count = 0;
-    const int max_retries = 1;
+    // Log the count of address entries
+    log_message(LOG_INFO, log_filename, __FILE__, "Address count: %llu", count);
 
-    while (total_bytes_received < message_size)
+    // Ensure count does not exceed the maximum allowed entries
+    if (count > MAX_ADDR_COUNT)
     {
-        log_message(LOG_INFO, log_filename, __FILE__, "second while receiving");
-        bytes_received = recv(node->socket_fd, buffer + total_bytes_received,
-            sizeof(buffer) - total_bytes_received - 1, 0);
-        if (bytes_received <= 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                log_message(LOG_INFO, log_filename, __FILE__,
-                    "second while receiving inside if errno");
-                // Resource temporarily unavailable, continue receiving
-
-                if (++retry_count >= max_retries)
-                {
-                    log_message(LOG_WARN, log_filename, __FILE__,
-                        "Max retries reached, stopping recv.");
-                    node->is_connected = 0;
-                    node->operation_in_progress = 0;
-                    break;
-                }
-                continue;
-            }
-            log_message(LOG_INFO, log_filename, __FILE__, "Recv failed: %s",
-                strerror(errno));
-            node->is_connected = 0;
-            node->operation_in_progress = 0;
-            return;
-        }
-        total_bytes_received += bytes_received;
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Address count exceeds maximum allowed: %llu", count);
+        return;
     }
 
-    buffer[total_bytes_received] = '\0'; // Null-terminate the received data
-
-    if (hdr->magic == BITCOIN_MAINNET_MAGIC)
+    for (uint64_t i = 0; i < count; i++)
     {
-        char cmd_name[13];
-        memset(cmd_name, 0, sizeof(cmd_name));
-        memcpy(cmd_name, hdr->command, 12);
-
-        log_message(LOG_INFO, log_filename, __FILE__, "[!] Received %s command ",
-            cmd_name);
-
-        const unsigned char* payload_data = (unsigned char*)buffer + sizeof(
-            bitcoin_msg_header);
-
-
-        if (strcmp(cmd_name, "addr") == 0)
+        if (offset + ADDR_ENTRY_SIZE > payload_len)
         {
-            size_t offset = 0;
-
-            // Check if the payload length is sufficient to read the count of address entries
-            if (payload_len < 1)
-            {
-                log_message(LOG_WARN, log_filename, __FILE__,
-                    "Insufficient payload length to read address count");
+            log_message(LOG_WARN, log_filename, __FILE__,
+                "Insufficient payload length for address entry");
                 return;
-            }
-
-            // Read the count of address entries (var_int)
-            uint64_t count = read_var_int(payload_data + offset, &offset);
-
-            // Log the count of address entries
-            log_message(LOG_INFO, log_filename, __FILE__, "Address count: %llu", count);
+        }
 
-            // Ensure count does not exceed the maximum allowed entries
-            if (count > 1000)
-            {
-                log_message(LOG_WARN, log_filename, __FILE__,
-                    "Address count exceeds maximum allowed: %llu", count);
-                return;
-            }
+        // Timestamp and services are little-endian, the port is big-endian
+        const unsigned char* entry = payload_data + offset;
+        Peer peer;
+        memset(&peer, 0, sizeof(peer));
+        peer.timestamp = (uint32_t)entry[0] | (uint32_t)entry[1] << 8 | (uint32_t)entry[2] << 16 |
+            (uint32_t)entry[3] << 24;
+        for (int j = 7; j >= 0; --j)
+            peer.services = peer.services << 8 | entry[4 + j];
+        memcpy(peer.addr, entry + 12, 16);
+        peer.port = (uint16_t)(entry[28] << 8 | entry[29]);
+        offset += ADDR_ENTRY_SIZE;
+
+        // Convert IP to string only for display
+        char ip_str[PEER_IP_STRLEN];
+        format_peer_ip(&peer, ip_str, sizeof(ip_str));
+
+        // Check if it's a valid IPv4 address
+        if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr*)peer.addr) && is_valid_ipv4(ip_str) &&
+            !is_in_private_network(ip_str))
+        {
+            // Guarded print of the IP address and port
+            guarded_print_line("Valid IPv4 Peer: %s:%u (timestamp: %u)", ip_str,
+                peer.port, peer.timestamp);
 
-            for (uint64_t i = 0; i < count; i++)
-            {
-                if (offset + 30 > payload_len)
-                {
-                    log_message(LOG_WARN, log_filename, __FILE__,
-                        "Insufficient payload length for address entry");
-                    return;
-                }
-
-                // Read timestamp (4 bytes)
-                uint32_t timestamp;
-                memcpy(&timestamp, payload_data + offset, 4);
-                timestamp = ntohl(timestamp);
-                offset += 4;
-
-                // Read services (8 bytes, skip for now)
-                offset += 8;
-
-                // Read IP address (16 bytes)
-                struct in6_addr ip_addr;
-                memcpy(&ip_addr, payload_data + offset, 16);
-                offset += 16;
-
-                // Read port (2 bytes)
-                uint16_t port;
-                memcpy(&port, payload_data + offset, 2);
-                port = ntohs(port);
-                offset += 2;
-
-                // Convert IP to string
-                char ip_str[INET6_ADDRSTRLEN];
-                inet_ntop(AF_INET6, &ip_addr, ip_str, INET6_ADDRSTRLEN);
-
-                // Determine if the address is IPv4-mapped or IPv6
-                const char* ip_type = "IPv6";
-                if (IN6_IS_ADDR_V4MAPPED(&ip_addr))
-                {
-                    struct in_addr ipv4_addr;
-                    memcpy(&ipv4_addr, &ip_addr.s6_addr[12], 4);
-                    inet_ntop(AF_INET, &ipv4_addr, ip_str, INET_ADDRSTRLEN);
-                    ip_type = "IPv4";
-                }
-
-                // Check if it's a valid IPv4 address
-                if (strcmp(ip_type, "IPv4") == 0 && is_valid_ipv4(ip_str) && !
-                    is_in_private_network(ip_str))
-                {
-                    // Guarded print of the IP address and port
-                    guarded_print_line("Valid IPv4 Peer: %s:%u (timestamp: %u)", ip_str,
-                        port, timestamp);
-
-                    // Add to peer queue
-                    add_peer_to_queue(ip_str, port);
-
-                    // Log the result if valid
-                    log_message(LOG_INFO, log_filename, __FILE__,
-                        "Received valid IPv4 address: %s:%u (timestamp: %u)",
-                        ip_str, port, timestamp);
-                }
-                else if (strcmp(ip_type, "IPv6") == 0)
-                {
-                    // Log the IPv6 addresses if needed
-                    log_message(LOG_INFO, log_filename, __FILE__,
-                        "Received IPv6 address: %s:%u (timestamp: %u)",
-                        ip_str, port, timestamp);
-                }
-            }
+            // Record in the address manager and add to peer queue
+            addrman_add(&peer, source.addr);
+            add_peer_record(&peer);
 
-            if (offset != payload_len)
-            {
-                log_message(LOG_WARN, log_filename, __FILE__,
-                    "Remaining bytes after processing: %zu",
-                    payload_len - offset);
-            }
+            // Log the result if valid
+            log_message(LOG_INFO, log_filename, __FILE__,
+                "Received valid IPv4 address: %s:%u (timestamp: %u)",
+                ip_str, peer.port, peer.timestamp);
+        }
+        else if (!IN6_IS_ADDR_V4MAPPED((const struct in6_addr*)peer.addr))
+        {
+            // Log the IPv6 addresses if needed
+            log_message(LOG_INFO, log_filename, __FILE__,
+                "Received IPv6 address: %s:%u (timestamp: %u)",
+                ip_str, peer.port, peer.timestamp);
         }
     }
-    else
+
+    if (offset != payload_len)
     {
         log_message(LOG_WARN, log_filename, __FILE__,
-            "else hdr->magic ");
+            "Remaining bytes after processing: %zu",
+            payload_len - offset);
+    }
+}
+
+void send_getaddr_and_wait(int idx)
+{
+    if (idx < 0 || idx >= MAX_NODES || !nodes[idx].is_connected)
+    {
+        fprintf(stderr, "[Error] Invalid node index or node not connected.\n");
+        return;
+    }
+
+    Node* node = &nodes[idx];
+    // Build the 'getaddr' message
+    unsigned char getaddr_msg[sizeof(bitcoin_msg_header)];
+    size_t msg_len = build_message(getaddr_msg, sizeof(getaddr_msg), "getaddr", NULL,
+        0);
+    if (msg_len == 0)
+    {
+        fprintf(stderr, "[Error] Failed to build 'getaddr' message.\n");
+        return;
     }
 
-    node->operation_in_progress = 0;
+    // Wait for 3 seconds for a response
+    send_request_and_wait(node, getaddr_msg, msg_len, COMMAND_ADDR, 1, 3000,
+        handle_addr_response, node);
 }
 
 /**
  * send_addr:
- *   Sends the 'addr' message to the specified socket with the list of peers.
- *   The addresses are converted to IPv6-mapped IPv4 addresses.
+ *   Sends the 'addr' message to the specified socket with the best addresses of the address manager.
+ *   The records are written as they are stored, IPv4 addresses are already IPv6-mapped.
  *
  * Parameters:
- *   sockfd - The socket file descriptor to send the message to.
- *   ip_addr - The IP address of the peer to log the message.
+ *   node - The node to send the message to.
  *
  * Returns:
- *   The number of bytes sent on success, or -1 on failure.
+ *   0 if the message was sent or queued, or -1 on failure.
  */
-ssize_t send_addr(int sockfd, const char* ip_addr)
+int send_addr(Node* node)
 {
     char log_filename[256];
-    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", ip_addr);
-
-    int peer_count;
-    Peer* peers = get_peer_queue(&peer_count);
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
 
-    if (peer_count == 0 || peers == NULL)
+    Peer* peers = (Peer*)malloc(MAX_ADDR_COUNT * sizeof(Peer));
+    size_t peer_count = peers ? addrman_get_addresses(peers, MAX_ADDR_COUNT) : 0;
+    if (peer_count == 0)
     {
         guarded_print_line("[Error] No peers available to send");
+        free(peers);
         return -1;
     }
 
-    // Allocate memory for address payload (IPv4 to IPv6-mapped)
-    size_t payload_size = peer_count * sizeof(struct sockaddr_in6);
-    unsigned char* addr_payload = malloc(payload_size);
-    if (!addr_payload)
+    // The address count followed by the entries
+    size_t payload_size = 9 + peer_count * ADDR_ENTRY_SIZE;
+    size_t msg_size = sizeof(bitcoin_msg_header) + payload_size;
+    unsigned char* addr_msg = (unsigned char*)malloc(msg_size + payload_size);
+    if (!addr_msg)
     {
         perror("malloc failed");
         free(peers);
         return -1;
     }
-
-    // Populate address payload with peer data (IPv6-mapped addresses for IPv4)
-    for (int i = 0; i < peer_count; ++i)
+    unsigned char* addr_payload = addr_msg + msg_size;
+    size_t offset = write_var_int(addr_payload, peer_count);
+    for (size_t i = 0; i < peer_count; ++i)
     {
-        struct sockaddr_in6* addr = (struct sockaddr_in6*)&addr_payload[i * sizeof(
-            struct sockaddr_in6)];
-        memset(addr, 0, sizeof(struct sockaddr_in6));
-        addr->sin6_family = AF_INET6;
-        addr->sin6_port = htons(peers[i].port);
-        addr->sin6_addr.s6_addr[10] = 0xFF;
-        addr->sin6_addr.s6_addr[11] = 0xFF;
-        inet_pton(AF_INET, peers[i].ip, &addr->sin6_addr.s6_addr[12]);
-
-        char ip_str[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &addr->sin6_addr, ip_str, INET6_ADDRSTRLEN);
-        if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr))
-        {
-            struct in_addr ipv4_addr;
-            memcpy(&ipv4_addr, &addr->sin6_addr.s6_addr[12], 4);
-            inet_ntop(AF_INET, &ipv4_addr, ip_str, INET_ADDRSTRLEN);
-        }
-        log_message(LOG_INFO, log_filename, __FILE__, "Sending address: %s:%d", ip_str,
-            peers[i].port);
+        unsigned char* entry = addr_payload + offset;
+        for (int j = 0; j < 4; ++j)
+            entry[j] = (unsigned char)(peers[i].timestamp >> (8 * j));
+        for (int j = 0; j < 8; ++j)
+            entry[4 + j] = (unsigned char)(peers[i].services >> (8 * j));
+        memcpy(entry + 12, peers[i].addr, 16);
+        entry[28] = (unsigned char)(peers[i].port >> 8);
+        entry[29] = (unsigned char)peers[i].port;
+        offset += ADDR_ENTRY_SIZE;
     }
+    log_message(LOG_INFO, log_filename, __FILE__, "Sending %zu addresses", peer_count);
 
-    // Prepare message buffer
-    unsigned char addr_msg[sizeof(bitcoin_msg_header) + payload_size];
-    size_t msg_len = build_message(addr_msg, sizeof(addr_msg), "addr", addr_payload,
-        payload_size);
-
+    size_t msg_len = build_message(addr_msg, msg_size, "addr", addr_payload, offset);
+    free(peers);
     if (msg_len == 0)
     {
         guarded_print_line("Failed to build 'addr' message.");
-        free(peers);
-        free(addr_payload);
+        free(addr_msg);
         return -1;
     }
 
     // Send the 'addr' message
-    ssize_t bytes_sent = send(sockfd, addr_msg, msg_len, 0);
-    if (bytes_sent < 0)
+    int result = queue_message(node, addr_msg, msg_len);
+    if (result < 0)
     {
         perror("Sending addresses failed");
     }
@@ -610,11 +500,8 @@ ssize_t send_addr(int sockfd, const char* ip_addr)
         log_message(LOG_INFO, log_filename, __FILE__,
             "Successfully sent addresses");
     }
-
-    free(peers);
-    free(addr_payload);
-
-    return bytes_sent;
+    free(addr_msg);
+    return result;
 }
 
 /**
@@ -659,14 +546,14 @@ static ssize_t send_verack(int sockfd, const char* ip_addr)
         "sent verack");
     // log_to_file('test.log', 'sent verack');
     // Send to peer
-    return send(sockfd, verack_msg, sizeof(verack_header), 0);
+    return send(sockfd, verack_msg, sizeof(verack_header), MSG_NOSIGNAL);
 }
 
 /**
  * send_pong:
  *   Send a "pong" message echoing the same 8-byte nonce from a "ping" payload.
  */
-static ssize_t send_pong(int sockfd, const unsigned char* nonce8)
+static int send_pong(Node* node, const unsigned char* nonce8)
 {
     // Build an 8-byte payload containing the same nonce
     unsigned char pong_payload[8];
@@ -687,13 +574,15 @@ static ssize_t send_pong(int sockfd, const unsigned char* nonce8)
         return -1;
     }
 
-    return send(sockfd, pong_msg, msg_len, 0);
+    return queue_message(node, pong_msg, msg_len);
 }
 
-ssize_t send_ping(int sockfd, const char* ip_addr)
+int send_ping(Node* node)
 {
-    // Generate an 8-byte nonce
+    // Generate an 8-byte nonce, zero is left for no 'ping' waiting for its 'pong'
     uint64_t nonce = ((uint64_t)rand() << 32) | rand();
+    if (nonce == 0)
+        nonce = 1;
 
     // Prepare the ping payload (8 bytes)
     unsigned char ping_payload[8];
@@ -717,18 +606,19 @@ ssize_t send_ping(int sockfd, const char* ip_addr)
 
     char log_filename[256];
     snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
-        ip_addr);
-    ssize_t bytes_sent = send(sockfd, ping_msg, msg_len, 0);
-    if (bytes_sent < 0)
+        node->ip_address);
+    if (queue_message(node, ping_msg, msg_len) < 0)
     {
         log_message(LOG_INFO, log_filename, __FILE__,
             "[Error] Failed to send 'ping' message: %s", strerror(errno));
         return -1;
     }
 
+    node->ping_nonce = nonce;
+    node->ping_sent_ms = get_monotonic_ms();
     log_message(LOG_INFO, log_filename, __FILE__,
         "Sent 'ping' message with nonce: %llu", (unsigned long long)nonce);
-    return bytes_sent;
+    return 0;
 }
 
 void initialize_node(Node* node, const char* ip, uint16_t port, int socket_fd)
@@ -736,531 +626,1627 @@ void initialize_node(Node* node, const char* ip, uint16_t port, int socket_fd)
     snprintf(node->ip_address, sizeof(node->ip_address), "%s", ip);
     node->port = port;
     node->socket_fd = socket_fd;
+    free_message_buffer(&node->recv_buffer);
+    node->is_inbound = 0;
+    node->blocks_served = 0;
+    node->compact_blocks = 0;
+    node->fee_rate = 0;
+    node->ping_nonce = 0;
+    node->ping_sent_ms = 0;
+    node->rtt_ms = 0;
+    node->rtt_min_ms = 0;
+    node->rtt_max_ms = 0;
+    node->rtt_samples = 0;
+    node->bytes_received = 0;
+    node->throughput = 0;
+    node->throughput_bytes = 0;
+    node->throughput_sample_ms = get_monotonic_ms();
+    node->failures = 0;
+    node->failure_decay_ms = node->throughput_sample_ms;
+
+    pthread_mutex_lock(&node->send_mutex);
+    free_send_queue(&node->send_queue);
+    node->events = 0;
+    node->generation++;
     node->is_connected = 1; // Mark as connected
+    pthread_mutex_unlock(&node->send_mutex);
 }
 
-void* peer_communication(void* arg)
+/**
+ * handle_ping:
+ *   Answer the 'ping' with a 'pong' carrying the same nonce.
+ */
+static void handle_ping(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
 {
-    Node* node = (Node*)arg;
-
-    char log_filename[256];
-    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
-        node->ip_address);
-    log_message(LOG_INFO, log_filename, __FILE__,
-        "started peer communication with node with ip: %s", node->ip_address);
-
-    char buffer[2048];
-    struct timeval tv;
-    tv.tv_sec = 5; // 5 seconds timeout for recv
-    tv.tv_usec = 0;
-    setsockopt(node->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-    time_t last_ping_time = time(NULL);
+    Node* node = (Node*)ctx;
 
-    while (node->is_connected)
+    // Typically 8-byte payload
+    if (payload_len == 8)
     {
-        // Check the magic
-        ssize_t bytes_received = recv(node->socket_fd, buffer, sizeof(buffer) - 1, 0);
-
-        // Wait while other operation is in progress e.g. getaddr
-        while (node->operation_in_progress)
-        {
-            sleep(1);
-        }
-        if (bytes_received < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                log_message(LOG_WARN, log_filename, __FILE__,
-                    "recv() timed out, continuing...");
-            }
-            else
-            {
-                log_message(LOG_INFO, log_filename, __FILE__,
-                    "Recv failed: %s", strerror((errno)));
-            }
-            time_t current_time = time(NULL);
-            if (difftime(current_time, last_ping_time) >= 5)
-            {
-                send_ping(node->socket_fd, node->ip_address);
-                last_ping_time = current_time;
-            }
-
-            continue;
-        }
-        if (bytes_received == 0)
-        {
-            log_message(LOG_INFO, log_filename, __FILE__,
-                "Connection closed by peer %s", node->ip_address);
-            node->is_connected = 0;
-            break;
-        }
-
-        buffer[bytes_received] = '\0'; // Null-terminate the received data
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "Received bytes: %s", buffer);
-        // If we have at least a full header, parse it
-        if (bytes_received < (ssize_t)sizeof(bitcoin_msg_header))
+        if (send_pong(node, payload_data) < 0)
         {
-            log_message(LOG_INFO, log_filename, __FILE__,
-                "[!] Received %zd bytes (less than header size 24).",
-                bytes_received);
-            continue;
+            log_message(LOG_ERROR, log_filename, __FILE__,
+                "Sending pong: %s\n", strerror(errno));
         }
-
-        // Cast to a header
-        bitcoin_msg_header* hdr = (bitcoin_msg_header*)buffer;
-        if (hdr->magic == BITCOIN_MAINNET_MAGIC)
+        else
         {
-            char cmd_name[13];
-            memset(cmd_name, 0, sizeof(cmd_name));
-            memcpy(cmd_name, hdr->command, 12);
-
             log_message(LOG_INFO, log_filename, __FILE__,
-                "[!] Received %s command ",
-                cmd_name);
-
-            // Determine the payload length & pointer
-            size_t payload_len = hdr->length;
-            const unsigned char* payload_data = (const unsigned char*)buffer + sizeof(
-                bitcoin_msg_header);
-
-            // In real code, you’d handle partial messages if n < header+payload
-            if (bytes_received < (ssize_t)(sizeof(bitcoin_msg_header) + payload_len))
-            {
-                log_message(LOG_INFO, log_filename, __FILE__,
-                    "Incomplete message; got %zd bytes, expected %zu.\n",
-                    bytes_received, sizeof(bitcoin_msg_header) + payload_len);
-                continue;
-            }
-
-            if (strcmp(cmd_name, "ping") == 0)
-            {
-                // Typically 8-byte payload
-                if (payload_len == 8)
-                {
-                    ssize_t s = send_pong(node->socket_fd, payload_data);
-                    if (s < 0)
-                    {
-                        log_message(LOG_ERROR, log_filename, __FILE__,
-                            "Sending pong: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        log_message(LOG_INFO, log_filename, __FILE__,
-                            "Successfully sent pong");
-                    }
-                }
-                else
-                {
-                    log_message(LOG_WARN, log_filename, __FILE__,
-                        "Ping payload length is not 8 bytes, not sending pong");
-                }
-            }
-            else if (strcmp(cmd_name, "getaddr") == 0)
-            {
-                if (payload_len == 0)
-                {
-                    ssize_t s = send_addr(node->socket_fd, node->ip_address);
-                    if (s < 0)
-                    {
-                        log_message(LOG_ERROR, log_filename, __FILE__,
-                            "Sending addr: %s\n", strerror(errno));
-                    }
-                    else
-                    {
-                        log_message(LOG_INFO, log_filename, __FILE__,
-                            "Successfully sent addresses");
-                    }
-                }
-                else
-                {
-                    log_message(LOG_WARN, log_filename, __FILE__,
-                        "Invalid payload length for 'getaddr' command: %zu",
-                        payload_len);
-                }
-            }
-            else if (strcmp(cmd_name, "getheaders") == 0)
-            {
-                // Parse the getheaders message
-                size_t offset = sizeof(bitcoin_msg_header);
-                uint32_t version;
-                memcpy(&version, payload_data + offset, 4);
-                offset += 4;
-
-                unsigned char start_hash[32];
-                memcpy(start_hash, payload_data + offset, 32);
-                offset += 32;
-
-                unsigned char stop_hash[32];
-                memcpy(stop_hash, payload_data + offset, 32);
-
-                // Log the received getheaders message
-                log_message(LOG_INFO, log_filename, __FILE__, "Received 'getheaders' message.");
-
-                // Send the headers in response
-                int idx = get_idx(node->ip_address);
-                send_headers(idx, start_hash, stop_hash);
-            }
-            else if (strcmp(cmd_name, "getblocks") == 0)
-            {
-                // Log the received getblocks message
-                log_message(LOG_INFO, log_filename, __FILE__, "Received 'getblocks' message.");
-
-                // Handle the getblocks request
-                size_t payload_len;
-                unsigned char* payload = load_blocks_from_file("blocks.dat", &payload_len);
-                if (!payload)
-                {
-                    log_message(LOG_ERROR, log_filename, __FILE__, "Failed to load blocks from file");
-                }
-                else
-                {
-                    ssize_t bytes_sent = send(node->socket_fd, payload, payload_len, 0);
-                    if (bytes_sent < 0)
-                    {
-                        log_message(LOG_ERROR, log_filename, __FILE__, "Failed to send blocks: %s", strerror(errno));
-                    }
-                    else
-                    {
-                        log_message(LOG_INFO, log_filename, __FILE__, "Sent blocks to node %s", node->ip_address);
-                    }
-                    free(payload);
-                }
-            }
-            else if (strcmp(cmd_name, "inv") == 0)
-            {
-                // Handle the inv message
-                log_message(LOG_INFO, log_filename, __FILE__, "Received 'inv' message.");
-                int idx = get_idx(node->ip_address);
-                handle_inv_message(idx, payload_data, payload_len);
-            }
-            else if (strcmp(cmd_name, "getdata") == 0)
-            {
-                // Handle the getdata message
-                log_message(LOG_INFO, log_filename, __FILE__, "Received 'getdata' message.");
-                // Load the requested data from file and send it
-                size_t data_len;
-                unsigned char* data = load_blocks_from_file("data.dat", &data_len);
-                if (!data)
-                {
-                    log_message(LOG_ERROR, log_filename, __FILE__, "Failed to load data from file");
-                }
-                else
-                {
-                    ssize_t bytes_sent = send(node->socket_fd, data, data_len, 0);
-                    if (bytes_sent < 0)
-                    {
-                        log_message(LOG_ERROR, log_filename, __FILE__, "Failed to send data: %s", strerror(errno));
-                    }
-                    else
-                    {
-                        log_message(LOG_INFO, log_filename, __FILE__, "Sent data to node %s", node->ip_address);
-                    }
-                    free(data);
-                }
-            }
-            // Info about compact blocks is saved but handling of compact blocks is not implemented
-            else if (strcmp(cmd_name, "sendcmpct") == 0)
-            {
-                // usually 9 bytes: fannounce(1 byte) + version(8 bytes)
-                if (payload_len == 9)
-                {
-                    unsigned char fannounce = payload_data[0];
-                    uint64_t cmpctversion;
-                    memcpy(&cmpctversion, payload_data + 1, 8);
-                    node->compact_blocks = cmpctversion;
-                    log_message(LOG_INFO, log_filename, __FILE__,
-                        "compactblocks set to: %lu, fannounce: %u",
-                        cmpctversion, fannounce);
-                }
-                else
-                {
-                    log_message(LOG_WARN, log_filename, __FILE__,
-                        "sendcmpct payload length is not 9 bytes, its: %zu",
-                        payload_len);
-                }
-            }
-            // Fee rate is saved, but filtering out transactions is not implemented
-            else if (strcmp(cmd_name, "feefilter") == 0)
-            {
-                // 8 bytes: an uint64_t in little-endian indicating min fee rate in sat/kB
-                if (payload_len == 8)
-                {
-                    uint64_t fee_rate;
-                    memcpy(&fee_rate, payload_data, 8);
-                    node->fee_rate = fee_rate;
-                    log_message(LOG_INFO, log_filename, __FILE__,
-                        "fee rate set to: %lu", fee_rate);
-                }
-                else
-                {
-                    log_message(LOG_WARN, log_filename, __FILE__,
-                        "feefilter payload length is not 8 bytes, its: %zu",
-                        payload_len);
-                }
-            }
-        }
-
-        time_t current_time = time(NULL);
-        if (difftime(current_time, last_ping_time) >= 5)
-        {
-            send_ping(node->socket_fd, node->ip_address);
-            last_ping_time = current_time;
+                "Successfully sent pong");
         }
     }
-
-    close(node->socket_fd); // Close the socket once done
-    return NULL;
+    else
+    {
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Ping payload length is not 8 bytes, not sending pong");
+    }
 }
 
-void create_peer_thread(Node* node)
+/**
+ * handle_pong:
+ *   Measure the round-trip time of the 'ping' the 'pong' answers and update the moving average
+ *   and the extremes of the node.
+ */
+static void handle_pong(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
 {
-    if (pthread_create(&node->thread, NULL, peer_communication, (void*)node) != 0)
+    Node* node = (Node*)ctx;
+    if (payload_len != 8)
     {
-        perror("Failed to create thread for peer");
-        exit(1);
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Pong payload length is not 8 bytes, ignoring");
+        return;
     }
 
-    if (pthread_detach(node->thread) != 0)
+    uint64_t nonce;
+    memcpy(&nonce, payload_data, sizeof(nonce));
+    if (node->ping_sent_ms == 0 || nonce != node->ping_nonce)
     {
-        perror("Failed to detach thread for peer");
-        exit(1);
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Pong with unexpected nonce: %llu", (unsigned long long)nonce);
+        return;
     }
-}
 
-int connect_to_peer(const char* ip_addr)
-{
-    // Create the socket
-    int sockfd;
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    uint64_t elapsed_ms = get_monotonic_ms() - node->ping_sent_ms;
+    uint32_t rtt_ms = elapsed_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed_ms;
+    node->ping_sent_ms = 0;
+    if (node->rtt_samples == 0)
     {
-        fprintf(stderr, "[Error] socket creation failed: %s\n", strerror(errno));
-        return -1;
+        node->rtt_ms = rtt_ms;
+        node->rtt_min_ms = rtt_ms;
+        node->rtt_max_ms = rtt_ms;
+    }
+    else
+    {
+        node->rtt_ms += PEER_EWMA_WEIGHT * (rtt_ms - node->rtt_ms);
+        if (rtt_ms < node->rtt_min_ms)
+            node->rtt_min_ms = rtt_ms;
+        if (rtt_ms > node->rtt_max_ms)
+            node->rtt_max_ms = rtt_ms;
     }
+    node->rtt_samples++;
+    log_message(LOG_INFO, log_filename, __FILE__,
+        "Received pong, round-trip time: %u ms (average %.1f ms)", rtt_ms, node->rtt_ms);
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = 3; // seconds
-    timeout.tv_usec = 0; // microseconds
+/**
+ * handle_getaddr:
+ *   Answer the 'getaddr' with the addresses known to BitLab.
+ */
+static void handle_getaddr(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+    (void)payload_data;
 
-    // Set timeout for recv
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+    if (payload_len == 0)
     {
-        perror("setsockopt failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        if (send_addr(node) < 0)
+        {
+            log_message(LOG_ERROR, log_filename, __FILE__,
+                "Sending addr: %s\n", strerror(errno));
+        }
+        else
+        {
+            log_message(LOG_INFO, log_filename, __FILE__,
+                "Successfully sent addresses");
+        }
     }
-    // Set timeout for connect()
-    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+    else
     {
-        perror("setsockopt failed");
-        close(sockfd);
-        return -1;
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Invalid payload length for 'getaddr' command: %zu",
+            payload_len);
     }
+}
 
-    // Prepare the sockaddr_in
-    struct sockaddr_in servaddr;
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(BITCOIN_MAINNET_PORT);
-
-    if (inet_pton(AF_INET, ip_addr, &servaddr.sin_addr) <= 0)
-    {
-        fprintf(stderr, "[Error] inet_pton failed (IP '%s'): %s\n",
-            ip_addr, strerror(errno));
-        close(sockfd);
+/**
+ * parse_locator_message:
+ *   Parse the payload of 'getheaders' or 'getblocks': the protocol version, the block locator and
+ *   the stop hash. Returns 0 if successful, -1 if the payload is malformed.
+ */
+static int parse_locator_message(const unsigned char* payload, size_t payload_len,
+    const unsigned char** locator, size_t* locator_count, const unsigned char** stop_hash)
+{
+    if (payload_len < 4 + 1 + 32)
         return -1;
-    }
 
-    // Connect
-    if (connect(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0)
-    {
-        fprintf(stderr, "[Error] connect to %s:%d failed: %s\n",
-            ip_addr, BITCOIN_MAINNET_PORT, strerror(errno));
-        close(sockfd);
+    size_t offset = 4;
+    uint64_t count = read_var_int(payload, &offset);
+    if (count > MAX_LOCATOR_HASHES || offset > payload_len || payload_len - offset < (count + 1) * 32)
         return -1;
-    }
 
-    printf("[+] Connected to peer %s:%d\n", ip_addr, BITCOIN_MAINNET_PORT);
+    *locator = payload + offset;
+    *locator_count = (size_t)count;
+    *stop_hash = payload + offset + count * 32;
+    return 0;
+}
 
+/**
+ * handle_getheaders:
+ *   Answer the 'getheaders' with the headers following the last locator block in the header index.
+ */
+static void handle_getheaders(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+
+    const unsigned char* locator;
+    size_t locator_count;
+    const unsigned char* stop_hash;
+    if (parse_locator_message(payload_data, payload_len, &locator, &locator_count, &stop_hash) < 0)
+    {
+        log_message(LOG_WARN, log_filename, __FILE__, "Malformed 'getheaders' message.");
+        return;
+    }
+
+    int fork_height = find_locator_fork(locator, locator_count);
+    log_message(LOG_INFO, log_filename, __FILE__,
+        "Received 'getheaders' message with %zu locator hashes, fork at height %d.",
+        locator_count, fork_height);
+
+    // Send the headers in response
+    send_headers_from(node, fork_height + 1, stop_hash);
+}
+
+/**
+ * handle_getblocks:
+ *   Answer the 'getblocks' with the inventory of the blocks following the last locator block in
+ *   the header index.
+ */
+static void handle_getblocks(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+
+    const unsigned char* locator;
+    size_t locator_count;
+    const unsigned char* stop_hash;
+    if (parse_locator_message(payload_data, payload_len, &locator, &locator_count, &stop_hash) < 0)
+    {
+        log_message(LOG_WARN, log_filename, __FILE__, "Malformed 'getblocks' message.");
+        return;
+    }
+
+    int fork_height = find_locator_fork(locator, locator_count);
+    log_message(LOG_INFO, log_filename, __FILE__,
+        "Received 'getblocks' message with %zu locator hashes, fork at height %d.",
+        locator_count, fork_height);
+
+    unsigned char hashes[MAX_INV_BLOCKS * 32];
+    size_t count = get_headers(fork_height + 1, MAX_INV_BLOCKS, stop_hash, NULL, hashes);
+
+    unsigned char payload[3 + MAX_INV_BLOCKS * 36];
+    size_t offset = write_var_int(payload, count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t type = 2; // MSG_BLOCK
+        memcpy(payload + offset, &type, 4);
+        memcpy(payload + offset + 4, hashes + i * 32, 32);
+        offset += 36;
+    }
+
+    unsigned char inv_msg[sizeof(bitcoin_msg_header) + sizeof(payload)];
+    size_t msg_len = build_message(inv_msg, sizeof(inv_msg), "inv", payload, offset);
+    if (msg_len == 0 || queue_message(node, inv_msg, msg_len) < 0)
+    {
+        log_message(LOG_ERROR, log_filename, __FILE__, "Failed to send blocks: %s", strerror(errno));
+    }
+    else
+    {
+        log_message(LOG_INFO, log_filename, __FILE__, "Sent inventory of %zu blocks to node %s",
+            count, node->ip_address);
+    }
+}
+
+/**
+ * handle_inv:
+ *   Request the blocks announced in the 'inv'.
+ */
+static void handle_inv(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+
+    // Handle the inv message
+    log_message(LOG_INFO, log_filename, __FILE__, "Received 'inv' message.");
+    handle_inv_message((int)(node - nodes), payload_data, payload_len);
+}
+
+/**
+ * handle_getdata:
+ *   Answer the 'getdata' with the requested blocks streamed from the block files with sendfile,
+ *   behind a message header built from the length and checksum kept in the block index, and a
+ *   'notfound' listing the items which are not stored.
+ */
+static void handle_getdata(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+    log_message(LOG_INFO, log_filename, __FILE__, "Received 'getdata' message.");
+    if (payload_len == 0)
+        return;
+
+    size_t offset = 0;
+    uint64_t count = read_var_int(payload_data, &offset);
+    if (count > MAX_GETDATA_COUNT || offset + count * 36 > payload_len)
+    {
+        log_message(LOG_WARN, log_filename, __FILE__, "Invalid inventory count in 'getdata' message: %llu",
+            (unsigned long long)count);
+        return;
+    }
+
+    unsigned char* notfound = (unsigned char*)malloc(9 + count * 36);
+    if (!notfound)
+    {
+        perror("malloc failed");
+        return;
+    }
+    size_t notfound_count = 0;
+    size_t served = 0;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const unsigned char* item = payload_data + offset + i * 36;
+        uint32_t type = (uint32_t)item[0] | (uint32_t)item[1] << 8 | (uint32_t)item[2] << 16 |
+            (uint32_t)item[3] << 24;
+        block_location location;
+        char path[512];
+        if ((type & ~INV_WITNESS_FLAG) != INV_TYPE_BLOCK ||
+            !find_block_file(item + 4, &location, path, sizeof(path)))
+        {
+            memcpy(notfound + 9 + notfound_count * 36, item, 36);
+            notfound_count++;
+            continue;
+        }
+
+        bitcoin_msg_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = BITCOIN_MAINNET_MAGIC;
+        memcpy(header.command, "block", 5);
+        header.length = location.len;
+        memcpy(header.checksum, location.checksum, sizeof(header.checksum));
+        if (queue_file_message(node, (const unsigned char*)&header, sizeof(header), path,
+            (off_t)location.offset, location.len) != 0)
+        {
+            // Stop at a full send queue, the peer asks again for what it did not get
+            log_message(LOG_WARN, log_filename, __FILE__, "Failed to send block: %s", strerror(errno));
+            break;
+        }
+        served++;
+        node->blocks_served++;
+    }
+
+    if (notfound_count > 0)
+    {
+        // The var_int count is written right before the items
+        unsigned char count_buf[9];
+        size_t count_len = write_var_int(count_buf, notfound_count);
+        unsigned char* notfound_payload = notfound + 9 - count_len;
+        memcpy(notfound_payload, count_buf, count_len);
+        size_t payload_size = count_len + notfound_count * 36;
+        unsigned char* notfound_msg = (unsigned char*)malloc(sizeof(bitcoin_msg_header) + payload_size);
+        if (notfound_msg && build_message(notfound_msg, sizeof(bitcoin_msg_header) + payload_size,
+            "notfound", notfound_payload, payload_size) > 0)
+            queue_message(node, notfound_msg, sizeof(bitcoin_msg_header) + payload_size);
+        free(notfound_msg);
+    }
+    free(notfound);
+    log_message(LOG_INFO, log_filename, __FILE__, "Served %zu of %llu items requested by node %s, %zu not found",
+        served, (unsigned long long)count, node->ip_address, notfound_count);
+}
+
+/**
+ * handle_block:
+ *   Pass the block not matching a pending request to the block download, e.g. a block arriving
+ *   after its request expired.
+ */
+static void handle_block(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+    if (!receive_block((int)(node - nodes), payload_data, payload_len))
+        log_message(LOG_INFO, log_filename, __FILE__, "Ignored unrequested 'block' message.");
+}
+
+/**
+ * handle_sendcmpct:
+ *   Save the compact blocks version requested by the peer.
+ *   Info about compact blocks is saved but handling of compact blocks is not implemented.
+ */
+static void handle_sendcmpct(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+
+    // usually 9 bytes: fannounce(1 byte) + version(8 bytes)
+    if (payload_len == 9)
+    {
+        unsigned char fannounce = payload_data[0];
+        uint64_t cmpctversion;
+        memcpy(&cmpctversion, payload_data + 1, 8);
+        node->compact_blocks = cmpctversion;
+        log_message(LOG_INFO, log_filename, __FILE__,
+            "compactblocks set to: %lu, fannounce: %u",
+            cmpctversion, fannounce);
+    }
+    else
+    {
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "sendcmpct payload length is not 9 bytes, its: %zu",
+            payload_len);
+    }
+}
+
+/**
+ * handle_feefilter:
+ *   Save the minimal fee rate of transactions relayed to the peer.
+ *   Fee rate is saved, but filtering out transactions is not implemented.
+ */
+static void handle_feefilter(void* ctx, const unsigned char* payload_data, size_t payload_len,
+    const char* log_filename)
+{
+    Node* node = (Node*)ctx;
+
+    // 8 bytes: an uint64_t in little-endian indicating min fee rate in sat/kB
+    if (payload_len == 8)
+    {
+        uint64_t fee_rate;
+        memcpy(&fee_rate, payload_data, 8);
+        node->fee_rate = fee_rate;
+        log_message(LOG_INFO, log_filename, __FILE__,
+            "fee rate set to: %lu", fee_rate);
+    }
+    else
+    {
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "feefilter payload length is not 8 bytes, its: %zu",
+            payload_len);
+    }
+}
+
+/**
+ * handle_peer_message:
+ *   Handle a single message received from the peer with the handler registered for its command.
+ *   The payload is expected to be complete.
+ */
+static void handle_peer_message(Node* node, const message_view* view, const char* log_filename)
+{
+    if (view->command == COMMAND_UNKNOWN)
+    {
+        char cmd_name[13];
+        memset(cmd_name, 0, sizeof(cmd_name));
+        memcpy(cmd_name, view->header->command, 12);
+        log_message(LOG_INFO, log_filename, __FILE__,
+            "[!] Received unknown %s command ", cmd_name);
+        return;
+    }
+
+    log_message(LOG_INFO, log_filename, __FILE__,
+        "[!] Received %s command ",
+        get_command_name(view->command));
+
+    // Responses to pending requests are not handled as unsolicited messages
+    if (complete_requests(&node->requests, view))
+        return;
+
+    dispatch_command(view->command, node, view->payload, view->payload_len, log_filename);
+}
+
+/**
+ * close_peer:
+ *   Unregister the peer from the event loop, close its socket and mark it as disconnected.
+ *   Pending requests fail at once and queued messages are dropped. The receive buffer is kept
+ *   until the node slot is reused, as the loop may still be reading it. A peer closed already
+ *   is left alone, so its descriptor number, possibly reused by now, is never closed twice.
+ */
+static void close_peer(Node* node)
+{
+    pthread_mutex_lock(&node->send_mutex);
+    if (!node->is_connected)
+    {
+        pthread_mutex_unlock(&node->send_mutex);
+        return;
+    }
+    event_loop_remove(node->socket_fd);
+    close(node->socket_fd);
+    node->socket_fd = -1;
+    node->is_connected = 0;
+    free_send_queue(&node->send_queue);
+    pthread_mutex_unlock(&node->send_mutex);
+    fail_requests(&node->requests);
+}
+
+/**
+ * update_peer_events:
+ *   Register the socket of the node for writability while messages are queued, and stop reading
+ *   from it while the send queue is over the high-water mark, so a peer not reading its responses
+ *   cannot make BitLab queue more of them. Must be called with the send mutex held.
+ */
+static void update_peer_events(Node* node)
+{
+    uint32_t events = node->send_queue.over_high_water ? 0 : EPOLLIN;
+    if (send_queue_pending(&node->send_queue))
+        events |= EPOLLOUT;
+    if (events != node->events && event_loop_modify(node->socket_fd, events) == 0)
+        node->events = events;
+}
+
+/**
+ * queue_message:
+ *   Send the message to the node through its send queue, so messages sent from different threads
+ *   never interleave on the socket. Returns 0 if the message was sent or queued, -1 otherwise.
+ */
+static int queue_message(Node* node, const unsigned char* msg, size_t msg_len)
+{
+    pthread_mutex_lock(&node->send_mutex);
+    if (!node->is_connected)
+    {
+        pthread_mutex_unlock(&node->send_mutex);
+        errno = ENOTCONN;
+        return -1;
+    }
+    int result = send_queue_push(&node->send_queue, node->socket_fd, msg, msg_len);
+    int error = errno;
+    if (result == 0)
+        update_peer_events(node);
+    pthread_mutex_unlock(&node->send_mutex);
+    errno = error;
+    return result;
+}
+
+/**
+ * queue_file_message:
+ *   Send the message made of the header and a range of a file to the node through its send queue,
+ *   the file range is written with sendfile when its turn comes. A failure after the header may
+ *   have been written leaves the stream broken, so the socket is shut down and the event loop
+ *   closes the peer. Returns 0 if the message was sent or queued, -1 otherwise.
+ */
+static int queue_file_message(Node* node, const unsigned char* header, size_t header_len,
+    const char* path, off_t file_offset, size_t len)
+{
+    pthread_mutex_lock(&node->send_mutex);
+    if (!node->is_connected)
+    {
+        pthread_mutex_unlock(&node->send_mutex);
+        errno = ENOTCONN;
+        return -1;
+    }
+    int result = send_queue_push_file(&node->send_queue, node->socket_fd, header, header_len, path,
+        file_offset, len);
+    int error = errno;
+    if (result == 0)
+        update_peer_events(node);
+    else if (error != ENOBUFS && error != ENOMEM)
+        shutdown(node->socket_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&node->send_mutex);
+    errno = error;
+    return result;
+}
+
+/**
+ * flush_peer:
+ *   Write the messages queued for the node once its socket became writable.
+ *   Returns -1 if the socket failed, 0 otherwise.
+ */
+static int flush_peer(Node* node)
+{
+    pthread_mutex_lock(&node->send_mutex);
+    int result = send_queue_flush(&node->send_queue, node->socket_fd);
+    int error = errno;
+    if (result == 0)
+        update_peer_events(node);
+    pthread_mutex_unlock(&node->send_mutex);
+    errno = error;
+    return result;
+}
+
+/**
+ * dispatch_buffered_messages:
+ *   Handle every complete message waiting in the receive buffer of the node.
+ *   Returns -1 if the stream from the peer is corrupted, 0 otherwise.
+ */
+static int dispatch_buffered_messages(Node* node, const char* log_filename)
+{
+    message_view view;
+    while (node->is_connected)
+    {
+        message_status status = message_buffer_next(&node->recv_buffer, &view);
+        if (status == MESSAGE_INCOMPLETE)
+            break;
+        if (status == MESSAGE_INVALID)
+            return -1;
+        if (status == MESSAGE_BAD_CHECKSUM)
+        {
+            log_message(LOG_WARN, log_filename, __FILE__,
+                "Dropped message with invalid checksum (payload size=%zu)", view.payload_len);
+            continue;
+        }
+        handle_peer_message(node, &view, log_filename);
+    }
+    return 0;
+}
+
+/**
+ * peer_communication:
+ *   Event loop callback of the peer socket. Queued messages are flushed once it becomes writable.
+ *   Bytes read once it becomes readable are appended to the receive buffer of the node and every
+ *   complete message is handled in order.
+ */
+static void peer_communication(int fd, uint32_t events, void* ctx)
+{
+    Node* node = (Node*)ctx;
+
+    if (!node->is_connected)
+        return;
+
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
+        node->ip_address);
+
+    if ((events & EPOLLOUT) && flush_peer(node) < 0)
+    {
+        log_message(LOG_INFO, log_filename, __FILE__,
+            "Send failed: %s", strerror((errno)));
+        close_peer(node);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    ssize_t bytes_received = message_buffer_recv(&node->recv_buffer, fd);
+    if (bytes_received < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        log_message(LOG_INFO, log_filename, __FILE__,
+            "Recv failed: %s", strerror((errno)));
+        close_peer(node);
+        return;
+    }
+    if (bytes_received == 0)
+    {
+        log_message(LOG_INFO, log_filename, __FILE__,
+            "Connection closed by peer %s", node->ip_address);
+        close_peer(node);
+        return;
+    }
+
+    node->bytes_received += (uint64_t)bytes_received;
+    log_message(LOG_INFO, log_filename, __FILE__,
+        "Received bytes: %zd", bytes_received);
+
+    if (dispatch_buffered_messages(node, log_filename) < 0)
+    {
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Invalid message stream from peer %s, disconnecting", node->ip_address);
+        close_peer(node);
+    }
+}
+
+/**
+ * sample_peer_stats:
+ *   Fold the bytes received since the last sample into the throughput average of the node and
+ *   halve its failures every PEER_FAILURE_DECAY_MS, so peers recover from past trouble.
+ */
+static void sample_peer_stats(Node* node, uint64_t now_ms)
+{
+    if (now_ms > node->throughput_sample_ms)
+    {
+        double rate = (double)(node->bytes_received - node->throughput_bytes) * 1000 /
+            (double)(now_ms - node->throughput_sample_ms);
+        node->throughput += PEER_EWMA_WEIGHT * (rate - node->throughput);
+        node->throughput_bytes = node->bytes_received;
+        node->throughput_sample_ms = now_ms;
+    }
+    if (now_ms - node->failure_decay_ms >= PEER_FAILURE_DECAY_MS)
+    {
+        node->failures /= 2;
+        node->failure_decay_ms = now_ms;
+    }
+}
+
+/**
+ * ping_peers:
+ *   Event loop timer sampling the statistics of every connected peer and sending a 'ping' to the
+ *   ones idle for PING_INTERVAL seconds. A 'ping' still waiting for its 'pong' by then counts as
+ *   a failure of the peer.
+ */
+static void ping_peers(void* ctx)
+{
+    (void)ctx;
+    time_t current_time = time(NULL);
+    uint64_t now_ms = get_monotonic_ms();
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        Node* node = &nodes[i];
+        if (!node->is_connected)
+            continue;
+        sample_peer_stats(node, now_ms);
+        if (difftime(current_time, node->last_ping_time) >= PING_INTERVAL)
+        {
+            if (node->ping_sent_ms != 0)
+            {
+                node->failures++;
+                log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+                    "Peer %s did not answer 'ping' in time", node->ip_address);
+            }
+            send_ping(node);
+            node->last_ping_time = current_time;
+        }
+    }
+}
+
+/**
+ * register_peer:
+ *   Hand the connected peer socket over to the event loop.
+ */
+static void register_peer(Node* node)
+{
+    set_nonblocking(node->socket_fd, 1);
+    node->last_ping_time = time(NULL);
+
+    // Messages may have been queued by other threads since the node was marked as connected
+    pthread_mutex_lock(&node->send_mutex);
+    node->events = EPOLLIN;
+    if (send_queue_pending(&node->send_queue))
+        node->events |= EPOLLOUT;
+    if (event_loop_add(node->socket_fd, node->events, peer_communication, node) < 0)
+    {
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__,
+            "Failed to register peer %s in the event loop", node->ip_address);
+        close(node->socket_fd);
+        node->socket_fd = -1;
+        node->is_connected = 0;
+        free_send_queue(&node->send_queue);
+    }
+    pthread_mutex_unlock(&node->send_mutex);
+}
+
+/**
+ * send_hash_request:
+ *   Register a request expecting `expected` messages with the command, or the blocks with the
+ *   given hashes if not NULL, and send the message to the node. The callback is invoked on the
+ *   event loop thread for every matching message.
+ *   Returns the request referenced by the caller, or NULL if it could not be sent.
+ */
+static peer_request* send_hash_request(Node* node, const unsigned char* msg, size_t msg_len,
+    command_id command, int expected, const unsigned char* hashes, int timeout_ms,
+    request_callback callback, void* ctx)
+{
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
+        node->ip_address);
+    const bitcoin_msg_header* hdr = (const bitcoin_msg_header*)msg;
+
+    peer_request* request = create_request(&node->requests, command, expected, hashes, timeout_ms,
+        callback, ctx);
+    if (request == NULL)
+    {
+        log_message(LOG_ERROR, log_filename, __FILE__,
+            "[Error] Failed to create request for '%.12s' message", hdr->command);
+        return NULL;
+    }
+
+    if (queue_message(node, msg, msg_len) < 0)
+    {
+        log_message(LOG_INFO, log_filename, __FILE__,
+            "[Error] Failed to send '%.12s' message: %s", hdr->command, strerror(errno));
+        cancel_request(&node->requests, request);
+        release_request(request);
+        return NULL;
+    }
+
+    log_message(LOG_INFO, log_filename, __FILE__, "Sent '%.12s' message.", hdr->command);
+    return request;
+}
+
+/**
+ * send_request:
+ *   Register a request expecting `expected` messages with the command and send the message to the
+ *   node. Returns the request referenced by the caller, or NULL if it could not be sent.
+ */
+static peer_request* send_request(Node* node, const unsigned char* msg, size_t msg_len,
+    command_id command, int expected, int timeout_ms, request_callback callback, void* ctx)
+{
+    return send_hash_request(node, msg, msg_len, command, expected, NULL, timeout_ms, callback, ctx);
+}
+
+/**
+ * finish_waiting:
+ *   Wait until the request sent to the node is finished and release it.
+ *   Returns 1 if all expected messages were received, 0 otherwise.
+ */
+static int finish_waiting(Node* node, peer_request* request)
+{
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
+        node->ip_address);
+
+    command_id command = request->command;
+    request_status status = wait_request(request);
+    release_request(request);
+
+    if (status == REQUEST_TIMED_OUT)
+    {
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Timed out waiting for '%s' message", get_command_name(command));
+    }
+    else if (status == REQUEST_FAILED)
+    {
+        log_message(LOG_WARN, log_filename, __FILE__,
+            "Request for '%s' message failed, peer %s disconnected",
+            get_command_name(command), node->ip_address);
+    }
+    return status == REQUEST_COMPLETED;
+}
+
+/**
+ * send_request_and_wait:
+ *   Send the request to the node and wait until it is finished.
+ *   Returns 1 if all expected messages were received, 0 otherwise.
+ */
+static int send_request_and_wait(Node* node, const unsigned char* msg, size_t msg_len,
+    command_id command, int expected, int timeout_ms, request_callback callback, void* ctx)
+{
+    peer_request* request = send_request(node, msg, msg_len, command, expected, timeout_ms,
+        callback, ctx);
+    if (request == NULL)
+        return 0;
+    return finish_waiting(node, request);
+}
+
+/**
+ * expire_peer_requests:
+ *   Event loop timer finishing the requests of every peer which were not answered in time and
+ *   counting them as failures of the peer.
+ */
+static void expire_peer_requests(void* ctx)
+{
+    (void)ctx;
+    uint64_t now_ms = get_monotonic_ms();
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        int expired = expire_requests(&nodes[i].requests, now_ms);
+        if (expired > 0 && nodes[i].is_connected)
+            nodes[i].failures += (uint32_t)expired;
+    }
+}
+
+/**
+ * sync_headers:
+ *   Event loop timer syncing the headers appended since the last sync to disk.
+ */
+static void sync_headers(void* ctx)
+{
+    (void)ctx;
+    sync_header_index();
+}
+
+void init_peer_connection()
+{
+    // sendfile has no MSG_NOSIGNAL, a peer closing while a block is streamed must not kill BitLab
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        init_request_list(&nodes[i].requests);
+        init_send_queue(&nodes[i].send_queue);
+        pthread_mutex_init(&nodes[i].send_mutex, NULL);
+    }
+
+    register_command_handler(COMMAND_PING, handle_ping);
+    register_command_handler(COMMAND_PONG, handle_pong);
+    register_command_handler(COMMAND_GETADDR, handle_getaddr);
+    register_command_handler(COMMAND_GETHEADERS, handle_getheaders);
+    register_command_handler(COMMAND_GETBLOCKS, handle_getblocks);
+    register_command_handler(COMMAND_INV, handle_inv);
+    register_command_handler(COMMAND_GETDATA, handle_getdata);
+    register_command_handler(COMMAND_BLOCK, handle_block);
+    register_command_handler(COMMAND_SENDCMPCT, handle_sendcmpct);
+    register_command_handler(COMMAND_FEEFILTER, handle_feefilter);
+
+    if (event_loop_add_timer(ping_peers, NULL, 1000) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register peer ping timer");
+    if (event_loop_add_timer(expire_peer_requests, NULL, REQUEST_SWEEP_INTERVAL_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register request expiry timer");
+    if (event_loop_add_timer(expire_connections, NULL, REQUEST_SWEEP_INTERVAL_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register connection expiry timer");
+    if (event_loop_add_timer(sync_headers, NULL, HEADER_SYNC_INTERVAL_MS) < 0)
+        log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to register header sync timer");
+}
+
+/**
+ * The state of the connection attempt.
+ *
+ * @param CONNECTION_CONNECTING The non-blocking connect is in progress.
+ * @param CONNECTION_HANDSHAKE The 'version' was sent, waiting for 'version' and 'verack' of the peer.
+ */
+typedef enum
+{
+    CONNECTION_CONNECTING,
+    CONNECTION_HANDSHAKE
+} connection_state;
+
+/**
+ * The group of connection attempts awaited together by the thread which started them.
+ *
+ * @param started The number of started attempts.
+ * @param finished The number of finished attempts, successful or not.
+ * @param connected The number of attempts which ended with a connected node.
+ * @param last_node The node index of the last successful attempt.
+ * @param last_error The reason of the last failed attempt.
+ * @param mutex The mutex guarding the batch.
+ * @param cond The condition signalled when an attempt finishes.
+ */
+typedef struct
+{
+    int started;
+    int finished;
+    int connected;
+    int last_node;
+    char last_error[128];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} connect_batch;
+
+/**
+ * The connection attempt driven by the event loop until the handshake finishes.
+ *
+ * @param ip_address The IP address of the peer.
+ * @param port The port of the peer.
+ * @param socket_fd The non-blocking socket.
+ * @param state The state of the attempt.
+ * @param inbound Whether the peer connected to the listener, BitLab then answers its 'version'.
+ * @param version_sent Whether the 'version' of BitLab was sent.
+ * @param version_received Whether the 'version' of the peer was received.
+ * @param recv_buffer The bytes received during the handshake.
+ * @param deadline_ms The monotonic time the attempt fails at.
+ * @param batch The batch the attempt belongs to, NULL for inbound peers.
+ * @param next The next attempt in the list of attempts in progress.
+ */
+typedef struct connection_attempt
+{
+    char ip_address[64];
+    uint16_t port;
+    int socket_fd;
+    connection_state state;
+    bool inbound;
+    bool version_sent;
+    bool version_received;
+    message_buffer recv_buffer;
+    uint64_t deadline_ms;
+    connect_batch* batch;
+    struct connection_attempt* next;
+} connection_attempt;
+
+// Attempts in progress, checked by the timer for expired deadlines
+static connection_attempt* connection_attempts = NULL;
+static pthread_mutex_t connection_attempts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * finish_connection:
+ *   Release the attempt and report its result to the batch. `node_idx` is the index of the
+ *   connected node or -1 if the attempt failed for the given reason.
+ */
+static void finish_connection(connection_attempt* attempt, int node_idx, const char* reason)
+{
+    pthread_mutex_lock(&connection_attempts_mutex);
+    for (connection_attempt** it = &connection_attempts; *it != NULL; it = &(*it)->next)
+    {
+        if (*it == attempt)
+        {
+            *it = attempt->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&connection_attempts_mutex);
+
+    if (node_idx < 0)
+    {
+        if (attempt->socket_fd >= 0)
+        {
+            event_loop_remove(attempt->socket_fd);
+            close(attempt->socket_fd);
+        }
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Connection to %s:%u failed: %s",
+            attempt->ip_address, attempt->port, reason);
+    }
+    free_message_buffer(&attempt->recv_buffer);
+
+    connect_batch* batch = attempt->batch;
+    if (batch == NULL)
+    {
+        free(attempt);
+        return;
+    }
+    pthread_mutex_lock(&batch->mutex);
+    batch->finished++;
+    if (node_idx >= 0)
+    {
+        batch->connected++;
+        batch->last_node = node_idx;
+    }
+    else
+    {
+        snprintf(batch->last_error, sizeof(batch->last_error), "%s", reason);
+    }
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+    free(attempt);
+}
+
+/**
+ * complete_handshake:
+ *   Move the socket of the attempt which received 'verack' to a free node slot and hand it over
+ *   to the event loop as a connected peer.
+ */
+static void complete_handshake(connection_attempt* attempt)
+{
+    int j = 0;
+    while (j < MAX_NODES && nodes[j].is_connected != 0)
+        ++j;
+    if (j == MAX_NODES)
+    {
+        finish_connection(attempt, -1, "no free node slot");
+        return;
+    }
+
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
+        attempt->ip_address);
+
+    event_loop_remove(attempt->socket_fd);
+    initialize_node(&nodes[j], attempt->ip_address, attempt->port, attempt->socket_fd);
+    nodes[j].is_inbound = attempt->inbound;
+    nodes[j].recv_buffer = attempt->recv_buffer;
+    attempt->recv_buffer.data = NULL;
+    attempt->socket_fd = -1;
+    log_message(LOG_INFO, log_filename, __FILE__, "Handshake with %s:%u finished, node %d",
+        nodes[j].ip_address, nodes[j].port, j);
+
+    // Messages which arrived together with the handshake e.g. 'sendcmpct'
+    if (dispatch_buffered_messages(&nodes[j], log_filename) < 0)
+    {
+        close_peer(&nodes[j]);
+        finish_connection(attempt, -1, "invalid message stream");
+        return;
+    }
+    register_peer(&nodes[j]);
+    if (!nodes[j].is_connected)
+    {
+        finish_connection(attempt, -1, "event loop registration failed");
+        return;
+    }
+
+    // Outbound peers which completed the handshake move to the tried table
+    Peer peer;
+    if (!attempt->inbound && parse_peer(attempt->ip_address, attempt->port, &peer))
+        addrman_good(peer.addr, peer.port);
+    finish_connection(attempt, j, NULL);
+}
+
+/**
+ * send_version:
+ *   Send the 'version' message opening the handshake of the attempt.
+ *   Returns 0 if successful, -1 otherwise.
+ */
+static int send_version(connection_attempt* attempt, const char* log_filename)
+{
     // Build the 'version' payload
     unsigned char version_payload[200];
     size_t version_payload_len = build_version_payload(
         version_payload, sizeof(version_payload));
-    if (version_payload_len == 0)
-    {
-        fprintf(stderr, "[Error] build_version_payload() failed.\n");
-        close(sockfd);
-        return -1;
-    }
 
     // Create the full 'version' message
     unsigned char version_msg[256];
-    size_t version_msg_len = build_message(
-        version_msg,
-        sizeof(version_msg),
-        "version",
-        version_payload,
-        version_payload_len
-    );
-    if (version_msg_len == 0)
-    {
-        fprintf(stderr, "[Error] build_message() failed for 'version'.\n");
-        close(sockfd);
+    size_t version_msg_len = build_message(version_msg, sizeof(version_msg), "version",
+        version_payload, version_payload_len);
+    if (version_payload_len == 0 || version_msg_len == 0)
         return -1;
-    }
 
-    // Send the 'version' message
-    ssize_t bytes_sent = send(sockfd, version_msg, version_msg_len, 0);
-    if (bytes_sent < 0)
-    {
-        fprintf(stderr, "[Error] send() of 'version' failed: %s\n", strerror(errno));
-        close(sockfd);
+    // Send the 'version' message, it fits in the empty send buffer of a new socket
+    if (send(attempt->socket_fd, version_msg, version_msg_len, MSG_NOSIGNAL) != (ssize_t)version_msg_len)
         return -1;
-    }
-    printf("[+] Sent 'version' message (%zd bytes).\n", bytes_sent);
+    log_message(LOG_INFO, log_filename, __FILE__, "Sent 'version' message (%zu bytes).",
+        version_msg_len);
+    attempt->version_sent = true;
+    return 0;
+}
 
+/**
+ * handle_connection_event:
+ *   Event loop callback advancing the connection attempt: finishing the non-blocking connect,
+ *   sending 'version' and handling the 'version' and 'verack' of the peer. Inbound peers send
+ *   their 'version' first and are answered with 'version' and 'verack'.
+ */
+static void handle_connection_event(int fd, uint32_t events, void* ctx)
+{
+    connection_attempt* attempt = (connection_attempt*)ctx;
     char log_filename[256];
     snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
-        ip_addr);
-    init_logging(log_filename);
-    // Read loop - up to 10 messages
-    unsigned char recv_buf[2048];
-    bool connected = false;
-    for (int i = 0; i < 4; ++i)
-    {
-        printf("[d] Executing %dth receive loop iteration\n", i);
-        ssize_t n = recv(sockfd, recv_buf, sizeof(recv_buf), 0);
-        if (n < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                log_message(LOG_WARN, log_filename, __FILE__,
-                    "recv() timed out, continuing...");
-                continue;
-            }
-            fprintf(stderr, "[Error] recv() failed: %s\n", strerror(errno));
-            break;
-        }
-        if (n == 0)
+        attempt->ip_address);
+
+    if (attempt->state == CONNECTION_CONNECTING)
+    {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+            error = errno;
+        if (error != 0)
         {
-            // Peer closed the connection
-            printf("[i] Peer closed the connection.\n");
-            break;
+            finish_connection(attempt, -1, strerror(error));
+            return;
         }
+        if (!(events & EPOLLOUT))
+            return;
 
-        // If we have at least a full header, parse it
-        if (n < (ssize_t)sizeof(bitcoin_msg_header))
+        if (send_version(attempt, log_filename) < 0)
         {
-            printf("[!] Received %zd bytes (less than header size 24).\n", n);
-            continue;
+            finish_connection(attempt, -1, "sending 'version' failed");
+            return;
         }
+        attempt->state = CONNECTION_HANDSHAKE;
+        event_loop_modify(fd, EPOLLIN);
+        return;
+    }
 
-        printf("[<] Received %zd bytes.\n", n);
+    if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN))
+    {
+        finish_connection(attempt, -1, "connection closed by peer");
+        return;
+    }
 
-        // Cast to a header
-        bitcoin_msg_header* hdr = (bitcoin_msg_header*)recv_buf;
+    ssize_t bytes_received = message_buffer_recv(&attempt->recv_buffer, fd);
+    if (bytes_received < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        finish_connection(attempt, -1, strerror(errno));
+        return;
+    }
+    if (bytes_received == 0)
+    {
+        finish_connection(attempt, -1, "connection closed by peer");
+        return;
+    }
 
-        // Check the magic
-        if (hdr->magic == BITCOIN_MAINNET_MAGIC)
+    // Handle every complete message, stop after 'verack' leaving the rest for the event loop
+    message_view view;
+    while (true)
+    {
+        message_status status = message_buffer_next(&attempt->recv_buffer, &view);
+        if (status == MESSAGE_INCOMPLETE)
+            return;
+        if (status == MESSAGE_INVALID)
         {
-            char cmd_name[13];
-            memset(cmd_name, 0, sizeof(cmd_name));
-            memcpy(cmd_name, hdr->command, 12);
-
-            printf("[<] Received command: '%s'\n", cmd_name);
-
-            // Determine the payload length & pointer
-            size_t payload_len = hdr->length;
+            finish_connection(attempt, -1, "invalid message stream");
+            return;
+        }
+        if (status == MESSAGE_BAD_CHECKSUM)
+        {
+            log_message(LOG_WARN, log_filename, __FILE__,
+                "Invalid checksum of '%s' message, dropped", get_command_name(view.command));
+            continue;
+        }
 
-            if (n < (ssize_t)(sizeof(bitcoin_msg_header) + payload_len))
+        if (view.command == COMMAND_VERSION)
+        {
+            // Answer the version of an inbound peer with ours before acknowledging it
+            if (!attempt->version_sent && send_version(attempt, log_filename) < 0)
             {
-                printf("[!] Incomplete message; got %zd bytes, expected %zu.\n",
-                    n, sizeof(bitcoin_msg_header) + payload_len);
-                continue;
+                finish_connection(attempt, -1, "sending 'version' failed");
+                return;
             }
 
-            // Handle known commands
-            if (strcmp(cmd_name, "version") == 0)
-            {
-                // Send verack once we get their version
-                ssize_t verack_sent = send_verack(sockfd, ip_addr);
-                if (verack_sent < 0)
-                {
-                    fprintf(stderr, "[Error] sending verack: %s\n", strerror(errno));
-                }
-                else
-                {
-                    printf("[+] Sent 'verack' message.\n");
-                }
-                connected = true;
-            }
-            else if (strcmp(cmd_name, "verack") == 0)
-            {
-                connected = true;
-                break;
-            }
-            else
+            // Send verack once we get their version
+            if (send_verack(fd, attempt->ip_address) < 0)
             {
-                // Unhandled command
-                printf("[!] Unhandled command: '%s' (payload size=%u)\n",
-                    cmd_name, hdr->length);
+                finish_connection(attempt, -1, "sending 'verack' failed");
+                return;
             }
+            attempt->version_received = true;
+        }
+        else if (view.command == COMMAND_VERACK)
+        {
+            if (!attempt->version_received)
+                log_message(LOG_WARN, log_filename, __FILE__, "Received 'verack' before 'version'");
+            complete_handshake(attempt);
+            return;
         }
         else
         {
-            printf("[!] Unexpected magic bytes (0x%08X).\n", hdr->magic);
+            log_message(LOG_INFO, log_filename, __FILE__,
+                "Unhandled command during handshake: '%s' (payload size=%zu)",
+                get_command_name(view.command), view.payload_len);
         }
     }
-    if (connected == true)
+}
+
+/**
+ * expire_connections:
+ *   Event loop timer failing the connection attempts which did not finish before their deadline.
+ */
+static void expire_connections(void* ctx)
+{
+    (void)ctx;
+    uint64_t now_ms = get_monotonic_ms();
+    for (;;)
+    {
+        // Attempts are only finished on the event loop thread, so the found one stays valid
+        pthread_mutex_lock(&connection_attempts_mutex);
+        connection_attempt* attempt = connection_attempts;
+        while (attempt != NULL && attempt->deadline_ms > now_ms)
+            attempt = attempt->next;
+        pthread_mutex_unlock(&connection_attempts_mutex);
+        if (attempt == NULL)
+            break;
+        finish_connection(attempt, -1, attempt->state == CONNECTION_CONNECTING ?
+            "connect timed out" : "handshake timed out");
+    }
+}
+
+/**
+ * start_connection:
+ *   Start the non-blocking connect to the peer and hand the attempt over to the event loop.
+ *   The result is reported to the batch, also when the attempt fails at once.
+ */
+static void start_connection(const char* ip_addr, uint16_t port, uint64_t deadline_ms,
+    connect_batch* batch)
+{
+    pthread_mutex_lock(&batch->mutex);
+    batch->started++;
+    pthread_mutex_unlock(&batch->mutex);
+
+    connection_attempt* attempt = (connection_attempt*)calloc(1, sizeof(connection_attempt));
+    if (attempt == NULL)
+    {
+        pthread_mutex_lock(&batch->mutex);
+        batch->finished++;
+        snprintf(batch->last_error, sizeof(batch->last_error), "out of memory");
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->mutex);
+        return;
+    }
+    snprintf(attempt->ip_address, sizeof(attempt->ip_address), "%s", ip_addr);
+    attempt->port = port;
+    attempt->socket_fd = -1;
+    attempt->state = CONNECTION_CONNECTING;
+    attempt->deadline_ms = deadline_ms;
+    attempt->batch = batch;
+
+    // Prepare the sockaddr_in
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip_addr, &servaddr.sin_addr) <= 0)
+    {
+        finish_connection(attempt, -1, "not an IPv4 address");
+        return;
+    }
+    unsigned char mapped_addr[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+    memcpy(mapped_addr + 12, &servaddr.sin_addr, 4);
+    addrman_attempt(mapped_addr, port);
+
+    if (init_message_buffer(&attempt->recv_buffer) != 0)
+    {
+        finish_connection(attempt, -1, "out of memory");
+        return;
+    }
+
+    attempt->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (attempt->socket_fd < 0 || set_nonblocking(attempt->socket_fd, 1) < 0)
+    {
+        finish_connection(attempt, -1, strerror(errno));
+        return;
+    }
+
+    if (connect(attempt->socket_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        finish_connection(attempt, -1, strerror(errno));
+        return;
+    }
+
+    // Writability reports the end of the connect, also when it finished at once. The list mutex
+    // is held until the registration is done, so the loop cannot finish the attempt before that.
+    pthread_mutex_lock(&connection_attempts_mutex);
+    attempt->next = connection_attempts;
+    connection_attempts = attempt;
+    int registered = event_loop_add(attempt->socket_fd, EPOLLOUT, handle_connection_event, attempt);
+    pthread_mutex_unlock(&connection_attempts_mutex);
+    if (registered < 0)
+        finish_connection(attempt, -1, "event loop registration failed");
+}
+
+/**
+ * init_connect_batch:
+ *   Initialize an empty batch of connection attempts.
+ */
+static void init_connect_batch(connect_batch* batch)
+{
+    batch->started = 0;
+    batch->finished = 0;
+    batch->connected = 0;
+    batch->last_node = -1;
+    batch->last_error[0] = '\0';
+    pthread_mutex_init(&batch->mutex, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+}
+
+/**
+ * destroy_connect_batch:
+ *   Release the batch once all of its attempts finished.
+ */
+static void destroy_connect_batch(connect_batch* batch)
+{
+    pthread_mutex_destroy(&batch->mutex);
+    pthread_cond_destroy(&batch->cond);
+}
+
+int connect_to_peer(const char* ip_addr)
+{
+    connect_batch batch;
+    init_connect_batch(&batch);
+    start_connection(ip_addr, BITCOIN_MAINNET_PORT, get_monotonic_ms() + HANDSHAKE_TIMEOUT_MS,
+        &batch);
+
+    pthread_mutex_lock(&batch.mutex);
+    while (batch.finished < batch.started)
+        pthread_cond_wait(&batch.cond, &batch.mutex);
+    pthread_mutex_unlock(&batch.mutex);
+    destroy_connect_batch(&batch);
+
+    if (batch.connected == 0)
+    {
+        guarded_print_line("Couldn't connect to node %s: %s", ip_addr, batch.last_error);
+        return -1;
+    }
+    guarded_print_line("connected to node: %s | %d.", ip_addr, batch.last_node);
+    return batch.last_node;
+}
+
+int connect_to_peers_from_queue(int count, int concurrency, int timeout_sec)
+{
+    if (count <= 0 || concurrency <= 0 || timeout_sec <= 0)
+        return 0;
+
+    connect_batch batch;
+    init_connect_batch(&batch);
+    uint64_t deadline_ms = get_monotonic_ms() + (uint64_t)timeout_sec * 1000;
+    bool queue_empty = false;
+
+    pthread_mutex_lock(&batch.mutex);
+    for (;;)
     {
-        for (int j = 0; j < MAX_NODES; ++j)
+        // Keep up to `concurrency` attempts in flight until `count` were started
+        while (!queue_empty && batch.started < count &&
+            batch.started - batch.finished < concurrency && get_monotonic_ms() < deadline_ms)
         {
-            if (nodes[j].is_connected == 0)
+            Peer record;
+            pthread_mutex_unlock(&batch.mutex);
+            if (!get_peer_from_queue(&record))
             {
-                guarded_print_line("connected to node: %s | %d.", ip_addr, j);
-                initialize_node(&nodes[j], ip_addr, 8333, sockfd);
-                create_peer_thread(&nodes[j]);
+                queue_empty = true;
+                pthread_mutex_lock(&batch.mutex);
                 break;
             }
+
+            char peer[PEER_IP_STRLEN];
+            format_peer_ip(&record, peer, sizeof(peer));
+            uint16_t port = record.port != 0 ? record.port : BITCOIN_MAINNET_PORT;
+            if (get_idx(peer) >= 0)
+            {
+                log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Already connected to %s, skipped", peer);
+                pthread_mutex_lock(&batch.mutex);
+                continue;
+            }
+
+            uint64_t attempt_deadline_ms = get_monotonic_ms() + HANDSHAKE_TIMEOUT_MS;
+            if (attempt_deadline_ms > deadline_ms)
+                attempt_deadline_ms = deadline_ms;
+            start_connection(peer, port, attempt_deadline_ms, &batch);
+            pthread_mutex_lock(&batch.mutex);
         }
+
+        bool nothing_to_start = queue_empty || batch.started >= count ||
+            get_monotonic_ms() >= deadline_ms;
+        if (nothing_to_start && batch.finished == batch.started)
+            break;
+        pthread_cond_wait(&batch.cond, &batch.mutex);
     }
-    else
+    int started = batch.started;
+    int connected = batch.connected;
+    pthread_mutex_unlock(&batch.mutex);
+    destroy_connect_batch(&batch);
+
+    guarded_print_line("Connected to %d of %d peers from the queue.", connected, started);
+    return connected;
+}
+
+// Listening socket accepting inbound peers, guarded by the listener mutex
+static pthread_mutex_t listener_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int listen_fd = -1;
+static uint16_t listen_port = 0;
+static int max_inbound_peers = 0;
+static uint64_t inbound_accepted = 0;
+static uint64_t inbound_rejected = 0;
+
+/**
+ * count_inbound_peers:
+ *   Count the inbound peers which are connected or still in the handshake.
+ */
+static int count_inbound_peers()
+{
+    int count = 0;
+    for (int i = 0; i < MAX_NODES; ++i)
     {
-        guarded_print_line("Couldn't connect to node\n");
-        close(sockfd);
+        if (nodes[i].is_connected && nodes[i].is_inbound)
+            count++;
     }
-    return 0;
+    pthread_mutex_lock(&connection_attempts_mutex);
+    for (connection_attempt* attempt = connection_attempts; attempt != NULL; attempt = attempt->next)
+    {
+        if (attempt->inbound)
+            count++;
+    }
+    pthread_mutex_unlock(&connection_attempts_mutex);
+    return count;
 }
 
-void disconnect(int node_id)
+/**
+ * start_inbound_handshake:
+ *   Hand the accepted socket over to the event loop as a connection attempt waiting for the
+ *   'version' of the peer. The socket is closed if the attempt cannot be started.
+ */
+static void start_inbound_handshake(int fd, const struct sockaddr_in* addr)
 {
-    if (node_id < 0 || node_id >= MAX_NODES || !nodes[node_id].is_connected)
+    connection_attempt* attempt = (connection_attempt*)calloc(1, sizeof(connection_attempt));
+    if (attempt == NULL || init_message_buffer(&attempt->recv_buffer) != 0)
     {
-        fprintf(stderr, "[Error] Invalid node ID or node not connected.\n");
+        int error = errno;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Failed to set up inbound connection from %s: %s", ip, strerror(error));
+        free(attempt);
+        close(fd);
         return;
     }
+    inet_ntop(AF_INET, &addr->sin_addr, attempt->ip_address, sizeof(attempt->ip_address));
+    attempt->port = ntohs(addr->sin_port);
+    attempt->socket_fd = fd;
+    attempt->state = CONNECTION_HANDSHAKE;
+    attempt->inbound = true;
+    attempt->deadline_ms = get_monotonic_ms() + HANDSHAKE_TIMEOUT_MS;
+    attempt->batch = NULL;
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Accepted inbound connection from %s:%u",
+        attempt->ip_address, attempt->port);
+
+    pthread_mutex_lock(&connection_attempts_mutex);
+    attempt->next = connection_attempts;
+    connection_attempts = attempt;
+    int registered = event_loop_add(fd, EPOLLIN, handle_connection_event, attempt);
+    pthread_mutex_unlock(&connection_attempts_mutex);
+    if (registered < 0)
+        finish_connection(attempt, -1, "event loop registration failed");
+}
+
+/**
+ * handle_listener_event:
+ *   Event loop callback accepting every pending inbound connection. Connections over the inbound
+ *   limit are closed at once.
+ */
+static void handle_listener_event(int fd, uint32_t events, void* ctx)
+{
+    (void)events;
+    (void)ctx;
+    for (;;)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int peer_fd = accept(fd, (struct sockaddr*)&addr, &addr_len);
+        if (peer_fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Accept failed: %s", strerror(errno));
+            return;
+        }
+
+        pthread_mutex_lock(&listener_mutex);
+        int limit = max_inbound_peers;
+        pthread_mutex_unlock(&listener_mutex);
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        if (count_inbound_peers() >= limit)
+        {
+            log_message(LOG_INFO, BITLAB_LOG, __FILE__,
+                "Rejected inbound connection from %s, limit of %d inbound peers reached", ip, limit);
+            close(peer_fd);
+            pthread_mutex_lock(&listener_mutex);
+            inbound_rejected++;
+            pthread_mutex_unlock(&listener_mutex);
+            continue;
+        }
+        if (set_nonblocking(peer_fd, 1) < 0)
+        {
+            log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+                "Failed to set up inbound connection from %s: %s", ip, strerror(errno));
+            close(peer_fd);
+            continue;
+        }
+        pthread_mutex_lock(&listener_mutex);
+        inbound_accepted++;
+        pthread_mutex_unlock(&listener_mutex);
+        start_inbound_handshake(peer_fd, &addr);
+    }
+}
+
+int start_listening(uint16_t port, int max_inbound)
+{
+    pthread_mutex_lock(&listener_mutex);
+    if (listen_fd >= 0)
+    {
+        pthread_mutex_unlock(&listener_mutex);
+        guarded_print_line("Already listening on port %u", listen_port);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    int reuse = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, LISTEN_BACKLOG) < 0 ||
+        set_nonblocking(fd, 1) < 0 || event_loop_add(fd, EPOLLIN, handle_listener_event, NULL) < 0)
+    {
+        guarded_print_line("[Error] Couldn't listen on port %u: %s", port, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        pthread_mutex_unlock(&listener_mutex);
+        return -1;
+    }
+
+    listen_fd = fd;
+    listen_port = port;
+    max_inbound_peers = max_inbound;
+    inbound_accepted = 0;
+    inbound_rejected = 0;
+    pthread_mutex_unlock(&listener_mutex);
+    log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Listening on port %u, at most %d inbound peers",
+        port, max_inbound);
+    return 0;
+}
+
+void stop_listening()
+{
+    pthread_mutex_lock(&listener_mutex);
+    if (listen_fd >= 0)
+    {
+        event_loop_remove(listen_fd);
+        close(listen_fd);
+        listen_fd = -1;
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "Stopped listening on port %u", listen_port);
+    }
+    pthread_mutex_unlock(&listener_mutex);
+}
+
+void print_listener_status()
+{
+    pthread_mutex_lock(&listener_mutex);
+    if (listen_fd >= 0)
+        guarded_print_line("Listening on port %u: %d of %d inbound peers, %llu accepted, %llu rejected",
+            listen_port, count_inbound_peers(), max_inbound_peers,
+            (unsigned long long)inbound_accepted, (unsigned long long)inbound_rejected);
+    else
+        guarded_print_line("Not listening: %d inbound peers", count_inbound_peers());
+    pthread_mutex_unlock(&listener_mutex);
+
+    uint64_t total_served = 0;
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        if (!nodes[i].is_connected || !nodes[i].is_inbound)
+            continue;
+        total_served += nodes[i].blocks_served;
+        guarded_print_line("  Peer %d (%s:%u): %llu blocks served", i, nodes[i].ip_address,
+            nodes[i].port, (unsigned long long)nodes[i].blocks_served);
+    }
+    guarded_print_line("Blocks served to inbound peers: %llu", (unsigned long long)total_served);
+}
+
+/**
+ * The peer to disconnect on the event loop thread.
+ *
+ * @param node_id The node slot of the peer.
+ * @param generation The generation of the slot when the disconnect was requested.
+ */
+typedef struct
+{
+    int node_id;
+    uint32_t generation;
+} disconnect_task;
+
+/**
+ * disconnect_peer:
+ *   Close the peer on the event loop thread, so it is never torn down while the loop reads from it.
+ *   A slot taken by another peer since the disconnect was requested is left alone. Peers are only
+ *   closed on the loop thread, so the slot cannot be reused between the check and the close.
+ */
+static void disconnect_peer(void* ctx)
+{
+    disconnect_task* task = (disconnect_task*)ctx;
+    Node* node = &nodes[task->node_id];
+    pthread_mutex_lock(&node->send_mutex);
+    int current = node->is_connected && node->generation == task->generation;
+    pthread_mutex_unlock(&node->send_mutex);
+    free(task);
+    if (!current)
+        return;
 
-    Node* node = &nodes[node_id];
     char log_filename[256];
     snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
         node->ip_address);
+    close_peer(node);
+    log_message(LOG_INFO, log_filename, __FILE__,
+        "Successfully disconnected from node %s:%u", node->ip_address,
+        node->port);
+}
 
-    log_message(LOG_INFO, log_filename, __FILE__, "Disconnecting from node %s:%u",
-        node->ip_address, node->port);
+void disconnect(int node_id)
+{
+    if (node_id < 0 || node_id >= MAX_NODES || !nodes[node_id].is_connected)
+    {
+        fprintf(stderr, "[Error] Invalid node ID or node not connected.\n");
+        return;
+    }
 
-    close(node->socket_fd);
+    Node* node = &nodes[node_id];
+    disconnect_task* task = (disconnect_task*)malloc(sizeof(disconnect_task));
+    if (task == NULL)
+    {
+        fprintf(stderr, "[Error] Failed to allocate memory for the disconnect.\n");
+        return;
+    }
+    pthread_mutex_lock(&node->send_mutex);
+    task->node_id = node_id;
+    task->generation = node->generation;
+    pthread_mutex_unlock(&node->send_mutex);
 
-    node->is_connected = 0;
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log",
+        node->ip_address);
 
-    if (pthread_cancel(node->thread) != 0)
-    {
-        perror("Failed to cancel thread for peer");
-    }
+    log_message(LOG_INFO, log_filename, __FILE__, "Disconnecting from node %s:%u",
+        node->ip_address, node->port);
 
-    log_message(LOG_INFO, log_filename, __FILE__,
-        "Successfully disconnected from node %s:%u", node->ip_address,
-        node->port);
+    // Without a running loop nothing else touches the peer, so it is closed right away
+    if (is_event_loop_thread() || event_loop_post(disconnect_peer, task) < 0)
+        disconnect_peer(task);
 }
 
 void print_block_header(const unsigned char* header)
@@ -1295,36 +2281,68 @@ void print_block_header(const unsigned char* header)
 void parse_headers_message(const unsigned char* payload, size_t payload_len)
 {
     size_t offset = 0;
-    FILE* file = fopen(HEADERS_FILE, "ab");
-    if (!file)
+    if (payload_len == 0)
+        return;
+
+    // Each header is followed by a transaction count, which is always 0 in 'headers' messages
+    uint64_t count = read_var_int(payload, &offset);
+    if (count > MAX_HEADERS_COUNT)
+        count = MAX_HEADERS_COUNT;
+    unsigned char* headers = (unsigned char*)malloc(count * BLOCK_HEADER_SIZE + 1);
+    if (!headers)
     {
-        perror("Failed to open headers file");
+        perror("malloc failed");
         return;
     }
 
-    while (offset + 80 <= payload_len)
+    size_t parsed = 0;
+    for (uint64_t i = 0; i < count && offset + 81 <= payload_len; i++)
     {
-        print_block_header(payload + offset);
-        fwrite(payload + offset, 80, 1, file);
+        memcpy(headers + parsed * BLOCK_HEADER_SIZE, payload + offset, BLOCK_HEADER_SIZE);
+        parsed++;
         offset += 80;
+        read_var_int(payload, &offset);
     }
 
-    fclose(file);
+    // Printing every header of a full sync would take longer than storing it, print the last one
+    if (parsed > 0)
+        print_block_header(headers + (parsed - 1) * BLOCK_HEADER_SIZE);
+    int added = add_headers(headers, parsed);
+    if (added < 0)
+        guarded_print_line("[Error] Failed to add headers to the header index.");
+    else
+        guarded_print_line("Added %d of %zu headers, tip height: %d", added, parsed,
+            get_header_count() - 1);
+    free(headers);
 }
 
-void load_latest_known_block_hash(unsigned char* block_hash)
+/**
+ * handle_headers_response:
+ *   Print and save the headers received in response to 'getheaders'.
+ */
+static void handle_headers_response(void* ctx, const unsigned char* payload, size_t payload_len)
 {
-    FILE* file = fopen(HEADERS_FILE, "rb");
-    if (!file)
-    {
-        // No known blocks, use genesis block hash
-        memset(block_hash, 0, 32);
-        return;
-    }
+    Node* node = (Node*)ctx;
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
+    log_message(LOG_INFO, log_filename, __FILE__, "Received response to 'getheaders' message.");
+
+    // Process the response and print to CLI
+    guarded_print("Received response to 'getheaders' message:\n");
+    parse_headers_message(payload, payload_len);
+}
 
-    fseek(file, -80, SEEK_END);
-    fread(block_hash, 32, 1, file);
-    fclose(file);
+/**
+ * build_locator_getheaders:
+ *   Build the 'getheaders' message with the block locator of the best chain.
+ *   Returns the length of the message, 0 on failure.
+ */
+static size_t build_locator_getheaders(unsigned char* buffer, size_t buffer_size)
+{
+    // Hashes of the best chain from the tip back to genesis at doubling distances
+    unsigned char block_locator[MAX_LOCATOR_COUNT * 32];
+    size_t locator_count = build_block_locator(block_locator, MAX_LOCATOR_COUNT);
+    return build_getheaders_message(buffer, buffer_size, block_locator, locator_count);
 }
 
 void send_getheaders_and_wait(int idx)
@@ -1336,183 +2354,130 @@ void send_getheaders_and_wait(int idx)
     }
 
     Node* node = &nodes[idx];
-    char log_filename[256];
-    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
-
-    // Define block locator and locator count
-    unsigned char block_locator[MAX_LOCATOR_COUNT * 32];
-    int locator_count = 1; // Set to 1 to request headers starting from the latest known block
-
-    // Load the latest known block hash
-    load_latest_known_block_hash(block_locator);
-
-    // Build the 'getheaders' message
     unsigned char getheaders_msg[sizeof(bitcoin_msg_header) + 4 + 1 + (MAX_LOCATOR_COUNT * 32) + 32];
-    size_t msg_len = build_getheaders_message(getheaders_msg, sizeof(getheaders_msg), block_locator, locator_count);
+    size_t msg_len = build_locator_getheaders(getheaders_msg, sizeof(getheaders_msg));
     if (msg_len == 0)
     {
         fprintf(stderr, "[Error] Failed to build 'getheaders' message.\n");
         return;
     }
 
-    // Send the 'getheaders' message
-    ssize_t bytes_sent = send(node->socket_fd, getheaders_msg, msg_len, 0);
-    if (bytes_sent < 0)
-    {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to send 'getheaders' message: %s", strerror(errno));
-        return;
-    }
-
-    log_message(LOG_INFO, log_filename, __FILE__, "Sent 'getheaders' message.");
-    node->operation_in_progress = 1;
-
     // Wait for 10 seconds for a response
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(node->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-    // Receive the response
-    unsigned char buffer[4096];
-    ssize_t bytes_received = recv(node->socket_fd, buffer, sizeof(buffer), 0);
-    if (bytes_received < 0)
-    {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to receive response: %s", strerror(errno));
-        node->operation_in_progress = 0;
-        return;
-    }
-
-    log_message(LOG_INFO, log_filename, __FILE__, "Received response to 'getheaders' message.");
-    node->operation_in_progress = 0;
-
-    // Process the response and print to CLI
-    guarded_print("Received response to 'getheaders' message:\n");
-    parse_headers_message(buffer, bytes_received);
+    send_request_and_wait(node, getheaders_msg, msg_len, COMMAND_HEADERS, 1, 10000,
+        handle_headers_response, node);
 }
 
-void send_headers(int idx, const unsigned char* start_hash, const unsigned char* stop_hash)
+int send_getheaders(int idx, int timeout_ms, request_callback callback, void* ctx)
 {
     if (idx < 0 || idx >= MAX_NODES || !nodes[idx].is_connected)
-    {
-        fprintf(stderr, "[Error] Invalid node index or node not connected.\n");
-        return;
-    }
+        return -1;
 
-    Node* node = &nodes[idx];
+    unsigned char getheaders_msg[sizeof(bitcoin_msg_header) + 4 + 1 + (MAX_LOCATOR_COUNT * 32) + 32];
+    size_t msg_len = build_locator_getheaders(getheaders_msg, sizeof(getheaders_msg));
+    if (msg_len == 0)
+        return -1;
+
+    // The result is not awaited, the callback handles the response
+    peer_request* request = send_request(&nodes[idx], getheaders_msg, msg_len, COMMAND_HEADERS, 1,
+        timeout_ms, callback, ctx);
+    if (request == NULL)
+        return -1;
+    release_request(request);
+    return 0;
+}
+
+/**
+ * send_headers_from:
+ *   Send the 'headers' message with the headers of the best chain from the given height up to
+ *   the stop hash or MAX_HEADERS_COUNT headers.
+ */
+static void send_headers_from(Node* node, int start_height, const unsigned char* stop_hash)
+{
     char log_filename[256];
     snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
 
-    // Open the headers file
-    FILE* file = fopen(HEADERS_FILE, "rb");
-    if (!file)
+    unsigned char* payload = (unsigned char*)malloc(3 + MAX_HEADERS_COUNT * (BLOCK_HEADER_SIZE + 1));
+    unsigned char* headers_msg = (unsigned char*)malloc(sizeof(bitcoin_msg_header) + 3 +
+        MAX_HEADERS_COUNT * (BLOCK_HEADER_SIZE + 1));
+    if (!payload || !headers_msg)
     {
-        perror("Failed to open headers file");
+        perror("malloc failed");
+        free(payload);
+        free(headers_msg);
         return;
     }
 
-    // Find the starting block header
-    unsigned char buffer[81];
+    // Headers are copied straight from the mapped headers file into the payload
     size_t headers_count = 0;
-    int found_start = 0;
-    while (fread(buffer, 80, 1, file) == 1)
-    {
-        if (memcmp(buffer, start_hash, 32) == 0)
-        {
-            found_start = 1;
-            break;
-        }
-    }
-
-    if (!found_start)
-    {
-        fclose(file);
-        fprintf(stderr, "[Error] Start hash not found in headers file.\n");
-        return;
-    }
-
-    // Build the 'headers' message
-    unsigned char headers_msg[sizeof(bitcoin_msg_header) + 1 + (MAX_HEADERS_COUNT * 81)];
-    size_t offset = sizeof(bitcoin_msg_header);
-    headers_msg[offset++] = 0; // Placeholder for count
-
-    while (headers_count < MAX_HEADERS_COUNT && fread(buffer, 80, 1, file) == 1)
+    int stop_height = stop_hash != NULL ? get_header_height(stop_hash) : -1;
+    int end_height = get_header_count();
+    if (stop_height >= start_height && stop_height < end_height)
+        end_height = stop_height + 1;
+    if (start_height >= 0 && end_height - start_height > MAX_HEADERS_COUNT)
+        end_height = start_height + MAX_HEADERS_COUNT;
+    if (start_height >= 0 && start_height < end_height)
+        headers_count = (size_t)(end_height - start_height);
+    size_t offset = write_var_int(payload, headers_count);
+    for (size_t i = 0; i < headers_count; ++i)
     {
-        memcpy(headers_msg + offset, buffer, 80);
-        offset += 80;
-        headers_msg[offset++] = 0; // Transaction count (var_int, 0 for headers only)
-        headers_count++;
-
-        if (memcmp(buffer, stop_hash, 32) == 0)
-        {
-            break;
-        }
+        memcpy(payload + offset, get_header_data(start_height + (int)i), BLOCK_HEADER_SIZE);
+        offset += BLOCK_HEADER_SIZE;
+        payload[offset++] = 0; // Transaction count (var_int, 0 for headers only)
     }
 
-    fclose(file);
-
-    // Set the count
-    headers_msg[sizeof(bitcoin_msg_header)] = headers_count;
-
-    // Build the message header
-    bitcoin_msg_header* header = (bitcoin_msg_header*)headers_msg;
-    header->magic = htole32(BITCOIN_MAINNET_MAGIC);
-    strncpy(header->command, "headers", 12);
-    header->length = htole32(offset - sizeof(bitcoin_msg_header));
-    compute_checksum(headers_msg + sizeof(bitcoin_msg_header), offset - sizeof(bitcoin_msg_header), header->checksum);
+    size_t msg_len = build_message(headers_msg, sizeof(bitcoin_msg_header) + 3 +
+        MAX_HEADERS_COUNT * (BLOCK_HEADER_SIZE + 1), "headers", payload, offset);
 
     // Send the 'headers' message
-    ssize_t bytes_sent = send(node->socket_fd, headers_msg, offset, 0);
-    if (bytes_sent < 0)
+    if (msg_len == 0 || queue_message(node, headers_msg, msg_len) < 0)
     {
         log_message(LOG_INFO, log_filename, __FILE__,
             "[Error] Failed to send 'headers' message: %s", strerror(errno));
-        return;
+    }
+    else
+    {
+        log_message(LOG_INFO, log_filename, __FILE__, "Sent 'headers' message with %zu headers from height %d.",
+            headers_count, start_height);
     }
 
-    log_message(LOG_INFO, log_filename, __FILE__, "Sent 'headers' message.");
+    free(payload);
+    free(headers_msg);
 }
 
-void save_blocks_to_file(const unsigned char* payload, size_t payload_len, const char* filename)
+void send_headers(int idx, const unsigned char* start_hash, const unsigned char* stop_hash)
 {
-    FILE* file = fopen(filename, "wb");
-    if (!file)
+    if (idx < 0 || idx >= MAX_NODES || !nodes[idx].is_connected)
     {
-        perror("Failed to open file for writing");
+        fprintf(stderr, "[Error] Invalid node index or node not connected.\n");
         return;
     }
 
-    fwrite(payload, 1, payload_len, file);
-    fclose(file);
-    guarded_print("Blocks saved to file: %s\n", filename);
-}
-
-unsigned char* load_blocks_from_file(const char* filename, size_t* payload_len)
-{
-    FILE* file = fopen(filename, "rb");
-    if (!file)
+    int start_height = get_header_height(start_hash);
+    if (start_height < 0)
     {
-        perror("Failed to open file for reading");
-        return NULL;
+        fprintf(stderr, "[Error] Start hash not found in the header index.\n");
+        return;
     }
+    send_headers_from(&nodes[idx], start_height + 1, stop_hash);
+}
 
-    fseek(file, 0, SEEK_END);
-    *payload_len = ftell(file);
-    fseek(file, 0, SEEK_SET);
+/**
+ * handle_getblocks_response:
+ *   Print the inventory received in response to 'getblocks' and download the announced blocks.
+ */
+static void handle_getblocks_response(void* ctx, const unsigned char* payload, size_t payload_len)
+{
+    Node* node = (Node*)ctx;
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
+    log_message(LOG_INFO, log_filename, __FILE__, "Received response to 'getblocks' message.");
 
-    unsigned char* payload = (unsigned char*)malloc(*payload_len);
-    if (!payload)
-    {
-        perror("Failed to allocate memory");
-        fclose(file);
-        return NULL;
-    }
+    // Process the response and print to CLI
+    guarded_print("Received response to 'getblocks' message:\n");
+    parse_inv_message(payload, payload_len);
 
-    fread(payload, 1, *payload_len, file);
-    fclose(file);
-    guarded_print("Blocks loaded from file: %s\n", filename);
-    return payload;
+    // The announced blocks are downloaded into the block store
+    handle_inv_message((int)(node - nodes), payload, payload_len);
 }
 
 void send_getblocks_and_wait(int idx)
@@ -1524,15 +2489,9 @@ void send_getblocks_and_wait(int idx)
     }
 
     Node* node = &nodes[idx];
-    char log_filename[256];
-    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
-
-    // Define block locator and locator count
+    // Hashes of the best chain from the tip back to genesis at doubling distances
     unsigned char block_locator[MAX_LOCATOR_COUNT * 32];
-    int locator_count = 1; // Set to 1 to request blocks starting from the latest known block
-
-    // Load the latest known block hash
-    load_latest_known_block_hash(block_locator);
+    size_t locator_count = build_block_locator(block_locator, MAX_LOCATOR_COUNT);
 
     // Build the 'getblocks' message
     unsigned char getblocks_msg[sizeof(bitcoin_msg_header) + 4 + 1 + (MAX_LOCATOR_COUNT * 32) + 32];
@@ -1543,52 +2502,9 @@ void send_getblocks_and_wait(int idx)
         return;
     }
 
-    // Send the 'getblocks' message
-    ssize_t bytes_sent = send(node->socket_fd, getblocks_msg, msg_len, 0);
-    if (bytes_sent < 0)
-    {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to send 'getblocks' message: %s", strerror(errno));
-        return;
-    }
-
-    log_message(LOG_INFO, log_filename, __FILE__, "Sent 'getblocks' message.");
-    node->operation_in_progress = 1;
-
     // Wait for 10 seconds for a response
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(node->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-    // Increase buffer size to handle larger responses
-    unsigned char buffer[32768];
-    size_t total_bytes_received = 0;
-    ssize_t bytes_received;
-
-    // Receive the message in parts
-    while ((bytes_received = recv(node->socket_fd, buffer + total_bytes_received, sizeof(buffer) - total_bytes_received - 1, 0)) > 0)
-    {
-        total_bytes_received += bytes_received;
-    }
-
-    if (bytes_received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-    {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to receive response: %s", strerror(errno));
-        node->operation_in_progress = 0;
-        return;
-    }
-
-    log_message(LOG_INFO, log_filename, __FILE__, "Received response to 'getblocks' message.");
-    node->operation_in_progress = 0;
-
-    // Process the response and print to CLI
-    guarded_print("Received response to 'getblocks' message:\n");
-    parse_inv_message(buffer, total_bytes_received);
-
-    // Save the blocks to a file
-    save_blocks_to_file(buffer, total_bytes_received, "blocks.dat");
+    send_request_and_wait(node, getblocks_msg, msg_len, COMMAND_INV, 1, 10000,
+        handle_getblocks_response, node);
 }
 
 size_t build_getblocks_message(unsigned char* buffer, size_t buffer_size, const unsigned char* block_locator, size_t locator_count)
@@ -1666,9 +2582,10 @@ void handle_inv_message(int idx, const unsigned char* payload, size_t payload_le
         return;
     }
 
-    unsigned char hashes[count * 32];
-    size_t hash_count = 0;
-
+    // Blocks of the header index extend a running download, others are asked from the announcer
+    unsigned char hashes[MAX_INV_BLOCKS * 32];
+    size_t unknown_count = 0;
+    int last_height = -1;
     for (uint64_t i = 0; i < count; i++)
     {
         if (offset + 36 > payload_len)
@@ -1680,28 +2597,43 @@ void handle_inv_message(int idx, const unsigned char* payload, size_t payload_le
 
         uint32_t type;
         memcpy(&type, payload + offset, 4);
-        offset += 4;
+        const unsigned char* hash = payload + offset + 4;
+        offset += 36;
+        if (type != 2) // Type 2 for block (1 for transaction)
+            continue;
 
-        if (type == 2) // Type 2 for block (1 for transaction)
+        int height = get_header_height(hash);
+        if (height < 0)
         {
-            memcpy(hashes + (hash_count * 32), payload + offset, 32);
-            hash_count++;
+            // At most MAX_INV_BLOCKS unknown blocks are asked for at once
+            if (unknown_count < MAX_INV_BLOCKS)
+                memcpy(hashes + (unknown_count++ * 32), hash, 32);
+            continue;
         }
-        offset += 32;
+        if (height > last_height && !find_block(hash, NULL))
+            last_height = height;
     }
+    if (last_height >= 0)
+        extend_block_download(last_height);
 
-    if (hash_count > 0)
+    // Called from the event loop thread, so the blocks are not awaited here
+    if (unknown_count > 0 && idx >= 0 && idx < MAX_NODES && nodes[idx].is_connected)
     {
-        send_getdata_and_wait(idx, hashes, hash_count);
+        peer_request* request = send_getdata(&nodes[idx], hashes, unknown_count);
+        if (request != NULL)
+            release_request(request);
     }
 }
 
 size_t build_getdata_message(unsigned char* buffer, size_t buffer_size, const unsigned char* hashes, size_t hash_count)
 {
-    if (buffer_size < sizeof(bitcoin_msg_header) + 1 + (hash_count * 36))
+    size_t payload_size = write_var_int(NULL, hash_count) + (hash_count * 36);
+    if (buffer_size < sizeof(bitcoin_msg_header) + payload_size)
         return 0;
 
-    unsigned char payload[1 + (hash_count * 36)];
+    unsigned char* payload = (unsigned char*)malloc(payload_size);
+    if (payload == NULL)
+        return 0;
 
     // Set inventory count (var_int encoding)
     size_t offset = 0;
@@ -1710,94 +2642,97 @@ size_t build_getdata_message(unsigned char* buffer, size_t buffer_size, const un
     // Copy inventory vectors (type + hash)
     for (size_t i = 0; i < hash_count; i++)
     {
-        uint32_t type = htonl(2); // Assuming type 2 for block (1 for transaction)
-        memcpy(payload + offset, &type, 4);
+        // Type 2 for block (1 for transaction), little-endian as every integer of the protocol
+        const unsigned char type[4] = { 2, 0, 0, 0 };
+        memcpy(payload + offset, type, 4);
         offset += 4;
         memcpy(payload + offset, hashes + (i * 32), 32);
         offset += 32;
     }
 
-    // Ensure buffer is large enough
-    if (offset > buffer_size)
-        return 0;
-
     // Build final message
-    return build_message(buffer, buffer_size, "getdata", payload, offset);
+    size_t message_size = build_message(buffer, buffer_size, "getdata", payload, offset);
+    free(payload);
+    return message_size;
 }
 
-void send_getdata_and_wait(int idx, const unsigned char* hashes, size_t hash_count)
+/**
+ * handle_block_response:
+ *   Decode the transactions of a block received in response to 'getdata'.
+ */
+static void handle_block_response(void* ctx, const unsigned char* payload, size_t payload_len)
 {
-    if (idx < 0 || idx >= MAX_NODES || !nodes[idx].is_connected)
-    {
-        fprintf(stderr, "[Error] Invalid node index or node not connected.\n");
-        return;
-    }
+    Node* node = (Node*)ctx;
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
+    log_message(LOG_INFO, log_filename, __FILE__, "Received 'block' message.");
+    decode_transactions(payload, payload_len);
+}
 
+/**
+ * send_getdata:
+ *   Request the blocks with given hashes from the node without waiting for them. Every received
+ *   block is decoded on the event loop thread. Returns the request, or NULL on failure.
+ */
+static peer_request* send_getdata(Node* node, const unsigned char* hashes, size_t hash_count)
+{
     if (hash_count == 0 || hash_count > 50000)
     {
         fprintf(stderr, "[Error] Invalid hash count. Must be between 1 and 50000.\n");
-        return;
+        return NULL;
     }
 
-    Node* node = &nodes[idx];
-    char log_filename[256];
-    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
-
     // Build the 'getdata' message
-    unsigned char getdata_msg[sizeof(bitcoin_msg_header) + 1 + (hash_count * 36)];
-    size_t msg_len = build_getdata_message(getdata_msg, sizeof(getdata_msg), hashes, hash_count);
+    size_t msg_size = sizeof(bitcoin_msg_header) + write_var_int(NULL, hash_count) + (hash_count * 36);
+    unsigned char* getdata_msg = (unsigned char*)malloc(msg_size);
+    size_t msg_len = getdata_msg != NULL ?
+        build_getdata_message(getdata_msg, msg_size, hashes, hash_count) : 0;
     if (msg_len == 0)
     {
         fprintf(stderr, "[Error] Failed to build 'getdata' message.\n");
-        return;
+        free(getdata_msg);
+        return NULL;
     }
 
-    // Send the 'getdata' message
-    ssize_t bytes_sent = send(node->socket_fd, getdata_msg, msg_len, 0);
-    if (bytes_sent < 0)
+    // Wait up to 20 seconds for all requested blocks
+    peer_request* request = send_hash_request(node, getdata_msg, msg_len, COMMAND_BLOCK,
+        (int)hash_count, hashes, 20000, handle_block_response, node);
+    free(getdata_msg);
+    return request;
+}
+
+void send_getdata_and_wait(int idx, const unsigned char* hashes, size_t hash_count)
+{
+    if (idx < 0 || idx >= MAX_NODES || !nodes[idx].is_connected)
     {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to send 'getdata' message: %s", strerror(errno));
+        fprintf(stderr, "[Error] Invalid node index or node not connected.\n");
         return;
     }
 
-    log_message(LOG_INFO, log_filename, __FILE__, "Sent 'getdata' message.");
-    node->operation_in_progress = 1;
-
-    // Wait for 20 seconds for a response (increased timeout)
-    struct timeval tv;
-    tv.tv_sec = 20;
-    tv.tv_usec = 0;
-    setsockopt(node->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-    // Receive the response
-    unsigned char buffer[32768];
-    ssize_t bytes_received;
-
-    while ((bytes_received = recv(node->socket_fd, buffer, sizeof(buffer), 0)) > 0)
-    {
-        bitcoin_msg_header* hdr = (bitcoin_msg_header*)buffer;
-        if (hdr->magic == BITCOIN_MAINNET_MAGIC)
-        {
-            char cmd_name[13];
-            memset(cmd_name, 0, sizeof(cmd_name));
-            memcpy(cmd_name, hdr->command, 12);
+    peer_request* request = send_getdata(&nodes[idx], hashes, hash_count);
+    if (request != NULL)
+        finish_waiting(&nodes[idx], request);
+}
 
-            if (strcmp(cmd_name, "block") == 0)
-            {
-                log_message(LOG_INFO, log_filename, __FILE__, "Received 'block' message.");
-                decode_transactions(buffer + sizeof(bitcoin_msg_header), hdr->length);
-            }
-        }
-    }
+int send_getdata_blocks(int idx, const unsigned char* hashes, size_t hash_count, int timeout_ms,
+    request_callback callback, void* ctx)
+{
+    if (idx < 0 || idx >= MAX_NODES || !nodes[idx].is_connected || hash_count == 0 ||
+        hash_count > MAX_INV_BLOCKS)
+        return -1;
 
-    if (bytes_received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-    {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to receive block message: %s", strerror(errno));
-    }
+    unsigned char getdata_msg[sizeof(bitcoin_msg_header) + 3 + (MAX_INV_BLOCKS * 36)];
+    size_t msg_len = build_getdata_message(getdata_msg, sizeof(getdata_msg), hashes, hash_count);
+    if (msg_len == 0)
+        return -1;
 
-    node->operation_in_progress = 0;
+    // The result is not awaited, the callback handles every block
+    peer_request* request = send_hash_request(&nodes[idx], getdata_msg, msg_len, COMMAND_BLOCK,
+        (int)hash_count, hashes, timeout_ms, callback, ctx);
+    if (request == NULL)
+        return -1;
+    release_request(request);
+    return 0;
 }
 
 /**
@@ -1852,6 +2787,20 @@ size_t build_inv_message(unsigned char* buffer, size_t buffer_size, const unsign
     return message_size;
 }
 
+/**
+ * handle_inv_response:
+ *   Request the blocks announced in the 'inv' received in response to 'inv'.
+ */
+static void handle_inv_response(void* ctx, const unsigned char* payload, size_t payload_len)
+{
+    Node* node = (Node*)ctx;
+    char log_filename[256];
+    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
+    log_message(LOG_INFO, log_filename, __FILE__, "Received response to 'inv' message.");
+    printf("Received 'inv' response:\n");
+    handle_inv_message((int)(node - nodes), payload, payload_len);
+}
+
 /**
  * @brief Sends an 'inv' message to the peer.
  *
@@ -1878,9 +2827,6 @@ void send_inv_and_wait(int idx, const unsigned char* inv_data, size_t inv_count)
     }
 
     Node* node = &nodes[idx];
-    char log_filename[256];
-    snprintf(log_filename, sizeof(log_filename), "peer_connection_%s.log", node->ip_address);
-
     size_t var_int_size = write_var_int(NULL, inv_count); // Get the size of the var_int encoding
     size_t payload_size = var_int_size + (inv_count * 36); // var_int size + 36 bytes per inventory vector
     size_t inv_msg_size = sizeof(bitcoin_msg_header) + payload_size;
@@ -1903,74 +2849,9 @@ void send_inv_and_wait(int idx, const unsigned char* inv_data, size_t inv_count)
         return;
     }
 
-    // Send the 'inv' message
-    ssize_t bytes_sent = send(node->socket_fd, inv_msg, msg_len, 0);
-    if (bytes_sent < 0)
-    {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to send 'inv' message: %s", strerror(errno));
-        free(inv_msg);
-        return;
-    }
-
-    log_message(LOG_INFO, log_filename, __FILE__, "Sent 'inv' message.");
-    printf("Sent 'inv' message.\n");
-    node->operation_in_progress = 1;
-
     // Wait for 10 seconds for a response
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(node->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-    // Receive the response
-    unsigned char buffer[32768];
-    ssize_t bytes_received = recv(node->socket_fd, buffer, sizeof(buffer), 0);
-    if (bytes_received < 0)
-    {
-        log_message(LOG_INFO, log_filename, __FILE__,
-            "[Error] Failed to receive response: %s", strerror(errno));
-        node->operation_in_progress = 0;
-        free(inv_msg);
-        return;
-    }
-
-    log_message(LOG_INFO, log_filename, __FILE__, "Received response to 'inv' message.");
-    printf("Received response to 'inv' message.\n");
-    node->operation_in_progress = 0;
-
-    // Process the response
-    if (bytes_received >= (ssize_t)sizeof(bitcoin_msg_header))
-    {
-        bitcoin_msg_header* hdr = (bitcoin_msg_header*)buffer;
-        if (hdr->magic == BITCOIN_MAINNET_MAGIC)
-        {
-            char cmd_name[13];
-            memset(cmd_name, 0, sizeof(cmd_name));
-            memcpy(cmd_name, hdr->command, 12);
-
-            printf("Received command: '%s'\n", cmd_name);
-
-            if (strcmp(cmd_name, "inv") == 0)
-            {
-                printf("Received 'inv' response:\n");
-                handle_inv_message(idx, buffer + sizeof(bitcoin_msg_header), bytes_received - sizeof(bitcoin_msg_header));
-            }
-            else
-            {
-                printf("Unhandled command: '%s'\n", cmd_name);
-            }
-        }
-        else
-        {
-            printf("Unexpected magic bytes (0x%08X).\n", hdr->magic);
-        }
-    }
-    else
-    {
-        printf("Received incomplete message.\n");
-    }
-
+    send_request_and_wait(node, inv_msg, msg_len, COMMAND_INV, 1, 10000,
+        handle_inv_response, node);
     free(inv_msg);
 }
 
@@ -1984,7 +2865,7 @@ void decode_transactions(const unsigned char* block_data, size_t block_len)
     offset += 80;
 
     // Read the number of transactions (var_int)
-    uint64_t tx_count = read_var_int(block_data + offset, &offset);
+    uint64_t tx_count = read_var_int(block_data, &offset);
 
     printf("Number of transactions: %lu\n", tx_count);
 
@@ -2000,7 +2881,7 @@ void decode_transactions(const unsigned char* block_data, size_t block_len)
         printf("  Version: %u\n", tx_version);
 
         // Read the number of inputs (var_int)
-        uint64_t input_count = read_var_int(block_data + offset, &offset);
+        uint64_t input_count = read_var_int(block_data, &offset);
         printf("  Number of inputs: %lu\n", input_count);
 
         // Read each input (simplified)
@@ -2010,14 +2891,14 @@ void decode_transactions(const unsigned char* block_data, size_t block_len)
             offset += 36;
 
             // Read script length (var_int)
-            uint64_t script_len = read_var_int(block_data + offset, &offset);
+            uint64_t script_len = read_var_int(block_data, &offset);
 
             // Skip script and sequence (script_len + 4 bytes)
             offset += script_len + 4;
         }
 
         // Read the number of outputs (var_int)
-        uint64_t output_count = read_var_int(block_data + offset, &offset);
+        uint64_t output_count = read_var_int(block_data, &offset);
         printf("  Number of outputs: %lu\n", output_count);
 
         // Read each output (simplified)
@@ -2030,7 +2911,7 @@ void decode_transactions(const unsigned char* block_data, size_t block_len)
             printf("    Value: %lu\n", value);
 
             // Read script length (var_int)
-            uint64_t script_len = read_var_int(block_data + offset, &offset);
+            uint64_t script_len = read_var_int(block_data, &offset);
 
             // Skip script (script_len bytes)
             offset += script_len;
@@ -2062,22 +2943,21 @@ void send_tx(int idx, const unsigned char* tx_data, size_t tx_size)
         return;
     }
 
-    // Build the 'tx' message with the appropriate header
-    unsigned char tx_msg[sizeof(bitcoin_msg_header) + tx_size];
-
-    // Build the message header
-    bitcoin_msg_header* header = (bitcoin_msg_header*)tx_msg;
-    header->magic = htole32(BITCOIN_MAINNET_MAGIC);
-    strncpy(header->command, "tx", 12);
-    header->length = htole32(tx_size);
-    compute_checksum(tx_data, tx_size, header->checksum);
-
-    // Copy the transaction data
-    memcpy(tx_msg + sizeof(bitcoin_msg_header), tx_data, tx_size);
+    // Build the 'tx' message, transactions may be too large for the stack
+    size_t msg_size = sizeof(bitcoin_msg_header) + tx_size;
+    unsigned char* tx_msg = (unsigned char*)malloc(msg_size);
+    size_t msg_len = tx_msg != NULL ? build_message(tx_msg, msg_size, "tx", tx_data, tx_size) : 0;
+    if (msg_len == 0)
+    {
+        fprintf(stderr, "[Error] Failed to build 'tx' message.\n");
+        free(tx_msg);
+        return;
+    }
 
     // Send the 'tx' message
-    ssize_t bytes_sent = send(node->socket_fd, tx_msg, sizeof(bitcoin_msg_header) + tx_size, 0);
-    if (bytes_sent < 0)
+    int result = queue_message(node, tx_msg, msg_len);
+    free(tx_msg);
+    if (result < 0)
     {
         log_message(LOG_INFO, log_filename, __FILE__,
             "[Error] Failed to send 'tx' message: %s", strerror(errno));
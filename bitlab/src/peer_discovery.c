@@ -1,17 +1,21 @@
 #include "peer_discovery.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <stdint.h>
 #include <netinet/in.h>
 #include <pthread.h>
 
 #include "peer_queue.h"
+#include "addrman.h"
 #include "state.h"
 #include "utils.h"
 #include "cli.h"
 #include "ip.h"
+#include "dns.h"
 
-static const char* dns_seeds[] =
+static const char* const dns_seeds[] =
 {
     "seed.bitcoin.sipa.be.",
     "seed.btc.petertodd.org.",
@@ -28,6 +32,16 @@ static const char* hardcoded_peers[] =
     NULL
 };
 
+/**
+ * add_discovered_peer:
+ *   Record the peer obtained locally in the address manager and add it to the peer queue.
+ */
+static void add_discovered_peer(const Peer* peer)
+{
+    addrman_add(peer, NULL);
+    add_peer_record(peer);
+}
+
 void* handle_peer_discovery(void* arg)
 {
     usleep(1000000); // 1 s
@@ -45,7 +59,9 @@ void* handle_peer_discovery(void* arg)
                 search = true;
                 for (int i = 0; hardcoded_peers[i] != NULL; ++i)
                 {
-                    add_peer_to_queue(hardcoded_peers[i], 0);
+                    Peer peer;
+                    if (parse_peer(hardcoded_peers[i], 0, &peer))
+                        add_discovered_peer(&peer);
                     guarded_print_line("Added hardcoded peer: %s", hardcoded_peers[i]);
                     peer_count++;
                 }
@@ -55,42 +71,40 @@ void* handle_peer_discovery(void* arg)
                 // query DNS seeds
                 search = true;
 
-                if (get_peer_discovery_dns_domain() == NULL)
+                // resolve the seeds concurrently, waiting at most for the slowest of them
+                const char* custom_seed[] = { get_peer_discovery_dns_domain(), NULL };
+                const char* const* seeds = custom_seed[0] != NULL ? custom_seed : dns_seeds;
+                size_t seed_count = 0;
+                while (seeds[seed_count] != NULL)
+                    seed_count++;
+                dns_lookup_result* results = (dns_lookup_result*)malloc(seed_count * sizeof(dns_lookup_result));
+                if (results == NULL)
+                    log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Failed to allocate memory for DNS seed results");
+                else
                 {
-                    for (int i = 0; dns_seeds[i] != NULL; ++i)
+                    lookup_domains(seeds, seed_count, DNS_SEED_TIMEOUT_MS, results);
+                    for (size_t i = 0; i < seed_count; ++i)
                     {
-                        char ip_address[BUFFER_SIZE];
-                        lookup_address(dns_seeds[i], ip_address);
-                        char* token = strtok(ip_address, " ");
-                        while (token != NULL && *token != '\0')
+                        if (results[i].status != DNS_LOOKUP_OK)
                         {
-                            if (strcmp(token, "0.0.0.0") == 0)
-                            {
-                                log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Invalid IP from DNS seed: %s", dns_seeds[i]);
-                                break;
-                            }
-                            add_peer_to_queue(token, 8333);
-                            token = strtok(NULL, " ");
-                            peer_count++;
+                            log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "DNS seed %s %s: %s", results[i].domain,
+                                get_dns_lookup_status_name(results[i].status), results[i].error);
+                            continue;
                         }
-                    }
-                }
-                else
-                {
-                    char ip_address[BUFFER_SIZE];
-                    lookup_address(get_peer_discovery_dns_domain(), ip_address);
-                    char* token = strtok(ip_address, " ");
-                    while (token != NULL && *token != '\0')
-                    {
-                        if (strcmp(token, "0.0.0.0") == 0)
+                        log_message(LOG_INFO, BITLAB_LOG, __FILE__, "DNS seed %s returned %zu addresses",
+                            results[i].domain, results[i].count);
+                        for (size_t j = 0; j < results[i].count; ++j)
                         {
-                            log_message(LOG_ERROR, BITLAB_LOG, __FILE__, "Invalid IP from DNS seed: %s", get_peer_discovery_dns_domain());
-                            break;
+                            Peer peer;
+                            memset(&peer, 0, sizeof(peer));
+                            memcpy(peer.addr, results[i].addresses[j], sizeof(peer.addr));
+                            peer.port = 8333;
+                            peer.timestamp = (uint32_t)time(NULL);
+                            add_discovered_peer(&peer);
+                            peer_count++;
                         }
-                        add_peer_to_queue(token, 8333);
-                        token = strtok(NULL, " ");
-                        peer_count++;
                     }
+                    free(results);
                 }
             }
             else
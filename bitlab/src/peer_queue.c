@@ -3,91 +3,256 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
+#include <arpa/inet.h>
 
 #include "utils.h"
 
-static Peer peer_queue[MAX_PEERS];
-static int peer_queue_start = 0;
-static int peer_queue_end = 0;
+/**
+ * The slot of the set of queued peers, keyed by the address and port.
+ *
+ * @param addr The IPv6 address of the peer.
+ * @param port The port of the peer.
+ * @param used Is the slot taken.
+ */
+typedef struct
+{
+    unsigned char addr[16];
+    uint16_t port;
+    bool used;
+} peer_slot;
+
+// Ring of queued peers of peer_queue_size entries, a power of two
+static Peer* peer_queue = NULL;
+static size_t peer_queue_size = 0;
+static size_t peer_queue_start = 0;
+static size_t peer_queue_count = 0;
+
+// Open-addressing set of the keys in the ring, kept under half full
+static peer_slot* peer_set = NULL;
+static size_t peer_set_size = 0;
+
 static pthread_mutex_t peer_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void add_peer_to_queue(const char* ip, int port)
+/**
+ * hash_peer_key:
+ *   FNV-1a hash of the address and port.
+ */
+static size_t hash_peer_key(const unsigned char addr[16], uint16_t port)
 {
-    pthread_mutex_lock(&peer_queue_mutex);
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < 16; ++i)
+        hash = (hash ^ addr[i]) * 1099511628211ULL;
+    hash = (hash ^ (port & 0xFF)) * 1099511628211ULL;
+    hash = (hash ^ (port >> 8)) * 1099511628211ULL;
+    return (size_t)hash;
+}
 
-    // Check if the IP-port pair already exists in the queue
-    for (int i = peer_queue_start; i != peer_queue_end; i = (i + 1) % MAX_PEERS)
+/**
+ * find_peer_slot:
+ *   Find the slot holding the address and port, or the free slot ending their probe sequence.
+ *   Must be called with the queue mutex held and the set allocated.
+ */
+static size_t find_peer_slot(const unsigned char addr[16], uint16_t port)
+{
+    size_t mask = peer_set_size - 1;
+    size_t i = hash_peer_key(addr, port) & mask;
+    while (peer_set[i].used && (peer_set[i].port != port || memcmp(peer_set[i].addr, addr, 16) != 0))
+        i = (i + 1) & mask;
+    return i;
+}
+
+/**
+ * insert_peer_key:
+ *   Add the address and port of the peer to the set. Must be called with the queue mutex held.
+ */
+static void insert_peer_key(const Peer* peer)
+{
+    size_t slot = find_peer_slot(peer->addr, peer->port);
+    memcpy(peer_set[slot].addr, peer->addr, 16);
+    peer_set[slot].port = peer->port;
+    peer_set[slot].used = true;
+}
+
+/**
+ * remove_peer_key:
+ *   Remove the address and port of the peer from the set, shifting back the keys probed past
+ *   it so no tombstones are needed. Must be called with the queue mutex held.
+ */
+static void remove_peer_key(const Peer* peer)
+{
+    size_t mask = peer_set_size - 1;
+    size_t i = find_peer_slot(peer->addr, peer->port);
+    if (!peer_set[i].used)
+        return;
+    size_t j = i;
+    for (;;)
     {
-        if (strcmp(peer_queue[i].ip, ip) == 0 && peer_queue[i].port == port)
+        j = (j + 1) & mask;
+        if (!peer_set[j].used)
+            break;
+
+        // The key at j moves to the hole at i unless its home slot lies cyclically in (i, j]
+        size_t home = hash_peer_key(peer_set[j].addr, peer_set[j].port) & mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
         {
-            // IP-port pair already exists, don't add it again
-            log_message(LOG_INFO, BITLAB_LOG, __FILE__,
-                "Duplicate peer: %s:%d, not added", ip, port);
-            pthread_mutex_unlock(&peer_queue_mutex);
-            return;
+            peer_set[i] = peer_set[j];
+            i = j;
         }
     }
+    peer_set[i].used = false;
+}
 
-    // Check if the queue is full
-    if ((peer_queue_end + 1) % MAX_PEERS == peer_queue_start)
+/**
+ * grow_peer_queue:
+ *   Double the ring and the set, moving the queued peers to the start of the new ring and
+ *   rehashing their keys. Must be called with the queue mutex held.
+ *   Returns true if successful, false if memory is exhausted.
+ */
+static bool grow_peer_queue()
+{
+    size_t new_size = peer_queue_size == 0 ? PEER_QUEUE_INITIAL_SIZE : peer_queue_size * 2;
+    Peer* new_queue = (Peer*)malloc(new_size * sizeof(Peer));
+    peer_slot* new_set = (peer_slot*)calloc(new_size * 2, sizeof(peer_slot));
+    if (new_queue == NULL || new_set == NULL)
     {
-        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
-            "Peer queue is full, cannot add peer: %s:%d", ip, port);
-        pthread_mutex_unlock(&peer_queue_mutex);
-        return;
+        free(new_queue);
+        free(new_set);
+        return false;
     }
+    for (size_t i = 0; i < peer_queue_count; ++i)
+        new_queue[i] = peer_queue[(peer_queue_start + i) & (peer_queue_size - 1)];
+    free(peer_queue);
+    free(peer_set);
+    peer_queue = new_queue;
+    peer_queue_size = new_size;
+    peer_queue_start = 0;
+    peer_set = new_set;
+    peer_set_size = new_size * 2;
+    for (size_t i = 0; i < peer_queue_count; ++i)
+        insert_peer_key(&peer_queue[i]);
+    return true;
+}
 
-    // Extract the port if not provided
+/**
+ * parse_peer_address:
+ *   Store the textual IPv4 or IPv6 address in the peer record.
+ *   Returns true if successful, false if the address is invalid.
+ */
+static bool parse_peer_address(const char* ip, Peer* peer)
+{
+    memset(peer->addr, 0, sizeof(peer->addr));
+    if (inet_pton(AF_INET, ip, peer->addr + 12) == 1)
+    {
+        peer->addr[10] = 0xFF;
+        peer->addr[11] = 0xFF;
+        return true;
+    }
+    return inet_pton(AF_INET6, ip, peer->addr) == 1;
+}
+
+bool parse_peer(const char* ip, int port, Peer* peer)
+{
+    // Extract the port if not provided, IPv6 addresses are then enclosed in brackets
+    char address[PEER_IP_STRLEN];
     if (port == 0)
     {
-        char* colon_pos = strrchr(ip, ':');
-        if (colon_pos != NULL)
-        {
-            port = atoi(colon_pos + 1);
-            strncpy(peer_queue[peer_queue_end].ip, ip, colon_pos - ip);
-            peer_queue[peer_queue_end].ip[colon_pos - ip] = '\0';
-        }
-        else
+        const char* colon_pos = strrchr(ip, ':');
+        if (colon_pos == NULL)
         {
             log_message(LOG_WARN, BITLAB_LOG, __FILE__,
                 "Invalid IP format, cannot extract port: %s", ip);
-            pthread_mutex_unlock(&peer_queue_mutex);
-            return;
+            return false;
         }
+        port = atoi(colon_pos + 1);
+        size_t start = ip[0] == '[' ? 1 : 0;
+        size_t len = colon_pos - ip - start;
+        if (start && len > 0 && ip[start + len - 1] == ']')
+            len--;
+        if (len >= sizeof(address))
+            len = sizeof(address) - 1;
+        memcpy(address, ip + start, len);
+        address[len] = '\0';
     }
     else
     {
-        strncpy(peer_queue[peer_queue_end].ip, ip,
-            sizeof(peer_queue[peer_queue_end].ip));
+        snprintf(address, sizeof(address), "%s", ip);
     }
 
-    // Add the IP-port pair to the queue
-    peer_queue[peer_queue_end].port = port;
-    peer_queue_end = (peer_queue_end + 1) % MAX_PEERS;
+    memset(peer, 0, sizeof(*peer));
+    peer->timestamp = (uint32_t)time(NULL);
+    peer->port = (uint16_t)port;
+    if (port <= 0 || port > 65535 || !parse_peer_address(address, peer))
+    {
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__, "Invalid peer address: %s:%d", address, port);
+        return false;
+    }
+    return true;
+}
+
+bool add_peer_to_queue(const char* ip, int port)
+{
+    Peer peer;
+    return parse_peer(ip, port, &peer) && add_peer_record(&peer);
+}
+
+bool add_peer_record(const Peer* peer)
+{
+    pthread_mutex_lock(&peer_queue_mutex);
+
+    // Check if the IP-port pair already exists in the queue
+    if (peer_set != NULL && peer_set[find_peer_slot(peer->addr, peer->port)].used)
+    {
+        pthread_mutex_unlock(&peer_queue_mutex);
+        char ip[PEER_IP_STRLEN];
+        format_peer_ip(peer, ip, sizeof(ip));
+        log_message(LOG_INFO, BITLAB_LOG, __FILE__,
+            "Duplicate peer: %s:%u, not added", ip, peer->port);
+        return false;
+    }
+
+    // Check if the queue is full
+    if (peer_queue_count == peer_queue_size &&
+        (peer_queue_size >= MAX_PEERS || !grow_peer_queue()))
+    {
+        pthread_mutex_unlock(&peer_queue_mutex);
+        char ip[PEER_IP_STRLEN];
+        format_peer_ip(peer, ip, sizeof(ip));
+        log_message(LOG_WARN, BITLAB_LOG, __FILE__,
+            "Peer queue is full, cannot add peer: %s:%u", ip, peer->port);
+        return false;
+    }
+
+    // Add the peer to the queue and its address to the set
+    peer_queue[(peer_queue_start + peer_queue_count) & (peer_queue_size - 1)] = *peer;
+    peer_queue_count++;
+    insert_peer_key(peer);
 
     pthread_mutex_unlock(&peer_queue_mutex);
+    return true;
 }
 
 bool is_peer_queue_empty()
 {
     pthread_mutex_lock(&peer_queue_mutex);
-    bool empty = (peer_queue_start == peer_queue_end);
+    bool empty = peer_queue_count == 0;
     pthread_mutex_unlock(&peer_queue_mutex);
     return empty;
 }
 
-bool get_peer_from_queue(char* buffer, size_t buffer_size)
+bool get_peer_from_queue(Peer* peer)
 {
     pthread_mutex_lock(&peer_queue_mutex);
-    if (peer_queue_start == peer_queue_end)
+    if (peer_queue_count == 0)
     {
         pthread_mutex_unlock(&peer_queue_mutex);
         return false;
     }
-    snprintf(buffer, buffer_size, "%s:%d", peer_queue[peer_queue_start].ip,
-        peer_queue[peer_queue_start].port);
-    peer_queue_start = (peer_queue_start + 1) % MAX_PEERS;
+    *peer = peer_queue[peer_queue_start];
+    remove_peer_key(peer);
+    peer_queue_start = (peer_queue_start + 1) & (peer_queue_size - 1);
+    peer_queue_count--;
     pthread_mutex_unlock(&peer_queue_mutex);
     return true;
 }
@@ -96,55 +261,58 @@ void clear_peer_queue()
 {
     pthread_mutex_lock(&peer_queue_mutex);
     peer_queue_start = 0;
-    peer_queue_end = 0;
+    peer_queue_count = 0;
+    if (peer_set != NULL)
+        memset(peer_set, 0, peer_set_size * sizeof(peer_slot));
     pthread_mutex_unlock(&peer_queue_mutex);
 }
 
 void print_peer_queue()
 {
     pthread_mutex_lock(&peer_queue_mutex);
-    if (peer_queue_start == peer_queue_end)
+    if (peer_queue_count == 0)
     {
         guarded_print_line("Peer queue is empty");
         pthread_mutex_unlock(&peer_queue_mutex);
         return;
     }
-    int k = 1;
-    for (int i = peer_queue_start; i != peer_queue_end; i = (i + 1) % MAX_PEERS)
-        guarded_print_line("%d | %s:%d", k++, peer_queue[i].ip, peer_queue[i].port);
+    for (size_t i = 0; i < peer_queue_count; ++i)
+    {
+        const Peer* peer = &peer_queue[(peer_queue_start + i) & (peer_queue_size - 1)];
+        char ip[PEER_IP_STRLEN];
+        format_peer_ip(peer, ip, sizeof(ip));
+        if (strchr(ip, ':') != NULL)
+            guarded_print_line("%zu | [%s]:%u", i + 1, ip, peer->port);
+        else
+            guarded_print_line("%zu | %s:%u", i + 1, ip, peer->port);
+    }
     pthread_mutex_unlock(&peer_queue_mutex);
 }
 
-Peer* get_peer_queue(int* count)
+size_t get_peers_from_queue(Peer* peers, size_t max_count)
 {
     pthread_mutex_lock(&peer_queue_mutex);
+    size_t count = peer_queue_count < max_count ? peer_queue_count : max_count;
+    for (size_t i = 0; i < count; ++i)
+        peers[i] = peer_queue[(peer_queue_start + i) & (peer_queue_size - 1)];
+    pthread_mutex_unlock(&peer_queue_mutex);
+    return count;
+}
 
-    if (peer_queue_start == peer_queue_end)
-    {
-        *count = 0;
-        pthread_mutex_unlock(&peer_queue_mutex);
-        return NULL;
-    }
-
-    int size = (peer_queue_end >= peer_queue_start)
-        ? (peer_queue_end - peer_queue_start)
-        : (MAX_PEERS - peer_queue_start + peer_queue_end);
-
-    Peer* peers = malloc(size * sizeof(Peer));
-    if (peers == NULL)
-    {
-        *count = 0;
-        pthread_mutex_unlock(&peer_queue_mutex);
-        return NULL;
-    }
-
-    for (int i = 0, j = peer_queue_start; j != peer_queue_end; j = (j + 1) % MAX_PEERS,
-        i++)
-    {
-        peers[i] = peer_queue[j];
-    }
-
-    *count = size;
+size_t get_peer_queue_count()
+{
+    pthread_mutex_lock(&peer_queue_mutex);
+    size_t count = peer_queue_count;
     pthread_mutex_unlock(&peer_queue_mutex);
-    return peers;
+    return count;
+}
+
+void format_peer_ip(const Peer* peer, char* buffer, size_t buffer_size)
+{
+    static const unsigned char v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+    const char* result = memcmp(peer->addr, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0 ?
+        inet_ntop(AF_INET, peer->addr + 12, buffer, buffer_size) :
+        inet_ntop(AF_INET6, peer->addr, buffer, buffer_size);
+    if (result == NULL && buffer_size > 0)
+        buffer[0] = '\0';
 }
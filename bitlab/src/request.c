@@ -0,0 +1,259 @@
+#include "request.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "event_loop.h"
+#include "hash.h"
+#include "header_index.h"
+
+void init_request_list(request_list* list)
+{
+    list->head = NULL;
+    list->count = 0;
+    pthread_mutex_init(&list->mutex, NULL);
+}
+
+peer_request* create_request(request_list* list, command_id command, int expected,
+    const unsigned char* hashes, int timeout_ms, request_callback callback, void* ctx)
+{
+    if (expected <= 0)
+        return NULL;
+
+    peer_request* request = (peer_request*)malloc(sizeof(peer_request));
+    if (request == NULL)
+        return NULL;
+
+    request->hashes = NULL;
+    request->answered = NULL;
+    if (hashes != NULL)
+    {
+        // The flags follow the hashes in the same allocation
+        request->hashes = (unsigned char*)malloc((size_t)expected * (HASH_SIZE + 1));
+        if (request->hashes == NULL)
+        {
+            free(request);
+            return NULL;
+        }
+        memcpy(request->hashes, hashes, (size_t)expected * HASH_SIZE);
+        request->answered = request->hashes + (size_t)expected * HASH_SIZE;
+        memset(request->answered, 0, (size_t)expected);
+    }
+    request->command = command;
+    request->expected = expected;
+    request->received = 0;
+    request->deadline_ms = get_monotonic_ms() + timeout_ms;
+    request->callback = callback;
+    request->ctx = ctx;
+    request->status = REQUEST_PENDING;
+    atomic_init(&request->refcount, 2); // the pending list and the caller
+    request->next = NULL;
+    pthread_mutex_init(&request->mutex, NULL);
+    pthread_cond_init(&request->cond, NULL);
+
+    pthread_mutex_lock(&list->mutex);
+    peer_request** tail = &list->head;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = request;
+    list->count++;
+    pthread_mutex_unlock(&list->mutex);
+    return request;
+}
+
+/**
+ * unlink_request:
+ *   Remove the request from the pending list. Must be called with the list mutex held.
+ *   Returns 1 if the request was in the list, 0 otherwise.
+ */
+static int unlink_request(request_list* list, peer_request* request)
+{
+    for (peer_request** it = &list->head; *it != NULL; it = &(*it)->next)
+    {
+        if (*it == request)
+        {
+            *it = request->next;
+            request->next = NULL;
+            list->count--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * finish_request:
+ *   Set the final state of the request unless it is already finished and wake up its waiters.
+ */
+static void finish_request(peer_request* request, request_status status)
+{
+    pthread_mutex_lock(&request->mutex);
+    if (request->status == REQUEST_PENDING)
+    {
+        request->status = status;
+        pthread_cond_broadcast(&request->cond);
+    }
+    pthread_mutex_unlock(&request->mutex);
+}
+
+/**
+ * match_request:
+ *   Check if the message answers the request, marking the block as received when the request
+ *   expects block hashes. The block hash is computed on first use.
+ *   Returns 1 if the request matches, 0 otherwise.
+ */
+static int match_request(peer_request* request, const message_view* view,
+    unsigned char hash[HASH_SIZE], int* has_hash)
+{
+    if (request->command != view->command)
+        return 0;
+    if (request->hashes == NULL)
+        return 1;
+    if (!*has_hash)
+    {
+        if (view->payload_len < BLOCK_HEADER_SIZE)
+            return 0;
+        double_sha256(view->payload, BLOCK_HEADER_SIZE, hash);
+        *has_hash = 1;
+    }
+    for (int i = 0; i < request->expected; ++i)
+    {
+        if (!request->answered[i] && memcmp(request->hashes + (size_t)i * HASH_SIZE, hash, HASH_SIZE) == 0)
+        {
+            request->answered[i] = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int complete_requests(request_list* list, const message_view* view)
+{
+    unsigned char hash[HASH_SIZE];
+    int has_hash = 0;
+    pthread_mutex_lock(&list->mutex);
+    peer_request* request = list->head;
+    while (request != NULL && !match_request(request, view, hash, &has_hash))
+        request = request->next;
+    if (request == NULL)
+    {
+        pthread_mutex_unlock(&list->mutex);
+        return 0;
+    }
+    int done = ++request->received >= request->expected;
+    if (done)
+        unlink_request(list, request);
+    else
+        atomic_fetch_add(&request->refcount, 1); // keep the request alive for the callback
+    pthread_mutex_unlock(&list->mutex);
+
+    // The callback runs under the request mutex, so the request cannot be finished meanwhile
+    pthread_mutex_lock(&request->mutex);
+    if (request->status == REQUEST_PENDING)
+    {
+        if (request->callback != NULL)
+            request->callback(request->ctx, view->payload, view->payload_len);
+        if (done)
+        {
+            request->status = REQUEST_COMPLETED;
+            pthread_cond_broadcast(&request->cond);
+        }
+    }
+    pthread_mutex_unlock(&request->mutex);
+    release_request(request);
+    return 1;
+}
+
+int expire_requests(request_list* list, uint64_t now_ms)
+{
+    peer_request* expired = NULL;
+    int count = 0;
+
+    pthread_mutex_lock(&list->mutex);
+    peer_request** it = &list->head;
+    while (*it != NULL)
+    {
+        peer_request* request = *it;
+        if (request->deadline_ms <= now_ms)
+        {
+            *it = request->next;
+            list->count--;
+            request->next = expired;
+            expired = request;
+            count++;
+        }
+        else
+        {
+            it = &request->next;
+        }
+    }
+    pthread_mutex_unlock(&list->mutex);
+
+    while (expired != NULL)
+    {
+        peer_request* request = expired;
+        expired = request->next;
+        request->next = NULL;
+        finish_request(request, REQUEST_TIMED_OUT);
+        release_request(request);
+    }
+    return count;
+}
+
+void fail_requests(request_list* list)
+{
+    pthread_mutex_lock(&list->mutex);
+    peer_request* request = list->head;
+    list->head = NULL;
+    list->count = 0;
+    pthread_mutex_unlock(&list->mutex);
+
+    while (request != NULL)
+    {
+        peer_request* next = request->next;
+        request->next = NULL;
+        finish_request(request, REQUEST_FAILED);
+        release_request(request);
+        request = next;
+    }
+}
+
+void cancel_request(request_list* list, peer_request* request)
+{
+    pthread_mutex_lock(&list->mutex);
+    int linked = unlink_request(list, request);
+    pthread_mutex_unlock(&list->mutex);
+
+    finish_request(request, REQUEST_FAILED);
+    if (linked)
+        release_request(request);
+}
+
+request_status wait_request(peer_request* request)
+{
+    pthread_mutex_lock(&request->mutex);
+    while (request->status == REQUEST_PENDING)
+        pthread_cond_wait(&request->cond, &request->mutex);
+    request_status status = request->status;
+    pthread_mutex_unlock(&request->mutex);
+    return status;
+}
+
+void release_request(peer_request* request)
+{
+    if (atomic_fetch_sub(&request->refcount, 1) > 1)
+        return;
+
+    pthread_mutex_destroy(&request->mutex);
+    pthread_cond_destroy(&request->cond);
+    free(request->hashes);
+    free(request);
+}
+
+int count_requests(request_list* list)
+{
+    pthread_mutex_lock(&list->mutex);
+    int count = list->count;
+    pthread_mutex_unlock(&list->mutex);
+    return count;
+}
@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "send_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+/**
+ * is_retryable:
+ *   Check if the failed write only means the socket cannot accept more bytes right now.
+ */
+static int is_retryable(int error)
+{
+    return error == EAGAIN || error == EWOULDBLOCK || error == EINTR;
+}
+
+/**
+ * update_water_mark:
+ *   Switch the high-water state of the queue after its size changed.
+ */
+static void update_water_mark(send_queue* queue)
+{
+    if (queue->size > SEND_QUEUE_HIGH_WATER)
+        queue->over_high_water = 1;
+    else if (queue->size < SEND_QUEUE_LOW_WATER)
+        queue->over_high_water = 0;
+}
+
+/**
+ * new_frame:
+ *   Allocate a message held in memory with a copy of the bytes.
+ *   Returns the message or NULL if memory is exhausted.
+ */
+static send_frame* new_frame(const unsigned char* data, size_t len)
+{
+    send_frame* frame = (send_frame*)malloc(sizeof(send_frame) + len);
+    if (frame == NULL)
+        return NULL;
+    frame->next = NULL;
+    frame->len = len;
+    frame->offset = 0;
+    frame->is_file = 0;
+    frame->file_fd = -1;
+    frame->file_offset = 0;
+    memcpy(frame->data, data, len);
+    return frame;
+}
+
+/**
+ * append_frame:
+ *   Append the message to the queue.
+ */
+static void append_frame(send_queue* queue, send_frame* frame)
+{
+    if (queue->tail != NULL)
+        queue->tail->next = frame;
+    else
+        queue->head = frame;
+    queue->tail = frame;
+}
+
+/**
+ * pop_frame:
+ *   Remove the fully written oldest message from the queue and close its file.
+ */
+static void pop_frame(send_queue* queue)
+{
+    send_frame* frame = queue->head;
+    queue->head = frame->next;
+    if (queue->head == NULL)
+        queue->tail = NULL;
+    if (frame->file_fd >= 0)
+        close(frame->file_fd);
+    free(frame);
+}
+
+void init_send_queue(send_queue* queue)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->size = 0;
+    queue->file_size = 0;
+    queue->over_high_water = 0;
+}
+
+void free_send_queue(send_queue* queue)
+{
+    while (queue->head != NULL)
+        pop_frame(queue);
+    init_send_queue(queue);
+}
+
+int send_queue_push(send_queue* queue, int fd, const unsigned char* msg, size_t msg_len)
+{
+    if (queue->over_high_water)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // Nothing to keep in order with, so the message skips the copy if the socket takes it whole
+    size_t written = 0;
+    if (queue->head == NULL)
+    {
+        ssize_t bytes_sent = send(fd, msg, msg_len, MSG_NOSIGNAL);
+        if (bytes_sent < 0 && !is_retryable(errno))
+            return -1;
+        if (bytes_sent > 0)
+            written = (size_t)bytes_sent;
+        if (written == msg_len)
+            return 0;
+    }
+
+    size_t remaining = msg_len - written;
+    send_frame* frame = new_frame(msg + written, remaining);
+    if (frame == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    append_frame(queue, frame);
+    queue->size += remaining;
+    update_water_mark(queue);
+    return 0;
+}
+
+int send_queue_push_file(send_queue* queue, int fd, const unsigned char* header, size_t header_len,
+    const char* path, off_t file_offset, size_t len)
+{
+    if (queue->over_high_water || queue->file_size + len > SEND_QUEUE_FILE_HIGH_WATER)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // Both parts are allocated before either is queued, the peer must never get half a message
+    size_t path_size = strlen(path) + 1;
+    send_frame* header_frame = new_frame(header, header_len);
+    send_frame* file_frame = new_frame((const unsigned char*)path, path_size);
+    if (header_frame == NULL || file_frame == NULL)
+    {
+        free(header_frame);
+        free(file_frame);
+        errno = ENOMEM;
+        return -1;
+    }
+    file_frame->len = len;
+    file_frame->is_file = 1;
+    file_frame->file_offset = file_offset;
+
+    int was_empty = queue->head == NULL;
+    append_frame(queue, header_frame);
+    append_frame(queue, file_frame);
+    queue->size += header_len;
+    queue->file_size += len;
+    update_water_mark(queue);
+
+    // Nothing to keep in order with, so the message is written right away
+    return was_empty ? send_queue_flush(queue, fd) : 0;
+}
+
+/**
+ * send_file_frame:
+ *   Write the file range of the oldest message with sendfile, opening its file on first use.
+ *   Returns 1 if the range was written whole, 0 if the socket cannot accept more bytes right now
+ *   and -1 with errno set if the socket or the file failed.
+ */
+static int send_file_frame(send_queue* queue, int fd)
+{
+    send_frame* frame = queue->head;
+    if (frame->file_fd < 0)
+    {
+        frame->file_fd = open((const char*)frame->data, O_RDONLY | O_CLOEXEC);
+        if (frame->file_fd < 0)
+            return -1;
+    }
+
+    size_t left = frame->len - frame->offset;
+    off_t file_offset = frame->file_offset + (off_t)frame->offset;
+    ssize_t bytes_sent = sendfile(fd, frame->file_fd, &file_offset, left);
+    if (bytes_sent < 0)
+        return is_retryable(errno) ? 0 : -1;
+    if (bytes_sent == 0)
+    {
+        // The file ends before the range does
+        errno = EIO;
+        return -1;
+    }
+
+    frame->offset += (size_t)bytes_sent;
+    queue->file_size -= (size_t)bytes_sent;
+    if (frame->offset < frame->len)
+        return 0;
+    pop_frame(queue);
+    return 1;
+}
+
+int send_queue_flush(send_queue* queue, int fd)
+{
+    while (queue->head != NULL)
+    {
+        if (queue->head->is_file)
+        {
+            int result = send_file_frame(queue, fd);
+            if (result < 0)
+                return -1;
+            if (result == 0)
+                break;
+            continue;
+        }
+
+        // Messages held in memory are batched up to the next file range
+        struct iovec iov[SEND_QUEUE_MAX_BATCH];
+        int iov_count = 0;
+        size_t batch_len = 0;
+        for (send_frame* frame = queue->head;
+            frame != NULL && !frame->is_file && iov_count < SEND_QUEUE_MAX_BATCH; frame = frame->next)
+        {
+            iov[iov_count].iov_base = frame->data + frame->offset;
+            iov[iov_count].iov_len = frame->len - frame->offset;
+            batch_len += iov[iov_count].iov_len;
+            iov_count++;
+        }
+
+        // sendmsg is writev with flags, MSG_NOSIGNAL turns a closed peer into EPIPE instead of SIGPIPE
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+        ssize_t bytes_sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (bytes_sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (is_retryable(errno))
+                break;
+            return -1;
+        }
+
+        size_t consumed = (size_t)bytes_sent;
+        queue->size -= consumed;
+        while (consumed > 0)
+        {
+            send_frame* frame = queue->head;
+            size_t left = frame->len - frame->offset;
+            if (consumed < left)
+            {
+                frame->offset += consumed;
+                break;
+            }
+            consumed -= left;
+            pop_frame(queue);
+        }
+
+        // A short write means the socket buffer is full
+        if ((size_t)bytes_sent < batch_len)
+            break;
+    }
+    update_water_mark(queue);
+    return 0;
+}
+
+int send_queue_pending(const send_queue* queue)
+{
+    return queue->head != NULL;
+}
@@ -113,6 +113,26 @@ uint64_t read_var_int(const unsigned char* data, size_t* offset)
     return result;
 }
 
+int read_compact_size(const unsigned char* data, size_t data_len, size_t* offset, uint64_t* value)
+{
+    if (*offset >= data_len)
+        return 0;
+    unsigned char prefix = data[(*offset)++];
+    size_t size = prefix == 0xFD ? 2 : prefix == 0xFE ? 4 : prefix == 0xFF ? 8 : 0;
+    if (size == 0)
+    {
+        *value = prefix;
+        return 1;
+    }
+    if (data_len - *offset < size)
+        return 0;
+    *value = 0;
+    for (size_t i = size; i > 0; --i)
+        *value = *value << 8 | data[*offset + i - 1];
+    *offset += size;
+    return 1;
+}
+
 int is_valid_ipv4(const char* ip_str)
 {
     struct sockaddr_in sa;
@@ -0,0 +1,357 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "log.h"
+#include "utils.h"
+
+// Name of the tool in error messages
+#define LOGDECODE_NAME "bitlab-logdecode"
+
+// Format of the timestamps, the same as in text log files
+#define LOGDECODE_TIMESTAMP_FORMAT "%Y-%m-%d %H:%M:%S"
+
+/**
+ * The state of the file being decoded.
+ *
+ * @param in The binary log file.
+ * @param name The name of the file in error messages.
+ * @param offset The offset of the next record.
+ * @param realtime_ns The wall clock time at the start of the session.
+ * @param monotonic_ns The monotonic time at the start of the session.
+ * @param strings The strings defined in the session by ID.
+ * @param tag The tag of the following messages, the peer of a combined peer log.
+ */
+typedef struct
+{
+    FILE* in;
+    const char* name;
+    long offset;
+    uint64_t realtime_ns;
+    uint64_t monotonic_ns;
+    char* strings[LOG_MAX_STRINGS];
+    char tag[LOG_MAX_TAG_LENGTH];
+} decoder;
+
+/**
+ * reset_strings:
+ *   Forget the strings of the previous session.
+ */
+static void reset_strings(decoder* dec)
+{
+    for (int i = 0; i < LOG_MAX_STRINGS; ++i)
+    {
+        free(dec->strings[i]);
+        dec->strings[i] = NULL;
+    }
+}
+
+/**
+ * read_bytes:
+ *   Read exactly len bytes of the record. Returns 0 if successful, -1 if the file ends.
+ */
+static int read_bytes(decoder* dec, void* buffer, size_t len)
+{
+    return len == 0 || fread(buffer, 1, len, dec->in) == len ? 0 : -1;
+}
+
+/**
+ * read_string:
+ *   Read a string stored as u16 length and bytes. Returns the string, which must be freed, or
+ *   NULL if the file ends.
+ */
+static char* read_string(decoder* dec)
+{
+    uint16_t len;
+    if (read_bytes(dec, &len, 2) < 0)
+        return NULL;
+    char* string = (char*)malloc((size_t)len + 1);
+    if (string == NULL)
+        return NULL;
+    if (read_bytes(dec, string, len) < 0)
+    {
+        free(string);
+        return NULL;
+    }
+    string[len] = '\0';
+    return string;
+}
+
+/**
+ * format_time:
+ *   Format the monotonic time of a message as the wall clock time of the session.
+ */
+static void format_time(const decoder* dec, uint64_t monotonic_ns, char* buffer, size_t size)
+{
+    int64_t delta_ns = (int64_t)(monotonic_ns - dec->monotonic_ns);
+    time_t seconds = (time_t)((int64_t)(dec->realtime_ns / 1000000000ULL) +
+        ((int64_t)(dec->realtime_ns % 1000000000ULL) + delta_ns) / 1000000000LL);
+    struct tm tm_time;
+    localtime_r(&seconds, &tm_time);
+    strftime(buffer, size, LOGDECODE_TIMESTAMP_FORMAT, &tm_time);
+}
+
+/**
+ * append_literal:
+ *   Append the text between conversions to the message, turning "%%" into '%'.
+ */
+static size_t append_literal(const char* text, size_t len, char* out, size_t size, size_t written)
+{
+    for (size_t i = 0; i < len && written + 1 < size; ++i)
+    {
+        out[written++] = text[i];
+        if (text[i] == '%' && i + 1 < len && text[i + 1] == '%')
+            i++;
+    }
+    out[written] = '\0';
+    return written;
+}
+
+/**
+ * format_message:
+ *   Format the packed arguments with the format string, every conversion on its own with the
+ *   argument cast back to the type of the conversion.
+ *   Returns 0 if successful, -1 if the arguments do not match the format string.
+ */
+static int format_message(const char* format, const unsigned char* args, size_t args_len,
+    char* out, size_t size)
+{
+    log_format_spec specs[LOG_MAX_ARGS];
+    int count = parse_log_format(format, specs, LOG_MAX_ARGS);
+    if (count < 0)
+        return -1;
+
+    size_t written = 0;
+    size_t literal = 0;
+    size_t offset = 0;
+    out[0] = '\0';
+    for (int i = 0; i < count; ++i)
+    {
+        written = append_literal(format + literal, specs[i].start - literal, out, size, written);
+        literal = specs[i].start + specs[i].length;
+
+        char spec[64];
+        if (specs[i].length >= sizeof(spec))
+            return -1;
+        memcpy(spec, format + specs[i].start, specs[i].length);
+        spec[specs[i].length] = '\0';
+
+        uint64_t value = 0;
+        char text[LOG_MESSAGE_LENGTH + 1];
+        if (specs[i].type == LOG_ARG_STRING)
+        {
+            uint16_t len;
+            if (offset + 2 > args_len)
+                return -1;
+            memcpy(&len, args + offset, 2);
+            if (offset + 2 + len > args_len || len > LOG_MESSAGE_LENGTH)
+                return -1;
+            memcpy(text, args + offset + 2, len);
+            text[len] = '\0';
+            offset += 2 + (size_t)len;
+        }
+        else
+        {
+            if (offset + 8 > args_len)
+                return -1;
+            memcpy(&value, args + offset, 8);
+            offset += 8;
+        }
+
+        char* dest = out + written;
+        size_t left = size - written;
+        int n = 0;
+        switch (specs[i].type)
+        {
+        case LOG_ARG_INT: n = snprintf(dest, left, spec, (int)(int64_t)value); break;
+        case LOG_ARG_UINT: n = snprintf(dest, left, spec, (unsigned int)value); break;
+        case LOG_ARG_LONG: n = snprintf(dest, left, spec, (long)(int64_t)value); break;
+        case LOG_ARG_ULONG: n = snprintf(dest, left, spec, (unsigned long)value); break;
+        case LOG_ARG_LLONG: n = snprintf(dest, left, spec, (long long)value); break;
+        case LOG_ARG_ULLONG: n = snprintf(dest, left, spec, (unsigned long long)value); break;
+        case LOG_ARG_SIZE: n = snprintf(dest, left, spec, (size_t)value); break;
+        case LOG_ARG_INTMAX: n = snprintf(dest, left, spec, (intmax_t)value); break;
+        case LOG_ARG_UINTMAX: n = snprintf(dest, left, spec, (uintmax_t)value); break;
+        case LOG_ARG_PTRDIFF: n = snprintf(dest, left, spec, (ptrdiff_t)(int64_t)value); break;
+        case LOG_ARG_POINTER: n = snprintf(dest, left, spec, (void*)(uintptr_t)value); break;
+        case LOG_ARG_STRING: n = snprintf(dest, left, spec, text); break;
+        case LOG_ARG_DOUBLE:
+        {
+            double number;
+            memcpy(&number, &value, sizeof(number));
+            n = snprintf(dest, left, spec, number);
+            break;
+        }
+        }
+        if (n > 0)
+            written += (size_t)n < left ? (size_t)n : left - 1;
+    }
+    append_literal(format + literal, strlen(format + literal), out, size, written);
+    return 0;
+}
+
+/**
+ * decode_record:
+ *   Decode the next record, printing messages as text log lines.
+ *   Returns 1 if a record was decoded, 0 at the end of the file, -1 if the record is invalid.
+ */
+static int decode_record(decoder* dec, FILE* out)
+{
+    int type = fgetc(dec->in);
+    if (type == EOF)
+        return 0;
+
+    if (type == LOG_RECORD_SESSION)
+    {
+        uint32_t magic;
+        if (read_bytes(dec, &magic, 4) < 0 || magic != LOG_BINARY_MAGIC ||
+            read_bytes(dec, &dec->realtime_ns, 8) < 0 || read_bytes(dec, &dec->monotonic_ns, 8) < 0)
+            return -1;
+        reset_strings(dec);
+        dec->tag[0] = '\0';
+        return 1;
+    }
+    if (type == LOG_RECORD_TAG)
+    {
+        char* tag = read_string(dec);
+        if (tag == NULL)
+            return -1;
+        snprintf(dec->tag, sizeof(dec->tag), "%s", tag);
+        free(tag);
+        return 1;
+    }
+    if (type == LOG_RECORD_STRING)
+    {
+        uint32_t id;
+        if (read_bytes(dec, &id, 4) < 0 || id >= LOG_MAX_STRINGS)
+            return -1;
+        char* string = read_string(dec);
+        if (string == NULL)
+            return -1;
+        free(dec->strings[id]);
+        dec->strings[id] = string;
+        return 1;
+    }
+
+    uint8_t level;
+    uint64_t monotonic_ns;
+    const char* source_file;
+    char message[LOG_MESSAGE_LENGTH * 2];
+    char* text_source = NULL;
+    if (type == LOG_RECORD_MESSAGE)
+    {
+        uint32_t format_id;
+        uint32_t source_id;
+        uint16_t args_len;
+        unsigned char args[LOG_MESSAGE_LENGTH];
+        if (read_bytes(dec, &level, 1) < 0 || read_bytes(dec, &format_id, 4) < 0 ||
+            read_bytes(dec, &source_id, 4) < 0 || read_bytes(dec, &monotonic_ns, 8) < 0 ||
+            read_bytes(dec, &args_len, 2) < 0 || args_len > sizeof(args) ||
+            read_bytes(dec, args, args_len) < 0)
+            return -1;
+        if (format_id >= LOG_MAX_STRINGS || source_id >= LOG_MAX_STRINGS ||
+            dec->strings[format_id] == NULL || dec->strings[source_id] == NULL)
+            return -1;
+        if (format_message(dec->strings[format_id], args, args_len, message, sizeof(message)) < 0)
+            return -1;
+        source_file = dec->strings[source_id];
+    }
+    else if (type == LOG_RECORD_TEXT)
+    {
+        if (read_bytes(dec, &level, 1) < 0 || read_bytes(dec, &monotonic_ns, 8) < 0)
+            return -1;
+        text_source = read_string(dec);
+        char* text = text_source != NULL ? read_string(dec) : NULL;
+        if (text == NULL)
+        {
+            free(text_source);
+            return -1;
+        }
+        snprintf(message, sizeof(message), "%s", text);
+        free(text);
+        source_file = text_source;
+    }
+    else
+        return -1;
+
+    char timestamp[TIMESTAMP_LENGTH];
+    format_time(dec, monotonic_ns, timestamp, sizeof(timestamp));
+    if (dec->tag[0] != '\0')
+        fprintf(out, "%s - %s - %s - [%s] %s\n", timestamp, get_log_level_name((log_level)level),
+            source_file, dec->tag, message);
+    else
+        fprintf(out, "%s - %s - %s - %s\n", timestamp, get_log_level_name((log_level)level),
+            source_file, message);
+    free(text_source);
+    return 1;
+}
+
+/**
+ * decode_file:
+ *   Decode the binary log file to text log lines.
+ *   Returns 0 if successful, -1 if the file is invalid.
+ */
+static int decode_file(FILE* in, const char* name, FILE* out)
+{
+    decoder* dec = (decoder*)calloc(1, sizeof(decoder));
+    if (dec == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", LOGDECODE_NAME);
+        return -1;
+    }
+    dec->in = in;
+    dec->name = name;
+
+    int result = 0;
+    for (;;)
+    {
+        dec->offset = ftell(in);
+        int status = decode_record(dec, out);
+        if (status == 0)
+            break;
+        if (status < 0)
+        {
+            fprintf(stderr, "%s: %s: invalid or truncated record at offset %ld\n", LOGDECODE_NAME,
+                dec->name, dec->offset);
+            result = -1;
+            break;
+        }
+    }
+    reset_strings(dec);
+    free(dec);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    {
+        printf("Usage: %s [binary log file...]\n", LOGDECODE_NAME);
+        printf("Decodes binary BitLab log files (*%s) to the text log format, reading the standard input if no file is given.\n",
+            LOG_BINARY_SUFFIX);
+        return 0;
+    }
+    if (argc < 2)
+        return decode_file(stdin, "<stdin>", stdout) == 0 ? 0 : 1;
+
+    int result = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        FILE* in = fopen(argv[i], "rb");
+        if (in == NULL)
+        {
+            perror(argv[i]);
+            result = 1;
+            continue;
+        }
+        if (decode_file(in, argv[i], stdout) < 0)
+            result = 1;
+        fclose(in);
+    }
+    return result;
+}